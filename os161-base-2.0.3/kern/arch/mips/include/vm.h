@@ -116,11 +116,12 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct tlbshootdown_sync;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;			/* first page to invalidate */
+	unsigned ts_npages;			/* number of pages */
+	struct tlbshootdown_sync *ts_sync;	/* tells the sender we're done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
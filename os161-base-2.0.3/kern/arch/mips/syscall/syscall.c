@@ -33,8 +33,11 @@
 #include <lib.h>
 #include <mips/trapframe.h>
 #include <current.h>
+#include <copyinout.h>
 #include <addrspace.h>
 #include <syscall.h>
+#include <proc.h>
+#include <kmem.h>
 
 
 /*
@@ -146,6 +149,47 @@ syscall(struct trapframe *tf)
           &retval);
         break;
 
+      case SYS_pread:
+        /* the (64-bit aligned) offset comes from the stack */
+        err = copyin((const_userptr_t)(tf->tf_sp+16), &pos, sizeof(pos));
+        if (!err) {
+          err = sys_pread(
+            (int)tf->tf_a0,
+            (userptr_t)tf->tf_a1,
+            (size_t)tf->tf_a2,
+            pos,
+            &retval);
+        }
+        break;
+
+      case SYS_pwrite:
+        err = copyin((const_userptr_t)(tf->tf_sp+16), &pos, sizeof(pos));
+        if (!err) {
+          err = sys_pwrite(
+            (int)tf->tf_a0,
+            (userptr_t)tf->tf_a1,
+            (size_t)tf->tf_a2,
+            pos,
+            &retval);
+        }
+        break;
+
+      case SYS_readv:
+        err = sys_readv(
+          (int)tf->tf_a0,
+          (userptr_t)tf->tf_a1,
+          (int)tf->tf_a2,
+          &retval);
+        break;
+
+      case SYS_writev:
+        err = sys_writev(
+          (int)tf->tf_a0,
+          (userptr_t)tf->tf_a1,
+          (int)tf->tf_a2,
+          &retval);
+        break;
+
       case SYS_dup2:
         err = sys_dup2(
           (int) tf->tf_a0,
@@ -181,6 +225,42 @@ syscall(struct trapframe *tf)
           &retval_64);
         break;
 
+      case SYS_sync:
+        err = sys_sync();
+        break;
+
+      case SYS_pipe:
+        err = sys_pipe((userptr_t)tf->tf_a0, &retval);
+        break;
+
+      case SYS_mmap:
+        {
+          int32_t fd;
+
+          /* fd and the (64-bit aligned) offset come from the stack */
+          err = copyin((const_userptr_t)(tf->tf_sp+16), &fd, sizeof(fd));
+          if (!err) {
+            err = copyin((const_userptr_t)(tf->tf_sp+24), &pos, sizeof(pos));
+          }
+          if (!err) {
+            err = sys_mmap(
+              (userptr_t)tf->tf_a0,
+              (size_t)tf->tf_a1,
+              (int)tf->tf_a2,
+              (int)tf->tf_a3,
+              fd,
+              pos,
+              &retval);
+          }
+        }
+        break;
+
+      case SYS_munmap:
+        err = sys_munmap(
+          (userptr_t)tf->tf_a0,
+          (size_t)tf->tf_a1);
+        break;
+
       case SYS__exit:
         sys__exit((int)tf->tf_a0);
         break;
@@ -259,6 +339,7 @@ enter_forked_process(struct trapframe *tf)
 #if OPT_SHELL
   // Duplicate frame so it's on stack
   struct trapframe forkedTf = *tf; // copy trap frame onto kernel stack
+  kmem_cache_free(trapframe_cache, tf); // the parent's copy is no longer needed
 
   forkedTf.tf_v0 = 0; // return value is 0
   forkedTf.tf_a3 = 0; // return with success
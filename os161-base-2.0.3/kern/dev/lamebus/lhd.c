@@ -29,6 +29,17 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * Requests are queued per disk and served in C-LOOK order: the head
+ * sweeps upward through the queued requests, then jumps back to the
+ * lowest one. The hardware moves one sector per operation, so a
+ * request is carried out as a run of back-to-back sector operations;
+ * a batch of blocks (devop_iobatch) is sorted and contiguous blocks
+ * are merged into single requests before being queued.
+ *
+ * There is no separate I/O thread: whichever thread owns the active
+ * request does the transfer, and when it is done it picks the next
+ * request and wakes that request's owner.
  */
 
 #include <types.h>
@@ -37,6 +48,10 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -180,44 +195,24 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Move the sectors of one request. Called by the request's owner
+ * while the request is active, so nobody else touches the device.
  */
 static
 int
-lhd_io(struct device *d, struct uio *uio)
+lhd_transfer(struct lhd_softc *lh, struct lhd_request *req)
 {
-	struct lhd_softc *lh = d->d_data;
-
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
+	struct uio *uio = req->lr_uio;
 	uint32_t statval = LHD_WORKING;
+	uint32_t i;
 	int result;
 
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
-	}
-
-	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
-		return EINVAL;
-	}
-
 	/* Set up the value to write into the status register. */
 	if (uio->uio_rw==UIO_WRITE) {
 		statval |= LHD_ISWRITE;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
+	for (i=0; i<req->lr_nsect; i++) {
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -226,13 +221,12 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 			membar_store_store();
 			if (result) {
-				V(lh->lh_clear);
 				return result;
 			}
 		}
 
 		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+		lhd_wreg(lh, LHD_REG_SECT, req->lr_sector+i);
 
 		/* and start the operation. */
 		lhd_wreg(lh, LHD_REG_STAT, statval);
@@ -252,10 +246,6 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
 		if (result) {
 			return result;
 		}
@@ -264,10 +254,291 @@ lhd_io(struct device *d, struct uio *uio)
 	return 0;
 }
 
+/*
+ * C-LOOK: take off the queue the request with the lowest starting
+ * sector at or past the head; if there is none, wrap around to the
+ * lowest one overall. Returns NULL if the queue is empty.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *req, **pp, **best, **lowest;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+
+	best = lowest = NULL;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		req = *pp;
+		if (lowest == NULL || req->lr_sector < (*lowest)->lr_sector) {
+			lowest = pp;
+		}
+		if (req->lr_sector >= lh->lh_headpos &&
+		    (best == NULL || req->lr_sector < (*best)->lr_sector)) {
+			best = pp;
+		}
+	}
+	if (best == NULL) {
+		best = lowest;
+	}
+	if (best == NULL) {
+		return NULL;
+	}
+
+	req = *best;
+	*best = req->lr_next;
+	req->lr_next = NULL;
+	lh->lh_qdepth--;
+
+	/* Count picking up right where the last request left off. */
+	if (lh->lh_stats.ls_requests > 0 && req->lr_sector == lh->lh_headpos) {
+		lh->lh_stats.ls_seqpicks++;
+	}
+	return req;
+}
+
+/*
+ * Queue NREQS requests and carry them out, in whatever order the
+ * scheduler chooses, interleaved with other threads' requests.
+ * Returns the first error; the remaining requests are still done.
+ */
+static
+int
+lhd_run(struct lhd_softc *lh, struct lhd_request *reqs, unsigned nreqs)
+{
+	struct lhd_request *req;
+	struct timespec now, diff;
+	unsigned i, remaining;
+	uint32_t dist;
+	int result, ret = 0;
+
+	gettime(&now);
+
+	spinlock_acquire(&lh->lh_qlock);
+	for (i=0; i<nreqs; i++) {
+		reqs[i].lr_owner = curthread;
+		reqs[i].lr_queued = now;
+		reqs[i].lr_next = lh->lh_queue;
+		lh->lh_queue = &reqs[i];
+		lh->lh_qdepth++;
+		lh->lh_stats.ls_depthsum += lh->lh_qdepth;
+		if (lh->lh_qdepth > lh->lh_stats.ls_maxdepth) {
+			lh->lh_stats.ls_maxdepth = lh->lh_qdepth;
+		}
+	}
+	if (lh->lh_active == NULL) {
+		lh->lh_active = lhd_pick(lh);
+	}
+
+	remaining = nreqs;
+	while (remaining > 0) {
+		/* Wait until one of ours comes up. */
+		while (lh->lh_active->lr_owner != curthread) {
+			wchan_sleep(lh->lh_qwchan, &lh->lh_qlock);
+		}
+		req = lh->lh_active;
+		dist = req->lr_sector > lh->lh_headpos ?
+			req->lr_sector - lh->lh_headpos :
+			lh->lh_headpos - req->lr_sector;
+		spinlock_release(&lh->lh_qlock);
+
+		gettime(&now);
+		result = lhd_transfer(lh, req);
+		if (result && ret == 0) {
+			ret = result;
+		}
+
+		spinlock_acquire(&lh->lh_qlock);
+		timespec_sub(&now, &req->lr_queued, &diff);
+		lh->lh_stats.ls_waitns +=
+			diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+		gettime(&diff);
+		timespec_sub(&diff, &now, &diff);
+		lh->lh_stats.ls_servicens +=
+			diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+		lh->lh_stats.ls_requests++;
+		lh->lh_stats.ls_sectors += req->lr_nsect;
+		lh->lh_stats.ls_seekdist += dist;
+		lh->lh_headpos = req->lr_sector + req->lr_nsect;
+		remaining--;
+
+		/* Hand the disk to the next request, and wake its owner. */
+		lh->lh_active = lhd_pick(lh);
+		if (lh->lh_active != NULL &&
+		    lh->lh_active->lr_owner != curthread) {
+			wchan_wakeall(lh->lh_qwchan, &lh->lh_qlock);
+		}
+	}
+	spinlock_release(&lh->lh_qlock);
+
+	return ret;
+}
+
+/*
+ * I/O function (for both reads and writes)
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_request req;
+
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
+	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	/* XXX this check can overflow */
+	if (sector+len > lh->lh_dev.d_blocks) {
+		return EINVAL;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	req.lr_sector = sector;
+	req.lr_nsect = len;
+	req.lr_uio = uio;
+	return lhd_run(lh, &req, 1);
+}
+
+/*
+ * Batched I/O. Sort the blocks, merge runs of consecutive blocks into
+ * one request each, and queue all the requests at once.
+ */
+static
+int
+lhd_iobatch(struct device *d, struct devio *ios, unsigned nios,
+	    enum uio_rw rw)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_request *reqs;
+	struct iovec *iovs;
+	struct uio *uios;
+	struct devio *io;
+	unsigned *order;
+	daddr_t block;
+	unsigned i, j, nreqs;
+	int result;
+
+	if (nios == 0) {
+		return 0;
+	}
+
+	order = kmalloc(nios * sizeof(*order));
+	reqs = kmalloc(nios * sizeof(*reqs));
+	iovs = kmalloc(nios * sizeof(*iovs));
+	uios = kmalloc(nios * sizeof(*uios));
+	if (order == NULL || reqs == NULL || iovs == NULL || uios == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Sort by block number (insertion sort; batches are small). The
+	 * caller's array is left alone; we sort indexes into it.
+	 */
+	for (i=0; i<nios; i++) {
+		block = ios[i].dio_block;
+		for (j=i; j>0 && ios[order[j-1]].dio_block > block; j--) {
+			order[j] = order[j-1];
+		}
+		order[j] = i;
+	}
+	if (ios[order[nios-1]].dio_block >= lh->lh_dev.d_blocks) {
+		result = EINVAL;
+		goto out;
+	}
+
+	nreqs = 0;
+	for (i=0; i<nios; i++) {
+		io = &ios[order[i]];
+		iovs[i].iov_kbase = io->dio_data;
+		iovs[i].iov_len = LHD_SECTSIZE;
+		if (nreqs > 0 &&
+		    io->dio_block ==
+		    reqs[nreqs-1].lr_sector + reqs[nreqs-1].lr_nsect) {
+			/* extends the previous run */
+			reqs[nreqs-1].lr_nsect++;
+			uios[nreqs-1].uio_iovcnt++;
+			uios[nreqs-1].uio_resid += LHD_SECTSIZE;
+			continue;
+		}
+		uios[nreqs].uio_iov = &iovs[i];
+		uios[nreqs].uio_iovcnt = 1;
+		uios[nreqs].uio_offset = ((off_t)io->dio_block) * LHD_SECTSIZE;
+		uios[nreqs].uio_resid = LHD_SECTSIZE;
+		uios[nreqs].uio_segflg = UIO_SYSSPACE;
+		uios[nreqs].uio_rw = rw;
+		uios[nreqs].uio_space = NULL;
+		reqs[nreqs].lr_sector = io->dio_block;
+		reqs[nreqs].lr_nsect = 1;
+		reqs[nreqs].lr_uio = &uios[nreqs];
+		nreqs++;
+	}
+
+	spinlock_acquire(&lh->lh_qlock);
+	lh->lh_stats.ls_merges += nios - nreqs;
+	spinlock_release(&lh->lh_qlock);
+
+	result = lhd_run(lh, reqs, nreqs);
+
+ out:
+	kfree(order);
+	kfree(reqs);
+	kfree(iovs);
+	kfree(uios);
+	return result;
+}
+
+/*
+ * Print the per-disk statistics.
+ */
+static
+void
+lhd_printstats(struct device *d, const char *name)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_stats s;
+	unsigned depth;
+	unsigned n;
+
+	spinlock_acquire(&lh->lh_qlock);
+	s = lh->lh_stats;
+	depth = lh->lh_qdepth;
+	spinlock_release(&lh->lh_qlock);
+
+	n = s.ls_requests == 0 ? 1 : s.ls_requests;
+	kprintf("%s: %u requests, %u sectors, %u merges\n",
+		name, s.ls_requests, s.ls_sectors, s.ls_merges);
+	kprintf("    sequential: %u requests started where the last ended\n",
+		s.ls_seqpicks);
+	kprintf("    queue depth: %u now, %u max, %u.%02u average\n",
+		depth, s.ls_maxdepth,
+		(unsigned)(s.ls_depthsum / n),
+		(unsigned)((s.ls_depthsum * 100 / n) % 100));
+	kprintf("    seek distance: %llu sectors total, %llu per request\n",
+		(unsigned long long)s.ls_seekdist,
+		(unsigned long long)(s.ls_seekdist / n));
+	kprintf("    average wait: %llu us, average service: %llu us\n",
+		(unsigned long long)(s.ls_waitns / n / 1000),
+		(unsigned long long)(s.ls_servicens / n / 1000));
+}
+
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_iobatch = lhd_iobatch,
+	.devop_printstats = lhd_printstats,
 };
 
 /*
@@ -284,18 +555,26 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
+	/* Create the semaphore. */
 	lh->lh_done = sem_create("lhd-done", 0);
 	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
 		return ENOMEM;
 	}
 
+	/* Set up the request queue. */
+	lh->lh_qwchan = wchan_create("lhd-queue");
+	if (lh->lh_qwchan == NULL) {
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+	spinlock_init(&lh->lh_qlock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_qdepth = 0;
+	lh->lh_headpos = 0;
+	bzero(&lh->lh_stats, sizeof(lh->lh_stats));
+
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
@@ -31,12 +31,44 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <kern/time.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A queued request: a run of consecutive sectors, all read or all
+ * written. Lives on the stack of the thread that submitted it (the
+ * owner), which is also the thread that performs the transfer, so
+ * that uiomove runs in the right address space.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	uint32_t lr_nsect;		/* number of sectors */
+	struct uio *lr_uio;		/* where the data goes/comes from */
+	struct thread *lr_owner;	/* thread that will do the transfer */
+	struct timespec lr_queued;	/* when it was submitted */
+	struct lhd_request *lr_next;	/* queue link */
+};
+
+/*
+ * Per-disk statistics.
+ */
+struct lhd_stats {
+	unsigned ls_requests;		/* requests serviced */
+	unsigned ls_sectors;		/* sectors transferred */
+	unsigned ls_merges;		/* requests merged with a neighbour */
+	unsigned ls_seqpicks;		/* requests starting where the last ended */
+	unsigned ls_maxdepth;		/* longest the queue has been */
+	uint64_t ls_depthsum;		/* queue depth seen by each request */
+	uint64_t ls_seekdist;		/* sectors of head movement */
+	uint64_t ls_waitns;		/* time spent queued */
+	uint64_t ls_servicens;		/* time spent transferring */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -52,8 +84,16 @@ struct lhd_softc {
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct semaphore *lh_done;	/* Signalled by interrupt handler */
+
+	/* Request queue, protected by lh_qlock */
+	struct spinlock lh_qlock;
+	struct wchan *lh_qwchan;	/* owners waiting for their turn */
+	struct lhd_request *lh_queue;	/* waiting requests, unordered */
+	struct lhd_request *lh_active;	/* request being transferred */
+	unsigned lh_qdepth;		/* requests on lh_queue */
+	uint32_t lh_headpos;		/* sector after the last one done */
+	struct lhd_stats lh_stats;
 
 	struct device lh_dev;		/* VFS device structure */
 };
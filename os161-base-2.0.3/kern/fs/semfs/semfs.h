@@ -89,7 +89,7 @@ struct semfs_vnode {
 struct semfs {
 	struct fs semfs_absfs;			/* Abstract fs object */
 
-	struct lock *semfs_tablelock;		/* Lock for following */
+	struct rwlock *semfs_tablelock;		/* Lock for following */
 	struct vnodearray *semfs_vnodes;	/* Currently extant vnodes */
 	struct semfs_semarray *semfs_sems;	/* Semaphores */
 
@@ -94,7 +94,7 @@ semfs_sem_insert(struct semfs *semfs, struct semfs_sem *sem, unsigned *ret)
 {
 	unsigned i, num;
 
-	KASSERT(lock_do_i_hold(semfs->semfs_tablelock));
+	KASSERT(rwlock_do_i_hold_write(semfs->semfs_tablelock));
 	num = semfs_semarray_num(semfs->semfs_sems);
 	if (num == SEMFS_ROOTDIR) {
 		/* Too many */
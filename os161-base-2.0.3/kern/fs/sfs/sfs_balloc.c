@@ -33,15 +33,20 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. Blocks come out of sfs_balloc with whatever
+ * was on disk, so this is for callers that need a clean one (inodes
+ * and indirect blocks, and file blocks that are only partly written).
+ * Like any other write it only happens in the buffer cache for now.
  */
-static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
@@ -51,31 +56,197 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
 }
 
+////////////////////////////////////////////////////////////
+// Allocation groups
+
 /*
- * Allocate a block.
+ * Set up the allocation group summary from the freemap. Called at
+ * mount time, before anyone else can see the volume.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_ag_init(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	unsigned leaves, i;
+	uint32_t *tree;
+	daddr_t block;
+
+	sfs->sfs_ngroups = DIVROUNDUP(nblocks, SFS_AGBLOCKS);
+	leaves = 1;
+	while (leaves < sfs->sfs_ngroups) {
+		leaves *= 2;
+	}
+
+	tree = kmalloc(2 * leaves * sizeof(tree[0]));
+	if (tree == NULL) {
+		return ENOMEM;
+	}
+	bzero(tree, 2 * leaves * sizeof(tree[0]));
+
+	for (block=0; block<nblocks; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			tree[leaves + block / SFS_AGBLOCKS]++;
+		}
+	}
+	for (i=leaves-1; i>0; i--) {
+		tree[i] = tree[2*i] + tree[2*i+1];
+	}
+
+	sfs->sfs_agleaves = leaves;
+	sfs->sfs_agtree = tree;
+	return 0;
+}
+
+/*
+ * Number of free blocks in group GROUP.
+ */
+static
+uint32_t
+sfs_ag_nfree(struct sfs_fs *sfs, unsigned group)
 {
+	return sfs->sfs_agtree[sfs->sfs_agleaves + group];
+}
+
+/*
+ * Account for BLOCK being allocated (DELTA -1) or freed (DELTA 1).
+ */
+static
+void
+sfs_ag_adjust(struct sfs_fs *sfs, daddr_t block, int delta)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i = sfs->sfs_agleaves + block / SFS_AGBLOCKS; i > 0; i /= 2) {
+		sfs->sfs_agtree[i] += delta;
+	}
+}
+
+/*
+ * Find the first group at or after START that has a free block,
+ * wrapping around to group 0 if there isn't one. Returns false if
+ * the volume is full.
+ *
+ * Climb from START's leaf until there is a right sibling with free
+ * blocks (or we reach the root, which means wrapping around), then
+ * go down to the leftmost leaf with free blocks under it.
+ */
+static
+bool
+sfs_ag_find(struct sfs_fs *sfs, unsigned start, unsigned *group)
+{
+	const uint32_t *tree = sfs->sfs_agtree;
+	unsigned leaves = sfs->sfs_agleaves;
+	unsigned i;
+
+	if (start >= sfs->sfs_ngroups) {
+		start = 0;
+	}
+
+	i = leaves + start;
+	if (tree[i] == 0) {
+		while (i > 1 && (i % 2 == 1 || tree[i+1] == 0)) {
+			i /= 2;
+		}
+		if (i == 1) {
+			if (tree[1] == 0) {
+				return false;
+			}
+		}
+		else {
+			i++;
+		}
+		while (i < leaves) {
+			i = tree[2*i] > 0 ? 2*i : 2*i+1;
+		}
+	}
+
+	*group = i - leaves;
+	KASSERT(*group < sfs->sfs_ngroups);
+	return true;
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/*
+ * Note that the freemap bit for BLOCK has changed, so the freemap
+ * block holding it needs writing.
+ */
+static
+void
+sfs_freemap_dirty(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned j = block / SFS_BITSPERBLOCK;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!bitmap_isset(sfs->sfs_freemapdirty, j)) {
+		bitmap_mark(sfs->sfs_freemapdirty, j);
+		sfs->sfs_freemapndirty++;
+	}
+}
+
+/*
+ * Allocate a block, as close to HINT as we can: the first free one
+ * at or after HINT in HINT's allocation group, or failing that the
+ * first free one earlier in the group, or failing that the first
+ * free one in the next group that has any. Callers pass the block
+ * after the last one they got (or after the inode, or after the
+ * directory for a new inode), so files written in order end up laid
+ * out in order and next to their inodes, and unrelated files don't
+ * all pile up at the front of the disk.
+ *
+ * The block is not zeroed; see sfs_clearblock.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t hint, daddr_t *diskblock)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	unsigned group;
+	daddr_t start, end;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (hint >= nblocks) {
+		hint = 0;
+	}
+	group = hint / SFS_AGBLOCKS;
+	if (sfs_ag_nfree(sfs, group) == 0) {
+		if (!sfs_ag_find(sfs, group + 1, &group)) {
+			lock_release(sfs->sfs_freemaplock);
+			return ENOSPC;
+		}
+		hint = group * SFS_AGBLOCKS;
+	}
+	start = group * SFS_AGBLOCKS;
+	end = start + SFS_AGBLOCKS;
+	if (end > nblocks) {
+		end = nblocks;
+	}
+
+	/* The group has a free block, so one of these finds it */
+	result = bitmap_alloc_range(sfs->sfs_freemap, hint, end, diskblock);
 	if (result) {
-		return result;
+		result = bitmap_alloc_range(sfs->sfs_freemap, start, hint,
+					    diskblock);
+	}
+	if (result) {
+		panic("sfs: %s: balloc: group %u free count is wrong\n",
+		      sfs->sfs_sb.sb_volname, group);
 	}
-	sfs->sfs_freemapdirty = true;
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
+	sfs_ag_adjust(sfs, *diskblock, -1);
+	sfs_freemap_dirty(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	if (*diskblock >= nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
-
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
-	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
-	}
-	return result;
+	return 0;
 }
 
 /*
@@ -84,8 +255,18 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	/*
+	 * Whatever is cached for the block is garbage now. Drop it
+	 * before the block can be handed out again, or we might drop
+	 * the new owner's data.
+	 */
+	buffer_drop(sfs->sfs_device, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_ag_adjust(sfs, diskblock, 1);
+	sfs_freemap_dirty(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +275,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
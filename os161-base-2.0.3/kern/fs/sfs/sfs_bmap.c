@@ -35,156 +35,199 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <vfs.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Allocate a block for SV (data or indirect), next to the last one
+ * it got if possible. If ZERO is set, clear it too.
+ */
+static
+int
+sfs_bmap_alloc(struct sfs_fs *sfs, struct sfs_vnode *sv, bool zero,
+	       daddr_t *block)
+{
+	int result;
+
+	result = sfs_balloc(sfs, sv->sv_allochint, block);
+	if (result) {
+		return result;
+	}
+	if (zero) {
+		result = sfs_clearblock(sfs, *block);
+		if (result) {
+			sfs_bfree(sfs, *block);
+			return result;
+		}
+	}
+	sv->sv_allochint = *block + 1;
+	return 0;
+}
+
+/*
+ * Find the top of the tree that maps FILEBLOCK: the inode field that
+ * points to it (or the direct block itself), how many levels of
+ * indirect blocks are under that, and how many file blocks each
+ * entry in the topmost indirect block covers. *FILEBLOCK is adjusted
+ * to be relative to the start of the tree.
+ */
+static
+int
+sfs_bmap_top(struct sfs_vnode *sv, uint32_t *fileblock, uint32_t **topp,
+	     unsigned *levels, uint32_t *span)
+{
+	uint32_t fb = *fileblock;
+
+	if (fb < SFS_NDIRECT) {
+		*topp = &sv->sv_i.sfi_direct[fb];
+		*levels = 0;
+		*span = 1;
+		return 0;
+	}
+	fb -= SFS_NDIRECT;
+
+	if (fb < SFS_DBPERIDB) {
+		*topp = &sv->sv_i.sfi_indirect;
+		*levels = 1;
+		*span = 1;
+	}
+	else if (fb - SFS_DBPERIDB < SFS_DBPERIDB*SFS_DBPERIDB) {
+		fb -= SFS_DBPERIDB;
+		*topp = &sv->sv_i.sfi_dindirect;
+		*levels = 2;
+		*span = SFS_DBPERIDB;
+	}
+	else if (fb - SFS_DBPERIDB - SFS_DBPERIDB*SFS_DBPERIDB <
+		 SFS_DBPERIDB*SFS_DBPERIDB*SFS_DBPERIDB) {
+		fb -= SFS_DBPERIDB + SFS_DBPERIDB*SFS_DBPERIDB;
+		*topp = &sv->sv_i.sfi_tindirect;
+		*levels = 3;
+		*span = SFS_DBPERIDB*SFS_DBPERIDB;
+	}
+	else {
+		/* Past the largest file we can map */
+		return EFBIG;
+	}
+
+	*fileblock = fb;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, along with any indirect blocks needed to reach it.
+ *
+ * A newly allocated data block is not zeroed, since most of the time
+ * the caller is about to write all of it anyway; *ISNEW says whether
+ * that happened, so the caller can clear whatever it won't write.
+ * ISNEW may be NULL if DOALLOC is false.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+	 daddr_t *diskblock, bool *isnew)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *topp;
+	daddr_t block, next;
+	uint32_t offset, span, idoff;
+	unsigned levels;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
-	 * If the block we want is one of the direct blocks...
+	 * Looking blocks up only needs the vnode locked for reading,
+	 * but allocating them changes the inode.
 	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
+	KASSERT(!doalloc || rwlock_do_i_hold_write(sv->sv_lock));
+	KASSERT(!doalloc || isnew != NULL);
 
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
-			}
-
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
-		}
+	if (isnew != NULL) {
+		*isnew = false;
+	}
 
+	if (doalloc && sv->sv_allochint == 0) {
 		/*
-		 * Hand back the block
+		 * First allocation since the vnode was loaded: put it
+		 * after the block before it in the file, if there is
+		 * one, or else after the inode.
 		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: %s: Data block %u (block %u of file %u) "
-			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
+		sv->sv_allochint = sv->sv_ino + 1;
+		if (fileblock > 0) {
+			result = sfs_bmap(sv, fileblock-1, false, &block,
+					  NULL);
+			if (result == 0 && block != 0) {
+				sv->sv_allochint = block + 1;
+			}
 		}
-		*diskblock = block;
-		return 0;
 	}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	offset = fileblock;
+	result = sfs_bmap_top(sv, &offset, &topp, &levels, &span);
+	if (result) {
+		return result;
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Get the block (direct or indirect) the inode points to,
+	 * allocating it if need be. A new indirect block gets zeroed
+	 * so it starts out empty.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
-	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	block = *topp;
+	if (block==0 && doalloc) {
+		result = sfs_bmap_alloc(sfs, sv, levels > 0, &block);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		if (levels == 0) {
+			*isnew = true;
 		}
+
+		/* Remember what we allocated; mark inode dirty */
+		*topp = block;
+		sfs_dirty_inode(sv);
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down the indirect blocks, if any. Work on each one
+	 * right in the buffer cache; the buffer stays busy while we
+	 * look at it, so two readers of the same file don't trip over
+	 * each other. If there's a hole and we weren't asked to
+	 * allocate, pretend the rest of the way down is all zeros.
+	 */
+	for (; levels > 0 && block != 0; levels--) {
+		idoff = offset / span;
+		offset %= span;
+		span /= SFS_DBPERIDB;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = buffer_read(sfs->sfs_device, block, &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = buffer_map(idbuf);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		next = iddata[idoff];
+		if (next==0 && doalloc) {
+			result = sfs_bmap_alloc(sfs, sv, levels > 1, &next);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+			if (levels == 1) {
+				*isnew = true;
+			}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+			/* Remember the block; the indirect block is dirty */
+			iddata[idoff] = next;
+			buffer_mark_dirty(idbuf);
 		}
+		buffer_release(idbuf);
+
+		block = next;
 	}
 
 	/* Hand back the result and return. */
@@ -198,34 +241,108 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free everything mapped at or past file block BLOCKLEN in the
+ * indirect block IDBLOCK, which sits LEVELS levels above the data
+ * blocks and maps the file starting at BASEBLOCK, SPAN blocks per
+ * entry. Sets *ISEMPTY if nothing is left in it afterwards, so the
+ * caller can free it too.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, daddr_t idblock, unsigned levels,
+		    uint32_t baseblock, uint32_t span, uint32_t blocklen,
+		    bool *isempty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, entrybase;
+	bool hasnonzero, iddirty, subempty;
+	int result;
 
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	/* Nothing to do if it's all before the new EOF */
+	if (blocklen >= baseblock + span*SFS_DBPERIDB) {
+		*isempty = false;
+		return 0;
+	}
 
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = baseblock + j*span;
+		if (iddata[j] != 0 && blocklen < entrybase + span) {
+			/* This entry maps something past the new EOF */
+			if (levels > 1) {
+				result = sfs_itrunc_indirect(sfs, iddata[j],
+							     levels-1,
+							     entrybase,
+							     span/SFS_DBPERIDB,
+							     blocklen,
+							     &subempty);
+				if (result) {
+					if (iddirty) {
+						buffer_mark_dirty(idbuf);
+					}
+					buffer_release(idbuf);
+					return result;
+				}
+			}
+			else {
+				subempty = true;
+			}
+			if (subempty) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
+				iddirty = true;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	if (iddirty) {
+		buffer_mark_dirty(idbuf);
+	}
+	buffer_release(idbuf);
+
+	*isempty = !hasnonzero;
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked
+ * for writing.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *tops[3];
+	uint32_t baseblock, span;
+	uint32_t blocklen;
+	daddr_t block;
+	unsigned i;
+	bool isempty;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (len < 0) {
+		return EINVAL;
+	}
+	if (len > (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
 
-	vfs_biglock_acquire();
+	/* Length in blocks (divide rounding up) */
+	blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -236,68 +353,47 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+	/*
+	 * Then the indirect, double indirect, and triple indirect
+	 * trees, freeing whatever is past the new EOF and then the
+	 * indirect blocks that end up empty.
+	 */
+	tops[0] = &sv->sv_i.sfi_indirect;
+	tops[1] = &sv->sv_i.sfi_dindirect;
+	tops[2] = &sv->sv_i.sfi_tindirect;
 
-	/* The lowest block in the indirect block */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
+	span = 1;
+	for (i=0; i<3; i++) {
+		if (*tops[i] != 0) {
+			result = sfs_itrunc_indirect(sfs, *tops[i], i+1,
+						     baseblock, span,
+						     blocklen, &isempty);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
+			if (isempty) {
+				sfs_bfree(sfs, *tops[i]);
+				*tops[i] = 0;
+				sfs_dirty_inode(sv);
+			}
 		}
+		baseblock += span*SFS_DBPERIDB;
+		span *= SFS_DBPERIDB;
 	}
 
+	/* Start over working out where new blocks should go */
+	sv->sv_allochint = 0;
+
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty_inode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
-
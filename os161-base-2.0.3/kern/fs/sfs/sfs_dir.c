@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -96,13 +97,15 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Search a directory for a particular filename by reading every slot,
+ * and return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found. This is how directories
+ * without an index are searched.
  */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -146,6 +149,412 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+////////////////////////////////////////////////////////////
+// Directory index
+//
+// See kern/sfs.h for the on-disk layout. The index vnode is loaded
+// for each operation and its lock is taken inside the directory's,
+// for reading to look up and for writing to change anything.
+
+/* Positions of things in the index file */
+#define DIRIDX_FREEHEAD    ((off_t)2 * sizeof(uint32_t))	/* sdi_freehead */
+#define DIRIDX_BUCKET(b)   ((off_t)SFS_DIRIDX_BUCKETS + (b)*sizeof(uint32_t))
+#define DIRIDX_LINK(slot)  ((off_t)SFS_DIRIDX_LINKS + (slot)*sizeof(uint32_t))
+
+/*
+ * Hash a name to its bucket: 32-bit FNV-1a. mksfs and sfsck compute
+ * the same thing, so don't change it without changing them too.
+ */
+static
+unsigned
+sfs_dirindex_hash(const char *name)
+{
+	const unsigned char *s;
+	uint32_t h;
+
+	h = 2166136261U;
+	for (s = (const unsigned char *)name; *s; s++) {
+		h ^= *s;
+		h *= 16777619U;
+	}
+	return h % SFS_DIRIDX_NBUCKETS;
+}
+
+/*
+ * Read or write one word of the index.
+ */
+static
+int
+sfs_dirindex_get(struct sfs_vnode *ix, off_t pos, uint32_t *val)
+{
+	return sfs_metaio(ix, pos, val, sizeof(*val), UIO_READ);
+}
+
+static
+int
+sfs_dirindex_put(struct sfs_vnode *ix, off_t pos, uint32_t val)
+{
+	return sfs_metaio(ix, pos, &val, sizeof(val), UIO_WRITE);
+}
+
+/*
+ * Load the index of directory SV, or hand back NULL if it doesn't
+ * have one. The directory must be locked. Drop the reference with
+ * VOP_DECREF when done.
+ */
+static
+int
+sfs_dirindex_load(struct sfs_vnode *sv, struct sfs_vnode **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *ix;
+	int nentries;
+	int result;
+
+	if (sv->sv_i.sfi_dirindex == 0) {
+		*ret = NULL;
+		return 0;
+	}
+
+	result = sfs_loadvnode(sfs, sv->sv_i.sfi_dirindex, SFS_TYPE_INVAL,
+			       &ix);
+	if (result) {
+		return result;
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	if (ix->sv_i.sfi_type != SFS_TYPE_DIRIDX ||
+	    ix->sv_i.sfi_size < DIRIDX_LINK(nentries)) {
+		panic("sfs: %s: directory %u: Invalid index %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, ix->sv_ino);
+	}
+
+	*ret = ix;
+	return 0;
+}
+
+/*
+ * Look NAME up in directory SV through its index IX.
+ */
+static
+int
+sfs_dirindex_find(struct sfs_vnode *sv, struct sfs_vnode *ix,
+		  const char *name, uint32_t *ino, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry tsd;
+	uint32_t next;
+	int nentries, i, count;
+	int result;
+
+	nentries = sfs_dir_nentries(sv);
+
+	result = sfs_dirindex_get(ix, DIRIDX_BUCKET(sfs_dirindex_hash(name)),
+				  &next);
+	if (result) {
+		return result;
+	}
+
+	for (count = 0; next != 0; count++) {
+		i = next - 1;
+		if (i >= nentries || count >= nentries) {
+			panic("sfs: %s: directory %u: Corrupt index chain\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino != SFS_NOINO) {
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (!strcmp(tsd.sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = i;
+				}
+				if (ino != NULL) {
+					*ino = tsd.sfd_ino;
+				}
+				return 0;
+			}
+		}
+
+		result = sfs_dirindex_get(ix, DIRIDX_LINK(i), &next);
+		if (result) {
+			return result;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Put slot SLOT, which holds NAME, on its hash chain.
+ */
+static
+int
+sfs_dirindex_insert(struct sfs_vnode *ix, const char *name, int slot)
+{
+	off_t bucketpos;
+	uint32_t head;
+	int result;
+
+	bucketpos = DIRIDX_BUCKET(sfs_dirindex_hash(name));
+	result = sfs_dirindex_get(ix, bucketpos, &head);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirindex_put(ix, DIRIDX_LINK(slot), head);
+	if (result) {
+		return result;
+	}
+	return sfs_dirindex_put(ix, bucketpos, slot + 1);
+}
+
+/*
+ * Put slot SLOT on the free list.
+ */
+static
+int
+sfs_dirindex_pushfree(struct sfs_vnode *ix, int slot)
+{
+	uint32_t head;
+	int result;
+
+	result = sfs_dirindex_get(ix, DIRIDX_FREEHEAD, &head);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirindex_put(ix, DIRIDX_LINK(slot), head);
+	if (result) {
+		return result;
+	}
+	return sfs_dirindex_put(ix, DIRIDX_FREEHEAD, slot + 1);
+}
+
+/*
+ * Build an index for directory SV, which doesn't have one yet. The
+ * directory must be locked for writing.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *ix;
+	struct sfs_dirindex *sdi;
+	struct sfs_direntry tsd;
+	off_t pos, end;
+	size_t len;
+	int nentries, i;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_dirindex == 0);
+
+	sdi = kmalloc(sizeof(*sdi));
+	if (sdi == NULL) {
+		return ENOMEM;
+	}
+	bzero(sdi, sizeof(*sdi));
+
+	result = sfs_makeobj(sfs, SFS_TYPE_DIRIDX, sv->sv_ino, &ix);
+	if (result) {
+		kfree(sdi);
+		return result;
+	}
+
+	rwlock_acquire_write(ix->sv_lock);
+	ix->sv_i.sfi_linkcount = 1;
+	sfs_dirty_inode(ix);
+
+	/* Fill the file with zeros first so it has no holes. */
+	nentries = sfs_dir_nentries(sv);
+	end = DIRIDX_LINK(SFS_ROUNDUP(nentries, SFS_DIRENTRIESPERBLOCK));
+	for (pos = 0; pos < end; pos += len) {
+		len = end - pos < SFS_BLOCKSIZE ? end - pos : SFS_BLOCKSIZE;
+		result = sfs_metaio(ix, pos, sdi, len, UIO_WRITE);
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* Going backwards leaves the lowest free slot at the head. */
+	for (i = nentries - 1; i >= 0; i--) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			goto fail;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			result = sfs_dirindex_pushfree(ix, i);
+		}
+		else {
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			result = sfs_dirindex_insert(ix, tsd.sfd_name, i);
+		}
+		if (result) {
+			goto fail;
+		}
+	}
+
+	/* The header goes last; pushfree has already set sdi_freehead. */
+	result = sfs_dirindex_get(ix, DIRIDX_FREEHEAD, &sdi->sdi_freehead);
+	if (result) {
+		goto fail;
+	}
+	sdi->sdi_magic = SFS_DIRIDX_MAGIC;
+	sdi->sdi_nbuckets = SFS_DIRIDX_NBUCKETS;
+	result = sfs_metaio(ix, 0, sdi, sizeof(*sdi), UIO_WRITE);
+	if (result) {
+		goto fail;
+	}
+	rwlock_release_write(ix->sv_lock);
+
+	sv->sv_i.sfi_dirindex = ix->sv_ino;
+	sfs_dirty_inode(sv);
+
+	VOP_DECREF(&ix->sv_absvn);
+	kfree(sdi);
+	return 0;
+
+ fail:
+	/* Unlinked, so the last reference erases it. */
+	ix->sv_i.sfi_linkcount = 0;
+	rwlock_release_write(ix->sv_lock);
+	VOP_DECREF(&ix->sv_absvn);
+	kfree(sdi);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_vnode *ix;
+	uint32_t freehead;
+	int result;
+
+	result = sfs_dirindex_load(sv, &ix);
+	if (result) {
+		return result;
+	}
+	if (ix == NULL) {
+		return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+	}
+
+	rwlock_acquire_read(ix->sv_lock);
+	result = sfs_dirindex_find(sv, ix, name, ino, slot);
+	if ((result == 0 || result == ENOENT) && emptyslot != NULL) {
+		int result2;
+
+		result2 = sfs_dirindex_get(ix, DIRIDX_FREEHEAD, &freehead);
+		if (result2) {
+			result = result2;
+		}
+		else if (freehead != 0) {
+			*emptyslot = freehead - 1;
+		}
+	}
+	rwlock_release_read(ix->sv_lock);
+
+	VOP_DECREF(&ix->sv_absvn);
+	return result;
+}
+
+/*
+ * Create a link in a directory through its index. The free list
+ * gives us a slot without looking at the rest of the directory.
+ */
+static
+int
+sfs_dir_link_indexed(struct sfs_vnode *sv, struct sfs_vnode *ix,
+		     const char *name, uint32_t ino, int *slot)
+{
+	struct sfs_direntry sd;
+	uint32_t freehead, next;
+	int newslot;
+	int result;
+
+	/* Look up the name. We want to make sure it *doesn't* exist. */
+	result = sfs_dirindex_find(sv, ix, name, NULL, NULL);
+	if (result!=0 && result!=ENOENT) {
+		return result;
+	}
+	if (result==0) {
+		return EEXIST;
+	}
+
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	result = sfs_dirindex_get(ix, DIRIDX_FREEHEAD, &freehead);
+	if (result) {
+		return result;
+	}
+
+	if (freehead != 0) {
+		newslot = freehead - 1;
+		result = sfs_dirindex_get(ix, DIRIDX_LINK(newslot), &next);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		/*
+		 * Add the entry at the end. When that starts a new
+		 * directory block, extend the link array to match.
+		 */
+		static const uint32_t zeros[SFS_DIRENTRIESPERBLOCK];
+
+		newslot = sfs_dir_nentries(sv);
+		next = 0;
+		if (newslot % SFS_DIRENTRIESPERBLOCK == 0) {
+			result = sfs_metaio(ix, DIRIDX_LINK(newslot),
+					    (void *)zeros, sizeof(zeros),
+					    UIO_WRITE);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	/* Set up and write the entry. */
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = ino;
+	strcpy(sd.sfd_name, name);
+
+	result = sfs_writedir(sv, newslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Now move the slot from the free list to its hash chain. */
+	if (freehead != 0) {
+		result = sfs_dirindex_put(ix, DIRIDX_FREEHEAD, next);
+		if (result) {
+			return result;
+		}
+	}
+	result = sfs_dirindex_insert(ix, name, newslot);
+	if (result) {
+		return result;
+	}
+
+	/* Hand back the slot, if so requested. */
+	if (slot) {
+		*slot = newslot;
+	}
+	return 0;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -153,12 +562,36 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_vnode *ix;
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
 
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	/*
+	 * Index directories that have grown big enough to need it.
+	 * If that fails (say, the disk is full) carry on without.
+	 */
+	if (sv->sv_i.sfi_dirindex == 0 &&
+	    sfs_dir_nentries(sv) >= SFS_DIRIDX_MINSLOTS) {
+		(void)sfs_dirindex_build(sv);
+	}
+
+	result = sfs_dirindex_load(sv, &ix);
+	if (result) {
+		return result;
+	}
+	if (ix != NULL) {
+		rwlock_acquire_write(ix->sv_lock);
+		result = sfs_dir_link_indexed(sv, ix, name, ino, slot);
+		rwlock_release_write(ix->sv_lock);
+		VOP_DECREF(&ix->sv_absvn);
+		return result;
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	result = sfs_dir_scan(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
 		return result;
 	}
@@ -189,13 +622,83 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	return sfs_writedir(sv, emptyslot, &sd);
 }
 
+/*
+ * Take slot SLOT off its hash chain and put it on the free list.
+ */
+static
+int
+sfs_dir_unlink_indexed(struct sfs_vnode *sv, struct sfs_vnode *ix, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry tsd;
+	off_t prevpos;
+	uint32_t cur, next;
+	int result;
+
+	result = sfs_readdir(sv, slot, &tsd);
+	if (result) {
+		return result;
+	}
+	KASSERT(tsd.sfd_ino != SFS_NOINO);
+	tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+
+	/* Find whatever points at the slot. */
+	prevpos = DIRIDX_BUCKET(sfs_dirindex_hash(tsd.sfd_name));
+	while (1) {
+		result = sfs_dirindex_get(ix, prevpos, &cur);
+		if (result) {
+			return result;
+		}
+		if (cur == (uint32_t)slot + 1) {
+			break;
+		}
+		if (cur == 0) {
+			panic("sfs: %s: directory %u: slot %d missing "
+			      "from index\n", sfs->sfs_sb.sb_volname,
+			      sv->sv_ino, slot);
+		}
+		prevpos = DIRIDX_LINK(cur - 1);
+	}
+
+	/* Unchain it... */
+	result = sfs_dirindex_get(ix, DIRIDX_LINK(slot), &next);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirindex_put(ix, prevpos, next);
+	if (result) {
+		return result;
+	}
+
+	/* ...and keep it for the next link. */
+	return sfs_dirindex_pushfree(ix, slot);
+}
+
 /*
  * Unlink a name in a directory, by slot number.
  */
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_vnode *ix;
 	struct sfs_direntry sd;
+	int result;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	result = sfs_dirindex_load(sv, &ix);
+	if (result) {
+		return result;
+	}
+	if (ix != NULL) {
+		rwlock_acquire_write(ix->sv_lock);
+		result = sfs_dir_unlink_indexed(sv, ix, slot);
+		rwlock_release_write(ix->sv_lock);
+		VOP_DECREF(&ix->sv_absvn);
+		if (result) {
+			return result;
+		}
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
@@ -207,7 +710,8 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 
 /*
  * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * file, if there is one. The directory must be locked, at least for
+ * reading.
  */
 int
 sfs_lookonce(struct sfs_vnode *sv, const char *name,
@@ -38,9 +38,12 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <kmem.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -52,8 +55,9 @@
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading loads the whole bitmap; writing only writes the blocks of
+ * it marked in sfs_freemapdirty, so that a sync after allocating one
+ * block doesn't rewrite megabytes of bitmap on a big volume.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -82,11 +86,18 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
 	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
+	for (j=0; j<freemapblocks && (rw == UIO_READ ||
+				      sfs->sfs_freemapndirty > 0); j++) {
 
 		/* Get a pointer to its data */
 		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
 
+		/* (skipping it if we're writing and it hasn't changed) */
+		if (rw == UIO_WRITE &&
+		    !bitmap_isset(sfs->sfs_freemapdirty, j)) {
+			continue;
+		}
+
 		/* and read or write it. The freemap starts at sector 2. */
 		if (rw == UIO_READ) {
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
@@ -101,26 +112,85 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 		if (result) {
 			return result;
 		}
+
+		if (rw == UIO_WRITE) {
+			bitmap_unmark(sfs->sfs_freemapdirty, j);
+			sfs->sfs_freemapndirty--;
+		}
 	}
 	return 0;
 }
 
 /*
  * Sync routine for the vnode table.
+ *
+ * Only the vnodes on the dirty list need writing. The vnode locks
+ * come before sfs_vnlock, so we can't lock vnodes while looking at
+ * the list. Instead take a reference to each, drop the locks, and
+ * then sync them one by one. (Holding sfs_vnlock keeps them from
+ * being reclaimed while we do that; inactive vnodes were written
+ * back when they became inactive, so aren't on the list.) The
+ * inodes only go as far as the buffer cache; sfs_sync writes that
+ * out afterwards, once for all of them.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *vnodes;
+	struct vnode *v;
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	int result, err;
+
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_dirtylock);
+	result = vnodearray_setsize(vnodes, sfs->sfs_ndirty);
+	if (result) {
+		lock_release(sfs->sfs_dirtylock);
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	num = 0;
+	for (sv = sfs->sfs_dirtyhead; sv != NULL; sv = sv->sv_dirtynext) {
+		v = &sv->sv_absvn;
+		spinlock_acquire(&v->vn_countlock);
+		if (v->vn_refcount == 0) {
+			/* inactive; its sync must have failed */
+			spinlock_release(&v->vn_countlock);
+			continue;
+		}
+		v->vn_refcount++;
+		spinlock_release(&v->vn_countlock);
+		vnodearray_set(vnodes, num++, v);
+	}
+	lock_release(sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Go over the loaded vnodes, syncing as we go. */
+	err = 0;
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(vnodes, i);
+		sv = v->vn_data;
+
+		rwlock_acquire_write(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+		if (result && err == 0) {
+			err = result;
+		}
+		VOP_DECREF(v);
 	}
-	return 0;
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+	return err;
 }
 
 /*
@@ -132,12 +202,11 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
-		if (result) {
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemapio(sfs, UIO_WRITE);
+	lock_release(sfs->sfs_freemaplock);
+	if (result) {
+		return result;
 	}
 
 	return 0;
@@ -152,14 +221,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +246,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +281,30 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/*
+	 * All of the above only went as far as the buffer cache;
+	 * now push every dirty block of this volume to the disk.
+	 */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +318,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name never changes while mounted; no lock needed. */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +333,18 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_freemapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirty);
+	}
+	if (sfs->sfs_agtree != NULL) {
+		kfree(sfs->sfs_agtree);
+	}
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	KASSERT(sfs->sfs_ndirty == 0);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,18 +359,35 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. Vnodes
+	 * that are merely inactive don't count; throw them out. The
+	 * vfs layer holds knowndevs_lock for writing, so nobody can
+	 * get at our root to load new vnodes once we've checked.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_flush_inactive(sfs);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		return result;
+	}
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_freemapndirty == 0);
+
+	/* Flush and forget the cached blocks of the device */
+	result = buffer_drop_device(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +396,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -351,17 +449,49 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(*sfs->sfs_vnhash));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnlock;
+	}
+	bzero(sfs->sfs_vnhash, SFS_VNHASH_INITSIZE * sizeof(*sfs->sfs_vnhash));
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_ninactive = 0;
+
+	/* dirty list */
+	sfs->sfs_dirtylock = lock_create("sfs_dirty");
+	if (sfs->sfs_dirtylock == NULL) {
+		goto cleanup_vnodes;
+	}
+	sfs->sfs_dirtyhead = NULL;
+	sfs->sfs_ndirty = 0;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_dirty;
+	}
 	sfs->sfs_freemap = NULL;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirty = NULL;
+	sfs->sfs_freemapndirty = 0;
+	sfs->sfs_ngroups = 0;
+	sfs->sfs_agleaves = 0;
+	sfs->sfs_agtree = NULL;
 
 	return sfs;
 
+cleanup_dirty:
+	lock_destroy(sfs->sfs_dirtylock);
+cleanup_vnodes:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,7 +518,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
+	/*
+	 * No locking is needed here: nobody can see the new volume
+	 * until we return, and vfs_mount holds knowndevs_lock for
+	 * writing, which also protects creating sfs_vnode_cache.
+	 */
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -402,15 +536,24 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
 	}
 
+	/* The first mount sets up the cache of vnode structures. */
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    sfs_vnode_ctor,
+						    sfs_vnode_dtor);
+		if (sfs_vnode_cache == NULL) {
+				return ENOMEM;
+		}
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +566,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +578,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -450,24 +591,28 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_freemapdirty = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemapdirty == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return result;
+	}
+	result = sfs_ag_init(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,13 +35,104 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <kmem.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Memory for struct sfs_vnode, shared by all volumes. Set up by the
+ * first mount.
+ */
+struct kmem_cache *sfs_vnode_cache;
+
+/*
+ * Constructor and destructor for sfs_vnode_cache. The vnode locks are
+ * made once and kept while the structure sits in the cache.
+ */
+int
+sfs_vnode_ctor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sv->sv_ralock);
+	return 0;
+}
+
+void
+sfs_vnode_dtor(void *obj)
+{
+	struct sfs_vnode *sv = obj;
+
+	spinlock_cleanup(&sv->sv_ralock);
+	rwlock_destroy(sv->sv_lock);
+}
+
+/*
+ * Dirty list: vnodes whose inodes need writing. Needs sfs_dirtylock.
+ */
+
+static
+void
+sfs_dirtylist_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_dirtylock);
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtyhead;
+	if (sfs->sfs_dirtyhead != NULL) {
+		sfs->sfs_dirtyhead->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtyhead = sv;
+	sfs->sfs_ndirty++;
+	lock_release(sfs->sfs_dirtylock);
+}
+
+static
+void
+sfs_dirtylist_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_dirtylock);
+	if (sv->sv_dirtyprev != NULL) {
+		sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+	}
+	else {
+		KASSERT(sfs->sfs_dirtyhead == sv);
+		sfs->sfs_dirtyhead = sv->sv_dirtynext;
+	}
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+	}
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
+	KASSERT(sfs->sfs_ndirty > 0);
+	sfs->sfs_ndirty--;
+	lock_release(sfs->sfs_dirtylock);
+}
+
+/*
+ * Note that the in-memory inode has been changed and needs to be
+ * written out. The vnode must be locked for writing.
+ */
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (!sv->sv_dirty) {
+		sv->sv_dirty = true;
+		sfs_dirtylist_add(sfs, sv);
+	}
+}
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out to disk. The vnode must
+ * be locked for writing.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,6 +140,8 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -56,6 +149,259 @@ sfs_sync_inode(struct sfs_vnode *sv)
 			return result;
 		}
 		sv->sv_dirty = false;
+		sfs_dirtylist_remove(sfs, sv);
+	}
+	return 0;
+}
+
+/*
+ * Vnode table.
+ *
+ * Loaded vnodes are kept in a hash table keyed by inode number, with
+ * chaining through sv_hashnext. All of this needs sfs_vnlock.
+ */
+
+static
+unsigned
+sfs_vnhash_bucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnhash[sfs_vnhash_bucket(sfs, ino)];
+	while (sv != NULL && sv->sv_ino != ino) {
+		sv = sv->sv_hashnext;
+	}
+	return sv;
+}
+
+/*
+ * Double the number of buckets. If there's no memory for that, just
+ * keep the table we have; the chains get longer, but nothing breaks.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newhash, **oldhash;
+	struct sfs_vnode *sv, *next;
+	unsigned oldsize, i, b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	oldsize = sfs->sfs_vnhashsize;
+	newhash = kmalloc(2 * oldsize * sizeof(*newhash));
+	if (newhash == NULL) {
+		return;
+	}
+	bzero(newhash, 2 * oldsize * sizeof(*newhash));
+
+	oldhash = sfs->sfs_vnhash;
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = 2 * oldsize;
+
+	for (i=0; i<oldsize; i++) {
+		for (sv = oldhash[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			b = sfs_vnhash_bucket(sfs, sv->sv_ino);
+			sv->sv_hashnext = newhash[b];
+			newhash[b] = sv;
+		}
+	}
+	kfree(oldhash);
+}
+
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnhashsize &&
+	    sfs->sfs_vnhashsize < SFS_VNHASH_MAXSIZE) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	b = sfs_vnhash_bucket(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[b];
+	sfs->sfs_vnhash[b] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	pp = &sfs->sfs_vnhash[sfs_vnhash_bucket(sfs, sv->sv_ino)];
+	while (*pp != NULL && *pp != sv) {
+		pp = &(*pp)->sv_hashnext;
+	}
+	if (*pp == NULL) {
+		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Inactive list: vnodes with no references, least recently used
+ * first.
+ */
+
+static
+void
+sfs_lru_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv->sv_lrunext = NULL;
+	sv->sv_lruprev = sfs->sfs_lrutail;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->sv_lrunext = sv;
+	}
+	else {
+		sfs->sfs_lruhead = sv;
+	}
+	sfs->sfs_lrutail = sv;
+	sfs->sfs_ninactive++;
+}
+
+static
+void
+sfs_lru_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	KASSERT(sfs->sfs_ninactive > 0);
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Get rid of a vnode for good: erase the file if it has no links
+ * left, write the inode, and free the vnode. Called with sfs_vnlock
+ * held and the vnode's refcount at 1, so nobody else can get at it;
+ * that is also why taking its lock (against the usual order) can't
+ * block.
+ */
+static
+int
+sfs_vnode_destroy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_absvn.vn_refcount == 1);
+
+	rwlock_acquire_write(sv->sv_lock);
+
+	/* If there are no on-disk references to the file either, erase it. */
+	if (sv->sv_i.sfi_linkcount == 0) {
+		result = sfs_itrunc(sv, 0);
+		if (result) {
+			rwlock_release_write(sv->sv_lock);
+			return result;
+		}
+	}
+
+	/* Sync the inode to disk */
+	result = sfs_sync_inode(sv);
+	if (result) {
+		rwlock_release_write(sv->sv_lock);
+		return result;
+	}
+
+	/* If there are no on-disk references, discard the inode */
+	if (sv->sv_i.sfi_linkcount==0) {
+		sfs_bfree(sfs, sv->sv_ino);
+	}
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+
+	vnode_cleanup(&sv->sv_absvn);
+
+	rwlock_release_write(sv->sv_lock);
+
+	/* Release the storage for the vnode structure itself. */
+	kmem_cache_free(sfs_vnode_cache, sv);
+
+	return 0;
+}
+
+/*
+ * Destroy the least recently used inactive vnode.
+ */
+static
+int
+sfs_evict_inactive(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_lruhead;
+	KASSERT(sv != NULL);
+	sfs_lru_remove(sfs, sv);
+
+	/* Give it back the reference sfs_vnode_destroy expects */
+	KASSERT(sv->sv_absvn.vn_refcount == 0);
+	sv->sv_absvn.vn_refcount = 1;
+
+	result = sfs_vnode_destroy(sfs, sv);
+	if (result) {
+		/* Leave it inactive; maybe it works next time */
+		sv->sv_absvn.vn_refcount = 0;
+		sfs_lru_add(sfs, sv);
+	}
+	return result;
+}
+
+/*
+ * Destroy all inactive vnodes. Used before unmounting.
+ */
+int
+sfs_flush_inactive(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	while (sfs->sfs_lruhead != NULL) {
+		result = sfs_evict_inactive(sfs);
+		if (result) {
+			return result;
+		}
 	}
 	return 0;
 }
@@ -63,6 +409,11 @@ sfs_sync_inode(struct sfs_vnode *sv)
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
+ * If the file still exists, the inode is written back but the vnode
+ * is kept loaded, on the inactive list, in case it's wanted again
+ * soon. Only when there are too many inactive vnodes is the oldest
+ * one really thrown away.
+ *
  * This function should try to avoid returning errors other than EBUSY.
  */
 int
@@ -70,15 +421,18 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Holding the vnode table lock keeps sfs_loadvnode from
+	 * handing out new references while we decide, and from
+	 * reading the inode in again before we're done with it.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,57 +442,46 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+		/* The file is gone; so is the vnode. */
+		result = sfs_vnode_destroy(sfs, sv);
+		lock_release(sfs->sfs_vnlock);
+		return result;
 	}
 
-	/* Sync the inode to disk */
+	/*
+	 * Write the inode back now, so that sync never has to look
+	 * at inactive vnodes. (As with sfs_vnode_destroy, nobody else
+	 * can hold the vnode lock.)
+	 */
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
+	rwlock_release_write(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/* Drop the last reference and put the vnode on the inactive list */
+	spinlock_acquire(&v->vn_countlock);
+	v->vn_refcount = 0;
+	spinlock_release(&v->vn_countlock);
+	sfs_lru_add(sfs, sv);
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	if (sfs->sfs_ninactive > SFS_INACTIVE_MAX) {
+		result = sfs_evict_inactive(sfs);
+		if (result) {
+			kprintf("sfs: %s: evicting inactive vnode: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
 		}
 	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	vnode_cleanup(&sv->sv_absvn);
-
-	vfs_biglock_release();
-
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
-
-	/* Done */
+	lock_release(sfs->sfs_vnlock);
 	return 0;
 }
 
@@ -150,19 +493,17 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	bool wasinactive;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		/* Found */
 
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
@@ -170,22 +511,36 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		/*
+		 * Take a reference. If it was inactive, this is the
+		 * first one; nobody can race with us for that, as it
+		 * only happens under sfs_vnlock.
+		 */
+		spinlock_acquire(&sv->sv_absvn.vn_countlock);
+		wasinactive = (sv->sv_absvn.vn_refcount == 0);
+		sv->sv_absvn.vn_refcount++;
+		spinlock_release(&sv->sv_absvn.vn_countlock);
+
+		if (wasinactive) {
+			sfs_lru_remove(sfs, sv);
 		}
+
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
-	/* Didn't have it loaded; load it */
+	/*
+	 * Didn't have it loaded; load it. We keep sfs_vnlock while
+	 * reading, so nobody else can load a second copy meanwhile.
+	 */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -198,7 +553,8 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -207,13 +563,12 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
-	 * block on disk will have been zeroed out by sfs_balloc and
+	 * block will have been zeroed out by sfs_makeobj and
 	 * thus the type recorded there will be SFS_TYPE_INVAL.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
 	}
 
 	/*
@@ -226,6 +581,10 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	    case SFS_TYPE_DIR:
 		ops = &sfs_dirops;
 		break;
+	    case SFS_TYPE_DIRIDX:
+		/* only ever used from sfs_dir.c, never handed out */
+		ops = &sfs_fileops;
+		break;
 	    default:
 		panic("sfs: %s: loadvnode: Invalid inode type "
 		      "(inode %u, type %u)\n", sfs->sfs_sb.sb_volname,
@@ -235,31 +594,43 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_allochint = 0;
+	sv->sv_ranext = sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_dirtyprev = sv->sv_dirtynext = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
+	sfs_vnhash_insert(sfs, sv);
+
+	/* A new object's inode needs writing */
+	if (forcetype != SFS_TYPE_INVAL) {
+		sv->sv_dirty = true;
+		sfs_dirtylist_add(sfs, sv);
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. HINT is
+ * where to look for a place to put it; callers pass the directory
+ * it's going into, so files in the same directory end up together.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t hint,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -269,10 +640,15 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, hint, &ino);
 	if (result) {
 		return result;
 	}
+	result = sfs_clearblock(sfs, ino);
+	if (result) {
+		sfs_bfree(sfs, ino);
+		return result;
+	}
 
 	/*
 	 * Now load a vnode for it.
@@ -296,25 +672,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -36,8 +36,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,89 +48,55 @@
 // Basic block-level I/O routines
 
 /*
+ * All block I/O goes through the buffer cache (see buf.h), which
+ * also takes care of retrying device I/O errors.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
  */
 
-/*
- * Read or write a block, retrying I/O errors.
- */
-static
-int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
-{
-	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
-
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
-
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
-}
-
 /*
  * Read a block.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_read(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. This only updates the cached copy; it gets to disk
+ * at the next sync, eviction, or syncer run.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -136,10 +104,11 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to a block of a file that doesn't cover the whole block.
+ * The block is read into the buffer cache first, even if we're
+ * writing, so we don't clobber the portion of the block we're not
+ * intending to write over; the I/O is then done directly on the
+ * cached copy.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,18 +119,11 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	bool isnew;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
@@ -169,14 +131,11 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &isnew);
 	if (result) {
 		return result;
 	}
@@ -184,16 +143,25 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
+	}
+
+	/*
+	 * Get the block. If it was just allocated, what's on disk is
+	 * garbage; start from zeros instead of reading it.
+	 */
+	if (isnew) {
+		result = buffer_get(sfs->sfs_device, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		bzero(buffer_map(buf), SFS_BLOCKSIZE);
 	}
 	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		result = buffer_read(sfs->sfs_device, diskblock, &buf);
 		if (result) {
 			return result;
 		}
@@ -202,22 +170,18 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
-	}
+	result = uiomove((char *)buffer_map(buf) + skipstart, len, uio);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the block is now dirty. (Even if uiomove
+	 * failed partway, some of the data may have been changed.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(buf);
 	}
+	buffer_release(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,20 +192,18 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	bool isnew;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &isnew);
 	if (result) {
 		return result;
 	}
@@ -257,32 +219,132 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buffer_map(buf), SFS_BLOCKSIZE, uio);
+		buffer_release(buf);
+		return result;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Writing the whole block: no need to read it first, or to
+	 * zero it if it's new. But if it isn't cached, or is new,
+	 * start from zeros so that a uiomove failing halfway doesn't
+	 * leave garbage in the block.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	result = buffer_get(sfs->sfs_device, diskblock, &buf);
+	if (result) {
+		return result;
+	}
+	if (isnew || !buffer_is_valid(buf)) {
+		bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	}
+	result = uiomove(buffer_map(buf), SFS_BLOCKSIZE, uio);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+
+	return result;
+}
+
+/*
+ * Read-ahead for a read of file blocks START up to END.
+ *
+ * A read that starts where the last one ended is sequential; each
+ * one doubles the window (up to SFS_RA_MAX), and anything else
+ * closes it. While the window is open, ask the buffer cache to load
+ * the blocks of this read plus a window's worth after it, in one
+ * batch, so the device gets them as a few multi-sector requests
+ * instead of one synchronous request per block. To keep batches
+ * big, nothing is asked for until less than half a window is left
+ * ahead of the reader.
+ *
+ * Reads of more than one block get their own blocks loaded in one
+ * batch even when they aren't sequential.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t start, uint32_t end)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t blocks[2*SFS_RA_MAX];
+	daddr_t diskblock;
+	uint32_t from, to, fileblocks, fb;
+	unsigned window, n;
+	int result;
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
 
-	result = sfs_rwblock(sfs, uio);
+	spinlock_acquire(&sv->sv_ralock);
+	if (start == sv->sv_ranext) {
+		window = sv->sv_rawindow * 2;
+		if (window < SFS_RA_MIN) {
+			window = SFS_RA_MIN;
+		}
+		if (window > SFS_RA_MAX) {
+			window = SFS_RA_MAX;
+		}
+	}
+	else {
+		window = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = end;
+	sv->sv_rawindow = window;
+
+	if (window == 0 && end - start <= 1) {
+		/* random single-block read; nothing to gain */
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+	if (sv->sv_raend >= end + window/2) {
+		/* enough already on its way */
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+
+	from = sv->sv_raend > start ? sv->sv_raend : start;
+	to = end + window;
+	if (to > fileblocks) {
+		to = fileblocks;
+	}
+	if (to > from + 2*SFS_RA_MAX) {
+		to = from + 2*SFS_RA_MAX;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * Claim [from, to) before letting go, so another reader doesn't
+	 * ask for the same blocks while we look them up.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	sv->sv_raend = to;
+	spinlock_release(&sv->sv_ralock);
 
-	return result;
+	n = 0;
+	for (fb = from; fb < to; fb++) {
+		result = sfs_bmap(sv, fb, false, &diskblock, NULL);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			blocks[n++] = diskblock;
+		}
+	}
+	if (fb < to) {
+		/* give back what we didn't get to, unless someone moved on */
+		spinlock_acquire(&sv->sv_ralock);
+		if (sv->sv_raend == to) {
+			sv->sv_raend = fb;
+		}
+		spinlock_release(&sv->sv_ralock);
+	}
+
+	if (n > 0) {
+		buffer_readahead(sfs->sfs_device, blocks, n);
+	}
 }
 
 /*
@@ -296,6 +358,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 
+	/* Reads need the vnode locked, writes need it exclusively. */
+	KASSERT(uio->uio_rw == UIO_READ ||
+		rwlock_do_i_hold_write(sv->sv_lock));
+
 	origresid = uio->uio_resid;
 
 	/*
@@ -317,6 +383,15 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		sfs_readahead(sv, uio->uio_offset / SFS_BLOCKSIZE,
+			      DIVROUNDUP(uio->uio_offset + uio->uio_resid,
+					 SFS_BLOCKSIZE));
+	}
+	else if (uio->uio_offset + uio->uio_resid >
+		 (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		/* Past the largest file the inode can map */
+		return EFBIG;
 	}
 
 	/*
@@ -378,7 +453,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -407,24 +482,16 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	char *ptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
-	bool doalloc;
+	bool doalloc, isnew;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rw == UIO_READ || rwlock_do_i_hold_write(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -432,7 +499,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, &diskblock, &isnew);
 	if (result) {
 		return result;
 	}
@@ -446,32 +513,38 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
-	if (result) {
-		return result;
+	/* Get the block; if it's new, start from zeros */
+	if (isnew) {
+		result = buffer_get(sfs->sfs_device, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	}
+	else {
+		result = buffer_read(sfs->sfs_device, diskblock, &buf);
+		if (result) {
+			return result;
+		}
 	}
+	ptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ptr + blockoffset, len);
+		buffer_release(buf);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ptr + blockoffset, data, len);
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
@@ -37,10 +37,17 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
+#include <buf.h>
+#include <addrspace.h>
 #include <sfs.h>
 #include "sfsprivate.h"
+#include "opt-dumbvm.h"
+
+/* Size of the chunks sfs_bounceio copies through. */
+#define SFS_BOUNCESIZE  4096
 
 ////////////////////////////////////////////////////////////
 // Vnode operations.
@@ -90,6 +97,99 @@ sfs_eachopendir(struct vnode *v, int openflags)
 	return 0;
 }
 
+/*
+ * Check whether the user buffers of UIO are (partly) filled from the
+ * file itself, through a mapping of it or because it is the program
+ * being run. A fault on such a page reads the file, which it can't do
+ * while we hold sv_lock, so those transfers go through sfs_bounceio.
+ */
+static
+bool
+sfs_uio_mapsfile(struct sfs_vnode *sv, struct uio *uio)
+{
+#if OPT_DUMBVM
+	/* dumbvm loads everything up front, so nothing faults */
+	(void)sv;
+	(void)uio;
+#else
+	unsigned i;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len > 0 &&
+		    as_fills_from(uio->uio_space,
+				  (vaddr_t)uio->uio_iov[i].iov_ubase,
+				  uio->uio_iov[i].iov_len, &sv->sv_absvn)) {
+			return true;
+		}
+	}
+#endif
+	return false;
+}
+
+/*
+ * Do the I/O of UIO through a kernel buffer, a chunk at a time, only
+ * holding sv_lock while the chunk is moved between the buffer and the
+ * file, so that the copy to or from user space can fault freely.
+ * Unlike sfs_io, a large write is not done under one lock hold.
+ */
+static
+int
+sfs_bounceio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kbuf;
+	size_t len, done;
+	int result = 0;
+
+	kbuf = kmalloc(SFS_BOUNCESIZE);
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < SFS_BOUNCESIZE ?
+			uio->uio_resid : SFS_BOUNCESIZE;
+		uio_kinit(&iov, &ku, kbuf, len, uio->uio_offset, uio->uio_rw);
+
+		if (uio->uio_rw == UIO_READ) {
+			rwlock_acquire_read(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_read(sv->sv_lock);
+			done = len - ku.uio_resid;
+			if (done > 0) {
+				int result2 = uiomove(kbuf, done, uio);
+				if (result == 0) {
+					result = result2;
+				}
+			}
+		}
+		else {
+			result = uiomove(kbuf, len, uio);
+			if (result) {
+				break;
+			}
+			rwlock_acquire_write(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_write(sv->sv_lock);
+			/* give back what didn't make it to the file */
+			uio->uio_offset -= ku.uio_resid;
+			uio->uio_resid += ku.uio_resid;
+			done = len - ku.uio_resid;
+		}
+		if (result || done < len) {
+			/* error, or EOF or a short write */
+			break;
+		}
+	}
+
+	kfree(kbuf);
+	return result;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -102,9 +202,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	if (sfs_uio_mapsfile(sv, uio)) {
+		return sfs_bounceio(sv, uio);
+	}
+
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -121,9 +225,13 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	if (sfs_uio_mapsfile(sv, uio)) {
+		return sfs_bounceio(sv, uio);
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -164,8 +272,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -177,6 +287,8 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type is fixed when the vnode is loaded, so no lock is needed.
  */
 static
 int
@@ -185,16 +297,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -222,24 +330,33 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
+	if (result == 0) {
+		/*
+		 * The cache doesn't know which blocks belong to which
+		 * file, so flush the whole volume.
+		 */
+		result = buffer_sync(sfs->sfs_device);
+	}
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Only files get here (directories use
+ * vopfail_mmap_isdir), and any file can be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -250,8 +367,13 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	rwlock_release_write(sv->sv_lock);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,37 +411,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		rwlock_release_write(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -329,20 +450,20 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* Update the linkcount of the new file */
+	/* Update the linkcount of the new file, and mark it dirty. */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
+	sfs_dirty_inode(newguy);
+	rwlock_release_write(newguy->sv_lock);
 
-	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	rwlock_release_write(sv->sv_lock);
 
 	*ret = &newguy->sv_absvn;
-
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -361,27 +482,26 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	/* The directory comes first, then the file going in it. */
+	rwlock_acquire_write(sv->sv_lock);
+	rwlock_acquire_write(f->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		/* and update the link count, marking the inode dirty */
+		f->sv_i.sfi_linkcount++;
+		sfs_dirty_inode(f);
 	}
 
-	/* and update the link count, marking the inode dirty */
-	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
-
-	vfs_biglock_release();
-	return 0;
+	rwlock_release_write(f->sv_lock);
+	rwlock_release_write(sv->sv_lock);
+	return result;
 }
 
 /*
@@ -396,63 +516,113 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
+	/* Only files can be removed; we don't have subdirectories. */
+	if (victim->sv_i.sfi_type == SFS_TYPE_DIR) {
+		rwlock_release_write(sv->sv_lock);
+		VOP_DECREF(&victim->sv_absvn);
+		return EISDIR;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		rwlock_release_write(victim->sv_lock);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	rwlock_release_write(sv->sv_lock);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. If it was
+	 * the last one, the file gets erased now, which is better
+	 * done without the directory locked.
+	 */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
+/*
+ * Lock the directories of a rename for writing. So that two renames
+ * going opposite ways can't deadlock, the directory with the lower
+ * inode number is always locked first.
+ */
+static
+void
+sfs_lock_dirpair(struct sfs_vnode *a, struct sfs_vnode *b)
+{
+	if (a == b) {
+		rwlock_acquire_write(a->sv_lock);
+		return;
+	}
+	if (a->sv_ino > b->sv_ino) {
+		struct sfs_vnode *t = a;
+		a = b;
+		b = t;
+	}
+	rwlock_acquire_write(a->sv_lock);
+	rwlock_acquire_write(b->sv_lock);
+}
+
+static
+void
+sfs_unlock_dirpair(struct sfs_vnode *a, struct sfs_vnode *b)
+{
+	rwlock_release_write(a->sv_lock);
+	if (a != b) {
+		rwlock_release_write(b->sv_lock);
+	}
+}
+
 /*
  * Rename a file.
  *
- * Since we don't support subdirectories, assumes that the two
- * directories passed are the same.
+ * Both directories are locked (see sfs_lock_dirpair), then the file
+ * being moved. Since we don't support subdirectories, the two
+ * directories will in practice be the same, and only files can be
+ * renamed.
  */
 static
 int
 sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
-	struct sfs_vnode *sv = d1->vn_data;
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *sv1 = d1->vn_data;
+	struct sfs_vnode *sv2 = d2->vn_data;
+	struct sfs_fs *sfs = sv1->sv_absvn.vn_fs->fs_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	KASSERT(d1->vn_fs == d2->vn_fs);
 
-	KASSERT(d1==d2);
-	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
+	sfs_lock_dirpair(sv1, sv2);
 
 	/* Look up the old name of the file and get its inode and slot number*/
-	result = sfs_lookonce(sv, n1, &g1, &slot1);
+	result = sfs_lookonce(sv1, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_unlock_dirpair(sv1, sv2);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	rwlock_acquire_write(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -461,17 +631,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * the new name doesn't already exist; might as well use the
 	 * existing link routine.
 	 */
-	result = sfs_dir_link(sv, n2, g1->sv_ino, &slot2);
+	result = sfs_dir_link(sv2, n2, g1->sv_ino, &slot2);
 	if (result) {
 		goto puke;
 	}
 
 	/* Increment the link count, and mark inode dirty */
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -482,19 +652,21 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 */
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+
+	rwlock_release_write(g1->sv_lock);
+	sfs_unlock_dirpair(sv1, sv2);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv2, slot2);
 	if (result2) {
 		kprintf("sfs: %s: rename: %s\n",
 			sfs->sfs_sb.sb_volname, strerror(result));
@@ -505,9 +677,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	rwlock_release_write(g1->sv_lock);
+	sfs_unlock_dirpair(sv1, sv2);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -516,7 +690,8 @@ sfs_rename(struct vnode *d1, const char *n1,
  * directory it's in as a vnode.
  *
  * Since we don't support subdirectories, this is very easy -
- * return the root dir and copy the path.
+ * return the root dir and copy the path. Nothing here looks at
+ * anything that can change, so no lock is needed.
  */
 static
 int
@@ -525,15 +700,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +712,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +729,20 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	/* Lookups only read the directory, so they can run in parallel. */
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -39,13 +39,45 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
+#if !OPT_DUMBVM
+/*
+ * Region permission flags.
+ */
+#define RG_READ		0x1
+#define RG_WRITE	0x2
+#define RG_EXEC		0x4
+#define RG_MAPPED	0x8	/* made by mmap, so munmap can remove it */
+
+/* Size of the stack region. Pages are only allocated when touched. */
+#define VM_STACKPAGES	1024
+
+/*
+ * A region: a page-aligned range of virtual addresses with the same
+ * permissions. Pages are filled on first touch, with zeros or, for the
+ * part between rg_fvaddr and rg_fvaddr+rg_filesize, with data read
+ * starting at rg_foffset from rg_vnode for a file mapped with mmap, or
+ * else from the address space's executable. A mapped file may be
+ * shorter than the mapping; the rest of the last page, and any whole
+ * pages past the end of the file, are zeros.
+ */
+struct region {
+	vaddr_t rg_vbase;		/* first page */
+	size_t rg_npages;		/* length in pages */
+	int rg_flags;			/* RG_* */
+	vaddr_t rg_fvaddr;		/* where file data begins */
+	size_t rg_filesize;		/* bytes of file data; 0 if none */
+	off_t rg_foffset;		/* offset of file data in the file */
+	struct vnode *rg_vnode;		/* mapped file, or NULL */
+	struct region *rg_next;
+};
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
- *
- * You write this.
  */
 
 struct addrspace {
@@ -58,7 +90,9 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct region *as_regions;	/* list of regions */
+        struct pagetable *as_pt;	/* virtual to physical */
+        struct vnode *as_vnode;		/* executable, for loading pages */
 #endif
 };
 
@@ -99,6 +133,29 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - record that the part of a region starting at
+ *                VADDR, FILESIZE bytes long, comes from file V at
+ *                OFFSET. The data is read in a page at a time as the
+ *                pages are touched. (Not in dumbvm.)
+ *
+ *    as_find_region - return the region containing VADDR, or NULL.
+ *                (Not in dumbvm.)
+ *
+ *    as_fills_from - true if any page of the LEN bytes at VADDR is
+ *                filled from file V, as a mapping of it or as the
+ *                executable, so that a fault there may read V. File
+ *                systems use it to avoid faulting on such pages
+ *                while holding V locked. (Not in dumbvm.)
+ *
+ *    as_map    - map LEN bytes of file V from OFFSET, or zeros if V is
+ *                NULL, with RG_* permission FLAGS. Maps
+ *                at *VADDR if that is not 0, otherwise picks a free
+ *                range below the stack and returns it in *VADDR.
+ *                (Not in dumbvm.)
+ *
+ *    as_unmap  - unmap the pages from VADDR for LEN bytes, which must
+ *                all be in regions made by as_map. (Not in dumbvm.)
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +174,18 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 vaddr_t vaddr, size_t filesize,
+                                 off_t offset);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+bool              as_fills_from(struct addrspace *as, vaddr_t vaddr,
+                                size_t len, struct vnode *v);
+int               as_map(struct addrspace *as, struct vnode *v,
+                         off_t offset, size_t len, int flags,
+                         vaddr_t *vaddr);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
 
 
 /*
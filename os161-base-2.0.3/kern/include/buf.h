@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Block buffer cache.
+ *
+ * The buffer cache sits between filesystems and block devices and
+ * caches device blocks in memory, keyed by (device, block number).
+ * Buffers are write-back: modified buffers are only marked dirty and
+ * are written out when they are evicted, when the filesystem syncs,
+ * or periodically by the buffer syncer thread.
+ *
+ * A buffer is obtained with buffer_read (contents are loaded from
+ * disk if not already cached) or buffer_get (contents are not loaded;
+ * use this when the whole block is going to be overwritten). Either
+ * way the caller gets the buffer busy, meaning nobody else can use or
+ * evict it until buffer_release is called. Callers must not hold a
+ * buffer busy while getting another buffer of the same block.
+ *
+ *    buffer_bootstrap - initialize the cache and start the syncer.
+ *    buffer_read      - get a busy buffer with valid contents.
+ *    buffer_get       - get a busy buffer; contents valid only if
+ *                       buffer_is_valid says so.
+ *    buffer_map       - get a pointer to the buffer's data.
+ *    buffer_is_valid  - true if the buffer contents are up to date.
+ *    buffer_mark_valid - declare the contents up to date (after
+ *                       filling in the whole block).
+ *    buffer_mark_dirty - declare the contents modified; implies valid.
+ *    buffer_release   - give up a busy buffer.
+ *    buffer_release_and_invalidate - likewise, and discard contents.
+ *    buffer_readahead - ask for blocks to be read into the cache in
+ *                       the background; doesn't wait.
+ *    buffer_drop      - discard any cached copy of a block, e.g.
+ *                       because the block was freed.
+ *    buffer_sync      - write out all dirty buffers of a device (or
+ *                       all devices, if DEV is NULL).
+ *    buffer_drop_device - write out and discard every buffer of a
+ *                       device; used at unmount.
+ *    buffer_printstats - print cache counters.
+ *    buffer_resetstats - zero the cache counters.
+ */
+
+struct device;
+struct buf;
+
+/* Size of each buffer; all cached devices must use this block size. */
+#define BUFFER_SIZE          512
+
+/* Maximum number of buffers in the cache. */
+#define BUFFER_MAXBUFS       256
+
+/* Seconds between two runs of the buffer syncer. */
+#define BUFFER_SYNC_SECS     2
+
+/* Most dirty buffers handed to the device in one batched write. */
+#define BUFFER_SYNC_BATCH    32
+
+/* Most blocks waiting for the read-ahead thread. */
+#define BUFFER_RA_QUEUE      128
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+bool buffer_is_valid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_release_and_invalidate(struct buf *b);
+
+void buffer_readahead(struct device *dev, const daddr_t *blocks,
+		      unsigned nblocks);
+void buffer_drop(struct device *dev, daddr_t block);
+int buffer_sync(struct device *dev);
+int buffer_drop_device(struct device *dev);
+
+void buffer_printstats(void);
+void buffer_resetstats(void);
+
+
+#endif /* _BUF_H_ */
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame allocator.
+ *
+ * The coremap has one entry per page of physical memory, saying
+ * whether the page is free, reserved at boot, part of a kernel
+ * allocation, or holding a page of some address space. Free memory is
+ * managed by a buddy allocator, with a per-CPU cache of single pages
+ * in front of it.
+ *
+ *    coremap_bootstrap    - take over physical memory from ram.c.
+ *    coremap_alloc_kpages - allocate NPAGES contiguous kernel pages.
+ *                           Returns 0 if there is no room.
+ *    coremap_free_kpages  - free a block from coremap_alloc_kpages.
+ *    coremap_alloc_upage  - allocate one page for virtual page VADDR of
+ *                           address space AS, paging something out if
+ *                           need be. Returns 0 if out of memory. The
+ *                           page comes back pinned.
+ *    coremap_tryalloc_upage - same, but never pages anything out.
+ *    coremap_free_upage   - drop a reference to a pinned user page; the
+ *                           page is freed when the last reference goes
+ *                           away, and unpinned otherwise.
+ *    coremap_share_upage  - add a reference to a pinned user page, for
+ *                           copy-on-write sharing.
+ *    coremap_unshare_upage - if AS holds the only reference left to a
+ *                           shared (pinned) page, give it back to AS as
+ *                           VADDR and return true; else return false.
+ *
+ * User pages are pinned while their page table entries or contents
+ * are being changed, which keeps the page-out code away from them.
+ *
+ *    coremap_pin          - pin a user page if nobody else has it
+ *                           pinned; return whether we did.
+ *    coremap_waitpin      - sleep until a page is not pinned.
+ *    coremap_unpin        - unpin a page. If TOUCHED, the page was just
+ *                           used, and gets a second chance from the
+ *                           page-out clock.
+ *    coremap_isdirty      - whether a pinned page differs from its
+ *                           backing store.
+ *    coremap_setdirty     - mark a pinned page dirty.
+ *    coremap_getslot      - swap slot holding a clean copy of a pinned
+ *                           page, or -1.
+ *    coremap_setslot      - set or (with -1) clear that slot. A page
+ *                           holds a reference to its slot, dropped
+ *                           when the page is freed.
+ *    coremap_victim       - advance the clock hand to a user page that
+ *                           can be paged out, pin it and return it and
+ *                           its owner. Dirty pages are only taken if
+ *                           DIRTYOK. Returns 0 if there are none.
+ *    coremap_pin_victim   - pin the page at PADDR if it could also be
+ *                           paged out: unshared, belonging to AS as
+ *                           VADDR, dirty, and not recently used.
+ *    coremap_printstats   - print page counts, fragmentation, and
+ *                           allocation counters and latencies.
+ *    coremap_resetstats   - zero the allocation counters.
+ */
+
+/* Largest buddy block: 2^COREMAP_MAXORDER pages. */
+#define COREMAP_MAXORDER	10
+
+/* Per-CPU caches: size, and pages moved to/from the buddy lists at once */
+#define COREMAP_PCPU_MAX	32
+#define COREMAP_PCPU_BATCH	16
+
+/* Most CPUs we keep caches for (System/161 has at most 32). */
+#define COREMAP_MAXCPUS		32
+
+struct addrspace;
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc_kpages(unsigned npages);
+void coremap_free_kpages(paddr_t paddr);
+paddr_t coremap_alloc_upage(struct addrspace *as, vaddr_t vaddr);
+paddr_t coremap_tryalloc_upage(struct addrspace *as, vaddr_t vaddr);
+void coremap_free_upage(paddr_t paddr);
+void coremap_share_upage(paddr_t paddr);
+bool coremap_unshare_upage(paddr_t paddr, struct addrspace *as,
+			   vaddr_t vaddr);
+bool coremap_pin(paddr_t paddr);
+void coremap_waitpin(paddr_t paddr);
+void coremap_unpin(paddr_t paddr, bool touched);
+bool coremap_isdirty(paddr_t paddr);
+void coremap_setdirty(paddr_t paddr);
+int coremap_getslot(paddr_t paddr);
+void coremap_setslot(paddr_t paddr, int slot);
+paddr_t coremap_victim(bool dirtyok, struct addrspace **as, vaddr_t *vaddr);
+bool coremap_pin_victim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_printstats(void);
+void coremap_resetstats(void);
+
+#endif /* _COREMAP_H_ */
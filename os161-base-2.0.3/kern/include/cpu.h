@@ -35,6 +35,11 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Number of priority levels in the multi-level feedback queue
+ * scheduler (see schedule() in thread.c). Level 0 runs first.
+ */
+#define SCHED_LEVELS 4
 
 /*
  * Per-cpu structure
@@ -61,13 +66,17 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_idleclocks;		/* hardclock() calls while idle */
+	unsigned c_switches;		/* Counter of context switches */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_migrations;		/* Threads pushed to other cpus */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_LEVELS]; /* Run queues, by level */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -112,6 +121,11 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of CPUs started so far.
+ */
+unsigned cpu_count(void);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -155,6 +169,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends the shootdown to all CPUs except the
+ * current one, and returns how many that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +185,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -35,7 +35,7 @@
  */
 
 
-struct uio;  /* in <uio.h> */
+#include <uio.h>  /* for enum uio_rw */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -51,16 +51,33 @@ struct device {
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * One block of a batched request (see devop_iobatch).
+ */
+struct devio {
+	daddr_t dio_block;	/* block number on the device */
+	void *dio_data;		/* kernel buffer of d_blocksize bytes */
+};
+
 /*
  * Device operations.
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *
+ * Optional operations (may be NULL):
+ *      devop_iobatch - read or write a set of blocks, in any order; lets
+ *                      the driver sort and merge them, without
+ *                      changing the caller's array
+ *      devop_printstats - print driver statistics, under the given name
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_iobatch)(struct device *, struct devio *, unsigned nios,
+			     enum uio_rw rw);
+	void (*devop_printstats)(struct device *, const char *name);
 };
 
 /*
@@ -71,6 +88,14 @@ struct device_ops {
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
 
 
+/*
+ * Batched block I/O. Uses devop_iobatch if the device has one, and
+ * otherwise does the blocks one at a time with devop_io. Returns the
+ * first error encountered.
+ */
+int device_iobatch(struct device *dev, struct devio *ios, unsigned nios,
+		   enum uio_rw rw);
+
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
@@ -41,8 +41,8 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
@@ -62,10 +62,18 @@
 /* Size of free block bitmap (in blocks) */
 #define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
 
+/*
+ * Blocks per allocation group. This isn't recorded on disk; it's how
+ * the kernel's block allocator divides up a volume, and dumpsfs
+ * reports free space the same way.
+ */
+#define SFS_AGBLOCKS      1024
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
+#define SFS_TYPE_DIRIDX   3       /* Directory index; see below */
 
 /*
  * On-disk superblock
@@ -86,9 +94,22 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_dirindex;			/* Index inode (dirs only) */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/*
+ * File blocks are mapped by the direct blocks, then the indirect
+ * block, then the double and triple indirect blocks, each level of
+ * indirection covering SFS_DBPERIDB times as much as the last. That
+ * comes to a little over 1G, the file size limit.
+ */
+#define SFS_MAXFILEBLOCKS  (SFS_NDIRECT + SFS_DBPERIDB + \
+			    SFS_DBPERIDB*SFS_DBPERIDB + \
+			    SFS_DBPERIDB*SFS_DBPERIDB*SFS_DBPERIDB)
+
 /*
  * On-disk directory entry
  */
@@ -97,5 +118,38 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Directory index.
+ *
+ * A directory whose inode has a nonzero sfi_dirindex has a hash index
+ * in that inode (of type SFS_TYPE_DIRIDX, linked from nowhere else)
+ * so lookups and inserts don't have to read every slot. Directories
+ * with sfi_dirindex 0 are searched linearly.
+ *
+ * The index file is the header block below, then SFS_DIRIDX_NBUCKETS
+ * bucket heads, then one link word per directory slot. Heads and links
+ * hold a slot number plus one, so 0 ends a chain. Each slot is on
+ * exactly one chain: the bucket for the hash of its name if it is in
+ * use, the free list starting at sdi_freehead if it isn't. The link
+ * array always covers the directory's slots rounded up to a whole
+ * directory block, and the index file has no holes.
+ *
+ * The hash is 32-bit FNV-1a of the name bytes, mod sdi_nbuckets.
+ */
+#define SFS_DIRIDX_MAGIC     0xd1d1ce5f	/* magic for sdi_magic */
+#define SFS_DIRIDX_NBUCKETS  1024		/* hash buckets per index */
+#define SFS_DIRIDX_BUCKETS   SFS_BLOCKSIZE	/* offset of bucket heads */
+#define SFS_DIRIDX_LINKS     (SFS_DIRIDX_BUCKETS + SFS_DIRIDX_NBUCKETS*4)
+
+/* Directory entries per block; the link array grows by this much */
+#define SFS_DIRENTRIESPERBLOCK (SFS_BLOCKSIZE / sizeof(struct sfs_direntry))
+
+struct sfs_dirindex {
+	uint32_t sdi_magic;		/* Magic number; SFS_DIRIDX_MAGIC */
+	uint32_t sdi_nbuckets;		/* Number of hash buckets */
+	uint32_t sdi_freehead;		/* First free slot plus one, or 0 */
+	uint32_t sdi_reserved[125];	/* unused, set to 0 */
+};
+
 
 #endif /* _KERN_SFS_H_ */
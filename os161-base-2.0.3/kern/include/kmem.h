@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem cache hands out objects of one type. Objects are built with
+ * kmalloc and the cache's constructor the first time; when freed they
+ * go back to the cache still constructed, and the next allocation gets
+ * one of them without calling kmalloc or the constructor again. So
+ * whatever the constructor sets up (locks, wait channels, buffers)
+ * survives from one use of an object to the next, and users only need
+ * to reset the fields that actually change.
+ *
+ * Each cache keeps at most KMEM_CACHE_MAX free objects; beyond that,
+ * freed objects are destroyed. kmalloc also has kmem_reap destroy all
+ * cached objects when it runs out of memory.
+ *
+ *    kmem_cache_create  - make a cache of objects of SIZE bytes. CTOR,
+ *                         if not NULL, is called on each new object
+ *                         and returns an error code; DTOR, if not
+ *                         NULL, is called before an object's memory
+ *                         is released.
+ *    kmem_cache_destroy - destroy a cache; all its objects must have
+ *                         been freed.
+ *    kmem_cache_alloc   - get a constructed object, or NULL if out of
+ *                         memory.
+ *    kmem_cache_free    - give back an object. It must be in the state
+ *                         the constructor leaves it in, as far as the
+ *                         constructed parts go.
+ *    kmem_reap          - destroy the free objects of every cache.
+ *    kmem_printstats    - print cache counters.
+ *    kmem_resetstats    - zero the cache counters.
+ *
+ * kmem_cache_alloc may sleep if it has to construct an object.
+ * kmem_cache_free does not sleep, but may call the destructor, which
+ * therefore must not sleep either.
+ */
+
+/* Most free objects kept by one cache. */
+#define KMEM_CACHE_MAX 16
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+void kmem_reap(void);
+void kmem_printstats(void);
+void kmem_resetstats(void);
+
+#endif /* _KMEM_H_ */
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page tables.
+ *
+ * A user virtual address is split into a 10-bit directory index, a
+ * 10-bit table index, and a 12-bit page offset. The directory only
+ * covers user space (the lower 2G), so it has 512 entries; each
+ * second-level table has 1024 entries and is allocated the first time
+ * a page in its 4M range is touched.
+ *
+ * A page table entry holds the physical frame address in the top 20
+ * bits and flags in the low bits. A page that has been paged out has
+ * PTE_SWAPPED instead of PTE_VALID, and its swap slot number in place
+ * of the frame address. An entry that is neither has never been
+ * touched (or was clean and simply dropped), and is filled again from
+ * its region on the next fault.
+ *
+ * PTE_DIRTY says the page no longer matches what is backing it (its
+ * region's zeros or executable, or its swap slot), so it must be
+ * written to swap before the frame can be reused. Pages are loaded
+ * into the TLB read-only until they are dirty, so that the first
+ * write traps and sets it.
+ *
+ * pt_lock protects the entries against the page-out code, which
+ * changes entries of other address spaces. The owner can look at
+ * entries without it, except for valid ones: a valid entry can only
+ * be trusted after pinning its frame (coremap_pin), and the page-out
+ * code only changes entries whose frame it has pinned.
+ *
+ *    pt_create  - make an empty page table.
+ *    pt_destroy - free a page table and every frame and swap slot it
+ *                 maps.
+ *    pt_copy    - make a page table that shares every page mapped by
+ *                 another, copy-on-write; pages out on swap share
+ *                 their slot.
+ *                 Marks the pages copy-on-write in the source too, so
+ *                 the caller must flush the source's TLB entries.
+ *    pt_lookup  - get a pointer to the entry for VADDR. If the
+ *                 second-level table is missing, it is allocated when
+ *                 CREATE is true; otherwise NULL is returned. Also
+ *                 returns NULL if the allocation fails.
+ *    pt_pin     - pin the frame of entry PTE, waiting if it is being
+ *                 paged out. Returns the frame, or 0 if the entry is
+ *                 not (or no longer) valid.
+ *    pt_unmap   - free the frames and swap slots of NPAGES pages at
+ *                 VADDR and clear their entries. The caller must keep
+ *                 them out of the TLB.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_VALID	0x00000001	/* page is in memory */
+#define PTE_COW		0x00000002	/* page may be shared; copy on write */
+#define PTE_DIRTY	0x00000004	/* page differs from its backing */
+#define PTE_SWAPPED	0x00000008	/* page is out on swap */
+#define PTE_FRAME	PAGE_FRAME	/* physical frame address */
+
+#define PTE_SLOT(pte)		((pte) >> PT_TABLE_SHIFT)
+#define PTE_MKSWAPPED(slot)	(((pte_t)(slot) << PT_TABLE_SHIFT) | PTE_SWAPPED)
+
+#define PT_DIR_SHIFT	22
+#define PT_TABLE_SHIFT	12
+#define PT_TABLE_MASK	0x3ff
+#define PT_DIR_ENTRIES	(USERSPACETOP >> PT_DIR_SHIFT)
+#define PT_TABLE_ENTRIES 1024
+
+struct pagetable {
+	struct spinlock pt_lock;
+	pte_t *pt_dir[PT_DIR_ENTRIES];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+int pt_copy(struct pagetable *src, struct pagetable **ret);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+paddr_t pt_pin(struct pagetable *pt, pte_t *pte);
+void pt_unmap(struct pagetable *pt, vaddr_t vaddr, unsigned npages);
+
+#endif /* _PAGETABLE_H_ */
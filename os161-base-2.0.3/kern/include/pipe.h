@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Pipes.
+ *
+ * A pipe is a buffer in the kernel with a vnode for each end, so that
+ * the ends go in the file table and are read, written and closed like
+ * any other open file. See vfs/pipe.c.
+ *
+ *    pipe_create - make a pipe; hand back a reference to the vnode
+ *                  for each end. The pipe goes away when both are
+ *                  released.
+ *
+ * Reads wait until there is something to read, and then return what
+ * there is, or return 0 (end of file) once the write end is closed.
+ * Writes wait until there is room, and fail with EPIPE once the read
+ * end is closed. A write of up to PIPE_BUF bytes is never split up,
+ * so it can't be interleaved with another write.
+ */
+
+#include <vm.h>
+
+/* The ring buffer starts at PIPE_SIZE and can grow to PIPE_MAXSIZE. */
+#define PIPE_SIZE		PAGE_SIZE
+#define PIPE_MAXSIZE		(16 * PAGE_SIZE)
+
+/*
+ * Writes from user space of at least PIPE_DIRECT_MIN bytes lend the
+ * reader the writer's pages, up to PIPE_DIRECT_PAGES at a time,
+ * instead of going through the ring buffer.
+ */
+#define PIPE_DIRECT_MIN		(2 * PAGE_SIZE)
+#define PIPE_DIRECT_PAGES	16
+
+struct vnode;
+
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+
+
+#endif /* _PIPE_H_ */
@@ -14,6 +14,7 @@
 struct addrspace;
 struct thread;
 struct vnode;
+struct kmem_cache;
 
 /*
  * Process structure.
@@ -44,16 +45,6 @@ struct openfile {
 };
 #endif
 
-/**
- * @brief child_list, used to keep track of the child of a process
- */
-#if OPT_SHELL
-struct child_list{
-	pid_t pid;
-	struct child_list *next;
-};
-#endif 
-
 struct proc {
   char *p_name;      /* Name of this process */
   struct spinlock p_lock;    /* Lock for this structure */
@@ -69,8 +60,11 @@ struct proc {
 #if OPT_SHELL
   int p_status;                   /* status as obtained by exit() */
   pid_t p_pid;                    /* process pid */
-	struct child_list *child_list; //head of the list of children for a process, kept to terminate them on exit
-  pid_t father_pid;
+  struct proc *p_hashnext;        /* next in the pid hash chain */
+  struct proc *p_parent;          /* father, NULL if none (or gone) */
+  struct proc *p_children;        /* head of the list of children */
+  struct proc *p_sibnext;         /* next and previous child of p_parent */
+  struct proc *p_sibprev;
   struct cv *p_cv;
   struct lock *p_locklock;
   struct openfile *fileTable[OPEN_MAX];
@@ -80,12 +74,23 @@ struct proc {
 /* This is the process structure for the kernel and for kernel-only threads. */
 extern struct proc *kproc;
 
+#if OPT_SHELL
+/* Caches for open files and for the trapframe copies made by fork. */
+extern struct kmem_cache *openfile_cache;
+extern struct kmem_cache *trapframe_cache;
+#endif
+
 /* Call once during system startup to allocate data structures. */
 void proc_bootstrap(void);
 
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+#if OPT_SHELL
+/* Create a process for fork(), with no open files yet. */
+struct proc *proc_create_fork(const char *name);
+#endif
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
@@ -102,15 +107,10 @@ struct addrspace *proc_getas(void);
 struct addrspace *proc_setas(struct addrspace *);
 
 #if OPT_SHELL
-int get_valid_pid(void);
-int add_newp(pid_t pid, struct proc *proc);
-void remove_proc(pid_t pid);
 void call_enter_forked_process(void *tfv, unsigned long dummy);
 struct proc *proc_search_pid(pid_t pid);
-int add_new_child(struct proc* proc, pid_t child_pid);
-int delete_child_list(struct proc* proc);
-int remove_child_from_list(struct proc* proc, pid_t child_pid);
-int is_child(struct proc* proc, pid_t child_pid);
+void add_new_child(struct proc *proc, struct proc *child);
+int is_child(struct proc *proc, pid_t child_pid);
 #endif
 
 #endif /* _PROC_H_ */
\ No newline at end of file
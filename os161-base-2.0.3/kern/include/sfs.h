@@ -48,27 +48,124 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct rwlock;
+
+/*
+ * Sizes for the table of loaded vnodes: the initial number of hash
+ * buckets (a power of 2; the table doubles when there are more than
+ * two vnodes per bucket), and the most vnodes that are kept loaded
+ * after their last reference goes away.
+ */
+#define SFS_VNHASH_INITSIZE   64
+#define SFS_VNHASH_MAXSIZE    4096
+#define SFS_INACTIVE_MAX      128
+
+/*
+ * Directories without an index get one when they grow past this many
+ * slots; below that a linear scan is as cheap as the index.
+ */
+#define SFS_DIRIDX_MINSLOTS   64
+
+/*
+ * Read-ahead window for sequential reads, in blocks: it starts at
+ * SFS_RA_MIN and doubles with every sequential read up to SFS_RA_MAX.
+ */
+#define SFS_RA_MIN            4
+#define SFS_RA_MAX            32
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i, sv_dirty, sv_allochint and the file's data
+ * and indirect blocks. Anything that only looks (read, stat, directory
+ * lookup) holds it for reading; anything that changes the inode or
+ * allocates or frees blocks holds it for writing. The inode type
+ * never changes once the vnode is loaded, so it can be read without
+ * the lock.
+ *
+ * The sv_ra fields track sequential reading for read-ahead. Readers
+ * hold sv_lock only for reading, so several can be in sfs_readahead
+ * at once; the sv_ra fields belong to sv_ralock instead.
+ *
+ * A vnode whose last reference is gone, but whose file still exists,
+ * stays in the vnode table as inactive: its refcount is 0 and it is
+ * on the volume's inactive list, so it can be brought back without
+ * reading the inode again. The list and hash fields belong to
+ * sfs_vnlock.
+ *
+ * A vnode whose inode has been changed since it was last written out
+ * (sv_dirty) is also on the volume's dirty list, so sync only has to
+ * look at those. The dirty list fields belong to sfs_dirtylock.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	daddr_t sv_allochint;           /* where to put the next block */
+	uint32_t sv_ranext;             /* file block a sequential read
+					   would start at */
+	uint32_t sv_raend;              /* read-ahead issued up to here */
+	unsigned sv_rawindow;           /* current read-ahead window */
+	struct spinlock sv_ralock;      /* lock for the sv_ra fields */
+	struct rwlock *sv_lock;         /* lock for inode and data */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash bucket */
+	struct sfs_vnode *sv_lruprev;   /* inactive list links */
+	struct sfs_vnode *sv_lrunext;
+	struct sfs_vnode *sv_dirtyprev; /* dirty list links */
+	struct sfs_vnode *sv_dirtynext;
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * sfs_vnlock protects the vnode table and inactive list, and with
+ * them the decision to reclaim a vnode. sfs_dirtylock protects the
+ * list of vnodes with dirty inodes. sfs_freemaplock protects the
+ * freemap, the allocation group summary, and the superblock.
+ *
+ * sfs_freemapdirty has a bit for each block of the freemap, set when
+ * that part of the freemap has changed, so sync writes only those.
+ *
+ * For allocation the volume is divided into groups of SFS_AGBLOCKS
+ * blocks. sfs_agtree is a binary tree of free block counts kept in
+ * an array: entry 1 is the root, the children of entry i are 2i and
+ * 2i+1, and the count for group g is at sfs_agleaves + g. Each entry
+ * is the sum of its children, so a group with free blocks can be
+ * found from the root in O(log groups).
+ *
+ * Lock order:
+ *    1. sv_lock of a directory, then sv_lock of things in it. Two
+ *       directories (rename) are locked in increasing inode number
+ *       order. A directory's index is locked last and only briefly.
+ *    2. sfs_vnlock
+ *    3. sfs_dirtylock, which is only ever held briefly
+ *    4. sfs_freemaplock
+ *    5. the buffer cache and device locks.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded, by inode number */
+	unsigned sfs_vnhashsize;        /* number of buckets */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vnhash */
+	struct sfs_vnode *sfs_lruhead;  /* inactive vnodes, oldest first */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_ninactive;         /* vnodes on the inactive list */
+	struct lock *sfs_dirtylock;     /* lock for the dirty list */
+	struct sfs_vnode *sfs_dirtyhead; /* vnodes with dirty inodes */
+	unsigned sfs_ndirty;            /* vnodes on the dirty list */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirty; /* freemap blocks modified */
+	unsigned sfs_freemapndirty;     /* number of bits set in it */
+	unsigned sfs_ngroups;           /* number of allocation groups */
+	unsigned sfs_agleaves;          /* power of 2 >= sfs_ngroups */
+	uint32_t *sfs_agtree;           /* free blocks per group, summed */
 };
 
 /*
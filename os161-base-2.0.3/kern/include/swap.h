@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Paging to swap.
+ *
+ * Swap is the raw disk SWAP_DEVICE, divided into page-sized slots. A
+ * bitmap says which slots are in use; each slot also has a reference
+ * count, since after fork two address spaces can share a paged-out
+ * page just as they share one in memory.
+ *
+ * Page-out writes up to SWAP_CLUSTER virtually contiguous pages of the
+ * victim's address space to contiguous slots with a single write, and
+ * page-in reads the pages that went out along with the faulting one
+ * back with it.
+ *
+ *    swap_bootstrap  - attach the swap device. Without one, clean
+ *                      pages can still be evicted.
+ *    swap_evict      - page out a page, or a cluster of them, and free
+ *                      the frames. Returns the number of pages freed,
+ *                      0 if nothing could be.
+ *    swap_pagein     - read the page at VADDR of AS, whose entry PTE
+ *                      says it is on swap, into the pinned frame
+ *                      PADDR, and update PTE.
+ *    swap_share      - add a reference to a slot.
+ *    swap_free       - drop a reference to a slot.
+ *    swap_printstats - print swap space usage.
+ */
+
+#include <pagetable.h>
+
+#define SWAP_DEVICE	"lhd1:"
+#define SWAP_CLUSTER	8
+
+struct addrspace;
+
+void swap_bootstrap(void);
+unsigned swap_evict(void);
+int swap_pagein(struct addrspace *as, vaddr_t vaddr, pte_t *pte,
+		paddr_t paddr);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
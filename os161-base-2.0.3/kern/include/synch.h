@@ -42,10 +42,12 @@
 /* G.Cabodi - 2019 - implementing locks and CVs */
 /* option "synch" needed in conf.kern (and enabled!) */
 #include "opt-shell.h" 
+#include "opt-lockstats.h"
 /* 1: implement lock as a binary semaphore (+ pointer to thread) 
- * 0: lock implemented by wait channel
+ * 0: lock implemented by wait channel, spinning first while the
+ *    owner is running on another cpu (see lock_acquire)
  */
-#define USE_SEMAPHORE_FOR_LOCK 1
+#define USE_SEMAPHORE_FOR_LOCK 0
 /* ------------------------------------------------------------- */
 
 /*
@@ -94,7 +96,16 @@ struct lock {
 	struct wchan *lk_wchan;
 #endif
 	struct spinlock lk_spinlock;
-        volatile struct thread *lk_owner;
+        struct thread *volatile lk_owner;
+	/* statistics, see lock_printstats */
+	unsigned lk_acquires;		/* times acquired */
+	unsigned lk_contended;		/* times found already held */
+	unsigned lk_spun;		/* ...and got by spinning, not sleeping */
+	uint64_t lk_waitnsecs;		/* time spent waiting for it */
+#if OPT_LOCKSTATS
+	struct lock *lk_next;		/* list of all locks */
+	struct lock *lk_prev;
+#endif
 #endif
 };
 
@@ -116,6 +127,22 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Contention statistics, for the kernel menu.
+ *    lock_printstats - list the NUM locks that were most often found
+ *                   held by someone else, with how many of those times
+ *                   spinning got the lock, and how long was spent
+ *                   waiting for them.
+ *    lock_resetstats - zero the statistics of all locks.
+ *
+ * Every lock keeps its own counts, but finding all the locks needs a
+ * list of them, which costs a global spinlock in every lock_create
+ * and lock_destroy. So the list, and with it these two, are only in
+ * kernels built with "options lockstats".
+ */
+void lock_printstats(unsigned num);
+void lock_resetstats(void);
+
 
 /*
  * Condition variable.
@@ -162,4 +189,50 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, newly arriving
+ * readers wait behind it, so a steady stream of readers cannot starve
+ * writers. In turn, when a writer lets go, the readers that were
+ * already waiting all get in before the next writer, so writers
+ * cannot starve readers either.
+ *
+ * Unlike struct lock, the holder may sleep (for I/O, say) and the
+ * lock is not recursive. The name field is for easier debugging. A
+ * copy of the name is made internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct wchan *rw_readwchan;	/* readers wait here */
+	struct wchan *rw_writewchan;	/* writers wait here */
+	struct spinlock rw_spinlock;	/* protects the following */
+	unsigned rw_readers;		/* readers holding the lock */
+	unsigned rw_readwait;		/* readers waiting */
+	unsigned rw_readgrant;		/* waiting readers let past writers */
+	unsigned rw_writewait;		/* writers waiting */
+	struct thread *rw_writer;	/* writer holding the lock, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release_write - Give up the exclusive hold.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing. (Read holds aren't tracked
+ *                   per thread.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
\ No newline at end of file
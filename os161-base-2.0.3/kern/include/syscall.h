@@ -68,10 +68,19 @@ int sys_open(userptr_t path, int openflags, mode_t mode, int *errp);
 int sys_close(int fd);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
 int sys_read(int fd, userptr_t buf, size_t size, int* retval);
+int sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval);
+int sys_readv(int fd, userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, userptr_t iov, int iovcnt, int *retval);
 int sys_dup2(int old_fd, int new_fd, int* retval);
 int sys_chdir(const char *pathname);
 int sys_getcwd(const char *buf, size_t buflen, int *retval);
 int sys_lseek(int fd, off_t pos, int whence, int64_t* retval);
+int sys_sync(void);
+int sys_pipe(userptr_t fds, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
 void sys__exit(int status);
 pid_t sys_getpid(pid_t* retval);
 int sys_waitpid(pid_t pid, int *status, int options, int *retval);
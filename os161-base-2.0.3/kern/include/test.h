@@ -54,6 +54,9 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int lockbench(int, char **);
+int rwlocktest(int, char **);
+int lookupbench(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -93,6 +96,8 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int coremaptest(int, char **);
+int coremaptest2(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
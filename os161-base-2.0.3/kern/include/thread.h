@@ -81,8 +81,10 @@ struct thread {
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
-	struct cpu *t_cpu;		/* CPU thread runs on */
+	struct cpu *t_cpu;		/* CPU thread runs (or last ran) on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Scheduler level; 0 runs first */
+	unsigned t_ticks;		/* Hardclocks used at this level */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
 	/*
@@ -159,10 +161,25 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge the current thread for a clock tick and preempt it if its
+ * quantum is used up or a higher priority thread is waiting. Called
+ * from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Scheduler tuning, for the kernel menu. schedule_setpolicy picks
+ * between the multi-level feedback queue (true, the default) and
+ * plain round-robin (false); schedule_setquantum sets the base
+ * quantum in hardclocks. schedule_printstats shows the settings, the
+ * run queues and the per-cpu counters, which schedule_resetstats
+ * clears.
+ */
+void schedule_setpolicy(bool mlfq);
+void schedule_setquantum(unsigned hardclocks);
+void schedule_printstats(void);
+void schedule_resetstats(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -138,5 +138,22 @@ int uiomovezeros(size_t len, struct uio *uio);
 void uio_kinit(struct iovec *, struct uio *,
 	       void *kbuf, size_t len, off_t pos, enum uio_rw rw);
 
+/*
+ * Initialize a uio suitable for I/O straight to/from a user buffer
+ * in the current process's address space, with no kernel bounce
+ * buffer in between. Bad user pointers are reported as EFAULT by
+ * uiomove when the transfer actually happens.
+ */
+void uio_uinit(struct iovec *, struct uio *,
+	       userptr_t ubuf, size_t len, off_t pos, enum uio_rw rw);
+
+/*
+ * Like uio_uinit, but for IOVCNT user buffers already described by
+ * the iovecs in IOV (for readv and writev). The total length must
+ * already have been checked to fit in a size_t.
+ */
+void uio_uvinit(struct iovec *iov, unsigned iovcnt, struct uio *u,
+		off_t pos, enum uio_rw rw);
+
 
 #endif /* _UIO_H_ */
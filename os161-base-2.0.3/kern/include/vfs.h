@@ -55,6 +55,7 @@ struct vnode;  /* abstract structure for an on-disk file (vnode.h) */
  *    vfs_clearcurdir - change current directory of current thread to "none"
  *    vfs_getcurdir - retrieve vnode of current directory of current thread
  *    vfs_sync      - force all dirty buffers to disk
+ *    vfs_printdevstats - print statistics of devices that keep them
  *    vfs_getroot   - get root vnode for the filesystem named DEVNAME
  *    vfs_getdevname - get mounted device name for the filesystem passed in
  */
@@ -63,6 +64,7 @@ int vfs_setcurdir(struct vnode *dir);
 int vfs_clearcurdir(void);
 int vfs_getcurdir(struct vnode **retdir);
 int vfs_sync(void);
+void vfs_printdevstats(void);
 int vfs_getroot(const char *devname, struct vnode **result);
 const char *vfs_getdevname(struct fs *fs);
 
@@ -81,6 +83,33 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache (vfsdcache.c), used by vfs_lookup and vfs_lookparent.
+ *
+ *    vfs_dcache_lookup  - Look up NAME in DIR. On a hit, returns true
+ *                         with a new reference to the vnode, or NULL
+ *                         if the name is known not to exist. On a
+ *                         miss, hands back a generation number for
+ *                         vfs_dcache_enter.
+ *    vfs_dcache_enter   - Record the result of VOP_LOOKUP after a miss.
+ *    vfs_dcache_purge   - Forget a name after it changed; with CHILDREN,
+ *                         also forget names looked up in it.
+ *    vfs_dcache_purgefs - Forget everything on a file system.
+ *    vfs_dcache_printstats - Print hit counters.
+ *    vfs_dcache_resetstats - Zero the hit counters.
+ *    vfs_dcache_bootstrap - Allocate the cache; called by vfs_bootstrap.
+ */
+
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret, unsigned *genp);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_dcache_purge(struct vnode *dir, const char *name, bool children);
+void vfs_dcache_purgefs(struct fs *fs);
+void vfs_dcache_printstats(void);
+void vfs_dcache_resetstats(void);
+void vfs_dcache_bootstrap(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -193,13 +222,5 @@ int vfs_unmountall(void);
 DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
-/*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
- */
-void vfs_biglock_acquire(void);
-void vfs_biglock_release(void);
-bool vfs_biglock_do_i_hold(void);
-
 
 #endif /* _VFS_H_ */
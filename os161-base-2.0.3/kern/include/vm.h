@@ -58,5 +58,25 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Invalidate every entry in this CPU's TLB (not in dumbvm) */
+void vm_tlbflush(void);
+
+/*
+ * Invalidate NPAGES pages starting at VADDR in every CPU's TLB, and
+ * wait until it's done (not in dumbvm)
+ */
+void vm_shootdown(vaddr_t vaddr, unsigned npages);
+
+/*
+ * Lend the kernel the page of the current process at user address
+ * VADDR, faulting it in if need be, and return its frame. The page
+ * can't be paged out or freed until it is given back with
+ * vm_unloan_page. The process must not write to it meanwhile, so it
+ * is meant for the process to sleep on while someone else reads it
+ * (not in dumbvm).
+ */
+int vm_loan_page(vaddr_t vaddr, paddr_t *ret);
+void vm_unloan_page(paddr_t paddr);
+
 
 #endif /* _VM_H_ */
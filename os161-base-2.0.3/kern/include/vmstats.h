@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VMSTATS_H_
+#define _VMSTATS_H_
+
+/*
+ * Virtual memory statistics.
+ *
+ * Every TLB miss that is handled ends up either in a free TLB slot or
+ * replacing an entry, so
+ *     TLB faults = TLB faults with free + TLB faults with replace
+ * and it is satisfied either from a page already in memory (a reload)
+ * or by bringing the page in, so
+ *     TLB faults = TLB reloads + page faults (zeroed) + page faults (disk)
+ * and a page comes from disk from the executable, from swap, or from
+ * a file mapped with mmap:
+ *     page faults (disk) = ELF page faults + swapfile page faults
+ *                          + mapped file page faults
+ * vmstats_print checks all three and complains if they don't hold.
+ *
+ * Copy-on-write faults on pages already in the TLB are not TLB
+ * faults; they are counted separately, as are the pages that actually
+ * had to be copied, so vmstats_print can report pages copied per fork.
+ *
+ * Pages read from swap ahead of a fault (prefetched) are not page
+ * faults. Every page evicted is either written to swap or, if swap
+ * already has it or it can be filled again from its region, dropped.
+ *
+ *    vmstats_inc   - bump one counter.
+ *    vmstats_add   - add to one counter.
+ *    vmstats_print - print all counters.
+ *    vmstats_reset - zero all counters.
+ */
+
+enum vmstat {
+	VMSTAT_TLB_FAULTS,		/* TLB misses handled */
+	VMSTAT_TLB_FAULTS_FREE,		/* ...that found a free TLB slot */
+	VMSTAT_TLB_FAULTS_REPLACE,	/* ...that replaced a TLB entry */
+	VMSTAT_TLB_INVALIDATIONS,	/* whole-TLB flushes */
+	VMSTAT_TLB_RELOADS,		/* page was already in memory */
+	VMSTAT_PAGE_FAULTS_ZERO,	/* page filled with zeros */
+	VMSTAT_PAGE_FAULTS_DISK,	/* page read from disk */
+	VMSTAT_PAGE_FAULTS_ELF,		/* ...from the executable */
+	VMSTAT_AS_COPIES,		/* address spaces copied (forks) */
+	VMSTAT_COW_SHARED,		/* pages shared by as_copy */
+	VMSTAT_COW_FAULTS,		/* writes to copy-on-write pages */
+	VMSTAT_COW_COPIES,		/* ...that had to copy the page */
+	VMSTAT_PAGE_FAULTS_SWAP,	/* page read from swap */
+	VMSTAT_SWAP_PREFETCHES,		/* pages read from swap early */
+	VMSTAT_SWAPFILE_WRITES,		/* pages written to swap */
+	VMSTAT_SWAPFILE_WRITE_IOS,	/* ...in this many writes */
+	VMSTAT_EVICTIONS,		/* pages evicted */
+	VMSTAT_EVICTIONS_CLEAN,		/* ...without writing them */
+	VMSTAT_EVICT_SCANNED,		/* coremap entries the clock examined */
+	VMSTAT_PAGE_FAULTS_FILE,	/* page read from a mapped file */
+	VMSTAT_NUM			/* number of counters */
+};
+
+void vmstats_inc(enum vmstat which);
+void vmstats_add(enum vmstat which, unsigned n);
+void vmstats_print(void);
+void vmstats_reset(void);
+
+#endif /* _VMSTATS_H_ */
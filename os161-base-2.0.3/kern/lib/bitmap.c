@@ -120,6 +120,37 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+int
+bitmap_alloc_range(struct bitmap *b, unsigned start, unsigned end,
+                   unsigned *index)
+{
+        unsigned ix, offset;
+        WORD_TYPE mask;
+
+        KASSERT(start <= end && end <= b->nbits);
+
+        while (start < end) {
+                ix = start / BITS_PER_WORD;
+                offset = start % BITS_PER_WORD;
+
+                /* Skip whole words that are full */
+                if (offset == 0 && end - start >= BITS_PER_WORD &&
+                    b->v[ix] == WORD_ALLBITS) {
+                        start += BITS_PER_WORD;
+                        continue;
+                }
+
+                mask = ((WORD_TYPE)1) << offset;
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = start;
+                        return 0;
+                }
+                start++;
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -40,11 +40,17 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
+#include <kmem.h>
+#include <coremap.h>
+#include <vmstats.h>
+#include <swap.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 #include <current.h>
 
 /*
@@ -125,14 +131,8 @@ common_prog(int nargs, char **args)
 	}
 
 #if OPT_SHELL
-	/* adding a new child to the father */
-    if(add_new_child(curproc, proc->p_pid)==-1){
-        proc_destroy(proc);
-        return ENOMEM; 
-    }
-
-    /*linking child to the father */
-    proc->father_pid=curproc->p_pid;
+	/* linking the new child to the father */
+	add_new_child(curproc, proc);
 #endif
 
 	result = thread_fork(args[0] /* thread name */,
@@ -517,6 +517,137 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kmemstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kmem_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kmem_resetstats();
+	}
+	else {
+		kprintf("Usage: kmem [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	int quantum;
+
+	if (nargs == 1) {
+		schedule_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "mlfq")) {
+		schedule_setpolicy(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "rr")) {
+		schedule_setpolicy(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		schedule_resetstats();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "quantum")
+		 && (quantum = atoi(args[2])) > 0) {
+		schedule_setquantum(quantum);
+	}
+	else {
+		kprintf("Usage: sched [mlfq | rr | quantum hardclocks | reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lock_printstats(10);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lock_resetstats();
+	}
+	else {
+		kprintf("Usage: locks [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		buffer_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		buffer_resetstats();
+	}
+	else {
+		kprintf("Usage: bc [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_dcstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vfs_dcache_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vfs_dcache_resetstats();
+	}
+	else {
+		kprintf("Usage: dc [reset]\n");
+	}
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vmstats_print();
+		coremap_printstats();
+		swap_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstats_reset();
+		coremap_resetstats();
+	}
+	else {
+		kprintf("Usage: vm [reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_devstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_printdevstats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -583,6 +714,8 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[cm1] Page allocator stress test    ",
+	"[cm2] Page allocator exhaustion test",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -593,6 +726,9 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] Lock throughput       (1)     ",
+	"[sy6] Rwlock test           (1)     ",
+	"[sy7] Parallel lookups      (1)     ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -624,6 +760,15 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[kmem] Object cache stats [reset]   ",
+	"[sched] Scheduler [mlfq|rr|quantum] ",
+	"[locks] Lock contention [reset]     ",
+	"[bc] Buffer cache stats [reset]     ",
+	"[dc] Name cache stats [reset]       ",
+	"[ds] Disk queue stats               ",
+#if !OPT_DUMBVM
+	"[vm] VM stats [reset]               ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -675,6 +820,15 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "kmem",       cmd_kmemstats },
+	{ "sched",      cmd_sched },
+	{ "locks",      cmd_lockstats },
+	{ "bc",         cmd_bufstats },
+	{ "dc",         cmd_dcstats },
+	{ "ds",         cmd_devstats },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -685,6 +839,8 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "cm1",	coremaptest },
+	{ "cm2",	coremaptest2 },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -697,6 +853,9 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	lockbench },
+	{ "sy6",	rwlocktest },
+	{ "sy7",	lookupbench },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
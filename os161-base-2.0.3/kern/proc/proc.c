@@ -1,22 +1,54 @@
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <syscall.h>
+#include <kmem.h>
 
 #if OPT_SHELL
 #include <synch.h>
 #include <kern/fcntl.h>
+#include <mips/trapframe.h>
 #include <vfs.h>
 
-#define MAX_PROC 100
+/*
+ * Process table.
+ *
+ * A pid is made of a slot number (the low PID_SLOTBITS bits) and the
+ * generation of that slot (the rest). Slots are allocated from a bitmap
+ * that starts with PROC_INITSLOTS slots and doubles, up to
+ * PROC_MAXSLOTS, whenever it fills up. The search for a free slot
+ * starts after the last one allocated, and a slot's generation goes up
+ * each time it is freed, so a pid is only reused after the slot has
+ * gone around PID_NGENS times.
+ *
+ * Live processes are found by pid through a hash table, chained
+ * through p_hashnext. The table lock also protects the parent/child
+ * links (p_parent, p_children, p_sibnext, p_sibprev). It is a
+ * reader-writer lock: proc_search_pid and is_child, which waitpid and
+ * friends call all the time, only read and can run side by side;
+ * fork and process destruction write.
+ */
+#define PID_SLOTBITS	12
+#define PROC_MAXSLOTS	(1 << PID_SLOTBITS)
+#define PROC_INITSLOTS	128
+#define PID_NGENS	((PID_MAX + 1) >> PID_SLOTBITS)
+#define PID_SLOT(pid)	((unsigned)(pid) & (PROC_MAXSLOTS - 1))
+#define PID_MAKE(slot, gen) ((pid_t)(((gen) << PID_SLOTBITS) | (slot)))
+#define PROC_HASHSIZE	256
+#define PROC_HASH(pid)	((unsigned)(pid) % PROC_HASHSIZE)
+
 static struct _processTable {
-  bool active;           /* initial value 0 */
-  struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
-  int last_pid;           /* index of last allocated pid */
-  struct spinlock lk;  /* Lock for this table */
+  struct rwlock *lk;		/* Lock for this table; lookups only read */
+  unsigned nslots;		/* slots covered by pidmap and gens */
+  uint32_t *pidmap;		/* bit set if slot in use */
+  uint8_t *gens;		/* current generation of each slot */
+  unsigned hint;		/* where to start looking for a free slot */
+  unsigned nprocs;		/* processes in the table */
+  struct proc *hash[PROC_HASHSIZE]; /* pid -> proc */
 } processTable;
 
 #endif
@@ -25,76 +57,232 @@ static struct _processTable {
  */
 struct proc *kproc;
 
+/*
+ * Process structures. A recycled proc keeps its p_lock and, with
+ * OPT_SHELL, its p_cv and p_locklock.
+ */
+static struct kmem_cache *proc_cache;
+
+#if OPT_SHELL
+/* Open file objects; a recycled one keeps its lock. */
+struct kmem_cache *openfile_cache;
+
+/* Copies of the parent's trapframe handed to a forked child. */
+struct kmem_cache *trapframe_cache;
+#endif
+
 /**
- * @brief get_valid_pid, used to find in the process table a valid pid for a new process
- * 
- * @return an error in case of failure or 0 in case of success
+ * @brief proc_ctor, proc_dtor, constructor and destructor for proc_cache
+ *
+ * @param obj is the process structure
+ *
+ * @return ENOMEM in case of failure or 0 in case of success (proc_ctor)
  */
+static int proc_ctor(void *obj) {
+	struct proc *proc = obj;
+
+	spinlock_init(&proc->p_lock);
 #if OPT_SHELL
-int get_valid_pid(void){
+	proc->p_cv = cv_create("proc");
+	if (proc->p_cv == NULL) {
+		spinlock_cleanup(&proc->p_lock);
+		return ENOMEM;
+	}
+	proc->p_locklock = lock_create("proc");
+	if (proc->p_locklock == NULL) {
+		cv_destroy(proc->p_cv);
+		spinlock_cleanup(&proc->p_lock);
+		return ENOMEM;
+	}
+#endif
+	return 0;
+}
 
-  /* checking space availability in process table */
-	int index = (processTable.last_pid + 1 > MAX_PROC) ? 1 : processTable.last_pid + 1;
-	while (index != processTable.last_pid) {
-        if (processTable.proc[index] == NULL) {
-            break;
-        }
+static void proc_dtor(void *obj) {
+	struct proc *proc = obj;
 
-        index ++;
-        index = (index > MAX_PROC) ? 1 : index;
-    }
+#if OPT_SHELL
+	lock_destroy(proc->p_locklock);
+	cv_destroy(proc->p_cv);
+#endif
+	spinlock_cleanup(&proc->p_lock);
+}
 
-	/* new position not found */
-	if (index == processTable.last_pid) {
-        return -1; 
-    }
+/**
+ * @brief openfile_ctor, openfile_dtor, constructor and destructor for openfile_cache
+ *
+ * @param obj is the open file
+ *
+ * @return ENOMEM in case of failure or 0 in case of success (openfile_ctor)
+ */
+#if OPT_SHELL
+static int openfile_ctor(void *obj) {
+	struct openfile *of = obj;
 
-	return index;
+	of->vn = NULL;
+	of->lock = lock_create("file_lock");
+	if (of->lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void openfile_dtor(void *obj) {
+	struct openfile *of = obj;
+
+	KASSERT(of->vn == NULL);
+	lock_destroy(of->lock);
 }
 #endif
 
 /**
- * @brief add_newp, used to add a process to the process table
- * 
- * @param pid indicating the index in the process table where the process should be add
- * @param proc is the process to be added
- * 
- * @return an error in case of failure or 0 in case of success
+ * @brief pid_grow, used to make room for more slots in the process table
+ *
+ * Called with the table lock held for writing; the caller has to look
+ * again for a free slot afterwards.
+ *
+ * @return ENPROC if the table is as big as it gets, ENOMEM if out of memory, 0 otherwise
  */
 #if OPT_SHELL
-int add_newp(pid_t pid, struct proc *proc) {
+static int pid_grow(void) {
+	unsigned oldslots, newslots;
+	uint32_t *newmap, *oldmap;
+	uint8_t *newgens, *oldgens;
 
-	/* checking if the inputs are valid */
-	if (pid <= 0 || pid > MAX_PROC +1 || proc == NULL) {
-		return -1;
+	KASSERT(rwlock_do_i_hold_write(processTable.lk));
+
+	oldslots = processTable.nslots;
+	if (oldslots >= PROC_MAXSLOTS) {
+		return ENPROC;
+	}
+	newslots = oldslots * 2;
+
+	/* the table lock may be held across kmalloc, as it's a sleeping lock */
+	newmap = kmalloc(newslots / 32 * sizeof(uint32_t));
+	newgens = kmalloc(newslots * sizeof(uint8_t));
+	if (newmap == NULL || newgens == NULL) {
+		kfree(newmap);
+		kfree(newgens);
+		return ENOMEM;
 	}
 
-	/* adding the process to the process table at index pid */
-	spinlock_acquire(&processTable.lk);
-	processTable.proc[pid] = proc;
+	/* copying the old slots, the new ones are free and at generation 0 */
+	bzero(newmap, newslots / 32 * sizeof(uint32_t));
+	bzero(newgens, newslots * sizeof(uint8_t));
+	memcpy(newmap, processTable.pidmap, oldslots / 32 * sizeof(uint32_t));
+	memcpy(newgens, processTable.gens, oldslots * sizeof(uint8_t));
+
+	oldmap = processTable.pidmap;
+	oldgens = processTable.gens;
+	processTable.pidmap = newmap;
+	processTable.gens = newgens;
+	processTable.nslots = newslots;
+	/* carrying on from the first new slot */
+	processTable.hint = oldslots;
 
-	/* updating the last pid */
-	processTable.last_pid = pid;
-	spinlock_release(&processTable.lk);
+	kfree(oldmap);
+	kfree(oldgens);
 
 	return 0;
 }
 #endif
 
 /**
- * @brief remove_proc, used to remove a process from the process table
- * 
- * @param pid used to identify the process into the process table
- * 
+ * @brief pid_alloc, used to give a process a pid and put it in the process table
+ *
+ * @param proc is the process
+ *
+ * @return ENPROC or ENOMEM in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+static int pid_alloc(struct proc *proc) {
+	unsigned slot, word, bit, i, nwords;
+	uint32_t bits;
+	int err;
+
+	rwlock_acquire_write(processTable.lk);
+
+	for (;;) {
+		/* looking a word at a time, starting at the hint and wrapping around */
+		nwords = processTable.nslots / 32;
+		slot = processTable.nslots;
+		for (i = 0; i <= nwords; i++) {
+			word = (processTable.hint / 32 + i) % nwords;
+			bits = processTable.pidmap[word];
+			if (i == 0) {
+				/* the first time around, skip the slots below the hint */
+				bits |= (1U << (processTable.hint % 32)) - 1;
+			}
+			if (bits != 0xffffffff) {
+				for (bit = 0; bits & (1U << bit); bit++) {
+					/* nothing */
+				}
+				slot = word * 32 + bit;
+				break;
+			}
+		}
+		if (slot < processTable.nslots) {
+			break;
+		}
+
+		/* full: making the table bigger */
+		err = pid_grow();
+		if (err) {
+			rwlock_release_write(processTable.lk);
+			return err;
+		}
+	}
+
+	processTable.pidmap[slot / 32] |= 1U << (slot % 32);
+	processTable.hint = (slot + 1) % processTable.nslots;
+	processTable.nprocs++;
+
+	proc->p_pid = PID_MAKE(slot, processTable.gens[slot]);
+	KASSERT(proc->p_pid >= PID_MIN && proc->p_pid <= PID_MAX);
+
+	/* adding the process to its hash chain */
+	proc->p_hashnext = processTable.hash[PROC_HASH(proc->p_pid)];
+	processTable.hash[PROC_HASH(proc->p_pid)] = proc;
+
+	rwlock_release_write(processTable.lk);
+
+	return 0;
+}
+#endif
+
+/**
+ * @brief pid_free, used to take a process out of the process table and release its pid
+ *
+ * Must be called with the table lock held.
+ *
+ * @param proc is the process
+ *
  * @return doesn't have any return value
  */
 #if OPT_SHELL
-void remove_proc(pid_t pid) {
+static void pid_free(struct proc *proc) {
+	struct proc **pp;
+	unsigned slot;
 
-	/* putting null at the specified index */
-	spinlock_acquire(&processTable.lk);
-	processTable.proc[pid] = NULL;
-	spinlock_release(&processTable.lk);
+	KASSERT(rwlock_do_i_hold_write(processTable.lk));
+
+	/* removing the process from its hash chain */
+	for (pp = &processTable.hash[PROC_HASH(proc->p_pid)]; *pp != proc; pp = &(*pp)->p_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = proc->p_hashnext;
+	proc->p_hashnext = NULL;
+
+	/* freeing the slot; the next pid to get it will be of the next generation */
+	slot = PID_SLOT(proc->p_pid);
+	KASSERT(processTable.pidmap[slot / 32] & (1U << (slot % 32)));
+	processTable.pidmap[slot / 32] &= ~(1U << (slot % 32));
+	processTable.gens[slot] = (processTable.gens[slot] + 1) % PID_NGENS;
+	if (PID_MAKE(slot, processTable.gens[slot]) < PID_MIN) {
+		/* skipping the pids below PID_MIN */
+		processTable.gens[slot]++;
+	}
+	processTable.nprocs--;
 }
 #endif
 
@@ -123,21 +311,25 @@ void call_enter_forked_process(void *tfv, unsigned long dummy) {
  * 
  * @param pid to identify the process into the process table
  * 
- * @return the process associated to the pid
+ * @return the process associated to the pid, or NULL if there is none
  */
 #if OPT_SHELL
 struct proc *proc_search_pid(pid_t pid) {
+	struct proc *proc;
 
 	/* checking if pid is valid */
-	if (pid <= 0 || pid > MAX_PROC) {
+	if (pid < PID_MIN || pid > PID_MAX) {
 		return NULL;
 	}
 
-	/* retrieving the process by the pid */
-	struct proc *proc = processTable.proc[pid];
-	if (proc->p_pid != pid) {
-		return NULL;
+	/* retrieving the process by the pid; lookups can run in parallel */
+	rwlock_acquire_read(processTable.lk);
+	for (proc = processTable.hash[PROC_HASH(pid)]; proc != NULL; proc = proc->p_hashnext) {
+		if (proc->p_pid == pid) {
+			break;
+		}
 	}
+	rwlock_release_read(processTable.lk);
 
 	return proc;
 }
@@ -156,14 +348,16 @@ struct proc *proc_search_pid(pid_t pid) {
 #if OPT_SHELL
 static int std_init(const char *name, struct proc *proc, int fd, int mode) {
 
+	(void)name;
+
 	/* assigning the console name */
 	char *con = kstrdup("con:");
 	if (con == NULL) {
 		return -1;
 	}
 
-	/* allocating space in the filetable */
-	proc->fileTable[fd] = (struct openfile *) kmalloc(sizeof(struct openfile));
+	/* allocating space in the filetable (the lock comes with it) */
+	proc->fileTable[fd] = kmem_cache_alloc(openfile_cache);
 	if (proc->fileTable[fd] == NULL) {
 		kfree(con);
 		return -1;
@@ -173,19 +367,15 @@ static int std_init(const char *name, struct proc *proc, int fd, int mode) {
 	int err = vfs_open(con, mode, 0644, &proc->fileTable[fd]->vn);
 	if (err) {
 		kfree(con);
-		kfree(proc->fileTable[fd]);
+		proc->fileTable[fd]->vn = NULL;
+		kmem_cache_free(openfile_cache, proc->fileTable[fd]);
+		proc->fileTable[fd] = NULL;
 		return -1;
 	}
 	kfree(con);
 
 	/* initializing all the values */
 	proc->fileTable[fd]->offset = 0;
-	proc->fileTable[fd]->lock = lock_create(name);
-	if (proc->fileTable[fd]->lock == NULL) {
-		vfs_close(proc->fileTable[fd]->vn);
-		kfree(proc->fileTable[fd]);
-		return -1;
-	}
 	proc->fileTable[fd]->countRef = 1;
 	proc->fileTable[fd]->mode = mode;
 
@@ -193,6 +383,64 @@ static int std_init(const char *name, struct proc *proc, int fd, int mode) {
 }
 #endif
 
+/**
+ * @brief delete_child_list, used to orphan all the children of a process
+ * 
+ * Must be called with the process table lock held.
+ * 
+ * @param proc is the process whose children lose their father
+ * 
+ * @return doesn't have any return value
+ */
+#if OPT_SHELL
+static void delete_child_list(struct proc *proc) {
+	struct proc *child;
+
+	KASSERT(rwlock_do_i_hold_write(processTable.lk));
+
+	while ((child = proc->p_children) != NULL) {
+		proc->p_children = child->p_sibnext;
+
+		/* removing a father at the child process */
+		child->p_parent = NULL;
+		child->p_sibnext = NULL;
+		child->p_sibprev = NULL;
+	}
+}
+#endif
+
+/**
+ * @brief remove_child_from_list, used to remove a process from the children of its father
+ * 
+ * Must be called with the process table lock held.
+ * 
+ * @param proc is the process where we want to remove a child
+ * @param child is the process to remove
+ * 
+ * @return doesn't have any return value
+ */
+#if OPT_SHELL
+static void remove_child_from_list(struct proc *proc, struct proc *child) {
+
+	KASSERT(rwlock_do_i_hold_write(processTable.lk));
+	KASSERT(child->p_parent == proc);
+
+	if (child->p_sibprev != NULL) {
+		child->p_sibprev->p_sibnext = child->p_sibnext;
+	} else {
+		KASSERT(proc->p_children == child);
+		proc->p_children = child->p_sibnext;
+	}
+	if (child->p_sibnext != NULL) {
+		child->p_sibnext->p_sibprev = child->p_sibprev;
+	}
+
+	child->p_parent = NULL;
+	child->p_sibnext = NULL;
+	child->p_sibprev = NULL;
+}
+#endif
+
 /**
  * @brief proc_init, used to add a process to the process table, getting its pid
  * 
@@ -204,37 +452,18 @@ static int std_init(const char *name, struct proc *proc, int fd, int mode) {
 #if OPT_SHELL
 static int proc_init(struct proc *proc, const char *name) {
 
-	spinlock_acquire(&processTable.lk);
-	proc->p_pid = -1;
-
-	/* searching for a free inidex in the process table */
-	int index = processTable.last_pid + 1;
-	index = (index > MAX_PROC) ? 1 : index;		// skipping [0] (kernel process)
-	while (index != processTable.last_pid) {
-		if (processTable.proc[index] == NULL) {
-			processTable.proc[index] = proc;
-			processTable.last_pid = index;
-			proc->p_pid = index;
-			break;
-		}
-		index++;
-		index = (index > MAX_PROC) ? 1 : index;
-	}
+	(void)name;
 
-	spinlock_release(&processTable.lk);
-
-	if (proc->p_pid <= 0) {
-		return proc->p_pid;
-	}
-
-	/* initializing the values */
+	/* the process starts with no father and no children */
 	proc->p_status = 0;
-	/* the first process has no father */
-	proc->father_pid=-1;
-	proc->child_list= NULL;
-	proc->p_cv = cv_create(name);
-  	proc->p_locklock = lock_create(name);
-	if (proc->p_cv == NULL || proc->p_locklock == NULL) {
+	proc->p_parent = NULL;
+	proc->p_children = NULL;
+	proc->p_sibnext = NULL;
+	proc->p_sibprev = NULL;
+	/* p_cv and p_locklock come with the structure from proc_cache */
+
+	/* getting a pid and entering the process table */
+	if (pid_alloc(proc)) {
 		return -1;
 	}
 
@@ -251,43 +480,27 @@ static int proc_init(struct proc *proc, const char *name) {
  */
 #if OPT_SHELL
 static int proc_deinit(struct proc *proc) {
-	struct proc* parent_proc;
-
-	spinlock_acquire(&processTable.lk);
 
 	/* checking if pid is valid */
-	int index = proc->p_pid;
-	if (index <= 0 || index > MAX_PROC) {
+	if (proc->p_pid < PID_MIN || proc->p_pid > PID_MAX) {
 		return -1;
 	}
 
-	/* releasing the entry in the process table */
-	processTable.proc[index] = NULL;
+	rwlock_acquire_write(processTable.lk);
 
-	cv_destroy(proc->p_cv);
-  	lock_destroy(proc->p_locklock);
+	/* releasing the entry in the process table */
+	pid_free(proc);
 
-	spinlock_release(&processTable.lk);
+	/* orphaning the children */
+	delete_child_list(proc);
 
-	/* deleting the child list */
-	if (delete_child_list(proc)==-1) {
-		return -1;
-	}
-	
 	/* removing the process as child for the father */
-	if (proc->father_pid!=-1) {
-		parent_proc=proc_search_pid(proc->father_pid);
-		if (proc->father_pid==kproc->p_pid) {
-			parent_proc=kproc;
-		}			
-		if (parent_proc==NULL) {
-			return -1;
-		}
-		if (remove_child_from_list(parent_proc, proc->p_pid)==-1) {
-			return -1;
-		}
+	if (proc->p_parent != NULL) {
+		remove_child_from_list(proc->p_parent, proc);
 	}
 
+	rwlock_release_write(processTable.lk);
+
 	return 0;
 }
 #endif
@@ -298,18 +511,18 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
+	/* p_lock comes with the structure from proc_cache */
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -321,9 +534,19 @@ proc_create(const char *name)
 
 	bzero(proc->fileTable, OPEN_MAX * sizeof(struct openfile*));
 
+	/* the kernel process has pid 0 and is not in the process table */
+	if (strcmp(name, "[kernel]") == 0) {
+		proc->p_pid = 0;
+		proc->p_hashnext = NULL;
+		proc->p_parent = NULL;
+		proc->p_children = NULL;
+		proc->p_sibnext = NULL;
+		proc->p_sibprev = NULL;
+	}
 	/* adding the process to the process table */
-	if (strcmp(name, "[kernel]") != 0 && proc_init(proc, name) <= 0) {
-		kfree(proc);
+	else if (proc_init(proc, name) <= 0) {
+		kfree(proc->p_name);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 #endif
@@ -406,7 +629,6 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 
 #if OPT_SHELL
 	if (proc_deinit(proc) != 0) {
@@ -415,37 +637,82 @@ proc_destroy(struct proc *proc)
 #endif
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 void
 proc_bootstrap(void)
 {
 
-	/* KERNEL PROCESS INITIALIZATION AND CREATION */
-	kproc = proc_create("[kernel]");
-	if (kproc == NULL) {
-		panic("proc_create for kproc failed\n");
+	/* OBJECT CACHES */
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
 	}
+#if OPT_SHELL
+	openfile_cache = kmem_cache_create("openfile", sizeof(struct openfile),
+					   openfile_ctor, openfile_dtor);
+	trapframe_cache = kmem_cache_create("trapframe",
+					    sizeof(struct trapframe),
+					    NULL, NULL);
+	if (openfile_cache == NULL || trapframe_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+#endif
 
 	/* USER PROCESS INITIALIZATION (TABLE) */
 #if OPT_SHELL
-	spinlock_init(&processTable.lk);
+	COMPILE_ASSERT(PID_MAKE(PROC_MAXSLOTS - 1, PID_NGENS - 1) <= PID_MAX);
 
-	/* registering kernel process in the process table 	*/
-	processTable.proc[0] = kproc;
-
-	KASSERT(processTable.proc[0] != NULL);
+	processTable.lk = rwlock_create("processTable");
+	if (processTable.lk == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+	processTable.nslots = PROC_INITSLOTS;
+	processTable.pidmap = kmalloc(PROC_INITSLOTS / 32 * sizeof(uint32_t));
+	processTable.gens = kmalloc(PROC_INITSLOTS * sizeof(uint8_t));
+	if (processTable.pidmap == NULL || processTable.gens == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+	bzero(processTable.pidmap, PROC_INITSLOTS / 32 * sizeof(uint32_t));
+	bzero(processTable.gens, PROC_INITSLOTS * sizeof(uint8_t));
+
+	/* slot 0 is the kernel's (pid 0); slot 1 starts at the generation giving a pid >= PID_MIN */
+	processTable.pidmap[0] = 1;
+	processTable.gens[1] = 1;
+	processTable.hint = 1;
+	processTable.nprocs = 0;
+	for (int i = 0; i < PROC_HASHSIZE; i++) {
+		processTable.hash[i] = NULL;
+	}
+#endif
 
-	/* setting all (not the first one) the process table's entry to NULL */
-	for (int i = 1; i <= MAX_PROC; i++) {
-		processTable.proc[i] = NULL;
+	/* KERNEL PROCESS INITIALIZATION AND CREATION */
+	kproc = proc_create("[kernel]");
+	if (kproc == NULL) {
+		panic("proc_create for kproc failed\n");
 	}
+}
 
-	/* activating the process table */
-	processTable.active = true;		
-	processTable.last_pid = 0;
-#endif
+/*
+ * Give NEWPROC the current process's current directory.
+ */
+static
+void
+proc_inherit_cwd(struct proc *newproc)
+{
+	/*
+	 * Lock the current process to copy its current directory.
+	 * (We don't need to lock the new process, though, as we have
+	 * the only reference to it.)
+	 */
+	spinlock_acquire(&curproc->p_lock);
+	if (curproc->p_cwd != NULL) {
+		VOP_INCREF(curproc->p_cwd);
+		newproc->p_cwd = curproc->p_cwd;
+	}
+	spinlock_release(&curproc->p_lock);
 }
 
 struct proc *
@@ -475,20 +742,31 @@ proc_create_runprogram(const char *name)
 	}
 #endif
 
-	/*
-	 * Lock the current process to copy its current directory.
-	 * (We don't need to lock the new process, though, as we have
-	 * the only reference to it.)
-	 */
-	spinlock_acquire(&curproc->p_lock);
-	if (curproc->p_cwd != NULL) {
-		VOP_INCREF(curproc->p_cwd);
-		newproc->p_cwd = curproc->p_cwd;
+	proc_inherit_cwd(newproc);
+
+	return newproc;
+}
+
+#if OPT_SHELL
+/*
+ * Create a process for fork(). Unlike proc_create_runprogram, it
+ * opens no console files: the caller hands it the parent's.
+ */
+struct proc *
+proc_create_fork(const char *name)
+{
+	struct proc *newproc;
+
+	newproc = proc_create(name);
+	if (newproc == NULL) {
+		return NULL;
 	}
-	spinlock_release(&curproc->p_lock);
+
+	proc_inherit_cwd(newproc);
 
 	return newproc;
 }
+#endif
 
 int
 proc_addthread(struct proc *proc, struct thread *t)
@@ -559,100 +837,30 @@ proc_setas(struct addrspace *newas)
 }
 
 /**
- * @brief add_new_child, used to add a new child to the child_list of the process
- * 
- * @param proc is the current process
- * @param child_pid is the pid of the child to add to the father (current process)
- * 
- * @return -1 in case of failure or 0 in case of success
- */
-#if OPT_SHELL
-int add_new_child(struct proc* proc, pid_t child_pid){
-	struct child_list* c_list=proc->child_list;
-
-	if(proc->child_list==NULL){
-		proc->child_list=(struct child_list *) kmalloc(sizeof(struct child_list));
-		if(proc->child_list==NULL)
-			return -1;
-		proc->child_list->next=NULL;
-		proc->child_list->pid=child_pid;
-		return 0;
-	}	
-
-	while(c_list->next!=NULL){
-		c_list=c_list->next;
-	}
-
-	c_list->next=(struct child_list *) kmalloc(sizeof(struct child_list));
-	if(c_list->next==NULL)
-		return -1;
-	c_list->next->next=NULL;
-	c_list->next->pid=child_pid;
-	return 0;
-}
-#endif
-
-/**
- * @brief delete_child_list, used to delete a child_list of a process
+ * @brief add_new_child, used to add a new child to the children of a process
  * 
- * @param proc is the process to delete the child_list
+ * @param proc is the father
+ * @param child is the child to add to the father
  * 
- * @return -1 in case of failure or 0 in case of success
+ * @return doesn't have any return value
  */
 #if OPT_SHELL
-int delete_child_list(struct proc* proc){
-	struct child_list* c_list=proc->child_list;
-	struct proc* child_proc;
+void add_new_child(struct proc *proc, struct proc *child) {
 
-	while(c_list!=NULL){
-		proc->child_list=c_list->next;
+	rwlock_acquire_write(processTable.lk);
 
-		/* finding the child process */
-		child_proc=proc_search_pid(c_list->pid);
-		if(child_proc==NULL)
-			return -1;
+	KASSERT(child->p_parent == NULL);
 
-		/* removing a father at the child process */	
-		child_proc->father_pid=-1;
-
-		/* removing the child at the father process */
-		c_list->next=NULL;
-		kfree(c_list);
-
-		c_list=proc->child_list;
+	/* linking the child at the head of the father's list */
+	child->p_parent = proc;
+	child->p_sibprev = NULL;
+	child->p_sibnext = proc->p_children;
+	if (proc->p_children != NULL) {
+		proc->p_children->p_sibprev = child;
 	}
-	
-	return 0;
-}
-#endif
+	proc->p_children = child;
 
-/**
- * @brief remove_child_from_list, used to remove a process from the child_list
- * 
- * @param proc is the process where we want to remove a child
- * @param child_pid is the pid that identify the process to remove from the list
- * 
- * @return -1 in case of failure or 0 in case of success
- */
-#if OPT_SHELL
-int remove_child_from_list(struct proc* proc, pid_t child_pid){
-	struct child_list* c_list=proc->child_list;
-	struct child_list* prev_child=NULL;
-
-	while(c_list!=NULL){
-		if(c_list->pid==child_pid){
-			if(prev_child==NULL)
-				proc->child_list=c_list->next;
-			else
-				prev_child->next=c_list->next;
-			kfree(c_list);
-			return 0;
-		}
-		prev_child=c_list;
-		c_list=c_list->next;
-	}
-	
-	return -1;
+	rwlock_release_write(processTable.lk);
 }
 #endif
 
@@ -665,16 +873,25 @@ int remove_child_from_list(struct proc* proc, pid_t child_pid){
  * @return -1 in case of failure or 0 in case of success
  */
 #if OPT_SHELL
-int is_child(struct proc* proc, pid_t child_pid){
-	struct child_list* c_list=proc->child_list;
+int is_child(struct proc *proc, pid_t child_pid) {
+	struct proc *child;
+	int ret = -1;
+
+	if (child_pid < PID_MIN || child_pid > PID_MAX) {
+		return -1;
+	}
 
-	while(c_list!=NULL){
-		if(c_list->pid==child_pid){
-			return 0;
+	rwlock_acquire_read(processTable.lk);
+	for (child = processTable.hash[PROC_HASH(child_pid)]; child != NULL; child = child->p_hashnext) {
+		if (child->p_pid == child_pid) {
+			if (child->p_parent == proc) {
+				ret = 0;
+			}
+			break;
 		}
-		c_list=c_list->next;
 	}
-	
-	return -1;
+	rwlock_release_read(processTable.lk);
+
+	return ret;
 }
 #endif
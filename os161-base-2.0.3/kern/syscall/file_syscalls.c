@@ -1,6 +1,7 @@
 /*
- * Very simple implementation of sys_read and sys_write.
- * just works (partially) on stdin/stdout
+ * Implementation of the file system calls.
+ * sys_read and sys_write move data directly between the vnode and
+ * the user buffer through a UIO_USERSPACE uio.
  */
 
 #include <types.h>
@@ -22,11 +23,8 @@
 #include <kern/seek.h>
 #include <stat.h>
 #include <endian.h>
-
-/* max num of system wide open files */
-#define SYSTEM_OPEN_MAX (10*OPEN_MAX)
-
-struct openfile systemFileTable[SYSTEM_OPEN_MAX];
+#include <kmem.h>
+#include <pipe.h>
 
 /**
  * @brief sys_write, used to write bytes into a file
@@ -41,14 +39,14 @@ struct openfile systemFileTable[SYSTEM_OPEN_MAX];
 #if OPT_SHELL
 int sys_write(int fd, userptr_t buf, size_t size, int *retval) {
   struct iovec iov;
-  struct uio ku;
+  struct uio u;
   struct vnode *vn;
   struct openfile *of;
+  bool seekable;
   int err, nwrite;
-  void *kbuf;
 
   /* checking if fd is valid */
-  if (fd < 0 || fd > OPEN_MAX){
+  if (fd < 0 || fd >= OPEN_MAX){
     return EBADF;
   } 
   of = curproc->fileTable[fd];
@@ -66,39 +64,42 @@ int sys_write(int fd, userptr_t buf, size_t size, int *retval) {
     return EBADF;
   }
 
-  /* allocate a temporary kernel buffer for the operation */
-  kbuf = kmalloc(size);
-  if(kbuf == NULL){
-    return ENOMEM;
-  }
-
-  /* copying the content of the user buffer into the kernel buffer */
-  if(copyin(buf, kbuf, size)){
-      kfree(kbuf);
-      return EFAULT; //buf is outside the accessible address space
+  /*
+   * acquiring the lock that protects the offset; objects without one
+   * (pipes, the console) skip it, so that a writer blocked on a pipe
+   * does not hold up a close of the same open file
+   */
+  seekable = VOP_ISSEEKABLE(vn);
+  if (seekable) {
+    lock_acquire(of->lock);
   }
 
-  /* acquiring the lock */
-  lock_acquire(of->lock);
-
-  /* initializing the uio structure to the read operation */
-  uio_kinit(&iov, &ku, kbuf, size, of->offset, UIO_WRITE);
+  /* 
+   * initializing the uio structure directly over the user buffer:
+   * uiomove copies straight from user memory into the file, without
+   * any kernel bounce buffer in between
+   */
+  uio_uinit(&iov, &u, buf, size, seekable ? of->offset : 0, UIO_WRITE);
 
   /* performing the write operation */
-  err = VOP_WRITE(vn, &ku);
+  err = VOP_WRITE(vn, &u);
   if (err) {
-      kfree(kbuf);
-      return err;
+    if (seekable) {
+      lock_release(of->lock);
+    }
+    return err;
   }
-  /* freeing the kernel buffer */
-  kfree(kbuf);
 
   /* updating the file offset based on the number of bytes written */
-  of->offset = ku.uio_offset;
+  if (seekable) {
+    of->offset = u.uio_offset;
+  }
   /* computing the actual written bytes */
-  nwrite = size - ku.uio_resid;
+  nwrite = size - u.uio_resid;
   /* release the lock */
-  lock_release(of->lock);
+  if (seekable) {
+    lock_release(of->lock);
+  }
 
   *retval = nwrite;
 
@@ -119,11 +120,11 @@ int sys_write(int fd, userptr_t buf, size_t size, int *retval) {
 #if OPT_SHELL
 int sys_read(int fd, userptr_t buf, size_t size, int *retval) {
     struct iovec iov;
-    struct uio ku;
+    struct uio u;
     struct vnode *vn;
     struct openfile *of;
+    bool seekable;
     int err, nread;
-    void *kbuf;
 
     /* checking if fd is valid */
     if (fd < 0 || fd >= OPEN_MAX) {
@@ -144,47 +145,39 @@ int sys_read(int fd, userptr_t buf, size_t size, int *retval) {
       return EBADF;
     }
 
-    /* allocate a temporary kernel buffer for the operation */
-    kbuf = kmalloc(size);
-    if (kbuf == NULL) {
-      return ENOMEM;
-    }
-
-    /* copying the content of the user buffer into the kernel buffer */
-    if (copyin(buf, kbuf, size)) {
-      kfree(kbuf);
-      return EFAULT;
+    /* acquiring the lock, only needed for objects with an offset (see sys_write) */
+    seekable = VOP_ISSEEKABLE(vn);
+    if (seekable) {
+      lock_acquire(of->lock);
     }
 
-    /* acquiring the lock */
-    lock_acquire(of->lock);
-
-    /* initializing the uio structure to the read operation */
-    uio_kinit(&iov, &ku, kbuf, size, of->offset, UIO_READ);
+    /* 
+     * initializing the uio structure directly over the user buffer:
+     * uiomove copies straight from the file into user memory
+     */
+    uio_uinit(&iov, &u, buf, size, seekable ? of->offset : 0, UIO_READ);
 
     /* performing the read operation */
-    err = VOP_READ(vn, &ku);
+    err = VOP_READ(vn, &u);
     if (err) {
-      kfree(kbuf);
+      if (seekable) {
+        lock_release(of->lock);
+      }
       return err;
     }
 
     /* updating the file offset based on the number of bytes read */
-    of->offset = ku.uio_offset;
-    /* computing the actual read bytes */
-    nread = size - ku.uio_resid;
-    
-    /* copying the read data from the kernel buffer to the user buffer */
-    if (copyout(kbuf, buf, nread)) {
-      return EFAULT;
+    if (seekable) {
+      of->offset = u.uio_offset;
     }
+    /* computing the actual read bytes */
+    nread = size - u.uio_resid;
 
     /* release the lock */
-    lock_release(of->lock);
+    if (seekable) {
+      lock_release(of->lock);
+    }
 
-    /* freeing the kernel buffer */
-    kfree(kbuf);
-    
     *retval = nread;
 
     return 0;
@@ -203,7 +196,7 @@ int sys_read(int fd, userptr_t buf, size_t size, int *retval) {
  */
 #if OPT_SHELL
 int sys_open(userptr_t pathname, int openflags, mode_t mode, int *retval) {
-  int fd, i;
+  int fd;
   struct vnode *v;
   struct openfile *of=NULL;
   size_t len;
@@ -239,26 +232,16 @@ int sys_open(userptr_t pathname, int openflags, mode_t mode, int *retval) {
     return err;
   }
 
-  /* finding an available slot in the system file table, setting parameters */
-  for (i=0; i<SYSTEM_OPEN_MAX; i++) {
-    if (systemFileTable[i].vn==NULL) {
-      of = &systemFileTable[i];
-      of->vn = v;
-      of->offset = 0;
-      break;
-    }
-  }
-
-  /* no free slot in system file table */
-  if (of==NULL) { 
+  /* getting an open file object (it comes with its lock already created) */
+  of = kmem_cache_alloc(openfile_cache);
+  if (of == NULL) {
     vfs_close(v);
-    return ENFILE;
+    return ENOMEM;
   }
 
   /* finding an available slot in the current process file table */
   for (fd=STDERR_FILENO+1; fd<OPEN_MAX; fd++) { // skipping STDIN, STDOUT and STDERR
     if (curproc->fileTable[fd] == NULL) {
-      curproc->fileTable[fd] = of;
       break;
     }
   }
@@ -266,6 +249,7 @@ int sys_open(userptr_t pathname, int openflags, mode_t mode, int *retval) {
   /* no free slot in process open file table */
   if(fd == OPEN_MAX) {
     vfs_close(v);
+    kmem_cache_free(openfile_cache, of);
     return EMFILE;
   }
 
@@ -276,8 +260,8 @@ int sys_open(userptr_t pathname, int openflags, mode_t mode, int *retval) {
     err = VOP_STAT(v, &filest);
 
     if (err) {
-      curproc->fileTable[fd] = NULL;
       vfs_close(v);
+      kmem_cache_free(openfile_cache, of);
       return err;
     }
     /* putting the offset at the end of the file (starting at the end) */
@@ -301,22 +285,14 @@ int sys_open(userptr_t pathname, int openflags, mode_t mode, int *retval) {
 			break;
 		default: // none of the specified mode
 			vfs_close(v);
-			curproc->fileTable[fd] = NULL;
+			kmem_cache_free(openfile_cache, of);
       return EINVAL;
   }
 
-  /* creating the lock on the file */
-  of->lock = lock_create("file_lock");
-
-  /* if the lock is equal to NULL means that something went wrong during the creation process */
-  if (of->lock == NULL) {
-    vfs_close(v);
-    curproc->fileTable[fd] = NULL;
-    return ENOMEM;
-  }
-
   /* update the countRef, meaning that we have opened the file */
+  of->vn = v;
   of->countRef = 1;
+  curproc->fileTable[fd] = of;
   
   *retval = fd;
 
@@ -353,10 +329,11 @@ int sys_close(int fd) {
   if (of->countRef == 0) {
     /* close the vnode */
     vfs_close(of->vn);
+    of->vn = NULL;
     /* release the lock */
     lock_release(of->lock);
-    /* destroy the lock */
-    lock_destroy(of->lock);
+    /* give the open file back, keeping the lock for the next open */
+    kmem_cache_free(openfile_cache, of);
   } else {
     /* release the lock */
     lock_release(of->lock);
@@ -409,10 +386,13 @@ int sys_dup2(int old_fd, int new_fd, int *retval) {
       of->vn = NULL;
       /* close the vnode */
       vfs_close(vn);
+      /* releasing the lock and giving the open file back */
+      lock_release(of->lock);
+      kmem_cache_free(openfile_cache, of);
+    } else {
+      /* releasing the lock */
+      lock_release(of->lock);
     }
-
-    /* releasing the lock */
-    lock_release(of->lock);
     of = NULL;
   }
 
@@ -567,6 +547,19 @@ int sys_chdir(const char *pathname) {
 }
 #endif
 
+/**
+ * @brief sys_sync, used to write all modified filesystem data to disk
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_sync(void) {
+
+  /* syncing every mounted filesystem, then the buffer cache */
+  return vfs_sync();
+}
+#endif
+
 /**
  * @brief sys_getcwd, used to store the name of the current directory
  * 
@@ -611,3 +604,325 @@ int sys_getcwd(const char *buf, size_t buflen, int *retval) {
   return 0;
 }
 #endif
+
+/**
+ * @brief sys_pipe, used to create a pipe
+ * 
+ * @param fds user array of two ints, receiving the read end and the write end
+ * @param retval unused, the return value is 0
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_pipe(userptr_t fds, int *retval) {
+  struct vnode *readvn, *writevn;
+  struct openfile *rof, *wof;
+  int kfds[2];
+  int i, fd, err;
+
+  /* making the pipe */
+  err = pipe_create(&readvn, &writevn);
+  if (err) {
+    return err;
+  }
+
+  /* getting an open file object for each end */
+  rof = kmem_cache_alloc(openfile_cache);
+  wof = kmem_cache_alloc(openfile_cache);
+  if (rof == NULL || wof == NULL) {
+    err = ENOMEM;
+    goto fail;
+  }
+  rof->vn = readvn;
+  rof->offset = 0;
+  rof->mode = O_RDONLY;
+  rof->countRef = 1;
+  wof->vn = writevn;
+  wof->offset = 0;
+  wof->mode = O_WRONLY;
+  wof->countRef = 1;
+
+  /* finding two available slots in the current process file table */
+  i = 0;
+  for (fd=STDERR_FILENO+1; fd<OPEN_MAX && i<2; fd++) {
+    if (curproc->fileTable[fd] == NULL) {
+      kfds[i++] = fd;
+    }
+  }
+  if (i < 2) {
+    err = EMFILE;
+    goto fail;
+  }
+
+  /* handing the descriptors back before installing them, so nothing needs undoing */
+  err = copyout(kfds, fds, sizeof(kfds));
+  if (err) {
+    goto fail;
+  }
+  curproc->fileTable[kfds[0]] = rof;
+  curproc->fileTable[kfds[1]] = wof;
+
+  *retval = 0;
+  return 0;
+
+fail:
+  if (rof != NULL) {
+    rof->vn = NULL;
+    kmem_cache_free(openfile_cache, rof);
+  }
+  if (wof != NULL) {
+    wof->vn = NULL;
+    kmem_cache_free(openfile_cache, wof);
+  }
+  vfs_close(readvn);
+  vfs_close(writevn);
+  return err;
+}
+#endif
+
+/**
+ * @brief getfile, used to look up a file descriptor for reading or writing
+ * 
+ * @param fd the file descriptor
+ * @param rw UIO_READ or UIO_WRITE, the access needed
+ * @param ret used to return the open file
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+static int getfile(int fd, enum uio_rw rw, struct openfile **ret) {
+  struct openfile *of;
+
+  /* checking if fd is valid and is on the fileTable */
+  if (fd < 0 || fd >= OPEN_MAX) {
+    return EBADF;
+  }
+  of = curproc->fileTable[fd];
+  if (of == NULL || of->vn == NULL) {
+    return EBADF;
+  }
+  /* checking if the file is open in a correct mode */
+  if (rw == UIO_READ && of->mode != O_RDONLY && of->mode != O_RDWR) {
+    return EBADF;
+  }
+  if (rw == UIO_WRITE && of->mode != O_WRONLY && of->mode != O_RDWR) {
+    return EBADF;
+  }
+
+  *ret = of;
+  return 0;
+}
+#endif
+
+/**
+ * @brief file_prw, used to read or write at a given position (pread and pwrite)
+ * 
+ * @param fd specifying the file descriptor
+ * @param buf the user buffer
+ * @param size used to specify the number of bytes to transfer
+ * @param pos the position in the file, the seek pointer is not used nor changed
+ * @param rw UIO_READ or UIO_WRITE
+ * @param retval used to return the number of bytes transferred
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+static int file_prw(int fd, userptr_t buf, size_t size, off_t pos,
+                    enum uio_rw rw, int *retval) {
+  struct iovec iov;
+  struct uio u;
+  struct openfile *of;
+  int err;
+
+  err = getfile(fd, rw, &of);
+  if (err) {
+    return err;
+  }
+  /* a position only means something for files that can seek */
+  if (!VOP_ISSEEKABLE(of->vn)) {
+    return ESPIPE;
+  }
+  if (pos < 0) {
+    return EINVAL;
+  }
+
+  /*
+   * no of->lock here: the shared offset is neither read nor updated,
+   * so concurrent pread/pwrite on the same open file do not wait for
+   * each other (the file system does its own locking)
+   */
+  uio_uinit(&iov, &u, buf, size, pos, rw);
+  if (rw == UIO_READ) {
+    err = VOP_READ(of->vn, &u);
+  } else {
+    err = VOP_WRITE(of->vn, &u);
+  }
+  if (err) {
+    return err;
+  }
+
+  *retval = size - u.uio_resid;
+  return 0;
+}
+#endif
+
+/**
+ * @brief sys_pread, used to read bytes from a given position of a file
+ * 
+ * @param fd used to specify the file to read
+ * @param buf the user buffer
+ * @param size used to specify the number of bytes to be read
+ * @param pos the position to read from
+ * @param retval used to return the number of read bytes
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval) {
+  return file_prw(fd, buf, size, pos, UIO_READ, retval);
+}
+#endif
+
+/**
+ * @brief sys_pwrite, used to write bytes at a given position of a file
+ * 
+ * @param fd used to specify the file to write in
+ * @param buf containing data
+ * @param size used to specify the number of bytes to be written
+ * @param pos the position to write at
+ * @param retval used to return the number of written bytes
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval) {
+  return file_prw(fd, buf, size, pos, UIO_WRITE, retval);
+}
+#endif
+
+/* iovec arrays up to this long are copied in on the stack */
+#define SMALL_IOVCNT 8
+/* the most readv/writev move at once, so that the count fits in the int returned */
+#define MAX_IOVTOTAL ((size_t)0x7fffffff)
+
+/**
+ * @brief file_rwv, used to read or write several buffers at once (readv and writev)
+ * 
+ * @param fd specifying the file descriptor
+ * @param uiov user array of iovecs describing the buffers
+ * @param iovcnt the number of iovecs
+ * @param rw UIO_READ or UIO_WRITE
+ * @param retval used to return the number of bytes transferred
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+static int file_rwv(int fd, userptr_t uiov, int iovcnt, enum uio_rw rw,
+                    int *retval) {
+  struct iovec smalliov[SMALL_IOVCNT];
+  struct iovec *iov;
+  struct uio u;
+  struct openfile *of;
+  size_t total;
+  bool seekable;
+  int i, err;
+
+  err = getfile(fd, rw, &of);
+  if (err) {
+    return err;
+  }
+  if (iovcnt < 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  if (iovcnt == 0) {
+    *retval = 0;
+    return 0;
+  }
+
+  /* copying in the iovecs (the user's iov_base is our iov_ubase) */
+  if (iovcnt <= SMALL_IOVCNT) {
+    iov = smalliov;
+  } else {
+    iov = kmalloc(iovcnt * sizeof(struct iovec));
+    if (iov == NULL) {
+      return ENOMEM;
+    }
+  }
+  err = copyin((const_userptr_t) uiov, iov, iovcnt * sizeof(struct iovec));
+  if (err) {
+    goto done;
+  }
+
+  /* adding up the lengths */
+  total = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > MAX_IOVTOTAL - total) {
+      err = EINVAL;
+      goto done;
+    }
+    total += iov[i].iov_len;
+  }
+
+  /* the offset lock, as in sys_read and sys_write */
+  seekable = VOP_ISSEEKABLE(of->vn);
+  if (seekable) {
+    lock_acquire(of->lock);
+  }
+
+  /* one uio over all the buffers, moved in a single VOP_READ/VOP_WRITE */
+  uio_uvinit(iov, iovcnt, &u, seekable ? of->offset : 0, rw);
+  if (rw == UIO_READ) {
+    err = VOP_READ(of->vn, &u);
+  } else {
+    err = VOP_WRITE(of->vn, &u);
+  }
+  if (!err) {
+    if (seekable) {
+      of->offset = u.uio_offset;
+    }
+    *retval = total - u.uio_resid;
+  }
+
+  if (seekable) {
+    lock_release(of->lock);
+  }
+
+done:
+  if (iov != smalliov) {
+    kfree(iov);
+  }
+  return err;
+}
+#endif
+
+/**
+ * @brief sys_readv, used to read bytes from a file into several buffers
+ * 
+ * @param fd used to specify the file to read
+ * @param iov user array of iovecs describing the buffers, filled in order
+ * @param iovcnt the number of iovecs
+ * @param retval used to return the number of read bytes
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_readv(int fd, userptr_t iov, int iovcnt, int *retval) {
+  return file_rwv(fd, iov, iovcnt, UIO_READ, retval);
+}
+#endif
+
+/**
+ * @brief sys_writev, used to write bytes from several buffers into a file
+ * 
+ * @param fd used to specify the file to write in
+ * @param iov user array of iovecs describing the buffers, written in order
+ * @param iovcnt the number of iovecs
+ * @param retval used to return the number of written bytes
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_writev(int fd, userptr_t iov, int iovcnt, int *retval) {
+  return file_rwv(fd, iov, iovcnt, UIO_WRITE, retval);
+}
+#endif
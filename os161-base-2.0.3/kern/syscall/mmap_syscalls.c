@@ -0,0 +1,120 @@
+/*
+ * Implementation of the memory mapping system calls.
+ * The mappings themselves are regions of the address space; see
+ * vm/addrspace.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <syscall.h>
+#include <current.h>
+#include <lib.h>
+#include <limits.h>
+#include <vnode.h>
+#include <proc.h>
+#include <addrspace.h>
+
+/**
+ * @brief sys_mmap, used to map a file, or zero-filled memory, into the address space
+ * 
+ * @param addr where to put the mapping; only used with MAP_FIXED
+ * @param len specifying the number of bytes to map
+ * @param prot specifying the PROT_* permissions of the pages
+ * @param flags specifying MAP_PRIVATE, plus MAP_FIXED and MAP_ANON
+ * @param fd used to specify the file to map (ignored with MAP_ANON)
+ * @param offset specifying where in the file the mapping starts
+ * @param retval used to return the address of the mapping
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval) {
+  struct openfile *of;
+  struct vnode *vn = NULL;
+  vaddr_t vaddr;
+  int rgflags, err;
+
+  /*
+   * MAP_PRIVATE is required: there is no page cache for the mappers
+   * of a file to share frames through, so MAP_SHARED isn't supported
+   */
+  if ((flags & MAP_SHARED) || !(flags & MAP_PRIVATE)) {
+    return EINVAL;
+  }
+  if (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) {
+    return EINVAL;
+  }
+
+  /*
+   * translating the protections into region flags; the
+   * MIPS TLB can't make a page writeable or executable but not
+   * readable, so those imply PROT_READ (as POSIX allows), and only
+   * PROT_NONE leaves the pages inaccessible
+   */
+  rgflags = 0;
+  if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) {
+    rgflags |= RG_READ;
+  }
+  if (prot & PROT_WRITE) {
+    rgflags |= RG_WRITE;
+  }
+  if (prot & PROT_EXEC) {
+    rgflags |= RG_EXEC;
+  }
+
+  if (!(flags & MAP_ANON)) {
+    /* checking if fd is valid */
+    if (fd < 0 || fd >= OPEN_MAX) {
+      return EBADF;
+    }
+    of = curproc->fileTable[fd];
+    if (of == NULL || of->vn == NULL) {
+      return EBADF;
+    }
+    /* the pages are read from the file */
+    if (of->mode == O_WRONLY) {
+      return EACCES;
+    }
+    vn = of->vn;
+
+    /* checking if the object is one that can be mapped */
+    err = VOP_MMAP(vn);
+    if (err) {
+      return err;
+    }
+  }
+
+  /* without MAP_FIXED, the address is only a hint, and we don't take it */
+  vaddr = (flags & MAP_FIXED) ? (vaddr_t)addr : 0;
+  if ((flags & MAP_FIXED) && vaddr == 0) {
+    return EINVAL;
+  }
+
+  err = as_map(proc_getas(), vn, offset, len, rgflags, &vaddr);
+  if (err) {
+    return err;
+  }
+
+  *retval = (int)vaddr;
+
+  return 0;
+}
+#endif
+
+/**
+ * @brief sys_munmap, used to remove the mappings of a range of pages
+ * 
+ * @param addr specifying the first page (must be page aligned)
+ * @param len specifying the number of bytes to unmap
+ * 
+ * @return an error in case of failure or 0 in case of success
+ */
+#if OPT_SHELL
+int sys_munmap(userptr_t addr, size_t len) {
+
+  return as_unmap(proc_getas(), (vaddr_t)addr, len);
+}
+#endif
@@ -12,6 +12,8 @@
 #include <current.h>
 #include <synch.h>
 #include <kern/wait.h>
+#include <kmem.h>
+#include <vfs.h>
 #include "exec.h"
 
 
@@ -24,12 +26,34 @@
 #if OPT_SHELL
 void sys__exit(int status) {
     struct proc *proc = curproc;
+    struct addrspace *as;
+    int fd;
+
     proc->p_status = _MKWAIT_EXIT(status);    /* exitcode & 0xff */
 
-    /* removing thread from current process */
-    proc_remthread(curthread);
+    /*
+     * releasing now what the process will not need as a zombie, so
+     * that many of them can wait for waitpid without holding on to
+     * their files and memory
+     */
+    for (fd = 0; fd < OPEN_MAX; fd++) {
+        if (proc->fileTable[fd] != NULL) {
+            sys_close(fd);
+        }
+    }
+    as = proc_setas(NULL);
+    as_deactivate();
+    if (as != NULL) {
+        as_destroy(as);
+    }
 
+    /*
+     * removing thread from current process, under p_locklock: waitpid
+     * checks p_numthreads holding it, and may destroy the proc as soon
+     * as it sees 0, so the proc must not be touched after the release
+     */
     lock_acquire(proc->p_locklock);
+    proc_remthread(curthread);
     cv_signal(proc->p_cv, proc->p_locklock);
     lock_release(proc->p_locklock);
 
@@ -107,17 +131,15 @@ int sys_waitpid(pid_t pid, int *status, int options, int *retval) {
         return ESRCH;
     }
 
-    /* setting the return values */
-    if (proc->p_numthreads == 0) {
-        *status = proc->p_status;
-        *retval = proc->p_pid;
-        proc_destroy(proc);
-        return 0;
-    }
-
-    /* waiting the termination of the process */
+    /* 
+     * waiting the termination of the process; p_numthreads is checked
+     * under p_locklock, which the child takes to signal after leaving,
+     * so the wakeup cannot be missed
+     */
     lock_acquire(proc->p_locklock);
-    cv_wait(proc->p_cv, proc->p_locklock);
+    while (proc->p_numthreads != 0) {
+        cv_wait(proc->p_cv, proc->p_locklock);
+    }
     lock_release(proc->p_locklock);
 
     /* setting the return values */
@@ -133,6 +155,76 @@ int sys_waitpid(pid_t pid, int *status, int options, int *retval) {
 #endif
 
 
+/**
+ * @brief drop_file, used to give up a process's reference to an open file
+ * 
+ * @param of the open file
+ * 
+ * @return doesn't have return parameter
+ */
+#if OPT_SHELL
+static void drop_file(struct openfile *of) {
+    lock_acquire(of->lock);
+    if (--of->countRef == 0) {
+        vfs_close(of->vn);
+        of->vn = NULL;
+        lock_release(of->lock);
+        kmem_cache_free(openfile_cache, of);
+    } else {
+        lock_release(of->lock);
+    }
+}
+#endif
+
+/**
+ * @brief inherit_files, used to give the child of a fork the father's open files
+ * 
+ * @param father the process calling fork
+ * @param child the new process
+ * 
+ * @return doesn't have return parameter
+ */
+#if OPT_SHELL
+static void inherit_files(struct proc *father, struct proc *child) {
+    struct openfile *of;
+    int fd;
+
+    for (fd = 0; fd < OPEN_MAX; fd++) {
+        /* the child starts out with no open files (see proc_create_fork) */
+        KASSERT(child->fileTable[fd] == NULL);
+
+        /* sharing the same open file (and seek pointer) as the father */
+        of = father->fileTable[fd];
+        if (of != NULL) {
+            lock_acquire(of->lock);
+            of->countRef++;
+            lock_release(of->lock);
+            child->fileTable[fd] = of;
+        }
+    }
+}
+#endif
+
+/**
+ * @brief drop_files, used to close all the open files of a process that never ran
+ * 
+ * @param proc the process
+ * 
+ * @return doesn't have return parameter
+ */
+#if OPT_SHELL
+static void drop_files(struct proc *proc) {
+    int fd;
+
+    for (fd = 0; fd < OPEN_MAX; fd++) {
+        if (proc->fileTable[fd] != NULL) {
+            drop_file(proc->fileTable[fd]);
+            proc->fileTable[fd] = NULL;
+        }
+    }
+}
+#endif
+
 /**
  * @brief sys_fork, used to create a new process, from the existing ones
  * 
@@ -145,28 +237,27 @@ int sys_waitpid(pid_t pid, int *status, int options, int *retval) {
 int sys_fork(struct trapframe *ctf, pid_t *retval) {
     KASSERT(curproc != NULL);
 
-    /* getting a new valid pid */
-    int i = get_valid_pid();
-    if (i <= 0) {
-        return ENPROC;
-    }
-
-    /* creating a new process */
-    struct proc *newproc = proc_create_runprogram(curproc->p_name);
+    /* creating a new process (this also gives it its pid) */
+    struct proc *newproc = proc_create_fork(curproc->p_name);
     if (newproc == NULL) {
-        return ENOMEM;
+        return ENPROC;
     }
 
-    /* copying the address space into new process */
+    /* copying the address space into new process (pages are shared copy-on-write) */
     int err = as_copy(curproc->p_addrspace, &(newproc->p_addrspace));
     if (err) {
+        drop_files(newproc);
         proc_destroy(newproc);
         return err;
     }
 
-    /* moving the parent's trapframe */
-    struct trapframe *tf_child = (struct trapframe *) kmalloc(sizeof(struct trapframe));
+    /* the child shares the father's open files (pipes included) */
+    inherit_files(curproc, newproc);
+
+    /* moving the parent's trapframe (the child frees the copy once it is on its stack) */
+    struct trapframe *tf_child = kmem_cache_alloc(trapframe_cache);
     if(tf_child == NULL){
+        drop_files(newproc);
         proc_destroy(newproc);
         return ENOMEM; 
     }
@@ -174,20 +265,8 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
 
     struct proc *father=curproc;
 
-    /* adding the new process created to the father (the current process)*/
-    if(add_new_child(father, newproc->p_pid)==-1){
-        proc_destroy(newproc);
-        return ENOMEM; 
-    }
-
-    /* linking the child to the father */
-    newproc->father_pid=father->p_pid;
-
-    /* adding the new process into the process table */
-    err = add_newp((pid_t) i, newproc);
-    if (err == -1) {
-        return ENOMEM;
-    }
+    /* linking the new process to the father (the current process) */
+    add_new_child(father, newproc);
 
     /* calling the thread_fork */
     err = thread_fork(
@@ -199,8 +278,9 @@ int sys_fork(struct trapframe *ctf, pid_t *retval) {
     );
 
     if (err) {
+        drop_files(newproc);
         proc_destroy(newproc);
-        kfree(tf_child);
+        kmem_cache_free(trapframe_cache, tf_child);
         return err;
     }
 
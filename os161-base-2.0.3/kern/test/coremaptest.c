@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test code for the physical page allocator (alloc_kpages/free_kpages).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <vm.h>
+#include <test.h>
+
+#include "opt-dumbvm.h"
+
+#if !OPT_DUMBVM
+#include <coremap.h>
+#endif
+
+#define CM_NTHREADS	8
+#define CM_NTRIES	2000
+#define CM_NLIVE	4
+
+/* Block sizes used by cm1, in pages; mostly single pages. */
+#define CM_NSIZES	8
+static const unsigned cm_sizes[CM_NSIZES] = { 1, 1, 2, 1, 3, 1, 1, 5 };
+
+/*
+ * Fill a block with a pattern unique to the thread and try.
+ */
+static
+void
+cm_fill(vaddr_t va, unsigned npages, unsigned long num, unsigned try)
+{
+	uint32_t *p = (uint32_t *)va;
+	unsigned i, n;
+
+	n = npages * PAGE_SIZE / sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		p[i] = (num << 24) ^ (try << 8) ^ i;
+	}
+}
+
+/*
+ * Check the pattern written by cm_fill.
+ */
+static
+void
+cm_check(vaddr_t va, unsigned npages, unsigned long num, unsigned try)
+{
+	uint32_t *p = (uint32_t *)va;
+	unsigned i, n;
+
+	n = npages * PAGE_SIZE / sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		if (p[i] != ((num << 24) ^ (try << 8) ^ i)) {
+			panic("coremaptest: thread %lu: block 0x%x (%u pages) "
+			      "from try %u corrupted at word %u\n",
+			      num, va, npages, try, i);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// cm1
+
+/*
+ * Allocate blocks of various sizes, keeping CM_NLIVE of them at a
+ * time, and check that nobody else scribbled on them before freeing.
+ */
+static
+void
+coremaptestthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	vaddr_t blocks[CM_NLIVE];
+	unsigned npages[CM_NLIVE], tries[CM_NLIVE];
+	unsigned i, slot, failures = 0;
+
+	for (i=0; i<CM_NLIVE; i++) {
+		blocks[i] = 0;
+	}
+
+	for (i=0; i<CM_NTRIES; i++) {
+		slot = i % CM_NLIVE;
+		if (blocks[slot] != 0) {
+			cm_check(blocks[slot], npages[slot], num, tries[slot]);
+			free_kpages(blocks[slot]);
+			blocks[slot] = 0;
+		}
+		npages[slot] = cm_sizes[(i + num) % CM_NSIZES];
+		tries[slot] = i;
+		blocks[slot] = alloc_kpages(npages[slot]);
+		if (blocks[slot] == 0) {
+			failures++;
+			continue;
+		}
+		cm_fill(blocks[slot], npages[slot], num, i);
+	}
+
+	for (i=0; i<CM_NLIVE; i++) {
+		if (blocks[i] != 0) {
+			cm_check(blocks[i], npages[i], num, tries[i]);
+			free_kpages(blocks[i]);
+		}
+	}
+
+	if (failures > 0) {
+		kprintf("coremaptest: thread %lu: %u allocations failed\n",
+			num, failures);
+	}
+	V(sem);
+}
+
+int
+coremaptest(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator stress test...\n");
+#if OPT_DUMBVM
+	kprintf("(This test will not work with dumbvm)\n");
+#endif
+
+	sem = sem_create("coremaptest", 0);
+	if (sem == NULL) {
+		panic("coremaptest: sem_create failed\n");
+	}
+
+	for (i=0; i<CM_NTHREADS; i++) {
+		result = thread_fork("coremaptest", NULL,
+				     coremaptestthread, sem, i);
+		if (result) {
+			panic("coremaptest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<CM_NTHREADS; i++) {
+		P(sem);
+	}
+
+	sem_destroy(sem);
+#if !OPT_DUMBVM
+	coremap_printstats();
+#endif
+	kprintf("Page allocator stress test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// cm2
+
+/*
+ * Use up all of memory a page at a time, give it all back, and check
+ * that the pieces merged: the biggest block we could get before must
+ * be available again afterwards.
+ */
+int
+coremaptest2(int nargs, char **args)
+{
+	vaddr_t *pages, va;
+	unsigned maxpages, npages, bigblock, i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator exhaustion test...\n");
+#if OPT_DUMBVM
+	kprintf("(This test will not work with dumbvm)\n");
+#endif
+
+	/* Find the biggest power-of-two block we can get right now. */
+	for (bigblock = 1; bigblock < 1024; bigblock *= 2) {
+		va = alloc_kpages(bigblock * 2);
+		if (va == 0) {
+			break;
+		}
+		free_kpages(va);
+	}
+	kprintf("coremaptest2: largest block: %u pages\n", bigblock);
+
+	/* One page holds the list of pages we allocate. */
+	pages = (vaddr_t *)alloc_kpages(1);
+	if (pages == NULL) {
+		panic("coremaptest2: out of memory already\n");
+	}
+	maxpages = PAGE_SIZE / sizeof(vaddr_t);
+
+	npages = 0;
+	while (npages < maxpages) {
+		va = alloc_kpages(1);
+		if (va == 0) {
+			break;
+		}
+		cm_fill(va, 1, 0, npages);
+		pages[npages++] = va;
+	}
+	kprintf("coremaptest2: allocated %u single pages%s\n", npages,
+		npages == maxpages ? " (stopped at the limit)" : "");
+
+	for (i=0; i<npages; i++) {
+		cm_check(pages[i], 1, 0, i);
+		free_kpages(pages[i]);
+	}
+	free_kpages((vaddr_t)pages);
+
+	va = alloc_kpages(bigblock);
+	if (va == 0) {
+		panic("coremaptest2: can't get a %u-page block back; "
+		      "free pages did not merge\n", bigblock);
+	}
+	free_kpages(va);
+
+#if !OPT_DUMBVM
+	coremap_printstats();
+#endif
+	kprintf("coremaptest2: passed\n");
+	return 0;
+}
@@ -33,6 +33,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -58,6 +60,32 @@
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+/*
+ * Print the throughput of a test that did OPS kmalloc and kfree calls
+ * since START, so the allocator can be compared across CPU counts.
+ */
+static
+void
+kmalloc_throughput(const char *name, unsigned ops,
+		   const struct timespec *start)
+{
+	struct timespec end;
+	uint64_t nsecs;
+
+	gettime(&end);
+	timespec_sub(&end, start, &end);
+	nsecs = end.tv_sec * 1000000000ULL + end.tv_nsec;
+
+	kprintf("%s: %u ops on %u cpus in %llu.%09lu seconds",
+		name, ops, cpu_count(), (unsigned long long)end.tv_sec,
+		(unsigned long)end.tv_nsec);
+	if (nsecs > 0) {
+		kprintf(" (%llu ops/sec)",
+			(unsigned long long)(ops * 1000000000ULL / nsecs));
+	}
+	kprintf("\n");
+}
+
 static
 void
 kmallocthread(void *sm, unsigned long num)
@@ -114,6 +142,7 @@ int
 kmallocstress(int nargs, char **args)
 {
 	struct semaphore *sem;
+	struct timespec start;
 	int i, result;
 
 	(void)nargs;
@@ -125,6 +154,7 @@ kmallocstress(int nargs, char **args)
 	}
 
 	kprintf("Starting kmalloc stress test...\n");
+	gettime(&start);
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("kmallocstress", NULL,
@@ -139,6 +169,7 @@ kmallocstress(int nargs, char **args)
 		P(sem);
 	}
 
+	kmalloc_throughput("kmallocstress", 2 * NTRIES * NTHREADS, &start);
 	sem_destroy(sem);
 	kprintf("kmalloc stress test done\n");
 
@@ -183,6 +214,7 @@ kmalloctest3(int nargs, char **args)
 	size_t totalsize;
 	unsigned i, j;
 	unsigned char *ptr;
+	struct timespec start;
 
 	if (nargs != 2) {
 		kprintf("kmalloctest3: usage: km3 numobjects\n");
@@ -214,6 +246,7 @@ kmalloctest3(int nargs, char **args)
 	}
 
 	/* Allocate the objects. */
+	gettime(&start);
 	curblock = 0;
 	curpos = 0;
 	cursizeindex = 0;
@@ -279,6 +312,7 @@ kmalloctest3(int nargs, char **args)
 		cursizeindex = (cursizeindex + 1) % NUM_KM3_SIZES;
 	}
 	KASSERT(totalsize == 0);
+	kmalloc_throughput("kmalloctest3", 2 * numptrs, &start);
 
 	/* Free the lower tier. */
 	for (i=0; i<numptrblocks; i++) {
@@ -341,6 +375,7 @@ int
 kmalloctest4(int nargs, char **args)
 {
 	struct semaphore *sem;
+	struct timespec start;
 	unsigned nthreads;
 	unsigned i;
 	int result;
@@ -361,6 +396,7 @@ kmalloctest4(int nargs, char **args)
 	/* use 6 instead of 8 threads */
 	nthreads = (3*NTHREADS)/4;
 
+	gettime(&start);
 	for (i=0; i<nthreads; i++) {
 		result = thread_fork("kmalloctest4", NULL,
 				     kmalloctest4thread, sem, i);
@@ -374,6 +410,7 @@ kmalloctest4(int nargs, char **args)
 		P(sem);
 	}
 
+	kmalloc_throughput("kmalloctest4", 2 * NTRIES * nthreads, &start);
 	sem_destroy(sem);
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
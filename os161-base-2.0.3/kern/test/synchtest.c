@@ -32,10 +32,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
 #include <synch.h>
+#include <proc.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <limits.h>
 #include <test.h>
 
 #define NSEMLOOPS     63
@@ -220,6 +225,303 @@ locktest(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Lock throughput benchmark. NTHREADS threads (default LOCKBENCH_THREADS)
+ * each acquire and release one lock LOCKBENCH_LOOPS times around a
+ * critical section a few instructions long, like the offset updates
+ * in the file table. Prints the acquire/release pairs per second, and
+ * how many of the acquires that found the lock held got it by spinning
+ * rather than sleeping.
+ */
+
+#define LOCKBENCH_THREADS 8
+#define LOCKBENCH_LOOPS   20000
+
+static struct lock *benchlock;
+static volatile unsigned long benchcount;
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<LOCKBENCH_LOOPS; i++) {
+		lock_acquire(benchlock);
+		benchcount++;
+		lock_release(benchlock);
+	}
+	V(donesem);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	struct timespec before, after;
+	unsigned long nthreads, i;
+	uint64_t nsecs;
+	int result;
+
+	nthreads = LOCKBENCH_THREADS;
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2 || nthreads == 0) {
+		kprintf("Usage: sy5 [threads]\n");
+		return EINVAL;
+	}
+
+	inititems();
+	if (benchlock == NULL) {
+		benchlock = lock_create("lockbench");
+		if (benchlock == NULL) {
+			panic("lockbench: lock_create failed\n");
+		}
+	}
+	benchcount = 0;
+#if OPT_SHELL
+	benchlock->lk_acquires = 0;
+	benchlock->lk_contended = 0;
+	benchlock->lk_spun = 0;
+	benchlock->lk_waitnsecs = 0;
+#endif
+
+	kprintf("Starting lock throughput test with %lu threads...\n",
+		nthreads);
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("lockbench", NULL, lockbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	if (benchcount != nthreads * LOCKBENCH_LOOPS) {
+		kprintf("lockbench: count is %lu, expected %lu\n",
+			benchcount, nthreads * LOCKBENCH_LOOPS);
+		kprintf("Lock throughput test failed\n");
+		return EIO;
+	}
+
+	nsecs = (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+	kprintf("%lu acquire/release pairs in %llu.%09lu seconds",
+		benchcount, (unsigned long long)after.tv_sec,
+		(unsigned long)after.tv_nsec);
+	if (nsecs > 0) {
+		kprintf(", %llu per second",
+			(unsigned long long)benchcount * 1000000000ULL / nsecs);
+	}
+	kprintf("\n");
+#if OPT_SHELL
+	/* The counts are only updated by the owner, which is nobody now. */
+	kprintf("%u found the lock held, %u of them got it by spinning\n",
+		benchlock->lk_contended, benchlock->lk_spun);
+#endif
+	kprintf("Lock throughput test done.\n");
+
+	return 0;
+}
+
+/*
+ * Reader-writer lock test. Readers check that no writer is inside
+ * while they are; writers check that nobody at all is. Each thread
+ * with an odd number is a writer.
+ */
+
+#define RWTEST_LOOPS 200
+
+static struct rwlock *testrwlock;
+static volatile unsigned long rwreaders;
+static volatile unsigned long rwwriters;
+static volatile bool rwfailed;
+static struct spinlock rwtest_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i, j;
+
+	(void)junk;
+
+	for (i=0; i<RWTEST_LOOPS; i++) {
+		if (num % 2) {
+			rwlock_acquire_write(testrwlock);
+			rwwriters++;
+			for (j=0; j<3; j++) {
+				thread_yield();
+				if (rwwriters != 1 || rwreaders != 0) {
+					rwfailed = true;
+				}
+			}
+			rwwriters--;
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			spinlock_acquire(&rwtest_lock);
+			rwreaders++;
+			spinlock_release(&rwtest_lock);
+			for (j=0; j<3; j++) {
+				thread_yield();
+				if (rwwriters != 0) {
+					rwfailed = true;
+				}
+			}
+			spinlock_acquire(&rwtest_lock);
+			rwreaders--;
+			spinlock_release(&rwtest_lock);
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwlocktest(int nargs, char **args)
+{
+	unsigned long i;
+	int result;
+
+	(void)nargs; (void)args;
+
+	inititems();
+	if (testrwlock == NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("rwlocktest: rwlock_create failed\n");
+		}
+	}
+	rwreaders = rwwriters = 0;
+	rwfailed = false;
+
+	kprintf("Starting rwlock test...\n");
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwlocktest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	if (rwfailed) {
+		kprintf("Rwlock test failed\n");
+		return EIO;
+	}
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
+
+/*
+ * Parallel lookup benchmark. NTHREADS threads (default LOCKBENCH_THREADS)
+ * resolve a device path through vfs_lookup and, with the shell
+ * configured, look their process up in the process table, over and
+ * over. Both paths only take reader locks, so the rate should scale
+ * with the number of cpus instead of flattening out.
+ */
+
+#define LOOKUPBENCH_LOOPS 2000
+#define LOOKUPBENCH_PATH  "con:"
+
+static volatile unsigned long lookupcount;
+
+static
+void
+lookupbenchthread(void *junk, unsigned long num)
+{
+	char path[16];
+	struct vnode *vn;
+	unsigned long done = 0;
+	int i, result;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<LOOKUPBENCH_LOOPS; i++) {
+		/* vfs_lookup may scribble on the path */
+		strcpy(path, LOOKUPBENCH_PATH);
+		result = vfs_lookup(path, &vn);
+		if (result == 0) {
+			VOP_DECREF(vn);
+			done++;
+		}
+#if OPT_SHELL
+		/* hit or miss, the probe takes the table lock for reading */
+		(void)proc_search_pid(PID_MIN + i % 64);
+		done++;
+#endif
+	}
+
+	spinlock_acquire(&rwtest_lock);
+	lookupcount += done;
+	spinlock_release(&rwtest_lock);
+	V(donesem);
+}
+
+int
+lookupbench(int nargs, char **args)
+{
+	struct timespec before, after;
+	unsigned long nthreads, i;
+	uint64_t nsecs;
+	int result;
+
+	nthreads = LOCKBENCH_THREADS;
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2 || nthreads == 0) {
+		kprintf("Usage: sy7 [threads]\n");
+		return EINVAL;
+	}
+
+	inititems();
+	lookupcount = 0;
+
+	kprintf("Starting parallel lookup test with %lu threads...\n",
+		nthreads);
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("lookupbench", NULL, lookupbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("lookupbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+
+	nsecs = (uint64_t)after.tv_sec * 1000000000 + after.tv_nsec;
+	kprintf("%lu lookups in %llu.%09lu seconds",
+		lookupcount, (unsigned long long)after.tv_sec,
+		(unsigned long)after.tv_nsec);
+	if (nsecs > 0) {
+		kprintf(", %llu per second",
+			(unsigned long long)lookupcount * 1000000000ULL / nsecs);
+	}
+	kprintf("\n");
+	kprintf("Parallel lookup test done.\n");
+
+	return 0;
+}
+
 static
 void
 cvtestthread(void *junk, unsigned long num)
@@ -35,7 +35,9 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <clock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -138,6 +140,25 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_LOCKSTATS
+/*
+ * All the locks in the system, so lock_printstats can find them.
+ */
+static struct spinlock lock_list_lock = SPINLOCK_INITIALIZER;
+static struct lock *lock_list;
+#endif
+
+#if OPT_SHELL
+
+/*
+ * How many times to check the owner in one go while spinning on a
+ * lock, before looking again whether it's worth it. Spinning also
+ * stops after this many checks in total, in case the owner is in for
+ * a long stay.
+ */
+#define LOCK_SPIN_MAX 1000
+#endif
+
 struct lock *
 lock_create(const char *name)
 {
@@ -170,6 +191,21 @@ lock_create(const char *name)
 	}
 	lock->lk_owner = NULL;
 	spinlock_init(&lock->lk_spinlock);
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_spun = 0;
+	lock->lk_waitnsecs = 0;
+
+#if OPT_LOCKSTATS
+	spinlock_acquire(&lock_list_lock);
+	lock->lk_prev = NULL;
+	lock->lk_next = lock_list;
+	if (lock_list != NULL) {
+		lock_list->lk_prev = lock;
+	}
+	lock_list = lock;
+	spinlock_release(&lock_list_lock);
+#endif
 #endif	
         return lock;
 }
@@ -181,6 +217,20 @@ lock_destroy(struct lock *lock)
 
         // add stuff here as needed
 #if OPT_SHELL
+#if OPT_LOCKSTATS
+	spinlock_acquire(&lock_list_lock);
+	if (lock->lk_prev != NULL) {
+		lock->lk_prev->lk_next = lock->lk_next;
+	}
+	else {
+		lock_list = lock->lk_next;
+	}
+	if (lock->lk_next != NULL) {
+		lock->lk_next->lk_prev = lock->lk_prev;
+	}
+	spinlock_release(&lock_list_lock);
+#endif
+
 	spinlock_cleanup(&lock->lk_spinlock);
 #if USE_SEMAPHORE_FOR_LOCK
         sem_destroy(lock->lk_sem);
@@ -222,11 +272,28 @@ lock_acquire(struct lock *lock)
         (void)lock;  // suppress warning until code gets written
 }
 */
+/*
+ * With the wait channel implementation, locks are adaptive. A thread
+ * that finds the lock held spins as long as the owner is running on
+ * another cpu, since then it is likely to let go within a few
+ * instructions and a trip through thread_switch would cost far more.
+ * If the owner is not running (it is asleep or waiting for a cpu), or
+ * has held on for LOCK_SPIN_MAX checks, the thread sleeps instead.
+ *
+ * The owner's state is only looked at under lk_spinlock: while it
+ * holds the lock the owner cannot go away.
+ */
 void
 lock_acquire(struct lock *lock)
 {
         // Write this
 #if OPT_SHELL
+#if !USE_SEMAPHORE_FOR_LOCK
+	struct thread *owner;
+	struct timespec before, after;
+	unsigned spins;
+	bool contended, slept;
+#endif
         KASSERT(lock != NULL);
 	if (lock_do_i_hold(lock)) {
 	  kprintf("AAACKK!\n");
@@ -247,13 +314,48 @@ lock_acquire(struct lock *lock)
 	spinlock_acquire(&lock->lk_spinlock);        
 #else
 	spinlock_acquire(&lock->lk_spinlock);        
-	while (lock->lk_owner != NULL) {
-	  wchan_sleep(lock->lk_wchan, &lock->lk_spinlock);
+	spins = 0;
+	slept = false;
+	contended = lock->lk_owner != NULL;
+	if (contended) {
+		spinlock_release(&lock->lk_spinlock);
+		gettime(&before);
+		spinlock_acquire(&lock->lk_spinlock);
+	}
+	while ((owner = lock->lk_owner) != NULL) {
+		if (spins < LOCK_SPIN_MAX && owner->t_state == S_RUN
+		    && owner->t_cpu != curcpu->c_self) {
+			spinlock_release(&lock->lk_spinlock);
+			/* lk_owner is volatile, so this reads it every time */
+			while (lock->lk_owner == owner
+			       && spins < LOCK_SPIN_MAX) {
+				spins++;
+			}
+			spinlock_acquire(&lock->lk_spinlock);
+		}
+		else {
+			wchan_sleep(lock->lk_wchan, &lock->lk_spinlock);
+			slept = true;
+		}
         }
 #endif
         KASSERT(lock->lk_owner == NULL);
         lock->lk_owner=curthread;
+	lock->lk_acquires++;
 	spinlock_release(&lock->lk_spinlock);
+#if !USE_SEMAPHORE_FOR_LOCK
+	if (contended) {
+		/* only the owner updates these */
+		gettime(&after);
+		timespec_sub(&after, &before, &after);
+		lock->lk_contended++;
+		if (!slept) {
+			lock->lk_spun++;
+		}
+		lock->lk_waitnsecs += (uint64_t)after.tv_sec * 1000000000
+			+ after.tv_nsec;
+	}
+#endif
 #endif
         (void)lock;  // suppress warning until code gets written
 }
@@ -305,6 +407,102 @@ lock_do_i_hold(struct lock *lock)
         return true; // dummy until code gets written
 }
 
+#if OPT_SHELL && OPT_LOCKSTATS
+/*
+ * Per-lock statistics. The numbers are read and cleared without the
+ * locks' own spinlocks, so they may be slightly off while in use.
+ */
+
+struct lockstat {
+	char name[24];
+	unsigned acquires;
+	unsigned contended;
+	unsigned spun;
+	uint64_t waitnsecs;
+};
+
+#define LOCKSTAT_MAX 16
+
+void
+lock_printstats(unsigned num)
+{
+	struct lockstat top[LOCKSTAT_MAX];
+	struct lock *lk;
+	unsigned i, n, nlocks;
+
+	if (num > LOCKSTAT_MAX) {
+		num = LOCKSTAT_MAX;
+	}
+
+	/* Keep the NUM most contended, sorted, in top[]. */
+	n = nlocks = 0;
+	spinlock_acquire(&lock_list_lock);
+	for (lk = lock_list; lk != NULL; lk = lk->lk_next) {
+		nlocks++;
+		if (lk->lk_contended == 0) {
+			continue;
+		}
+		for (i = n; i > 0 && top[i-1].contended < lk->lk_contended; i--) {
+			if (i < num) {
+				top[i] = top[i-1];
+			}
+		}
+		if (i < num) {
+			snprintf(top[i].name, sizeof(top[i].name), "%s",
+				 lk->lk_name);
+			top[i].acquires = lk->lk_acquires;
+			top[i].contended = lk->lk_contended;
+			top[i].spun = lk->lk_spun;
+			top[i].waitnsecs = lk->lk_waitnsecs;
+			if (n < num) {
+				n++;
+			}
+		}
+	}
+	spinlock_release(&lock_list_lock);
+
+	kprintf("locks: %u in all, %u most contended:\n", nlocks, n);
+	kprintf("    %-24s %10s %10s %10s %12s\n", "name", "acquires",
+		"contended", "spun", "wait (us)");
+	for (i=0; i<n; i++) {
+		kprintf("    %-24s %10u %10u %10u %12llu\n", top[i].name,
+			top[i].acquires, top[i].contended, top[i].spun,
+			(unsigned long long)(top[i].waitnsecs / 1000));
+	}
+}
+
+void
+lock_resetstats(void)
+{
+	struct lock *lk;
+
+	spinlock_acquire(&lock_list_lock);
+	for (lk = lock_list; lk != NULL; lk = lk->lk_next) {
+		lk->lk_acquires = 0;
+		lk->lk_contended = 0;
+		lk->lk_spun = 0;
+		lk->lk_waitnsecs = 0;
+	}
+	spinlock_release(&lock_list_lock);
+}
+#else
+/*
+ * Without the list of locks there is nothing to go through.
+ */
+
+void
+lock_printstats(unsigned num)
+{
+	(void)num;
+	kprintf("locks: not kept in this kernel (needs options lockstats)\n");
+}
+
+void
+lock_resetstats(void)
+{
+}
+#endif
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -411,4 +609,163 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 #endif
 	(void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
-}
\ No newline at end of file
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_spinlock);
+	rw->rw_readers = 0;
+	rw->rw_readwait = 0;
+	rw->rw_readgrant = 0;
+	rw->rw_writewait = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_readwait == 0 && rw->rw_writewait == 0);
+
+	spinlock_cleanup(&rw->rw_spinlock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * A reader gets in if there is no writer and either no writer is
+ * waiting or it is one of the readers granted a turn by the last
+ * writer to leave (see rwlock_release_write).
+ */
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_spinlock);
+	if (rw->rw_writer != NULL || (rw->rw_writewait > 0
+				      && rw->rw_readgrant == 0)) {
+		rw->rw_readwait++;
+		do {
+			wchan_sleep(rw->rw_readwchan, &rw->rw_spinlock);
+		} while (rw->rw_writer != NULL || (rw->rw_writewait > 0
+						   && rw->rw_readgrant == 0));
+		rw->rw_readwait--;
+	}
+	if (rw->rw_readgrant > 0) {
+		rw->rw_readgrant--;
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_spinlock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_readgrant == 0
+	    && rw->rw_writewait > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_spinlock);
+	}
+	spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_spinlock);
+	if (rw->rw_writer != NULL || rw->rw_readers > 0
+	    || rw->rw_readgrant > 0) {
+		rw->rw_writewait++;
+		do {
+			wchan_sleep(rw->rw_writewchan, &rw->rw_spinlock);
+		} while (rw->rw_writer != NULL || rw->rw_readers > 0
+			 || rw->rw_readgrant > 0);
+		rw->rw_writewait--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_spinlock);
+}
+
+/*
+ * On the way out, a writer lets in all the readers that queued up
+ * behind it before any other writer; if there are none, the next
+ * writer.
+ */
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_spinlock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	if (rw->rw_readwait > 0) {
+		rw->rw_readgrant = rw->rw_readwait;
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_spinlock);
+	}
+	else if (rw->rw_writewait > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_spinlock);
+	}
+	spinlock_release(&rw->rw_spinlock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	spinlock_acquire(&rw->rw_spinlock);
+	ret = rw->rw_writer == curthread;
+	spinlock_release(&rw->rw_spinlock);
+	return ret;
+}
@@ -47,6 +47,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -69,6 +70,25 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Thread structures. A recycled thread keeps its stack, so a stack is
+ * only allocated the first time a structure is used for a thread that
+ * needs one.
+ */
+static struct kmem_cache *thread_cache;
+
+/*
+ * Scheduler settings; see schedule(). A thread at level N gets a
+ * quantum of sched_quantum << N hardclocks. Every
+ * SCHED_BOOST_HARDCLOCKS all the ready threads on a cpu go back up to
+ * level 0 so that CPU-bound threads can't be starved forever.
+ */
+#define SCHED_QUANTUM		4
+#define SCHED_BOOST_HARDCLOCKS	100
+
+static bool sched_mlfq = true;
+static unsigned sched_quantum = SCHED_QUANTUM;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -108,6 +128,48 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+}
+
+/*
+ * Give a thread a stack, unless it still has the one from the last
+ * time its structure was used.
+ */
+static
+int
+thread_getstack(struct thread *thread)
+{
+	if (thread->t_stack == NULL) {
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			return ENOMEM;
+		}
+	}
+	thread_checkstack_init(thread);
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -120,14 +182,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -136,10 +198,12 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* t_stack is kept by thread_cache */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -164,6 +228,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -178,9 +243,15 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_idleclocks = 0;
+	c->c_switches = 0;
+	c->c_steals = 0;
+	c->c_migrations = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -205,15 +276,16 @@ cpu_create(unsigned hardware_number)
 		 * cpu. This means we're using the boot stack, which
 		 * can't be freed. (Exercise: what would it take to
 		 * make it possible to free the boot stack?)
+		 *
+		 * This is the first thread ever, so it can't have
+		 * come out of thread_cache with a stack.
 		 */
-		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
+		if (thread_getstack(c->c_curthread)) {
 			panic("cpu_create: couldn't allocate stack");
 		}
-		thread_checkstack_init(c->c_curthread);
 	}
 
 	/*
@@ -271,9 +343,8 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	/* the stack stays with the structure in thread_cache */
+	thread_checkstack(thread);
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -281,7 +352,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -311,6 +382,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -325,9 +399,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		tl = &curcpu->c_runqueue[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -370,6 +447,12 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -417,6 +500,15 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Return the number of CPUs.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -439,9 +531,109 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The caller must hold the cpu's run queue lock.
+ */
+
+/*
+ * Number of threads waiting to run on cpu C. This is also used
+ * without the lock, to pick which cpus to look at; the answer is then
+ * only a hint.
+ */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+/*
+ * Queue thread T on cpu C behind the others at its level. With the
+ * round-robin policy there is only one level in use.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_LEVELS);
+	threadlist_addtail(&c->c_runqueue[sched_mlfq ? t->t_priority : 0], t);
+}
+
+/*
+ * Take the next thread to run: the first one at the highest level
+ * that has any.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_LEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the thread that would run last, for migration.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_LEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Poke an idle cpu, if there is one other than BUSY, so that it comes
+ * out of cpu_idle and steals the thread just queued on BUSY. c_isidle
+ * is read without locking; if we get it wrong, either a cpu wakes up
+ * for nothing or the thread waits for BUSY (or the next hardclock on
+ * an idle cpu).
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
+ * The thread goes back on the cpu it last ran on (t_cpu), whose cache
+ * may still hold its working set. If that cpu is busy, an idle one is
+ * woken up to steal it instead of letting it wait.
+ *
  * targetcpu might be curcpu; it might not be, too.
  */
 static
@@ -463,7 +655,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -472,12 +664,72 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle) {
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Work stealing. Called by a cpu with nothing to run, not holding its
+ * own run queue lock, to take the thread that would run last on the
+ * busiest other cpu. Only one run queue lock is held at a time, so
+ * two cpus stealing from each other cannot deadlock.
+ *
+ * Returns the thread, now belonging to this cpu but not yet on its
+ * run queue, or NULL if there was nothing to take.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, count, most;
+
+	victim = NULL;
+	most = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = runqueue_count(c);
+		if (count > most) {
+			most = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim);
+	if (t != NULL && t == victim->c_curthread) {
+		/*
+		 * The victim's current thread, queued but still on its
+		 * stack; see thread_consider_migration. Leave it.
+		 */
+		runqueue_add(victim, t);
+		t = NULL;
+	}
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		curcpu->c_steals++;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -502,13 +754,12 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
+	/* Allocate a stack, if it doesn't have one already */
+	result = thread_getstack(newthread);
+	if (result) {
 		thread_destroy(newthread);
-		return ENOMEM;
+		return result;
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -585,7 +836,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu->c_self) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -635,17 +886,32 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * Before idling, try to steal a thread from another cpu. This
+	 * is repeated each time cpu_idle returns, which is at least
+	 * every hardclock.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (next != NULL) {
+				/* Requeue; something better may have come. */
+				runqueue_add(curcpu->c_self, next);
+				next = NULL;
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	curcpu->c_switches++;
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -817,17 +1083,169 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has SCHED_LEVELS run
+ * queues and always runs the first thread of the highest level that
+ * has one. New threads start at level 0. A thread that uses up its
+ * whole quantum is taken to be CPU-bound and moves down a level,
+ * where the quantum is twice as long; a thread that sleeps before
+ * that and is woken up moves up a level. So interactive and I/O-bound
+ * threads stay near the top, and get to run as soon as they wake up,
+ * while compute jobs sink and share the cpu among themselves in
+ * longer slices.
+ *
+ * The time used is kept across sleeps, so a thread cannot stay on top
+ * by sleeping just before its quantum runs out. To keep the bottom
+ * levels from starving, every SCHED_BOOST_HARDCLOCKS everything on
+ * the cpu goes back to level 0.
+ *
+ * With the round-robin policy all threads share level 0 and the
+ * current one is preempted every sched_quantum hardclocks.
  */
 
+/*
+ * Move every ready thread on this cpu, and the current one, to level 0.
+ */
+static
+void
+schedule_boost(void)
+{
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_LEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	curthread->t_priority = 0;
+	curthread->t_ticks = 0;
+}
+
+/*
+ * This is called from hardclock() on every tick.
+ */
 void
 schedule(void)
 {
+	struct thread *cur;
+	unsigned i, level;
+	bool preempt;
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * If the cpu is idle, curthread isn't actually running; the
+	 * idle loop picks up new threads on its own.
 	 */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+
+	if (!sched_mlfq) {
+		if (++cur->t_ticks >= sched_quantum) {
+			cur->t_ticks = 0;
+			thread_yield();
+		}
+		return;
+	}
+
+	if (curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS == 0) {
+		schedule_boost();
+	}
+
+	level = cur->t_priority;
+	preempt = false;
+	if (++cur->t_ticks >= sched_quantum << level) {
+		/* Used up the quantum: move down a level. */
+		cur->t_ticks = 0;
+		if (level < SCHED_LEVELS - 1) {
+			cur->t_priority = level + 1;
+		}
+		preempt = true;
+	}
+	else if (level > 0) {
+		/* Give way at once to anything ready at a higher level. */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		for (i=0; i<level; i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				preempt = true;
+				break;
+			}
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+void
+schedule_setpolicy(bool mlfq)
+{
+	sched_mlfq = mlfq;
+}
+
+void
+schedule_setquantum(unsigned hardclocks)
+{
+	KASSERT(hardclocks > 0);
+	sched_quantum = hardclocks;
+}
+
+void
+schedule_printstats(void)
+{
+	unsigned counts[SCHED_LEVELS];
+	unsigned i, j, numcpus;
+	struct cpu *c;
+
+	kprintf("sched: policy %s, quantum %u hardclocks\n",
+		sched_mlfq ? "mlfq" : "rr", sched_quantum);
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (j=0; j<SCHED_LEVELS; j++) {
+			counts[j] = c->c_runqueue[j].tl_count;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+
+		kprintf("cpu%u: ready by level:", c->c_number);
+		for (j=0; j<SCHED_LEVELS; j++) {
+			kprintf(" %u", counts[j]);
+		}
+		kprintf("\n");
+		kprintf("      %u idle hardclocks, %u switches, "
+			"%u steals, %u migrations\n",
+			c->c_idleclocks, c->c_switches,
+			c->c_steals, c->c_migrations);
+	}
+}
+
+/*
+ * Clear the per-cpu counters. The cpus may be updating them as we go;
+ * that's fine for statistics.
+ */
+void
+schedule_resetstats(void)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		c->c_idleclocks = 0;
+		c->c_switches = 0;
+		c->c_steals = 0;
+		c->c_migrations = 0;
+	}
 }
 
 /*
@@ -843,9 +1261,11 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Idle cpus don't depend on this; they steal work themselves as soon
+ * as they run out (see thread_steal). What's left for here is evening
+ * out cpus that are all busy but have unequal queues, so it can afford
+ * to be lazy: the queue lengths are read without locking, and locks
+ * are only taken when there is something to move.
  */
 void
 thread_consider_migration(void)
@@ -860,16 +1280,14 @@ thread_consider_migration(void)
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += runqueue_count(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = runqueue_count(c);
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (my_count <= one_share) {
 		return;
 	}
 
@@ -877,18 +1295,23 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu->c_self);
+		if (t == NULL) {
+			/* the counts were only a guess */
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
+	to_send = i;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+		if (c == curcpu->c_self || runqueue_count(c) >= one_share) {
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (runqueue_count(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -919,7 +1342,8 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
+			curcpu->c_migrations++;
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -943,7 +1367,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1015,6 +1439,23 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * Make a thread that was sleeping runnable again. Threads that sleep
+ * before using up their quantum are the interactive and I/O-bound
+ * ones, so they move up a scheduler level (see schedule()). They keep
+ * the ticks they have used, though; otherwise a thread that always
+ * sleeps just before its quantum runs out would never move down.
+ */
+static
+void
+wchan_wakethread(struct thread *target)
+{
+	if (target->t_priority > 0) {
+		target->t_priority--;
+	}
+	thread_make_runnable(target, false);
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1041,7 +1482,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	wchan_wakethread(target);
 }
 
 /*
@@ -1071,7 +1512,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		wchan_wakethread(target);
 	}
 
 	threadlist_cleanup(&list);
@@ -1131,6 +1572,10 @@ ipi_broadcast(int code)
 
 /*
  * Send a TLB shootdown IPI to the specified CPU.
+ *
+ * If the target's queue is full, wait for it to drain. The target
+ * empties its whole queue each time it takes the IPI, so this doesn't
+ * take long; but the caller must not hold other spinlocks.
  */
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
@@ -1139,23 +1584,13 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	while ((n = target->c_numshootdown) == TLBSHOOTDOWN_MAX) {
+		mainbus_send_ipi(target);
+		spinlock_release(&target->c_ipi_lock);
+		spinlock_acquire(&target->c_ipi_lock);
 	}
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1163,6 +1598,27 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs but this one. Returns the
+ * number of CPUs it was sent to.
+ */
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
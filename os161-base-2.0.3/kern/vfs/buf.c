@@ -0,0 +1,1037 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Block buffer cache.
+ *
+ * Buffers live in a hash table keyed by (device, block) and on an LRU
+ * list; the least recently used buffer that is not busy is recycled
+ * when the cache is full. Dirty buffers are written back on eviction,
+ * on buffer_sync (called by the filesystems' FSOP_SYNC), and by the
+ * syncer thread, which writes out buffers that have stayed dirty for
+ * a whole syncer period. An eviction writeback takes the dirty
+ * buffers for the blocks on either side along, so the device sees
+ * one multi-sector write instead of many single ones.
+ *
+ * Read-ahead requests are queued for the reader thread, which loads
+ * them in batches through device_iobatch. Until a block is loaded its
+ * buffer is busy, so anyone who wants it just waits as for any other
+ * busy buffer. buffer_drop_device waits for a batch for its device
+ * that the reader has started on, via buffer_radev.
+ *
+ * Synchronization: buffer_lock protects the hash table, the lists,
+ * and the flag fields of every buffer. A buffer marked busy belongs
+ * to one thread; only that thread may touch its data, and the buffer
+ * cannot be evicted or written back by anyone else. Device I/O is
+ * always done with buffer_lock released and the buffer busy.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <current.h>
+#include <proc.h>
+#include <device.h>
+#include <buf.h>
+
+/* Number of hash buckets; a prime, for spreading block numbers. */
+#define BUFFER_HASHSIZE      131
+
+struct buf {
+	/* identity; meaningful only if b_attached */
+	struct device *b_dev;
+	daddr_t b_block;
+
+	/* hash chain, and LRU (if attached) or free list (if not) */
+	struct buf *b_hashnext;
+	struct buf *b_prev;
+	struct buf *b_next;
+
+	bool b_attached;	/* has an identity, in hash table */
+	bool b_valid;		/* contents match (or supersede) disk */
+	bool b_dirty;		/* contents must be written back */
+	bool b_busy;		/* in use by some thread */
+	bool b_readahead;	/* loaded by read-ahead, not yet used */
+	unsigned b_dirtyepoch;	/* syncer epoch when first dirtied */
+
+	void *b_data;
+};
+
+/* Sentinel-headed circular list. */
+struct buflist {
+	struct buf bl_head;
+	unsigned bl_count;
+};
+
+/* Counters, printed by buffer_printstats. */
+struct bufstats {
+	unsigned bs_reads;		/* buffer_read calls */
+	unsigned bs_gets;		/* buffer_get calls */
+	unsigned bs_hits;		/* found in cache */
+	unsigned bs_misses;		/* not found in cache */
+	unsigned bs_devreads;		/* blocks read from device */
+	unsigned bs_devwrites;		/* blocks written to device */
+	unsigned bs_evictions;		/* buffers recycled */
+	unsigned bs_dirtyevictions;	/* ...that needed a writeback first */
+	unsigned bs_syncwrites;		/* writebacks from buffer_sync */
+	unsigned bs_syncerwrites;	/* writebacks from the syncer */
+	unsigned bs_drops;		/* buffers discarded by buffer_drop */
+	unsigned bs_clustered;		/* written along with an eviction */
+	unsigned bs_rarequests;		/* blocks asked for read-ahead */
+	unsigned bs_rareads;		/* ...that were read */
+	unsigned bs_rahits;		/* ...and then used */
+	unsigned bs_radropped;		/* ...dropped, queue full */
+};
+
+/* A read-ahead request. */
+struct bufra {
+	struct device *ra_dev;
+	daddr_t ra_block;
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_busy_cv;
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buflist buffer_lru;	/* attached buffers, LRU first */
+static struct buflist buffer_free;	/* detached buffers */
+static unsigned buffer_total;		/* buffers allocated so far */
+static unsigned buffer_epoch;		/* syncer epoch */
+static struct bufstats buffer_stats;
+
+/* Read-ahead queue (circular), also protected by buffer_lock */
+static struct cv *buffer_ra_cv;
+static struct bufra buffer_raq[BUFFER_RA_QUEUE];
+static unsigned buffer_rahead, buffer_racount;
+/* device the reader thread has taken requests off the queue for */
+static struct device *buffer_radev;
+
+////////////////////////////////////////////////////////////
+// Lists and hashing
+
+static
+void
+buflist_init(struct buflist *bl)
+{
+	bl->bl_head.b_prev = &bl->bl_head;
+	bl->bl_head.b_next = &bl->bl_head;
+	bl->bl_count = 0;
+}
+
+static
+void
+buflist_addtail(struct buflist *bl, struct buf *b)
+{
+	b->b_prev = bl->bl_head.b_prev;
+	b->b_next = &bl->bl_head;
+	b->b_prev->b_next = b;
+	b->b_next->b_prev = b;
+	bl->bl_count++;
+}
+
+static
+void
+buflist_remove(struct buflist *bl, struct buf *b)
+{
+	KASSERT(bl->bl_count > 0);
+	b->b_prev->b_next = b->b_next;
+	b->b_next->b_prev = b->b_prev;
+	b->b_prev = b->b_next = NULL;
+	bl->bl_count--;
+}
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, daddr_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b = buffer_hash[buffer_hashfunc(dev, block)];
+	while (b != NULL) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+		b = b->b_hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * Give a detached buffer an identity: put it in the hash table and
+ * at the tail (most recently used end) of the LRU list.
+ */
+static
+void
+buffer_attach(struct buf *b, struct device *dev, daddr_t block)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_attached);
+
+	buflist_remove(&buffer_free, b);
+
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_readahead = false;
+
+	h = buffer_hashfunc(dev, block);
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+
+	buflist_addtail(&buffer_lru, b);
+	b->b_attached = true;
+}
+
+/*
+ * Take the identity away from a buffer and move it to the free list.
+ * Whatever was in it is lost.
+ */
+static
+void
+buffer_detach(struct buf *b)
+{
+	struct buf **pp;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_attached);
+
+	pp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+
+	buflist_remove(&buffer_lru, b);
+	buflist_addtail(&buffer_free, b);
+
+	b->b_attached = false;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_dev = NULL;
+	b->b_block = 0;
+}
+
+/*
+ * Wait until B is not busy. Returns with buffer_lock held, but since
+ * the lock may have been dropped, B may have changed identity.
+ */
+static
+void
+buffer_wait(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	while (b->b_busy) {
+		cv_wait(buffer_busy_cv, buffer_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Device I/O
+
+/*
+ * Read or write a buffer from/to its device, retrying I/O errors.
+ * Called with the buffer busy and buffer_lock not held.
+ */
+static
+int
+buffer_devio(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_attached);
+	KASSERT(b->b_dev->d_blocksize == BUFFER_SIZE);
+
+	while (1) {
+		uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+			  ((off_t)b->b_block) * BUFFER_SIZE, rw);
+		result = DEVOP_IO(b->b_dev, &ku);
+		if (result == EINVAL) {
+			/* out of range or misaligned: our fault */
+			panic("buffer: DEVOP_IO returned EINVAL for block %u\n",
+			      b->b_block);
+		}
+		if (result != EIO || tries >= 10) {
+			break;
+		}
+		if (tries == 0) {
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+		}
+		tries++;
+	}
+	if (result == EIO) {
+		kprintf("buffer: block %u I/O error, giving up after %d "
+			"retries\n", b->b_block, tries);
+	}
+	return result;
+}
+
+/*
+ * Write back a batch of dirty buffers on one device with a single
+ * device_iobatch call, so the driver can sort and merge them. Called
+ * with buffer_lock held and the buffers marked busy by the caller.
+ * If the batch fails, the buffers are retried one at a time so that
+ * only the ones that really fail stay dirty. Returns with buffer_lock
+ * held and the buffers no longer busy.
+ */
+static
+int
+buffer_writeback_batch(struct buf **bufs, unsigned n, unsigned *count)
+{
+	struct devio ios[BUFFER_SYNC_BATCH];
+	bool ok[BUFFER_SYNC_BATCH];
+	unsigned i;
+	int result, ret = 0;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(n > 0 && n <= BUFFER_SYNC_BATCH);
+
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dev == bufs[0]->b_dev);
+		ios[i].dio_block = bufs[i]->b_block;
+		ios[i].dio_data = bufs[i]->b_data;
+		ok[i] = true;
+	}
+	lock_release(buffer_lock);
+
+	result = device_iobatch(bufs[0]->b_dev, ios, n, UIO_WRITE);
+	if (result) {
+		for (i=0; i<n; i++) {
+			result = buffer_devio(bufs[i], UIO_WRITE);
+			if (result) {
+				ok[i] = false;
+				ret = result;
+			}
+		}
+	}
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<n; i++) {
+		if (ok[i]) {
+			bufs[i]->b_dirty = false;
+			buffer_stats.bs_devwrites++;
+			(*count)++;
+		}
+		bufs[i]->b_busy = false;
+	}
+	cv_broadcast(buffer_busy_cv, buffer_lock);
+	return ret;
+}
+
+/*
+ * Write back dirty buffer B, which is about to be evicted, and with
+ * it the dirty buffers for the blocks right before and after it on
+ * the same device that aren't busy. Since files are laid out in
+ * order, those are usually the rest of a file written sequentially,
+ * and they all go to the device as one request. Called with
+ * buffer_lock held and B not busy; returns with buffer_lock held and
+ * the buffers no longer busy.
+ */
+static
+int
+buffer_writeback_cluster(struct buf *b)
+{
+	struct buf *bufs[BUFFER_SYNC_BATCH];
+	struct buf *nb;
+	daddr_t block;
+	unsigned n, count = 0;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+	KASSERT(b->b_dirty);
+
+	n = 0;
+	b->b_busy = true;
+	bufs[n++] = b;
+
+	/* Forward first; sequential writers fill the blocks after. */
+	for (block = b->b_block + 1; n < BUFFER_SYNC_BATCH; block++) {
+		nb = buffer_find(b->b_dev, block);
+		if (nb == NULL || nb->b_busy || !nb->b_dirty) {
+			break;
+		}
+		nb->b_busy = true;
+		bufs[n++] = nb;
+	}
+	for (block = b->b_block; block > 0 && n < BUFFER_SYNC_BATCH; ) {
+		block--;
+		nb = buffer_find(b->b_dev, block);
+		if (nb == NULL || nb->b_busy || !nb->b_dirty) {
+			break;
+		}
+		nb->b_busy = true;
+		bufs[n++] = nb;
+	}
+
+	result = buffer_writeback_batch(bufs, n, &count);
+	if (count > 0 && !b->b_dirty) {
+		count--;
+	}
+	buffer_stats.bs_clustered += count;
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Getting buffers
+
+/*
+ * Get a detached buffer to attach to a new block: a fresh one if we
+ * haven't reached the limit, otherwise the least recently used one
+ * that isn't busy, written back first if dirty.
+ *
+ * May drop buffer_lock. Returns with it held, and the result still on
+ * the free list; or NULL if every buffer is busy.
+ */
+static
+struct buf *
+buffer_getfresh(void)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	if (buffer_free.bl_count > 0) {
+		return buffer_free.bl_head.b_next;
+	}
+
+	if (buffer_total < BUFFER_MAXBUFS) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUFFER_SIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			b->b_dev = NULL;
+			b->b_block = 0;
+			b->b_hashnext = NULL;
+			b->b_attached = false;
+			b->b_valid = false;
+			b->b_dirty = false;
+			b->b_busy = false;
+			b->b_dirtyepoch = 0;
+			buflist_addtail(&buffer_free, b);
+			buffer_total++;
+			return b;
+		}
+		/* out of memory: fall back to recycling */
+	}
+
+	/* Evict: scan from the least recently used end. */
+	for (b = buffer_lru.bl_head.b_next; b != &buffer_lru.bl_head;
+	     b = b->b_next) {
+		if (b->b_busy) {
+			continue;
+		}
+		if (b->b_dirty) {
+			buffer_stats.bs_dirtyevictions++;
+			result = buffer_writeback_cluster(b);
+			if (result) {
+				/* keep it; try another */
+				continue;
+			}
+			/* the lock was dropped; recheck from scratch */
+			if (b->b_busy || b->b_dirty || !b->b_attached) {
+				b = &buffer_lru.bl_head;
+				continue;
+			}
+		}
+		buffer_stats.bs_evictions++;
+		buffer_detach(b);
+		return b;
+	}
+	return NULL;
+}
+
+/*
+ * Common code for buffer_read and buffer_get.
+ */
+static
+int
+buffer_getbuf(struct device *dev, daddr_t block, bool doread,
+	      struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	lock_acquire(buffer_lock);
+	if (doread) {
+		buffer_stats.bs_reads++;
+	}
+	else {
+		buffer_stats.bs_gets++;
+	}
+
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				buffer_wait(b);
+				/* may have been recycled meanwhile */
+				continue;
+			}
+			buffer_stats.bs_hits++;
+			if (b->b_readahead) {
+				buffer_stats.bs_rahits++;
+				b->b_readahead = false;
+			}
+			/* move to the most recently used end */
+			buflist_remove(&buffer_lru, b);
+			buflist_addtail(&buffer_lru, b);
+			break;
+		}
+
+		b = buffer_getfresh();
+		if (b == NULL) {
+			/* everything busy; wait for a release */
+			cv_wait(buffer_busy_cv, buffer_lock);
+			continue;
+		}
+		/* getfresh may have slept; someone may have loaded it */
+		if (buffer_find(dev, block) != NULL) {
+			continue;
+		}
+		buffer_stats.bs_misses++;
+		buffer_attach(b, dev, block);
+		break;
+	}
+
+	b->b_busy = true;
+
+	if (doread && !b->b_valid) {
+		lock_release(buffer_lock);
+		result = buffer_devio(b, UIO_READ);
+		lock_acquire(buffer_lock);
+		if (result) {
+			buffer_detach(b);
+			b->b_busy = false;
+			cv_broadcast(buffer_busy_cv, buffer_lock);
+			lock_release(buffer_lock);
+			return result;
+		}
+		buffer_stats.bs_devreads++;
+		b->b_valid = true;
+	}
+
+	lock_release(buffer_lock);
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_getbuf(dev, block, true, ret);
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_getbuf(dev, block, false, ret);
+}
+
+////////////////////////////////////////////////////////////
+// Operations on busy buffers
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		b->b_dirtyepoch = buffer_epoch;
+	}
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	if (!b->b_valid) {
+		/* nobody filled it in; don't keep an empty identity */
+		buffer_detach(b);
+	}
+	b->b_busy = false;
+	cv_broadcast(buffer_busy_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	buffer_detach(b);
+	b->b_busy = false;
+	cv_broadcast(buffer_busy_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Whole-cache operations
+
+/*
+ * Discard the cached copy of a block, dirty or not.
+ */
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(dev, block)) != NULL) {
+		if (b->b_busy) {
+			buffer_wait(b);
+			continue;
+		}
+		buffer_stats.bs_drops++;
+		buffer_detach(b);
+		break;
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write out dirty buffers belonging to DEV (all devices if DEV is
+ * NULL). If MINAGE is true, only buffers dirtied before the current
+ * syncer epoch are written; this is what the syncer uses so that a
+ * block being rewritten over and over is not written every time.
+ *
+ * Buffers are gathered in batches of up to BUFFER_SYNC_BATCH blocks
+ * on the same device. Stops at the first batch that has an error,
+ * since those buffers would otherwise be picked up again forever.
+ */
+static
+int
+buffer_sync_internal(struct device *dev, bool minage, unsigned *count)
+{
+	struct buf *bufs[BUFFER_SYNC_BATCH];
+	struct device *bdev;
+	struct buf *b;
+	unsigned n;
+	int result = 0;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		n = 0;
+		bdev = dev;
+		for (b = buffer_lru.bl_head.b_next;
+		     b != &buffer_lru.bl_head && n < BUFFER_SYNC_BATCH;
+		     b = b->b_next) {
+			if (!b->b_dirty || (bdev != NULL && b->b_dev != bdev)) {
+				continue;
+			}
+			if (minage && b->b_dirtyepoch == buffer_epoch) {
+				continue;
+			}
+			if (b->b_busy) {
+				if (minage || n > 0) {
+					/*
+					 * The syncer doesn't wait (next
+					 * time); otherwise, write out
+					 * what we have first.
+					 */
+					continue;
+				}
+				buffer_wait(b);
+				/* the list may have changed under us */
+				break;
+			}
+			b->b_busy = true;
+			bdev = b->b_dev;
+			bufs[n++] = b;
+		}
+		if (n == 0) {
+			if (b != &buffer_lru.bl_head) {
+				/* we waited for a busy buffer; rescan */
+				continue;
+			}
+			break;
+		}
+		result = buffer_writeback_batch(bufs, n, count);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	unsigned count = 0;
+	int result;
+
+	result = buffer_sync_internal(dev, false, &count);
+
+	lock_acquire(buffer_lock);
+	buffer_stats.bs_syncwrites += count;
+	lock_release(buffer_lock);
+
+	return result;
+}
+
+/*
+ * Write out and forget every buffer belonging to DEV.
+ */
+int
+buffer_drop_device(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i, slot;
+	int result;
+
+	result = buffer_sync(dev);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(buffer_lock);
+
+	/* Cancel read-ahead that hasn't started yet */
+	for (i=0; i<buffer_racount; i++) {
+		slot = (buffer_rahead + i) % BUFFER_RA_QUEUE;
+		if (buffer_raq[slot].ra_dev == dev) {
+			buffer_raq[slot].ra_dev = NULL;
+		}
+	}
+	/*
+	 * ...and wait out any that has. The reader may be asleep in
+	 * buffer_getfresh with requests already off the queue, and
+	 * would attach their buffers after we had looked.
+	 */
+	while (buffer_radev == dev) {
+		cv_wait(buffer_busy_cv, buffer_lock);
+	}
+ again:
+	for (b = buffer_lru.bl_head.b_next; b != &buffer_lru.bl_head;
+	     b = next) {
+		next = b->b_next;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			buffer_wait(b);
+			goto again;
+		}
+		KASSERT(!b->b_dirty);
+		buffer_detach(b);
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Ask for NBLOCKS blocks of DEV to be read into the cache in the
+ * background. Blocks already cached are skipped. This is only a
+ * hint: if the queue is full, the rest are dropped.
+ */
+void
+buffer_readahead(struct device *dev, const daddr_t *blocks, unsigned nblocks)
+{
+	unsigned i, slot;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<nblocks; i++) {
+		buffer_stats.bs_rarequests++;
+		if (buffer_find(dev, blocks[i]) != NULL) {
+			continue;
+		}
+		if (buffer_racount == BUFFER_RA_QUEUE) {
+			buffer_stats.bs_radropped += nblocks - i;
+			break;
+		}
+		slot = (buffer_rahead + buffer_racount) % BUFFER_RA_QUEUE;
+		buffer_raq[slot].ra_dev = dev;
+		buffer_raq[slot].ra_block = blocks[i];
+		buffer_racount++;
+	}
+	cv_signal(buffer_ra_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * The reader thread. Takes up to BUFFER_SYNC_BATCH queued blocks of
+ * one device, attaches a busy buffer to each of the ones that still
+ * aren't cached, and reads them all with one device_iobatch call so
+ * consecutive blocks become one request.
+ */
+static
+void
+buffer_reader(void *data1, unsigned long data2)
+{
+	struct buf *bufs[BUFFER_SYNC_BATCH];
+	struct devio ios[BUFFER_SYNC_BATCH];
+	struct device *dev;
+	struct buf *b;
+	daddr_t block;
+	unsigned i, n;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_racount == 0) {
+			cv_wait(buffer_ra_cv, buffer_lock);
+		}
+
+		n = 0;
+		dev = buffer_raq[buffer_rahead].ra_dev;
+		buffer_radev = dev;
+		while (buffer_racount > 0 && n < BUFFER_SYNC_BATCH &&
+		       buffer_raq[buffer_rahead].ra_dev == dev) {
+			block = buffer_raq[buffer_rahead].ra_block;
+			buffer_rahead = (buffer_rahead + 1) % BUFFER_RA_QUEUE;
+			buffer_racount--;
+
+			if (dev == NULL || buffer_find(dev, block) != NULL) {
+				/* cancelled, or already there */
+				continue;
+			}
+			b = buffer_getfresh();
+			if (b == NULL) {
+				/* all busy; not worth waiting for */
+				break;
+			}
+			/* getfresh may have slept */
+			if (buffer_find(dev, block) != NULL) {
+				continue;
+			}
+			buffer_attach(b, dev, block);
+			b->b_busy = true;
+			bufs[n] = b;
+			ios[n].dio_block = block;
+			ios[n].dio_data = b->b_data;
+			n++;
+		}
+		if (n == 0) {
+			buffer_radev = NULL;
+			cv_broadcast(buffer_busy_cv, buffer_lock);
+			continue;
+		}
+
+		lock_release(buffer_lock);
+		result = device_iobatch(dev, ios, n, UIO_READ);
+		lock_acquire(buffer_lock);
+
+		for (i=0; i<n; i++) {
+			b = bufs[i];
+			if (result) {
+				/* whoever wants it will read it again */
+				buffer_detach(b);
+			}
+			else {
+				b->b_valid = true;
+				b->b_readahead = true;
+				buffer_stats.bs_devreads++;
+				buffer_stats.bs_rareads++;
+			}
+			b->b_busy = false;
+		}
+		buffer_radev = NULL;
+		cv_broadcast(buffer_busy_cv, buffer_lock);
+	}
+}
+
+/*
+ * The syncer thread. Every BUFFER_SYNC_SECS seconds, write back the
+ * buffers that have been dirty since the previous run.
+ */
+static
+void
+buffer_syncer(void *data1, unsigned long data2)
+{
+	unsigned count;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(BUFFER_SYNC_SECS);
+
+		count = 0;
+		buffer_sync_internal(NULL, true, &count);
+
+		lock_acquire(buffer_lock);
+		buffer_stats.bs_syncerwrites += count;
+		buffer_epoch++;
+		lock_release(buffer_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Stats and setup
+
+void
+buffer_printstats(void)
+{
+	struct bufstats s;
+	unsigned requests, devops, nbufs, ndirty;
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	s = buffer_stats;
+	nbufs = buffer_lru.bl_count;
+	ndirty = 0;
+	for (b = buffer_lru.bl_head.b_next; b != &buffer_lru.bl_head;
+	     b = b->b_next) {
+		if (b->b_dirty) {
+			ndirty++;
+		}
+	}
+	lock_release(buffer_lock);
+
+	/*
+	 * Without the cache every read request and every write would
+	 * be a device operation; REQUESTS is that number.
+	 */
+	requests = s.bs_reads + s.bs_gets;
+	devops = s.bs_devreads + s.bs_devwrites;
+
+	kprintf("Buffer cache: %u/%u buffers in use, %u dirty\n",
+		nbufs, BUFFER_MAXBUFS, ndirty);
+	kprintf("    requests: %u reads, %u gets\n", s.bs_reads, s.bs_gets);
+	kprintf("    hits: %u, misses: %u (hit rate %u%%)\n",
+		s.bs_hits, s.bs_misses,
+		s.bs_hits + s.bs_misses == 0 ? 0 :
+		(100 * s.bs_hits) / (s.bs_hits + s.bs_misses));
+	kprintf("    device reads: %u, device writes: %u\n",
+		s.bs_devreads, s.bs_devwrites);
+	kprintf("    writebacks: %u by eviction, %u by sync, %u by syncer\n",
+		s.bs_dirtyevictions, s.bs_syncwrites, s.bs_syncerwrites);
+	kprintf("    evictions: %u, drops: %u\n", s.bs_evictions, s.bs_drops);
+	kprintf("    clustered with evictions: %u blocks\n", s.bs_clustered);
+	kprintf("    read-ahead: %u asked, %u read, %u used, %u dropped\n",
+		s.bs_rarequests, s.bs_rareads, s.bs_rahits, s.bs_radropped);
+	kprintf("    device ops: %u with cache, at least %u without\n",
+		devops, requests);
+}
+
+void
+buffer_resetstats(void)
+{
+	lock_acquire(buffer_lock);
+	bzero(&buffer_stats, sizeof(buffer_stats));
+	lock_release(buffer_lock);
+}
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buffer_lock = lock_create("buffer_lock");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Cannot create lock\n");
+	}
+	buffer_busy_cv = cv_create("buffer_busy");
+	if (buffer_busy_cv == NULL) {
+		panic("buffer_bootstrap: Cannot create cv\n");
+	}
+	buffer_ra_cv = cv_create("buffer_ra");
+	if (buffer_ra_cv == NULL) {
+		panic("buffer_bootstrap: Cannot create cv\n");
+	}
+	buffer_rahead = buffer_racount = 0;
+	buffer_radev = NULL;
+	buflist_init(&buffer_lru);
+	buflist_init(&buffer_free);
+	buffer_total = 0;
+	buffer_epoch = 0;
+	bzero(buffer_hash, sizeof(buffer_hash));
+	bzero(&buffer_stats, sizeof(buffer_stats));
+
+	result = thread_fork("bufsyncer", NULL, buffer_syncer, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: Cannot start syncer: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("bufreader", NULL, buffer_reader, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: Cannot start reader: %s\n",
+		      strerror(result));
+	}
+}
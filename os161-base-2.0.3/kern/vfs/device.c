@@ -237,15 +237,15 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. None of our devices have memory that makes sense to map,
+ * and the disks are only accessed through the filesystems on them.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -386,3 +386,31 @@ dev_uncreate_vnode(struct vnode *vn)
 	vnode_cleanup(vn);
 	kfree(vn);
 }
+
+/*
+ * Batched block I/O. Drivers that can do better than one block at a
+ * time provide devop_iobatch; for everyone else, loop over devop_io.
+ */
+int
+device_iobatch(struct device *dev, struct devio *ios, unsigned nios,
+	       enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	if (dev->d_ops->devop_iobatch != NULL) {
+		return dev->d_ops->devop_iobatch(dev, ios, nios, rw);
+	}
+
+	for (i=0; i<nios; i++) {
+		uio_kinit(&iov, &ku, ios[i].dio_data, dev->d_blocksize,
+			  ((off_t)ios[i].dio_block) * dev->d_blocksize, rw);
+		result = DEVOP_IO(dev, &ku);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
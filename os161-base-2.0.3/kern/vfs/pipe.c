@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Pipes. See pipe.h.
+ *
+ * The data normally goes through a ring buffer, which starts out a
+ * page long and is doubled (up to PIPE_MAXSIZE) whenever a writer
+ * would otherwise have to wait for room, so that a pipe that is kept
+ * full gets to move more at a time.
+ *
+ * A large write from user space skips the ring: the writer lends its
+ * pages to the pipe (vm_loan_page) and sleeps, and readers copy
+ * straight out of them into their own buffers. That is one copy
+ * instead of two. Readers always empty the ring first, so the data
+ * stays in order.
+ *
+ * Locking: p_lock protects the fields of the pipe, and goes with the
+ * wchans readers and writers sleep on. Copying to and from user space
+ * can fault, so it can't be done under p_lock; instead p_rlock and
+ * p_wlock let only one reader and one writer at a time at the data,
+ * and each side only copies from or into the part of the ring the
+ * other can't touch until p_count is updated. Growing the ring moves
+ * it, so it takes both (p_wlock first).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stattypes.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <stat.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pipe.h>
+#include "opt-dumbvm.h"
+
+struct pipe {
+	struct spinlock p_lock;		/* protects the fields */
+	struct wchan *p_readwchan;	/* readers waiting for data */
+	struct wchan *p_writewchan;	/* writers waiting for room */
+	struct lock *p_rlock;		/* one reader at a time */
+	struct lock *p_wlock;		/* one writer at a time */
+
+	char *p_buf;			/* the ring */
+	size_t p_size;			/* its size */
+	size_t p_head;			/* where the next byte to read is */
+	size_t p_count;			/* bytes in it */
+
+	/*
+	 * A large write lent to the readers: bytes p_dpos up to p_dend
+	 * of the pages in p_dpages are still to be read.
+	 */
+	paddr_t p_dpages[PIPE_DIRECT_PAGES];
+	size_t p_dpos;
+	size_t p_dend;
+
+	bool p_readable;		/* read end still open */
+	bool p_writeable;		/* write end still open */
+	struct vnode p_readvn;		/* the read end */
+	struct vnode p_writevn;		/* the write end */
+};
+
+static const struct vnode_ops pipe_readops;
+static const struct vnode_ops pipe_writeops;
+
+////////////////////////////////////////////////////////////
+// Creation and destruction
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	KASSERT(p->p_dpos == p->p_dend);
+
+	kfree(p->p_buf);
+	lock_destroy(p->p_wlock);
+	lock_destroy(p->p_rlock);
+	wchan_destroy(p->p_writewchan);
+	wchan_destroy(p->p_readwchan);
+	spinlock_cleanup(&p->p_lock);
+	kfree(p);
+}
+
+int
+pipe_create(struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *p;
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&p->p_lock);
+	p->p_readwchan = wchan_create("pipe read");
+	p->p_writewchan = wchan_create("pipe write");
+	p->p_rlock = lock_create("pipe reader");
+	p->p_wlock = lock_create("pipe writer");
+	p->p_buf = kmalloc(PIPE_SIZE);
+	if (p->p_readwchan == NULL || p->p_writewchan == NULL ||
+	    p->p_rlock == NULL || p->p_wlock == NULL || p->p_buf == NULL) {
+		kfree(p->p_buf);
+		if (p->p_wlock != NULL) {
+			lock_destroy(p->p_wlock);
+		}
+		if (p->p_rlock != NULL) {
+			lock_destroy(p->p_rlock);
+		}
+		if (p->p_writewchan != NULL) {
+			wchan_destroy(p->p_writewchan);
+		}
+		if (p->p_readwchan != NULL) {
+			wchan_destroy(p->p_readwchan);
+		}
+		spinlock_cleanup(&p->p_lock);
+		kfree(p);
+		return ENOMEM;
+	}
+	p->p_size = PIPE_SIZE;
+	p->p_head = 0;
+	p->p_count = 0;
+	p->p_dpos = p->p_dend = 0;
+	p->p_readable = true;
+	p->p_writeable = true;
+	vnode_init(&p->p_readvn, &pipe_readops, NULL, p);
+	vnode_init(&p->p_writevn, &pipe_writeops, NULL, p);
+
+	*readend = &p->p_readvn;
+	*writeend = &p->p_writevn;
+	return 0;
+}
+
+/*
+ * Called when the last reference to one end goes away. The pipe
+ * itself goes when both ends have.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+	bool gone;
+
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount > 1) {
+		/* Somebody picked up a reference meanwhile. */
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
+		return EBUSY;
+	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Once we say this end is closed, the other may free the pipe. */
+	vnode_cleanup(v);
+
+	spinlock_acquire(&p->p_lock);
+	if (v == &p->p_readvn) {
+		p->p_readable = false;
+		wchan_wakeall(p->p_writewchan, &p->p_lock);
+	}
+	else {
+		p->p_writeable = false;
+		wchan_wakeall(p->p_readwchan, &p->p_lock);
+	}
+	gone = !p->p_readable && !p->p_writeable;
+	spinlock_release(&p->p_lock);
+
+	if (gone) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Reading
+
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	size_t head, n, first, pos, end, resid;
+	char *buf;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	lock_acquire(p->p_rlock);
+	spinlock_acquire(&p->p_lock);
+	while (p->p_count == 0 && p->p_dpos == p->p_dend && p->p_writeable) {
+		wchan_sleep(p->p_readwchan, &p->p_lock);
+	}
+
+	if (p->p_count > 0) {
+		/* What's in the ring, in up to two pieces. */
+		buf = p->p_buf;
+		head = p->p_head;
+		n = p->p_count < uio->uio_resid ? p->p_count : uio->uio_resid;
+		first = p->p_size - head < n ? p->p_size - head : n;
+		spinlock_release(&p->p_lock);
+
+		resid = uio->uio_resid;
+		result = uiomove(buf + head, first, uio);
+		if (!result && n > first) {
+			result = uiomove(buf, n - first, uio);
+		}
+		n = resid - uio->uio_resid;
+
+		spinlock_acquire(&p->p_lock);
+		p->p_head = (head + n) % p->p_size;
+		p->p_count -= n;
+		wchan_wakeall(p->p_writewchan, &p->p_lock);
+	}
+	else if (p->p_dpos < p->p_dend) {
+		/* Out of the writer's pages. */
+		pos = p->p_dpos;
+		end = p->p_dend;
+		spinlock_release(&p->p_lock);
+
+		while (pos < end && uio->uio_resid > 0 && !result) {
+			n = PAGE_SIZE - pos % PAGE_SIZE;
+			if (n > end - pos) {
+				n = end - pos;
+			}
+			buf = (char *)PADDR_TO_KVADDR(p->p_dpages[pos / PAGE_SIZE]);
+			resid = uio->uio_resid;
+			result = uiomove(buf + pos % PAGE_SIZE, n, uio);
+			pos += resid - uio->uio_resid;
+		}
+
+		spinlock_acquire(&p->p_lock);
+		p->p_dpos = pos;
+		if (pos == end) {
+			wchan_wakeall(p->p_writewchan, &p->p_lock);
+		}
+	}
+	spinlock_release(&p->p_lock);
+	lock_release(p->p_rlock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Writing
+
+/*
+ * Double the size of the ring. Called with p_wlock held; takes
+ * p_rlock too, since the reader may be copying out of the old one.
+ */
+static
+void
+pipe_grow(struct pipe *p)
+{
+	char *newbuf, *oldbuf;
+	size_t newsize, first;
+
+	KASSERT(lock_do_i_hold(p->p_wlock));
+
+	newsize = p->p_size * 2;
+	newbuf = kmalloc(newsize);
+	if (newbuf == NULL) {
+		/* not a problem; we'll wait for room instead */
+		return;
+	}
+
+	lock_acquire(p->p_rlock);
+	spinlock_acquire(&p->p_lock);
+
+	/* Straighten it out on the way. */
+	first = p->p_size - p->p_head;
+	if (first > p->p_count) {
+		first = p->p_count;
+	}
+	memcpy(newbuf, p->p_buf + p->p_head, first);
+	memcpy(newbuf + first, p->p_buf, p->p_count - first);
+
+	oldbuf = p->p_buf;
+	p->p_buf = newbuf;
+	p->p_size = newsize;
+	p->p_head = 0;
+
+	spinlock_release(&p->p_lock);
+	lock_release(p->p_rlock);
+	kfree(oldbuf);
+}
+
+/*
+ * Skip the empty iovecs at the front of UIO, and return the first
+ * one with something in it.
+ */
+static
+struct iovec *
+pipe_curiov(struct uio *uio)
+{
+	KASSERT(uio->uio_resid > 0);
+
+	while (uio->uio_iov->iov_len == 0) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+		KASSERT(uio->uio_iovcnt > 0);
+	}
+	return uio->uio_iov;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Lend the readers the pages of (the first part of) the current iovec
+ * of UIO, which is in user space, and sleep until they have read it
+ * all, or the read end is closed. Called with p_wlock held.
+ */
+static
+int
+pipe_write_direct(struct pipe *p, struct uio *uio)
+{
+	struct iovec *iov;
+	vaddr_t va;
+	size_t offset, len, n;
+	unsigned npages, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(p->p_wlock));
+	KASSERT(uio->uio_segflg == UIO_USERSPACE);
+
+	iov = pipe_curiov(uio);
+	va = (vaddr_t)iov->iov_ubase;
+	offset = va % PAGE_SIZE;
+	len = iov->iov_len;
+	if (len > PIPE_DIRECT_PAGES * PAGE_SIZE - offset) {
+		len = PIPE_DIRECT_PAGES * PAGE_SIZE - offset;
+	}
+	npages = (offset + len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	for (i=0; i<npages; i++) {
+		result = vm_loan_page(va - offset + i * PAGE_SIZE,
+				      &p->p_dpages[i]);
+		if (result) {
+			while (i-- > 0) {
+				vm_unloan_page(p->p_dpages[i]);
+			}
+			return result;
+		}
+	}
+
+	spinlock_acquire(&p->p_lock);
+	KASSERT(p->p_dpos == p->p_dend);
+	p->p_dpos = offset;
+	p->p_dend = offset + len;
+	wchan_wakeall(p->p_readwchan, &p->p_lock);
+	while (p->p_dpos < p->p_dend && p->p_readable) {
+		wchan_sleep(p->p_writewchan, &p->p_lock);
+	}
+	n = p->p_dpos - offset;
+	p->p_dpos = p->p_dend = 0;
+	spinlock_release(&p->p_lock);
+
+	for (i=0; i<npages; i++) {
+		vm_unloan_page(p->p_dpages[i]);
+	}
+
+	/* Account for what was read, as uiomove would have. */
+	iov->iov_ubase += n;
+	iov->iov_len -= n;
+	uio->uio_resid -= n;
+	uio->uio_offset += n;
+
+	return n < len ? EPIPE : 0;
+}
+#endif
+
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	size_t need, tail, n, first, resid, total;
+	char *buf;
+	int result = 0;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	/* Small writes go in all at once; larger ones as room appears. */
+	total = uio->uio_resid;
+	need = total <= PIPE_BUF ? total : 1;
+
+	while (uio->uio_resid > 0 && !result) {
+		lock_acquire(p->p_wlock);
+
+#if !OPT_DUMBVM
+		if (uio->uio_segflg == UIO_USERSPACE &&
+		    uio->uio_resid >= PIPE_DIRECT_MIN) {
+			result = pipe_write_direct(p, uio);
+			lock_release(p->p_wlock);
+			continue;
+		}
+#endif
+
+		spinlock_acquire(&p->p_lock);
+		while (p->p_readable && p->p_size - p->p_count < need) {
+			if (p->p_size < PIPE_MAXSIZE) {
+				spinlock_release(&p->p_lock);
+				pipe_grow(p);
+				spinlock_acquire(&p->p_lock);
+				if (p->p_size - p->p_count >= need) {
+					break;
+				}
+			}
+			wchan_sleep(p->p_writewchan, &p->p_lock);
+		}
+		if (!p->p_readable) {
+			spinlock_release(&p->p_lock);
+			lock_release(p->p_wlock);
+			result = EPIPE;
+			break;
+		}
+
+		/* As much as fits, in up to two pieces. */
+		buf = p->p_buf;
+		tail = (p->p_head + p->p_count) % p->p_size;
+		n = p->p_size - p->p_count;
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		first = p->p_size - tail < n ? p->p_size - tail : n;
+		spinlock_release(&p->p_lock);
+
+		resid = uio->uio_resid;
+		result = uiomove(buf + tail, first, uio);
+		if (!result && n > first) {
+			result = uiomove(buf, n - first, uio);
+		}
+		n = resid - uio->uio_resid;
+
+		spinlock_acquire(&p->p_lock);
+		p->p_count += n;
+		wchan_wakeall(p->p_readwchan, &p->p_lock);
+		spinlock_release(&p->p_lock);
+
+		lock_release(p->p_wlock);
+	}
+
+	/* A write that got somewhere before the reader left is short. */
+	if (result == EPIPE && uio->uio_resid < total) {
+		result = 0;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Everything else
+
+static
+int
+pipe_eachopen(struct vnode *v, int openflags)
+{
+	/* Pipes are made by pipe_create, not opened by name. */
+	(void)v;
+	(void)openflags;
+	return EINVAL;
+}
+
+static
+int
+pipe_badend(struct vnode *v, struct uio *uio)
+{
+	/* Reading the write end or writing the read end. */
+	(void)v;
+	(void)uio;
+	return EBADF;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *p = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	/* The size is what's waiting to be read. */
+	spinlock_acquire(&p->p_lock);
+	statbuf->st_size = p->p_count + (p->p_dend - p->p_dpos);
+	spinlock_release(&p->p_lock);
+
+	statbuf->st_mode = _S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_BUF;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *result)
+{
+	(void)v;
+	*result = _S_IFIFO;
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *v)
+{
+	(void)v;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	/* Nothing is stored anywhere. */
+	(void)v;
+	return EINVAL;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_namefile(struct vnode *v, struct uio *uio)
+{
+	/* Pipes have no names. */
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+/*
+ * Function tables for the two ends.
+ */
+static const struct vnode_ops pipe_readops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = pipe_badend,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = pipe_mmap,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = pipe_namefile,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+static const struct vnode_ops pipe_writeops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_badend,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = pipe_mmap,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = pipe_namefile,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
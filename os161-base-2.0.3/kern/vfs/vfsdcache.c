@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name cache: (directory vnode, name) -> vnode.
+ *
+ * vfs_lookup and vfs_lookparent walk paths one component at a time
+ * and ask here before calling VOP_LOOKUP, so repeated lookups of the
+ * same names (/bin/sh on every exec, the same files over and over)
+ * don't go back to the file system. A negative entry records that a
+ * name does not exist.
+ *
+ * Entries are keyed on the directory vnode, so they stay correct when
+ * directories are renamed; each entry holds a reference to both the
+ * directory and (if positive) the vnode found, which keeps the
+ * pointers from being reused. The VFS operations that change names
+ * (vfspath.c) purge the affected entries after the file system has
+ * made the change, and unmount purges the whole volume first.
+ *
+ * A lookup that misses remembers the purge generation before calling
+ * VOP_LOOKUP; if anything was purged meanwhile, the result may
+ * already be stale and isn't entered.
+ *
+ * Only file system vnodes are cached (not devices), and not "." and
+ * "..", or names too long for an entry. Changes made behind the VFS's
+ * back, such as on the host side of emufs, are not noticed.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries, and of hash buckets (a power of 2) */
+#define DCACHE_SIZE		512
+#define DCACHE_NBUCKETS		256
+
+/* Longest name cached */
+#define DCACHE_NAMELEN		31
+
+struct dcentry {
+	struct vnode *dc_dir;		/* directory (a reference) */
+	struct vnode *dc_vn;		/* vnode (a reference), or NULL */
+	unsigned dc_hash;		/* hash of dc_dir and dc_name */
+	struct dcentry *dc_hashnext;	/* next in bucket */
+	struct dcentry *dc_lruprev;	/* LRU list, most recent first */
+	struct dcentry *dc_lrunext;	/* (also links the free list) */
+	char dc_name[DCACHE_NAMELEN+1];
+};
+
+/* Counters, printed by vfs_dcache_printstats. */
+struct dcstats {
+	unsigned ds_hits;		/* found a vnode */
+	unsigned ds_neghits;		/* found a negative entry */
+	unsigned ds_misses;		/* not found */
+	unsigned ds_uncached;		/* lookups we don't cache */
+	unsigned ds_enters;		/* entries made */
+	unsigned ds_stale;		/* entries not made; purge raced */
+	unsigned ds_evictions;		/* entries recycled by LRU */
+	unsigned ds_purges;		/* entries purged */
+};
+
+/*
+ * dcache_lock protects everything here. It's a spinlock because
+ * lookups hold it only for a hash probe; references are dropped after
+ * releasing it, as VOP_DECREF can sleep.
+ */
+static struct spinlock dcache_lock = SPINLOCK_INITIALIZER;
+static struct dcentry *dcache_entries;
+static struct dcentry *dcache_hash[DCACHE_NBUCKETS];
+static struct dcentry *dcache_lruhead, *dcache_lrutail;
+static struct dcentry *dcache_free;
+static unsigned dcache_count;
+static unsigned dcache_gen;
+static struct dcstats dcache_stats;
+
+/*
+ * Hash a directory and a name.
+ */
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (unsigned)(uintptr_t)dir >> 4;
+	for (; *name; name++) {
+		h = h*33 + (unsigned char)*name;
+	}
+	return h;
+}
+
+/*
+ * Can we cache NAME in DIR?
+ */
+static
+bool
+dcache_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL) {
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return false;
+	}
+	return strlen(name) <= DCACHE_NAMELEN;
+}
+
+/*
+ * Find an entry. Call with dcache_lock held.
+ */
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct dcentry *e;
+
+	for (e = dcache_hash[hash % DCACHE_NBUCKETS]; e != NULL;
+	     e = e->dc_hashnext) {
+		if (e->dc_hash == hash && e->dc_dir == dir &&
+		    !strcmp(e->dc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * LRU list operations. Call with dcache_lock held.
+ */
+static
+void
+dcache_lru_remove(struct dcentry *e)
+{
+	if (e->dc_lruprev != NULL) {
+		e->dc_lruprev->dc_lrunext = e->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = e->dc_lrunext;
+	}
+	if (e->dc_lrunext != NULL) {
+		e->dc_lrunext->dc_lruprev = e->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = e->dc_lruprev;
+	}
+	e->dc_lruprev = e->dc_lrunext = NULL;
+}
+
+static
+void
+dcache_lru_addhead(struct dcentry *e)
+{
+	e->dc_lruprev = NULL;
+	e->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = e;
+	}
+	else {
+		dcache_lrutail = e;
+	}
+	dcache_lruhead = e;
+}
+
+/*
+ * Take an entry out of the hash table and LRU list. Its references
+ * stay with it. Call with dcache_lock held.
+ */
+static
+void
+dcache_detach(struct dcentry *e)
+{
+	struct dcentry **pp;
+
+	for (pp = &dcache_hash[e->dc_hash % DCACHE_NBUCKETS]; *pp != e;
+	     pp = &(*pp)->dc_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = e->dc_hashnext;
+	e->dc_hashnext = NULL;
+
+	dcache_lru_remove(e);
+	KASSERT(dcache_count > 0);
+	dcache_count--;
+}
+
+/*
+ * Purge an entry: detach it and put it on the list DEAD, to be handed
+ * to dcache_release once dcache_lock is released. Call with
+ * dcache_lock held.
+ */
+static
+void
+dcache_purgeentry(struct dcentry *e, struct dcentry **dead)
+{
+	dcache_detach(e);
+	dcache_stats.ds_purges++;
+	e->dc_lrunext = *dead;
+	*dead = e;
+}
+
+/*
+ * Drop the references held by a list of purged entries and put them
+ * on the free list. Call without dcache_lock.
+ */
+static
+void
+dcache_release(struct dcentry *dead)
+{
+	struct dcentry *e, *next;
+
+	for (e = dead; e != NULL; e = e->dc_lrunext) {
+		if (e->dc_vn != NULL) {
+			VOP_DECREF(e->dc_vn);
+		}
+		VOP_DECREF(e->dc_dir);
+	}
+
+	spinlock_acquire(&dcache_lock);
+	for (e = dead; e != NULL; e = next) {
+		next = e->dc_lrunext;
+		e->dc_dir = e->dc_vn = NULL;
+		e->dc_lrunext = dcache_free;
+		dcache_free = e;
+	}
+	spinlock_release(&dcache_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Look up NAME in DIR. Returns true on a hit, with *RET set to a new
+ * reference to the vnode, or to NULL if the name is known not to
+ * exist. On a miss, *GENP gets the value to hand vfs_dcache_enter
+ * after asking the file system.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+		  unsigned *genp)
+{
+	struct dcentry *e;
+	unsigned hash;
+
+	if (!dcache_cacheable(dir, name)) {
+		spinlock_acquire(&dcache_lock);
+		dcache_stats.ds_uncached++;
+		*genp = dcache_gen;
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+
+	hash = dcache_hashfunc(dir, name);
+
+	spinlock_acquire(&dcache_lock);
+	e = dcache_find(dir, name, hash);
+	if (e == NULL) {
+		dcache_stats.ds_misses++;
+		*genp = dcache_gen;
+		spinlock_release(&dcache_lock);
+		return false;
+	}
+
+	if (e != dcache_lruhead) {
+		dcache_lru_remove(e);
+		dcache_lru_addhead(e);
+	}
+	*ret = e->dc_vn;
+	if (e->dc_vn != NULL) {
+		VOP_INCREF(e->dc_vn);
+		dcache_stats.ds_hits++;
+	}
+	else {
+		dcache_stats.ds_neghits++;
+	}
+	spinlock_release(&dcache_lock);
+	return true;
+}
+
+/*
+ * Remember that NAME in DIR is VN (or, if VN is NULL, that it does
+ * not exist), as found by a lookup that missed at generation GEN.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct dcentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	unsigned hash;
+
+	if (!dcache_cacheable(dir, name)) {
+		return;
+	}
+
+	hash = dcache_hashfunc(dir, name);
+
+	/* The entry's references; VOP_INCREF doesn't sleep. */
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&dcache_lock);
+	if (gen != dcache_gen) {
+		/* Something was purged meanwhile; this may be stale. */
+		dcache_stats.ds_stale++;
+		spinlock_release(&dcache_lock);
+		goto drop;
+	}
+	if (dcache_find(dir, name, hash) != NULL) {
+		/* Someone else got here first */
+		spinlock_release(&dcache_lock);
+		goto drop;
+	}
+
+	if (dcache_free != NULL) {
+		e = dcache_free;
+		dcache_free = e->dc_lrunext;
+	}
+	else {
+		/* Recycle the least recently used entry */
+		e = dcache_lrutail;
+		KASSERT(e != NULL);
+		dcache_detach(e);
+		olddir = e->dc_dir;
+		oldvn = e->dc_vn;
+		dcache_stats.ds_evictions++;
+	}
+
+	e->dc_dir = dir;
+	e->dc_vn = vn;
+	e->dc_hash = hash;
+	strcpy(e->dc_name, name);
+	e->dc_hashnext = dcache_hash[hash % DCACHE_NBUCKETS];
+	dcache_hash[hash % DCACHE_NBUCKETS] = e;
+	dcache_lru_addhead(e);
+	dcache_count++;
+	dcache_stats.ds_enters++;
+	spinlock_release(&dcache_lock);
+
+	if (oldvn != NULL) {
+		VOP_DECREF(oldvn);
+	}
+	if (olddir != NULL) {
+		VOP_DECREF(olddir);
+	}
+	return;
+
+ drop:
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	VOP_DECREF(dir);
+}
+
+/*
+ * Forget NAME in DIR, after the file system has changed what it
+ * means. If CHILDREN is set and NAME was a directory, also forget the
+ * names looked up in it, so the cache doesn't keep a removed
+ * directory alive.
+ */
+void
+vfs_dcache_purge(struct vnode *dir, const char *name, bool children)
+{
+	struct dcentry *e, *next, *dead = NULL;
+	struct vnode *vn;
+
+	spinlock_acquire(&dcache_lock);
+
+	/* Whatever happens, lookups in flight mustn't enter results. */
+	dcache_gen++;
+
+	if (!dcache_cacheable(dir, name)) {
+		spinlock_release(&dcache_lock);
+		return;
+	}
+
+	e = dcache_find(dir, name, dcache_hashfunc(dir, name));
+	if (e == NULL) {
+		spinlock_release(&dcache_lock);
+		return;
+	}
+	vn = e->dc_vn;
+	dcache_purgeentry(e, &dead);
+
+	if (children && vn != NULL) {
+		for (e = dcache_lruhead; e != NULL; e = next) {
+			next = e->dc_lrunext;
+			if (e->dc_dir == vn) {
+				dcache_purgeentry(e, &dead);
+			}
+		}
+	}
+	spinlock_release(&dcache_lock);
+
+	dcache_release(dead);
+}
+
+/*
+ * Forget everything on file system FS, as at unmount.
+ */
+void
+vfs_dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *e, *next, *dead = NULL;
+
+	spinlock_acquire(&dcache_lock);
+	dcache_gen++;
+	for (e = dcache_lruhead; e != NULL; e = next) {
+		next = e->dc_lrunext;
+		if (e->dc_dir->vn_fs == fs) {
+			dcache_purgeentry(e, &dead);
+		}
+	}
+	spinlock_release(&dcache_lock);
+
+	dcache_release(dead);
+}
+
+void
+vfs_dcache_printstats(void)
+{
+	struct dcstats s;
+	unsigned count, lookups, hits;
+
+	spinlock_acquire(&dcache_lock);
+	s = dcache_stats;
+	count = dcache_count;
+	spinlock_release(&dcache_lock);
+
+	lookups = s.ds_hits + s.ds_neghits + s.ds_misses;
+	hits = s.ds_hits + s.ds_neghits;
+
+	kprintf("Name cache: %u/%u entries\n", count, DCACHE_SIZE);
+	kprintf("    hits: %u, negative hits: %u, misses: %u "
+		"(hit rate %u%%)\n", s.ds_hits, s.ds_neghits, s.ds_misses,
+		lookups == 0 ? 0 : (100 * hits) / lookups);
+	kprintf("    not cacheable: %u\n", s.ds_uncached);
+	kprintf("    entered: %u, not entered (raced): %u\n",
+		s.ds_enters, s.ds_stale);
+	kprintf("    evictions: %u, purges: %u\n",
+		s.ds_evictions, s.ds_purges);
+}
+
+void
+vfs_dcache_resetstats(void)
+{
+	spinlock_acquire(&dcache_lock);
+	bzero(&dcache_stats, sizeof(dcache_stats));
+	spinlock_release(&dcache_lock);
+}
+
+/*
+ * Setup function
+ */
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_entries = kmalloc(DCACHE_SIZE * sizeof(struct dcentry));
+	if (dcache_entries == NULL) {
+		panic("vfs: Could not allocate name cache\n");
+	}
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].dc_dir = NULL;
+		dcache_entries[i].dc_vn = NULL;
+		dcache_entries[i].dc_hashnext = NULL;
+		dcache_entries[i].dc_lruprev = NULL;
+		dcache_entries[i].dc_lrunext = dcache_free;
+		dcache_free = &dcache_entries[i];
+	}
+}
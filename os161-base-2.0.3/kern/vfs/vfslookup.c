@@ -35,12 +35,14 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
+#include <stat.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +53,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +79,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +93,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,9 +112,7 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
@@ -133,8 +129,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Entirely empty filenames aren't legal.
 	 */
@@ -195,11 +189,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		spinlock_acquire(&bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -234,23 +231,113 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up one name in DIR, asking the name cache first and filling
+ * it in on a miss. A negative cache entry comes back as ENOENT.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (vfs_dcache_lookup(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == ENOENT) {
+		vfs_dcache_enter(dir, name, NULL, gen);
+		return result;
+	}
+	if (result) {
+		return result;
+	}
+	vfs_dcache_enter(dir, name, vn, gen);
+	*ret = vn;
+	return 0;
+}
+
+/*
+ * Translate PATH relative to STARTVN one component at a time.
+ * Consumes the reference to STARTVN. PATH is modified.
+ */
+static
+int
+lookup_path(struct vnode *startvn, char *path, struct vnode **ret)
+{
+	struct vnode *dir, *next;
+	char *name, *s;
+	bool trailingslash = false;
+	mode_t type;
+	int result;
+
+	dir = startvn;
+	name = path;
+	while (*name != 0) {
+		s = strchr(name, '/');
+		if (s != NULL) {
+			*s++ = 0;
+			while (*s == '/') {
+				s++;
+			}
+			trailingslash = (*s == 0);
+		}
+		else {
+			s = name + strlen(name);
+		}
+
+		result = lookup_component(dir, name, &next);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = next;
+		name = s;
+	}
+
+	if (trailingslash) {
+		/* "foo/" must be a directory */
+		result = VOP_GETTYPE(dir, &type);
+		if (result == 0 && (type & S_IFMT) != S_IFDIR) {
+			result = ENOTDIR;
+		}
+		if (result) {
+			VOP_DECREF(dir);
+			return result;
+		}
+	}
+
+	*ret = dir;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * getdevice only needs knowndevs_lock (inside vfs_getroot) and
+ * bootfs_lock, the name cache only its own spinlock, and the file
+ * systems lock what they need in VOP_LOOKUP and VOP_LOOKPARENT. So
+ * lookups run in parallel as far as the file system allows.
  */
 
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *name;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -260,15 +347,30 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		return EINVAL;
 	}
-	else {
+
+	/*
+	 * Resolve everything up to the last slash through the name
+	 * cache and let the file system handle the last name. Paths
+	 * with no slash, or that end in one, go to the file system
+	 * whole, which knows what it makes of them.
+	 */
+	name = strrchr(path, '/');
+	if (name == NULL || name[1] == 0) {
 		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		VOP_DECREF(startvn);
+		return result;
 	}
+	*name++ = 0;
 
-	VOP_DECREF(startvn);
-
-	vfs_biglock_release();
+	result = lookup_path(startvn, path, &dir);
+	if (result) {
+		return result;
+	}
+	result = VOP_LOOKPARENT(dir, name, retval, buf, buflen);
+	VOP_DECREF(dir);
 	return result;
 }
 
@@ -278,23 +380,15 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
-
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	return lookup_path(startvn, path, retval);
 }
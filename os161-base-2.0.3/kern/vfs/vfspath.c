@@ -74,6 +74,10 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			/* drop any negative name cache entry */
+			vfs_dcache_purge(dir, name, false);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -146,6 +150,9 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		vfs_dcache_purge(dir, name, false);
+	}
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +186,15 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		/*
+		 * The name cache is keyed on directory vnodes, so
+		 * names under a moved directory are still good; but
+		 * whatever newname replaced is gone.
+		 */
+		vfs_dcache_purge(olddir, oldname, false);
+		vfs_dcache_purge(newdir, newname, true);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +229,9 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		vfs_dcache_purge(newdir, newname, false);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +259,9 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		vfs_dcache_purge(newdir, newname, false);
+	}
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +308,9 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		vfs_dcache_purge(parent, name, false);
+	}
 
 	VOP_DECREF(parent);
 
@@ -308,6 +333,10 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		/* also let go of the removed directory */
+		vfs_dcache_purge(parent, name, true);
+	}
 
 	VOP_DECREF(parent);
 
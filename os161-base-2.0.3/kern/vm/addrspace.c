@@ -32,12 +32,26 @@
 #include <lib.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <vnode.h>
 #include <proc.h>
+#include <pagetable.h>
+#include <vmstats.h>
 
 /*
- * Note! If OPT_DUMBVM is set, as is the case until you start the VM
- * assignment, this file is not compiled or linked or in any way
- * used. The cheesy hack versions in dumbvm.c are used instead.
+ * Note! If OPT_DUMBVM is set, this file is not compiled or linked or
+ * in any way used. The cheesy hack versions in dumbvm.c are used
+ * instead.
+ *
+ * An address space is a list of regions plus a page table. Nothing is
+ * allocated or loaded up front: vm_fault fills each page the first
+ * time it is touched, using the region to decide whether the page
+ * comes from the executable or is zero-filled. Copying an address
+ * space copies no pages either; they are shared copy-on-write.
+ *
+ * Files mapped with mmap are more regions, filled from the mapped file
+ * instead of the executable. They are always private: there is no
+ * page cache for the mappers of a file to share frames through, so
+ * MAP_SHARED is refused.
  */
 
 struct addrspace *
@@ -50,9 +64,13 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_regions = NULL;
+	as->as_vnode = NULL;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
 
 	return as;
 }
@@ -61,17 +79,52 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct region *rg, *newrg, **tail;
+	struct pagetable *pt;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	tail = &newas->as_regions;
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		newrg = kmalloc(sizeof(*newrg));
+		if (newrg == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*newrg = *rg;
+		newrg->rg_next = NULL;
+		if (newrg->rg_vnode != NULL) {
+			VOP_INCREF(newrg->rg_vnode);
+		}
+		*tail = newrg;
+		tail = &newrg->rg_next;
+	}
+
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		newas->as_vnode = old->as_vnode;
+	}
+
+	result = pt_copy(old->as_pt, &pt);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
+	pt_destroy(newas->as_pt);
+	newas->as_pt = pt;
+
 	/*
-	 * Write this.
+	 * OLD's pages are now copy-on-write, but the TLB may still
+	 * have writeable entries for them.
 	 */
-
-	(void)old;
+	if (old == proc_getas()) {
+		vm_tlbflush();
+	}
+	vmstats_inc(VMSTAT_AS_COPIES);
 
 	*ret = newas;
 	return 0;
@@ -80,9 +133,22 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct region *rg;
+
+	pt_destroy(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 
 	kfree(as);
 }
@@ -101,18 +167,16 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	/* There are no address space IDs, so flush the whole TLB. */
+	vm_tlbflush();
 }
 
 void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Nothing to do: as_activate flushes the TLB before the next
+	 * address space gets to use it.
 	 */
 }
 
@@ -122,32 +186,311 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * to a segment without WRITEABLE fault. The MIPS can't tell reads
+ * from executes, so READABLE and EXECUTABLE are only recorded.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	struct region *rg, **pp;
+	size_t npages;
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return ENOSYS;
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = memsize / PAGE_SIZE;
+
+	/* It must lie entirely in user space... */
+	if (npages == 0 || vaddr >= USERSPACETOP ||
+	    npages > (USERSPACETOP - vaddr) / PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	/* ...and not overlap any other region. Keep the list sorted. */
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->rg_next) {
+		rg = *pp;
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+		    rg->rg_vbase < vaddr + memsize) {
+			return EINVAL;
+		}
+		if (rg->rg_vbase > vaddr) {
+			break;
+		}
+	}
+
+	rg = kmalloc(sizeof(*rg));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	/* anything accessible at all is readable, as far as the TLB goes */
+	rg->rg_flags = (readable || writeable || executable ? RG_READ : 0) |
+		(writeable ? RG_WRITE : 0) |
+		(executable ? RG_EXEC : 0);
+	rg->rg_fvaddr = vaddr;
+	rg->rg_filesize = 0;
+	rg->rg_foffset = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_next = *pp;
+	*pp = rg;
+
+	return 0;
+}
+
+/*
+ * Arrange for FILESIZE bytes at VADDR to be read from V at OFFSET
+ * when the pages they fall in are first touched. This replaces
+ * actually reading the segment in load_segment.
+ */
+int
+as_define_file(struct addrspace *as, struct vnode *v, vaddr_t vaddr,
+	       size_t filesize, off_t offset)
+{
+	struct region *rg;
+	vaddr_t top;
+
+	if (filesize == 0) {
+		return 0;
+	}
+
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	if (filesize > top - vaddr) {
+		return ENOEXEC;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	else if (as->as_vnode != v) {
+		/* all segments come from the same executable */
+		return EINVAL;
+	}
+
+	rg->rg_fvaddr = vaddr;
+	rg->rg_filesize = filesize;
+	rg->rg_foffset = offset;
+	return 0;
+}
+
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+bool
+as_fills_from(struct addrspace *as, vaddr_t vaddr, size_t len,
+	      struct vnode *v)
+{
+	struct region *rg;
+	struct vnode *rv;
+	vaddr_t top;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		rv = rg->rg_vnode != NULL ? rg->rg_vnode : as->as_vnode;
+		if (rv != v || rg->rg_filesize == 0) {
+			continue;
+		}
+		top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (vaddr < top && vaddr + len > rg->rg_vbase) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Find NPAGES free pages of address space for a mapping, in the
+ * highest gap between regions that has room, so that mappings pile up
+ * below the stack and out of the program's way. Page 0 is never used,
+ * so that a null pointer never points into a mapping.
+ */
+static
+int
+as_find_free(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t start, end;
+	bool found;
+
+	found = false;
+	start = PAGE_SIZE;
+	rg = as->as_regions;
+	while (1) {
+		end = rg != NULL ? rg->rg_vbase : USERSPACETOP;
+		if (end > start && (end - start) / PAGE_SIZE >= npages) {
+			*ret = end - npages * PAGE_SIZE;
+			found = true;
+		}
+		if (rg == NULL) {
+			break;
+		}
+		start = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		rg = rg->rg_next;
+	}
+	return found ? 0 : ENOMEM;
+}
+
+int
+as_map(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+       int flags, vaddr_t *vaddr)
+{
+	struct region *rg;
+	size_t npages;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+	    (*vaddr & ~(vaddr_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if (*vaddr == 0) {
+		result = as_find_free(as, npages, vaddr);
+		if (result) {
+			return result;
+		}
+	}
+	result = as_define_region(as, *vaddr, npages * PAGE_SIZE,
+				  flags & RG_READ, flags & RG_WRITE,
+				  flags & RG_EXEC);
+	if (result) {
+		return result;
+	}
+
+	rg = as_find_region(as, *vaddr);
+	KASSERT(rg != NULL && rg->rg_vbase == *vaddr);
+	rg->rg_flags |= RG_MAPPED;
+	if (v != NULL) {
+		rg->rg_filesize = npages * PAGE_SIZE;
+		rg->rg_foffset = offset;
+		VOP_INCREF(v);
+		rg->rg_vnode = v;
+	}
+	return 0;
+}
+
+/*
+ * Shrink mapped region RG to the pages from LO to HI.
+ */
+static
+void
+as_trim_region(struct region *rg, vaddr_t lo, vaddr_t hi)
+{
+	KASSERT(rg->rg_flags & RG_MAPPED);
+	KASSERT(lo >= rg->rg_vbase && lo < hi);
+	KASSERT(hi <= rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+
+	rg->rg_foffset += lo - rg->rg_vbase;
+	rg->rg_vbase = lo;
+	rg->rg_npages = (hi - lo) / PAGE_SIZE;
+	rg->rg_fvaddr = lo;
+	if (rg->rg_vnode != NULL) {
+		rg->rg_filesize = hi - lo;
+	}
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg, *upper, **pp;
+	vaddr_t end, top, lo, hi;
+
+	if (len == 0 || (vaddr & ~(vaddr_t)PAGE_FRAME) != 0 ||
+	    vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	end = (vaddr + len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	/* Only mappings can be unmapped. */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (vaddr < top && rg->rg_vbase < end &&
+		    !(rg->rg_flags & RG_MAPPED)) {
+			return EINVAL;
+		}
+	}
+
+	pp = &as->as_regions;
+	while ((rg = *pp) != NULL) {
+		top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (top <= vaddr || rg->rg_vbase >= end) {
+			pp = &rg->rg_next;
+			continue;
+		}
+		lo = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+		hi = end < top ? end : top;
+
+		/* A hole in the middle leaves two regions. */
+		upper = NULL;
+		if (lo > rg->rg_vbase && hi < top) {
+			upper = kmalloc(sizeof(*upper));
+			if (upper == NULL) {
+				return ENOMEM;
+			}
+		}
+
+		if (as == proc_getas()) {
+			vm_tlbflush();
+		}
+		pt_unmap(as->as_pt, lo, (hi - lo) / PAGE_SIZE);
+
+		if (lo == rg->rg_vbase && hi == top) {
+			*pp = rg->rg_next;
+			if (rg->rg_vnode != NULL) {
+				VOP_DECREF(rg->rg_vnode);
+			}
+			kfree(rg);
+			continue;
+		}
+		if (upper != NULL) {
+			*upper = *rg;
+			as_trim_region(upper, hi, top);
+			if (upper->rg_vnode != NULL) {
+				VOP_INCREF(upper->rg_vnode);
+			}
+			rg->rg_next = upper;
+			as_trim_region(rg, rg->rg_vbase, lo);
+		}
+		else if (lo == rg->rg_vbase) {
+			as_trim_region(rg, hi, top);
+		}
+		else {
+			as_trim_region(rg, rg->rg_vbase, lo);
+		}
+		pp = &rg->rg_next;
+	}
+	return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * Nothing to do: pages are loaded on demand.
 	 */
 
 	(void)as;
@@ -158,7 +501,7 @@ int
 as_complete_load(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * Nothing to do: pages are loaded on demand.
 	 */
 
 	(void)as;
@@ -168,15 +511,16 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 
 	return 0;
 }
-
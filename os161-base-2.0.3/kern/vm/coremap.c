@@ -0,0 +1,1030 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Coremap: physical page frame allocator.
+ *
+ * Until coremap_bootstrap runs, pages come from ram_stealmem and can
+ * never be freed. After that, every physical page has a coremap entry.
+ *
+ * Free pages are kept by a binary buddy allocator: a free list per
+ * order, where a block of order K is 2^K pages aligned to 2^K pages.
+ * Allocating splits the smallest big-enough block, freeing merges a
+ * block with its buddy as long as the buddy is free too, so both take
+ * O(COREMAP_MAXORDER) time. A kernel block that isn't a power of two
+ * gets its unused tail given back right away.
+ *
+ * Single pages, which are nearly all requests (user pages and kmalloc
+ * pages), go through a small per-CPU cache first, so most of them
+ * never touch coremap_lock. Each cache is refilled from and flushed to
+ * the buddy allocator COREMAP_PCPU_BATCH pages at a time. If the buddy
+ * allocator runs dry, the other CPUs' caches are drained before
+ * giving up.
+ *
+ * Locking: coremap_lock protects the free lists, the entries of pages
+ * that are free in the buddy allocator, and the reference counts of
+ * user pages. Each per-CPU cache has its own lock, taken before
+ * coremap_lock if both are needed. The entry of an allocated page (or
+ * a cached one) belongs to whoever holds the page.
+ *
+ * User pages are reference counted so that copy-on-write can share
+ * them between address spaces. A shared page has no single owner, so
+ * its cme_as is NULL until all but one of the sharers let go and the
+ * last one claims it with coremap_unshare_upage.
+ *
+ * User page entries are different: the page-out code looks at all of
+ * them, so they only change state under coremap_lock. A user page is
+ * pinned (CMF_BUSY) by whoever is changing its mapping or contents;
+ * the rest of its entry then belongs to them. coremap_wchan is for
+ * waiting for a pin to go away.
+ *
+ * When memory runs out, single-page allocations page something out
+ * (swap_evict) and try again. Victims are chosen by a clock hand over
+ * the coremap: unshared user pages that aren't pinned, skipping (and
+ * clearing the reference bit of) those that were used since the hand
+ * last went by. Shared pages have no single page table entry that
+ * could be changed to point at swap, so they stay in memory.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <vmstats.h>
+
+#define CME_FREE	0	/* in the buddy allocator */
+#define CME_CACHED	1	/* in a per-CPU cache */
+#define CME_RESERVED	2	/* kernel image, or stolen before bootstrap */
+#define CME_KERNEL	3	/* part of a kernel block */
+#define CME_USER	4	/* a page of some address space */
+
+/* cme_order of a free page that isn't the first of its block */
+#define CME_NOTHEAD	0xff
+
+/* cme_flags for user pages */
+#define CMF_BUSY	0x01	/* pinned */
+#define CMF_REF		0x02	/* used since the clock hand went by */
+#define CMF_DIRTY	0x04	/* differs from its backing store */
+
+/* Times to page something out and retry before giving up on a page */
+#define COREMAP_EVICT_TRIES	8
+
+struct coremap_entry {
+	struct addrspace *cme_as;	/* owner (unshared user pages) */
+	vaddr_t cme_vaddr;		/* virtual page (unshared user pages) */
+	unsigned cme_npages;		/* block length (first kernel page) */
+	unsigned cme_refcount;		/* mappings (user pages) */
+	int cme_slot;			/* clean copy on swap (user pages) */
+	int cme_next, cme_prev;		/* free list links (free heads) */
+	uint8_t cme_state;		/* CME_* */
+	uint8_t cme_order;		/* block order (free heads) */
+	uint8_t cme_flags;		/* CMF_* (user pages) */
+};
+
+/*
+ * Per-CPU cache of free pages. Also holds this CPU's single-page
+ * allocation counters, so that keeping them is as cheap as the
+ * allocation itself.
+ */
+struct coremap_pcpu {
+	struct spinlock pc_lock;
+	unsigned pc_count;			/* pages in pc_pages */
+	unsigned pc_pages[COREMAP_PCPU_MAX];	/* coremap indexes */
+
+	unsigned pc_allocs;		/* single pages handed out */
+	unsigned pc_refills;		/* times refilled from buddy */
+	unsigned pc_flushes;		/* times flushed to buddy */
+	uint64_t pc_ns;			/* total allocation time */
+	uint32_t pc_maxns;		/* longest allocation */
+};
+
+/* Counters for the buddy allocator, protected by coremap_lock. */
+struct coremap_stats {
+	unsigned cs_allocs;		/* multi-page blocks handed out */
+	unsigned cs_failures;		/* requests that found no block */
+	unsigned cs_splits;		/* blocks split in two */
+	unsigned cs_merges;		/* buddies merged */
+	uint64_t cs_ns;			/* total multi-page allocation time */
+	uint32_t cs_maxns;		/* longest multi-page allocation */
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap;
+static unsigned coremap_npages;		/* entries in coremap */
+static unsigned coremap_nreserved;	/* pages in CME_RESERVED */
+static int coremap_freelist[COREMAP_MAXORDER + 1];
+static unsigned coremap_nfreeblocks[COREMAP_MAXORDER + 1];
+static unsigned coremap_nfree;		/* pages in the buddy allocator */
+static struct coremap_stats coremap_stats;
+static struct coremap_pcpu coremap_pcpus[COREMAP_MAXCPUS];
+static struct wchan *coremap_wchan;	/* for pinned pages */
+static unsigned coremap_hand;		/* page-out clock hand */
+static bool coremap_ready;
+
+////////////////////////////////////////////////////////////
+// Buddy allocator
+
+/*
+ * Put the free block at IDX of order ORDER on its free list.
+ */
+static
+void
+buddy_insert(unsigned idx, unsigned order)
+{
+	int head;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	head = coremap_freelist[order];
+	coremap[idx].cme_state = CME_FREE;
+	coremap[idx].cme_order = order;
+	coremap[idx].cme_prev = -1;
+	coremap[idx].cme_next = head;
+	if (head >= 0) {
+		coremap[head].cme_prev = idx;
+	}
+	coremap_freelist[order] = idx;
+	coremap_nfreeblocks[order]++;
+}
+
+/*
+ * Take the free block at IDX off its free list.
+ */
+static
+void
+buddy_remove(unsigned idx)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(e->cme_state == CME_FREE && e->cme_order != CME_NOTHEAD);
+
+	if (e->cme_prev >= 0) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		coremap_freelist[e->cme_order] = e->cme_next;
+	}
+	if (e->cme_next >= 0) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	coremap_nfreeblocks[e->cme_order]--;
+	e->cme_order = CME_NOTHEAD;
+}
+
+/*
+ * Free the block of 2^ORDER pages at IDX, merging it with its buddy
+ * for as long as the buddy is also free.
+ */
+static
+void
+buddy_free(unsigned idx, unsigned order)
+{
+	unsigned buddy, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(idx % (1U << order) == 0);
+
+	for (i=idx; i<idx + (1U << order); i++) {
+		coremap[i].cme_state = CME_FREE;
+		coremap[i].cme_order = CME_NOTHEAD;
+	}
+	coremap_nfree += 1U << order;
+
+	while (order < COREMAP_MAXORDER) {
+		buddy = idx ^ (1U << order);
+		if (buddy >= coremap_npages ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		buddy_remove(buddy);
+		coremap_stats.cs_merges++;
+		if (buddy < idx) {
+			idx = buddy;
+		}
+		order++;
+	}
+	buddy_insert(idx, order);
+}
+
+/*
+ * Free an arbitrary range of pages, as the largest aligned blocks
+ * that make it up.
+ */
+static
+void
+buddy_free_range(unsigned idx, unsigned npages)
+{
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	while (npages > 0) {
+		order = 0;
+		while (order < COREMAP_MAXORDER &&
+		       idx % (2U << order) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		buddy_free(idx, order);
+		idx += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Allocate a block of 2^ORDER pages. Returns its index, or -1. The
+ * pages are left in CME_FREE state for the caller to claim.
+ */
+static
+int
+buddy_alloc(unsigned order)
+{
+	unsigned o;
+	int idx;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (o = order; o <= COREMAP_MAXORDER; o++) {
+		if (coremap_freelist[o] >= 0) {
+			break;
+		}
+	}
+	if (o > COREMAP_MAXORDER) {
+		return -1;
+	}
+
+	idx = coremap_freelist[o];
+	buddy_remove(idx);
+	while (o > order) {
+		/* split; keep the lower half */
+		o--;
+		buddy_insert(idx + (1U << o), o);
+		coremap_stats.cs_splits++;
+	}
+	coremap_nfree -= 1U << order;
+	return idx;
+}
+
+////////////////////////////////////////////////////////////
+// Per-CPU caches
+
+/*
+ * Return the oldest NPAGES pages of a cache to the buddy allocator.
+ */
+static
+void
+pcpu_flush(struct coremap_pcpu *pc, unsigned npages)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&pc->pc_lock));
+	KASSERT(npages <= pc->pc_count);
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<npages; i++) {
+		buddy_free(pc->pc_pages[i], 0);
+	}
+	spinlock_release(&coremap_lock);
+
+	for (i=npages; i<pc->pc_count; i++) {
+		pc->pc_pages[i - npages] = pc->pc_pages[i];
+	}
+	pc->pc_count -= npages;
+	pc->pc_flushes++;
+}
+
+/*
+ * Give every CPU's cached pages back to the buddy allocator. Used
+ * when memory runs out, in case the pages we need are sitting in
+ * some other CPU's cache.
+ */
+static
+void
+pcpu_drain_all(void)
+{
+	struct coremap_pcpu *pc;
+	unsigned i;
+
+	for (i=0; i<COREMAP_MAXCPUS; i++) {
+		pc = &coremap_pcpus[i];
+		spinlock_acquire(&pc->pc_lock);
+		if (pc->pc_count > 0) {
+			pcpu_flush(pc, pc->pc_count);
+		}
+		spinlock_release(&pc->pc_lock);
+	}
+}
+
+/*
+ * Nanoseconds from START until now.
+ */
+static
+uint32_t
+coremap_elapsed(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return diff.tv_sec * 1000000000 + diff.tv_nsec;
+}
+
+/*
+ * Get one page, from this CPU's cache if possible. Returns its index,
+ * in CME_CACHED state, or -1 if memory is exhausted. If EVICT, page
+ * something out to make room rather than fail.
+ */
+static
+int
+coremap_getpage(bool evict)
+{
+	struct coremap_pcpu *pc;
+	struct timespec start;
+	uint32_t ns;
+	int idx, tries;
+
+	gettime(&start);
+
+	for (tries = 0; ; tries++) {
+		KASSERT(curcpu->c_number < COREMAP_MAXCPUS);
+		pc = &coremap_pcpus[curcpu->c_number];
+
+		spinlock_acquire(&pc->pc_lock);
+		if (pc->pc_count == 0) {
+			/* refill with up to a batch of pages */
+			spinlock_acquire(&coremap_lock);
+			while (pc->pc_count < COREMAP_PCPU_BATCH) {
+				idx = buddy_alloc(0);
+				if (idx < 0) {
+					break;
+				}
+				coremap[idx].cme_state = CME_CACHED;
+				pc->pc_pages[pc->pc_count++] = idx;
+			}
+			spinlock_release(&coremap_lock);
+			pc->pc_refills++;
+		}
+		if (pc->pc_count > 0) {
+			idx = pc->pc_pages[--pc->pc_count];
+			ns = coremap_elapsed(&start);
+			pc->pc_allocs++;
+			pc->pc_ns += ns;
+			if (ns > pc->pc_maxns) {
+				pc->pc_maxns = ns;
+			}
+			spinlock_release(&pc->pc_lock);
+			return idx;
+		}
+		spinlock_release(&pc->pc_lock);
+
+		if (tries == 0) {
+			/* Out of memory here; maybe other CPUs have some. */
+			pcpu_drain_all();
+			continue;
+		}
+		/* Really out of memory; page something out. */
+		if (!evict || tries > COREMAP_EVICT_TRIES ||
+		    swap_evict() == 0) {
+			break;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	coremap_stats.cs_failures++;
+	spinlock_release(&coremap_lock);
+	return -1;
+}
+
+/*
+ * Put a page back in this CPU's cache, flushing part of the cache to
+ * the buddy allocator if it is full.
+ */
+static
+void
+coremap_putpage(unsigned idx)
+{
+	struct coremap_pcpu *pc;
+
+	KASSERT(curcpu->c_number < COREMAP_MAXCPUS);
+	pc = &coremap_pcpus[curcpu->c_number];
+
+	coremap[idx].cme_state = CME_CACHED;
+	coremap[idx].cme_as = NULL;
+	coremap[idx].cme_vaddr = 0;
+	coremap[idx].cme_npages = 0;
+	coremap[idx].cme_refcount = 0;
+	coremap[idx].cme_slot = -1;
+	coremap[idx].cme_flags = 0;
+
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count == COREMAP_PCPU_MAX) {
+		pcpu_flush(pc, COREMAP_PCPU_BATCH);
+	}
+	pc->pc_pages[pc->pc_count++] = idx;
+	spinlock_release(&pc->pc_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Set up the coremap. The array itself is carved out of the first
+ * free physical pages and is reserved, like the kernel image.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t first, last;
+	size_t size;
+	unsigned i;
+
+	last = ram_getsize();
+	coremap_npages = last / PAGE_SIZE;
+	size = coremap_npages * sizeof(struct coremap_entry);
+	size = (size + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	coremap = (struct coremap_entry *)
+		PADDR_TO_KVADDR(ram_stealmem(size / PAGE_SIZE));
+	if (coremap == (struct coremap_entry *)PADDR_TO_KVADDR(0)) {
+		panic("coremap_bootstrap: no memory for the coremap\n");
+	}
+	first = ram_getfirstfree();
+
+	for (i=0; i<COREMAP_MAXCPUS; i++) {
+		spinlock_init(&coremap_pcpus[i].pc_lock);
+		coremap_pcpus[i].pc_count = 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		coremap_freelist[i] = -1;
+		coremap_nfreeblocks[i] = 0;
+	}
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_slot = -1;
+		coremap[i].cme_next = coremap[i].cme_prev = -1;
+		coremap[i].cme_state = CME_RESERVED;
+		coremap[i].cme_order = CME_NOTHEAD;
+		coremap[i].cme_flags = 0;
+	}
+	coremap_nreserved = first / PAGE_SIZE;
+	coremap_nfree = 0;
+	buddy_free_range(coremap_nreserved, coremap_npages - coremap_nreserved);
+	bzero(&coremap_stats, sizeof(coremap_stats));
+	coremap_hand = 0;
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+
+	/* now kmalloc works */
+	coremap_wchan = wchan_create("coremap");
+	if (coremap_wchan == NULL) {
+		panic("coremap_bootstrap: Out of memory\n");
+	}
+}
+
+paddr_t
+coremap_alloc_kpages(unsigned npages)
+{
+	struct timespec start;
+	paddr_t pa;
+	unsigned order, i;
+	uint32_t ns;
+	int first;
+
+	KASSERT(npages > 0);
+
+	if (!coremap_ready) {
+		/* too early; can't be given back */
+		spinlock_acquire(&coremap_lock);
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	if (npages == 1) {
+		first = coremap_getpage(true);
+		if (first < 0) {
+			return 0;
+		}
+		coremap[first].cme_state = CME_KERNEL;
+		coremap[first].cme_npages = 1;
+		return (paddr_t)first * PAGE_SIZE;
+	}
+
+	order = 0;
+	while ((1U << order) < npages) {
+		order++;
+	}
+	if (order > COREMAP_MAXORDER) {
+		return 0;
+	}
+
+	gettime(&start);
+	spinlock_acquire(&coremap_lock);
+	first = buddy_alloc(order);
+	if (first < 0) {
+		spinlock_release(&coremap_lock);
+		/* the pages may be split up in per-CPU caches */
+		pcpu_drain_all();
+		spinlock_acquire(&coremap_lock);
+		first = buddy_alloc(order);
+		if (first < 0) {
+			coremap_stats.cs_failures++;
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+	for (i=first; i<first+npages; i++) {
+		coremap[i].cme_state = CME_KERNEL;
+		coremap[i].cme_npages = 0;
+	}
+	coremap[first].cme_npages = npages;
+	/* give back the part we don't need */
+	buddy_free_range(first + npages, (1U << order) - npages);
+
+	ns = coremap_elapsed(&start);
+	coremap_stats.cs_allocs++;
+	coremap_stats.cs_ns += ns;
+	if (ns > coremap_stats.cs_maxns) {
+		coremap_stats.cs_maxns = ns;
+	}
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)first * PAGE_SIZE;
+}
+
+void
+coremap_free_kpages(paddr_t paddr)
+{
+	unsigned first, i, npages;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	first = paddr / PAGE_SIZE;
+	KASSERT(first < coremap_npages);
+
+	if (coremap[first].cme_state == CME_RESERVED) {
+		/* came from ram_stealmem before we started; leak it */
+		return;
+	}
+	KASSERT(coremap[first].cme_state == CME_KERNEL);
+	npages = coremap[first].cme_npages;
+	KASSERT(npages > 0);
+
+	if (npages == 1) {
+		coremap_putpage(first);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (i=first; i<first+npages; i++) {
+		KASSERT(coremap[i].cme_state == CME_KERNEL);
+		coremap[i].cme_npages = 0;
+	}
+	buddy_free_range(first, npages);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Make page I, from coremap_getpage, virtual page VADDR of AS. It
+ * comes back pinned, so the page-out code leaves it alone until the
+ * caller has filled and mapped it.
+ */
+static
+paddr_t
+coremap_claim_upage(int i, struct addrspace *as, vaddr_t vaddr)
+{
+	spinlock_acquire(&coremap_lock);
+	coremap[i].cme_as = as;
+	coremap[i].cme_vaddr = vaddr;
+	coremap[i].cme_refcount = 1;
+	coremap[i].cme_slot = -1;
+	coremap[i].cme_flags = CMF_BUSY;
+	coremap[i].cme_state = CME_USER;
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)i * PAGE_SIZE;
+}
+
+paddr_t
+coremap_alloc_upage(struct addrspace *as, vaddr_t vaddr)
+{
+	int i;
+
+	KASSERT(coremap_ready);
+
+	i = coremap_getpage(true);
+	if (i < 0) {
+		return 0;
+	}
+	return coremap_claim_upage(i, as, vaddr);
+}
+
+paddr_t
+coremap_tryalloc_upage(struct addrspace *as, vaddr_t vaddr)
+{
+	int i;
+
+	KASSERT(coremap_ready);
+
+	i = coremap_getpage(false);
+	if (i < 0) {
+		return 0;
+	}
+	return coremap_claim_upage(i, as, vaddr);
+}
+
+/*
+ * Get the entry for user page PADDR.
+ */
+static
+struct coremap_entry *
+coremap_uentry(paddr_t paddr)
+{
+	unsigned i;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	i = paddr / PAGE_SIZE;
+	KASSERT(i < coremap_npages);
+	KASSERT(coremap[i].cme_state == CME_USER);
+	return &coremap[i];
+}
+
+/*
+ * Drop one reference to a user page; free it when none are left.
+ * Either way, it is no longer pinned.
+ */
+void
+coremap_free_upage(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	int slot;
+	bool freed;
+
+	spinlock_acquire(&coremap_lock);
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	KASSERT(e->cme_refcount > 0);
+	slot = -1;
+	freed = --e->cme_refcount == 0;
+	if (freed) {
+		/* no longer a user page, as far as the clock is concerned */
+		slot = e->cme_slot;
+		e->cme_slot = -1;
+		e->cme_as = NULL;
+		e->cme_state = CME_CACHED;
+		e->cme_flags = 0;
+	}
+	else {
+		e->cme_flags &= ~CMF_BUSY;
+	}
+	wchan_wakeall(coremap_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+
+	if (slot >= 0) {
+		swap_free(slot);
+	}
+	if (freed) {
+		coremap_putpage(paddr / PAGE_SIZE);
+	}
+}
+
+/*
+ * Add a reference to a user page, which is now shared.
+ */
+void
+coremap_share_upage(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	KASSERT(e->cme_refcount > 0);
+	e->cme_refcount++;
+	e->cme_as = NULL;
+	e->cme_vaddr = 0;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * If AS holds the only reference to a user page, make it the page's
+ * owner again, as virtual page VADDR, and return true. Otherwise the
+ * page is still shared; return false.
+ */
+bool
+coremap_unshare_upage(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	KASSERT(e->cme_refcount > 0);
+	ret = e->cme_refcount == 1;
+	if (ret) {
+		e->cme_as = as;
+		e->cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+bool
+coremap_pin(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	e = coremap_uentry(paddr);
+	ret = !(e->cme_flags & CMF_BUSY);
+	if (ret) {
+		e->cme_flags |= CMF_BUSY;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+/*
+ * Wait until PADDR is not pinned. By then it may not even be a user
+ * page any more, so callers must look up whatever they wanted again.
+ */
+void
+coremap_waitpin(paddr_t paddr)
+{
+	unsigned i;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	i = paddr / PAGE_SIZE;
+	KASSERT(i < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	while (coremap[i].cme_state == CME_USER &&
+	       (coremap[i].cme_flags & CMF_BUSY)) {
+		wchan_sleep(coremap_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_unpin(paddr_t paddr, bool touched)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	e->cme_flags &= ~CMF_BUSY;
+	if (touched) {
+		e->cme_flags |= CMF_REF;
+	}
+	wchan_wakeall(coremap_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * The rest of a pinned page's entry belongs to whoever pinned it, so
+ * these don't need the lock.
+ */
+
+bool
+coremap_isdirty(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	return (e->cme_flags & CMF_DIRTY) != 0;
+}
+
+void
+coremap_setdirty(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	e->cme_flags |= CMF_DIRTY;
+}
+
+int
+coremap_getslot(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	return e->cme_slot;
+}
+
+void
+coremap_setslot(paddr_t paddr, int slot)
+{
+	struct coremap_entry *e;
+
+	e = coremap_uentry(paddr);
+	KASSERT(e->cme_flags & CMF_BUSY);
+	e->cme_slot = slot;
+}
+
+/*
+ * The page-out clock. See the comment at the top of the file.
+ */
+paddr_t
+coremap_victim(bool dirtyok, struct addrspace **as, vaddr_t *vaddr)
+{
+	struct coremap_entry *e;
+	unsigned scanned;
+	paddr_t ret;
+
+	ret = 0;
+	spinlock_acquire(&coremap_lock);
+	for (scanned = 0; scanned < 2 * coremap_npages; ) {
+		e = &coremap[coremap_hand];
+		coremap_hand = (coremap_hand + 1) % coremap_npages;
+		scanned++;
+
+		if (e->cme_state != CME_USER || e->cme_refcount != 1 ||
+		    e->cme_as == NULL || (e->cme_flags & CMF_BUSY)) {
+			continue;
+		}
+		if (!dirtyok && (e->cme_flags & CMF_DIRTY)) {
+			continue;
+		}
+		if (e->cme_flags & CMF_REF) {
+			/* second chance */
+			e->cme_flags &= ~CMF_REF;
+			continue;
+		}
+		e->cme_flags |= CMF_BUSY;
+		*as = e->cme_as;
+		*vaddr = e->cme_vaddr;
+		ret = (paddr_t)(e - coremap) * PAGE_SIZE;
+		break;
+	}
+	spinlock_release(&coremap_lock);
+
+	vmstats_add(VMSTAT_EVICT_SCANNED, scanned);
+	return ret;
+}
+
+bool
+coremap_pin_victim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	e = coremap_uentry(paddr);
+	ret = e->cme_refcount == 1 && e->cme_as == as &&
+		e->cme_vaddr == vaddr &&
+		(e->cme_flags & (CMF_BUSY | CMF_REF | CMF_DIRTY)) == CMF_DIRTY;
+	if (ret) {
+		e->cme_flags |= CMF_BUSY;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+void
+coremap_printstats(void)
+{
+	struct coremap_stats cs;
+	struct coremap_pcpu *pc;
+	unsigned nfreeblocks[COREMAP_MAXORDER + 1];
+	unsigned nbuddy, ncached, nkernel, nuser, largest;
+	unsigned allocs, refills, flushes;
+	uint64_t ns;
+	uint32_t maxns;
+	unsigned i;
+
+	ncached = allocs = refills = flushes = 0;
+	ns = maxns = 0;
+	for (i=0; i<COREMAP_MAXCPUS; i++) {
+		pc = &coremap_pcpus[i];
+		spinlock_acquire(&pc->pc_lock);
+		ncached += pc->pc_count;
+		allocs += pc->pc_allocs;
+		refills += pc->pc_refills;
+		flushes += pc->pc_flushes;
+		ns += pc->pc_ns;
+		if (pc->pc_maxns > maxns) {
+			maxns = pc->pc_maxns;
+		}
+		spinlock_release(&pc->pc_lock);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cs = coremap_stats;
+	nbuddy = coremap_nfree;
+	largest = 0;
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		nfreeblocks[i] = coremap_nfreeblocks[i];
+		if (nfreeblocks[i] > 0) {
+			largest = 1U << i;
+		}
+	}
+	/* An unlocked snapshot; good enough for statistics. */
+	nkernel = nuser = 0;
+	for (i=0; i<coremap_npages; i++) {
+		if (coremap[i].cme_state == CME_KERNEL) {
+			nkernel++;
+		}
+		else if (coremap[i].cme_state == CME_USER) {
+			nuser++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("Physical memory: %u pages\n", coremap_npages);
+	kprintf("    %u free (%u in buddy lists, %u in per-CPU caches), "
+		"%u kernel, %u user, %u reserved\n",
+		nbuddy + ncached, nbuddy, ncached, nkernel, nuser,
+		coremap_nreserved);
+	kprintf("    free blocks by order:");
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		kprintf(" %u", nfreeblocks[i]);
+	}
+	kprintf("\n");
+	/*
+	 * Fragmentation: how much of the free memory is not in the
+	 * largest free block, i.e. unusable for the biggest request
+	 * we could otherwise satisfy.
+	 */
+	kprintf("    largest free block: %u pages, fragmentation %u%%\n",
+		largest, nbuddy == 0 ? 0 : 100 - (100 * largest) / nbuddy);
+	kprintf("    single pages: %u allocs, %u refills, %u flushes, "
+		"%u ns average, %u ns max\n",
+		allocs, refills, flushes,
+		allocs == 0 ? 0 : (unsigned)(ns / allocs), maxns);
+	kprintf("    multi-page blocks: %u allocs, %u ns average, "
+		"%u ns max\n", cs.cs_allocs,
+		cs.cs_allocs == 0 ? 0 : (unsigned)(cs.cs_ns / cs.cs_allocs),
+		cs.cs_maxns);
+	kprintf("    buddy splits: %u, merges: %u, failed requests: %u\n",
+		cs.cs_splits, cs.cs_merges, cs.cs_failures);
+}
+
+void
+coremap_resetstats(void)
+{
+	struct coremap_pcpu *pc;
+	unsigned i;
+
+	for (i=0; i<COREMAP_MAXCPUS; i++) {
+		pc = &coremap_pcpus[i];
+		spinlock_acquire(&pc->pc_lock);
+		pc->pc_allocs = 0;
+		pc->pc_refills = 0;
+		pc->pc_flushes = 0;
+		pc->pc_ns = 0;
+		pc->pc_maxns = 0;
+		spinlock_release(&pc->pc_lock);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	bzero(&coremap_stats, sizeof(coremap_stats));
+	spinlock_release(&coremap_lock);
+}
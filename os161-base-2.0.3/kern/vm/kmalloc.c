@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmem.h>
 
 /*
  * Kernel malloc.
@@ -78,6 +81,13 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    A map from heap page to its entry in that table lets kfree find
+//    the page a block is on without searching.
+//
+//    In front of all this, each CPU keeps a magazine of free blocks of
+//    each size, so most allocations and frees touch neither the heap
+//    pages nor the global lock.
+//
 
 ////////////////////////////////////////
 
@@ -144,8 +154,10 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_samesize;	/* pages of this size with room */
+	struct pageref *prev_samesize;
+	struct pageref *next_all;	/* all pages */
+	struct pageref *prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -160,10 +172,11 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the heap pages and their pagerefs. Most
+ * allocations and frees don't get this far, though: each CPU keeps a
+ * magazine of free blocks of each size (see below), and only goes to
+ * the heap pages, under kmalloc_spinlock, when it runs out or has too
+ * many.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -171,130 +184,59 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 ////////////////////////////////////////
 
 /*
- * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * Pagerefs are allocated a whole page of them at a time, as needed;
+ * those pages are never freed. Unused pagerefs are kept on a free list
+ * (linked through next_samesize).
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page holds 170 pagerefs, which can manage up to
+ * 170 * 4K = 680K of kernel heap.
  */
 
 #define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
 
-struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
-
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pageref *freepagerefs;
+static unsigned numpagerefpages;
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a pageref structure.
  */
 static
-void
-allocpagerefpage(struct kheap_root *root)
+struct pageref *
+allocpageref(void)
 {
+	struct pageref *refs, *pr;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
-
-	/*
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
-	spinlock_release(&kmalloc_spinlock);
-	va = alloc_kpages(1);
-	spinlock_acquire(&kmalloc_spinlock);
-	if (va == 0) {
-		kprintf("kmalloc: Couldn't get a pageref page\n");
-		return;
-	}
-	KASSERT(va % PAGE_SIZE == 0);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
+	if (freepagerefs == NULL) {
+		/*
+		 * We release the spinlock while calling alloc_kpages.
+		 * This avoids deadlock if alloc_kpages needs to come
+		 * back here. If somebody else added pagerefs in the
+		 * meantime, we'll just have more.
+		 */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
+		va = alloc_kpages(1);
 		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
-	}
-
-	root->page = (struct pagerefpage *)va;
-}
-
-/*
- * Allocate a pageref structure.
- */
-static
-struct pageref *
-allocpageref(void)
-{
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
+		if (va == 0) {
+			kprintf("kmalloc: Couldn't get a pageref page\n");
+			return NULL;
 		}
+		KASSERT(va % PAGE_SIZE == 0);
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+		refs = (struct pageref *)va;
+		for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+			refs[i].next_samesize = freepagerefs;
+			freepagerefs = &refs[i];
 		}
+		numpagerefpages++;
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 /*
@@ -304,47 +246,33 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
-	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
 }
 
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on the list of all pages, and, as long as it has
+ * free blocks, on the list of pages of blocks of that same size. Both
+ * lists are doubly linked, so pages can be taken off in constant time.
  */
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * To find the pageref for a block being freed without searching, we
+ * also keep a map from heap page to pageref. System/161 is limited to
+ * 16M of RAM, so a fixed-size map covers all of it.
+ */
+
+#define KHEAP_MAXPAGES (16*1024*1024 / PAGE_SIZE)
+#define KHEAP_PAGEINDEX(va) (((va) - MIPS_KSEG0) / PAGE_SIZE)
+
+static struct pageref *kheap_pagemap[KHEAP_MAXPAGES];
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -588,18 +516,20 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < TOTAL_PAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(sc < numpagerefpages * NPAGEREFS_PER_PAGE);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
+		KASSERT(ac < numpagerefpages * NPAGEREFS_PER_PAGE);
+		KASSERT(kheap_pagemap[KHEAP_PAGEINDEX(PR_PAGEADDR(pr))] == pr);
 		ac++;
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc<=ac);
 }
 #else
 #define checksubpages()
@@ -681,13 +611,10 @@ void
 dump_subpages(unsigned generation)
 {
 	struct pageref *pr;
-	int i;
 
 	kprintf("Remaining allocations from generation %u:\n", generation);
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			dump_subpage(pr, generation);
-		}
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		dump_subpage(pr, generation);
 	}
 }
 
@@ -794,54 +721,100 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+////////////////////////////////////////
+
 /*
- * Print the whole heap.
+ * Most blocks a CPU keeps in a magazine; see below.
  */
+#define KMALLOC_MAGSIZE 32
+
+/*
+ * Put a pageref on, and take it off, the lists it belongs on.
+ */
+static
 void
-kheap_printstats(void)
+samesize_insert(struct pageref *pr, int blktype)
 {
-	struct pageref *pr;
+	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
+	pr->prev_samesize = NULL;
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
+	}
+	sizebases[blktype] = pr;
+}
 
-	kprintf("Subpage allocator status:\n");
+static
+void
+samesize_remove(struct pageref *pr, int blktype)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr);
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
+}
 
-	spinlock_release(&kmalloc_spinlock);
+static
+void
+all_insert(struct pageref *pr)
+{
+	pr->prev_all = NULL;
+	pr->next_all = allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr;
+	}
+	allbase = pr;
 }
 
-////////////////////////////////////////
+static
+void
+all_remove(struct pageref *pr)
+{
+	if (pr->prev_all != NULL) {
+		pr->prev_all->next_all = pr->next_all;
+	}
+	else {
+		KASSERT(allbase == pr);
+		allbase = pr->next_all;
+	}
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
+	}
+}
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Find the pageref for the heap page containing ADDR, or NULL if it
+ * isn't on a heap page.
+ *
+ * This can be called without kmalloc_spinlock when ADDR is an
+ * allocated block: the page can't go away while it has a block
+ * allocated, and nothing else about a pageref we use changes.
  */
 static
-void
-remove_lists(struct pageref *pr, int blktype)
+struct pageref *
+kheap_lookup(vaddr_t addr)
 {
-	struct pageref **guy;
-
-	KASSERT(blktype>=0 && blktype<NSIZES);
+	vaddr_t page;
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	page = addr & PAGE_FRAME;
+#ifdef __mips__
+	if (page < MIPS_KSEG0 || page >= MIPS_KSEG1) {
+		return NULL;
 	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+#endif
+	if (KHEAP_PAGEINDEX(page) >= KHEAP_MAXPAGES) {
+		return NULL;
 	}
+	return kheap_pagemap[KHEAP_PAGEINDEX(page)];
 }
 
 /*
@@ -867,97 +840,24 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Set up a new heap page for blocks of type BLKTYPE. Called with
+ * kmalloc_spinlock held, which it releases to get the page. Returns
+ * NULL if out of memory.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+struct pageref *
+subpage_newpage(int blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
+	struct pageref *pr;	// pageref for the new page
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
 
 	volatile int i;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
-
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
-
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
-	}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
 	 * Note that this means things can change behind our back...
@@ -967,10 +867,11 @@ subpage_kmalloc(size_t sz
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		spinlock_acquire(&kmalloc_spinlock);
 		return NULL;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
+	KASSERT(KHEAP_PAGEINDEX(prpage) < KHEAP_MAXPAGES);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
@@ -983,6 +884,7 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
+		spinlock_acquire(&kmalloc_spinlock);
 		return NULL;
 	}
 
@@ -1007,14 +909,465 @@ subpage_kmalloc(size_t sz
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	samesize_insert(pr, blktype);
+	all_insert(pr);
+	KASSERT(kheap_pagemap[KHEAP_PAGEINDEX(prpage)] == NULL);
+	kheap_pagemap[KHEAP_PAGEINDEX(prpage)] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	return pr;
+}
+
+/*
+ * Get up to N free blocks of type BLKTYPE from the heap pages, and put
+ * them in BLOCKS. Makes a new page only if there are no free blocks at
+ * all. Returns the number of blocks; 0 means out of memory.
+ */
+static
+unsigned
+subpage_getblocks(int blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	unsigned got;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	got = 0;
+	while (got < n) {
+		pr = sizebases[blktype];
+		if (pr == NULL) {
+			if (got > 0) {
+				break;
+			}
+			/* No page of the right size available. */
+			pr = subpage_newpage(blktype);
+			if (pr == NULL) {
+				break;
+			}
+			continue;
+		}
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
+		checksubpage(pr);
+		KASSERT(pr->nfree > 0);
+
+		KASSERT(pr->freelist_offset < PAGE_SIZE);
+		prpage = PR_PAGEADDR(pr);
+		fla = prpage + pr->freelist_offset;
+		fl = (struct freelist *)fla;
+
+		blocks[got++] = fl;
+		fl = fl->next;
+		pr->nfree--;
+
+		if (fl != NULL) {
+			KASSERT(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			KASSERT(fla - prpage < PAGE_SIZE);
+			pr->freelist_offset = fla - prpage;
+		}
+		else {
+			KASSERT(pr->nfree == 0);
+			pr->freelist_offset = INVALID_OFFSET;
+			/* full; nothing more to get from it */
+			samesize_remove(pr, blktype);
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+/*
+ * Give N blocks back to their heap pages, releasing pages that become
+ * entirely free. The blocks have already been checked and deadbeefed.
+ */
+static
+void
+subpage_putblocks(void **blocks, unsigned n)
+{
+	vaddr_t freepages[KMALLOC_MAGSIZE];
+	unsigned nfreepages, i;
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// block address
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+
+	KASSERT(n <= KMALLOC_MAGSIZE);
+	nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+		pr = kheap_lookup(ptraddr);
+		KASSERT(pr != NULL);
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+		KASSERT(blktype >= 0 && blktype < NSIZES);
+		checksubpage(pr);
+
+		fl = (struct freelist *)ptraddr;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+			/* it has room again */
+			samesize_insert(pr, blktype);
+		} else {
+			fl->next = (struct freelist *)
+				(prpage + pr->freelist_offset);
+
+			/* this block should not already be on the free list! */
+#ifdef SLOW
+			{
+				struct freelist *fl2;
+
+				for (fl2 = fl->next; fl2 != NULL;
+				     fl2 = fl2->next) {
+					KASSERT(fl2 != fl);
+				}
+			}
+#else
+			/* check just the head */
+			KASSERT(fl != fl->next);
+#endif
+		}
+		pr->freelist_offset = ptraddr - prpage;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			samesize_remove(pr, blktype);
+			all_remove(pr);
+			kheap_pagemap[KHEAP_PAGEINDEX(prpage)] = NULL;
+			freepageref(pr);
+			freepages[nfreepages++] = prpage;
+		}
+	}
+
+	checksubpages();
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+////////////////////////////////////////
+
+/*
+ * Per-CPU magazines.
+ *
+ * Each CPU has, for each block size, a magazine: a stack of free
+ * blocks it can hand out and take back without touching
+ * kmalloc_spinlock or the heap pages. An empty magazine is refilled
+ * with half a magazine's worth of blocks from the heap pages; a full
+ * one gets half of it flushed back. So a CPU goes to the heap pages at
+ * most once every magsizes[] / 2 operations on a size.
+ *
+ * The magazines hold at most about a page of each size, so as not to
+ * tie up too much memory in free blocks. If the heap pages run out of
+ * memory, all the magazines are flushed, and the object caches (see
+ * kmem.c) reaped, before giving up.
+ *
+ * The magazine structure of a CPU is itself allocated from the heap
+ * pages the first time that CPU calls kmalloc or kfree. Before there
+ * are CPUs, and with CHECKGUARDS (which expects every block not on a
+ * free list to have guard bands), everything goes straight to the
+ * heap pages.
+ */
+
+#define KMALLOC_MAXCPUS 32
+
+static const unsigned magsizes[NSIZES] = { 32, 32, 32, 32, 16, 8, 4, 2 };
+
+struct kmalloc_magazine {
+	unsigned km_count;
+	void *km_blocks[KMALLOC_MAGSIZE];
+};
+
+struct kmalloc_pcpu {
+	struct spinlock kp_lock;
+	struct kmalloc_magazine kp_mags[NSIZES];
+	unsigned kp_allocs;		/* blocks handed out */
+	unsigned kp_frees;		/* blocks taken back */
+	unsigned kp_refills;		/* magazines refilled from pages */
+	unsigned kp_flushes;		/* magazines flushed to pages */
+};
+
+static struct kmalloc_pcpu *kmalloc_pcpus[KMALLOC_MAXCPUS];
+
+/*
+ * Get the current CPU's magazines, setting them up if need be. Returns
+ * NULL if we can't use magazines.
+ */
+static
+struct kmalloc_pcpu *
+kmalloc_getpcpu(void)
+{
+#ifdef CHECKGUARDS
+	return NULL;
+#else
+	struct kmalloc_pcpu *kp;
+	void *block;
+	unsigned n;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	n = curcpu->c_number;
+	KASSERT(n < KMALLOC_MAXCPUS);
+	if (kmalloc_pcpus[n] != NULL) {
+		return kmalloc_pcpus[n];
+	}
+
+	if (subpage_getblocks(blocktype(sizeof(*kp)), &block, 1) == 0) {
+		return NULL;
+	}
+	kp = block;
+	bzero(kp, sizeof(*kp));
+	spinlock_init(&kp->kp_lock);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (kmalloc_pcpus[n] == NULL) {
+		kmalloc_pcpus[n] = kp;
+		kp = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (kp != NULL) {
+		/* someone else on this CPU got there first */
+		spinlock_cleanup(&kp->kp_lock);
+		fill_deadbeef(kp, sizes[blocktype(sizeof(*kp))]);
+		subpage_putblocks(&block, 1);
+	}
+	return kmalloc_pcpus[n];
+#endif
+}
+
+/*
+ * Flush every CPU's magazines back to the heap pages.
+ */
+static
+void
+kmalloc_drain(void)
+{
+	void *blocks[KMALLOC_MAGSIZE];
+	struct kmalloc_pcpu *kp;
+	struct kmalloc_magazine *mag;
+	unsigned i, j, n;
+
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		kp = kmalloc_pcpus[i];
+		if (kp == NULL) {
+			continue;
+		}
+		for (j=0; j<NSIZES; j++) {
+			spinlock_acquire(&kp->kp_lock);
+			mag = &kp->kp_mags[j];
+			n = mag->km_count;
+			memcpy(blocks, mag->km_blocks, n * sizeof(void *));
+			mag->km_count = 0;
+			spinlock_release(&kp->kp_lock);
+
+			if (n > 0) {
+				subpage_putblocks(blocks, n);
+			}
+		}
+	}
+}
+
+/*
+ * Out of memory: get back what the object caches and the magazines
+ * are holding on to.
+ */
+static
+void
+kmalloc_reclaim(void)
+{
+	kmem_reap();
+	kmalloc_drain();
+}
+
+/*
+ * Get a free block of type BLKTYPE.
+ */
+static
+void *
+kmalloc_getblock(int blktype)
+{
+	void *blocks[KMALLOC_MAGSIZE];
+	struct kmalloc_pcpu *kp;
+	struct kmalloc_magazine *mag;
+	unsigned n;
+	void *ret;
+
+	kp = kmalloc_getpcpu();
+	if (kp == NULL) {
+		if (subpage_getblocks(blktype, blocks, 1) == 0) {
+			kmalloc_reclaim();
+			if (subpage_getblocks(blktype, blocks, 1) == 0) {
+				return NULL;
+			}
+		}
+		return blocks[0];
+	}
+
+	spinlock_acquire(&kp->kp_lock);
+	mag = &kp->kp_mags[blktype];
+	if (mag->km_count > 0) {
+		ret = mag->km_blocks[--mag->km_count];
+		kp->kp_allocs++;
+		spinlock_release(&kp->kp_lock);
+		return ret;
+	}
+	spinlock_release(&kp->kp_lock);
+
+	/*
+	 * Refill. We can't hold kp_lock while doing it, as getting a
+	 * new page may sleep.
+	 */
+	n = subpage_getblocks(blktype, blocks, magsizes[blktype] / 2);
+	if (n == 0) {
+		kmalloc_reclaim();
+		n = subpage_getblocks(blktype, blocks, 1);
+		if (n == 0) {
+			return NULL;
+		}
+	}
+	ret = blocks[--n];
+
+	spinlock_acquire(&kp->kp_lock);
+	mag = &kp->kp_mags[blktype];
+	while (n > 0 && mag->km_count < magsizes[blktype]) {
+		mag->km_blocks[mag->km_count++] = blocks[--n];
+	}
+	kp->kp_allocs++;
+	kp->kp_refills++;
+	spinlock_release(&kp->kp_lock);
+
+	if (n > 0) {
+		/* somebody else refilled it meanwhile */
+		subpage_putblocks(blocks, n);
+	}
+	return ret;
+}
+
+/*
+ * Take back a free block of type BLKTYPE.
+ */
+static
+void
+kmalloc_putblock(int blktype, void *block)
+{
+	void *blocks[KMALLOC_MAGSIZE];
+	struct kmalloc_pcpu *kp;
+	struct kmalloc_magazine *mag;
+	unsigned n;
+
+	kp = kmalloc_getpcpu();
+	if (kp == NULL) {
+		subpage_putblocks(&block, 1);
+		return;
+	}
+
+	n = 0;
+	spinlock_acquire(&kp->kp_lock);
+	mag = &kp->kp_mags[blktype];
+#ifdef SLOW
+	{
+		unsigned i;
+
+		for (i=0; i<mag->km_count; i++) {
+			KASSERT(mag->km_blocks[i] != block);
+		}
+	}
+#else
+	/* check just the top */
+	KASSERT(mag->km_count == 0 ||
+		mag->km_blocks[mag->km_count - 1] != block);
+#endif
+	if (mag->km_count == magsizes[blktype]) {
+		/* flush the older half */
+		n = magsizes[blktype] / 2;
+		memcpy(blocks, mag->km_blocks, n * sizeof(void *));
+		memmove(mag->km_blocks, mag->km_blocks + n,
+			(mag->km_count - n) * sizeof(void *));
+		mag->km_count -= n;
+		kp->kp_flushes++;
+	}
+	mag->km_blocks[mag->km_count++] = block;
+	kp->kp_frees++;
+	spinlock_release(&kp->kp_lock);
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+}
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+	retptr = kmalloc_getblock(blktype);
+	if (retptr == NULL) {
+		/* Out of memory. */
+		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		return NULL;
+	}
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	return retptr;
 }
 
 /*
@@ -1029,8 +1382,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1061,33 +1412,15 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	/* No lock needed; see kheap_lookup. */
+	pr = kheap_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
 
 	offset = ptraddr - prpage;
 
@@ -1108,47 +1441,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
+	kmalloc_putblock(blktype, (void *)ptraddr);
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -1159,6 +1452,45 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+/*
+ * Print the whole heap, and the per-CPU magazines.
+ */
+void
+kheap_printstats(void)
+{
+	struct kmalloc_pcpu *kp;
+	struct pageref *pr;
+	unsigned i, j;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kprintf("Subpage allocator status:\n");
+
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		subpage_stats(pr);
+	}
+	kprintf("%u pageref pages\n", numpagerefpages);
+
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		kp = kmalloc_pcpus[i];
+		if (kp == NULL) {
+			continue;
+		}
+		spinlock_acquire(&kp->kp_lock);
+		kprintf("cpu%u: %u allocs, %u frees, %u refills, "
+			"%u flushes; cached:", i, kp->kp_allocs, kp->kp_frees,
+			kp->kp_refills, kp->kp_flushes);
+		for (j=0; j<NSIZES; j++) {
+			kprintf(" %u", kp->kp_mags[j].km_count);
+		}
+		kprintf("\n");
+		spinlock_release(&kp->kp_lock);
+	}
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1191,7 +1523,11 @@ kmalloc(size_t sz)
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
-			return NULL;
+			kmalloc_reclaim();
+			address = alloc_kpages(npages);
+			if (address==0) {
+				return NULL;
+			}
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches on top of kmalloc. See kmem.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem.h>
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+
+	struct spinlock kc_lock;	/* protects everything below */
+	unsigned kc_nfree;
+	void *kc_free[KMEM_CACHE_MAX];	/* constructed, free objects */
+
+	unsigned kc_allocs;		/* objects handed out */
+	unsigned kc_hits;		/* ...that came from kc_free */
+	unsigned kc_ctors;		/* constructor calls */
+	unsigned kc_dtors;		/* destructor calls */
+};
+
+/* Most objects kmem_reap takes off the caches at a time. */
+#define KMEM_REAP_BATCH 32
+
+/*
+ * All the caches, for kmem_reap and the stats.
+ */
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+/*
+ * Destroy an object that isn't in the cache any more.
+ */
+static
+void
+kmem_cache_release(struct kmem_cache *kc, void *obj)
+{
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+/*
+ * Destroy all the free objects of a cache.
+ */
+static
+void
+kmem_cache_drain(struct kmem_cache *kc)
+{
+	void *objs[KMEM_CACHE_MAX];
+	unsigned i, n;
+
+	spinlock_acquire(&kc->kc_lock);
+	n = kc->kc_nfree;
+	for (i=0; i<n; i++) {
+		objs[i] = kc->kc_free[i];
+	}
+	kc->kc_nfree = 0;
+	kc->kc_dtors += n;
+	spinlock_release(&kc->kc_lock);
+
+	for (i=0; i<n; i++) {
+		kmem_cache_release(kc, objs[i]);
+	}
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nfree = 0;
+	kc->kc_allocs = 0;
+	kc->kc_hits = 0;
+	kc->kc_ctors = 0;
+	kc->kc_dtors = 0;
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+
+	spinlock_acquire(&kmem_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_lock);
+
+	kmem_cache_drain(kc);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_allocs++;
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	/* Nothing cached; build a new one. */
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			kfree(obj);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	kc->kc_ctors++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree < KMEM_CACHE_MAX) {
+		/* check just the top for a double free */
+		KASSERT(kc->kc_nfree == 0 ||
+			kc->kc_free[kc->kc_nfree - 1] != obj);
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_dtors++;
+	spinlock_release(&kc->kc_lock);
+
+	kmem_cache_release(kc, obj);
+}
+
+/*
+ * Destroy the free objects of every cache, to give the memory back.
+ * The objects are taken off the caches a batch at a time under
+ * kmem_lock, and destroyed after letting go of it. Only the
+ * destructor is remembered, not the cache, which may be destroyed
+ * in the meantime.
+ */
+void
+kmem_reap(void)
+{
+	struct kmem_cache *kc;
+	void (*dtors[KMEM_REAP_BATCH])(void *obj);
+	void *objs[KMEM_REAP_BATCH];
+	unsigned i, n;
+
+	do {
+		n = 0;
+		spinlock_acquire(&kmem_lock);
+		for (kc = kmem_caches; kc != NULL && n < KMEM_REAP_BATCH;
+		     kc = kc->kc_next) {
+			spinlock_acquire(&kc->kc_lock);
+			while (kc->kc_nfree > 0 && n < KMEM_REAP_BATCH) {
+				objs[n] = kc->kc_free[--kc->kc_nfree];
+				dtors[n] = kc->kc_dtor;
+				kc->kc_dtors++;
+				n++;
+			}
+			spinlock_release(&kc->kc_lock);
+		}
+		spinlock_release(&kmem_lock);
+
+		for (i=0; i<n; i++) {
+			if (dtors[i] != NULL) {
+				dtors[i](objs[i]);
+			}
+			kfree(objs[i]);
+		}
+	} while (n == KMEM_REAP_BATCH);
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_lock);
+	kprintf("%-16s %6s %4s %8s %8s %6s %6s\n", "cache", "size",
+		"free", "allocs", "hits", "ctors", "dtors");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("%-16s %6zu %4u %8u %8u %6u %6u\n", kc->kc_name,
+			kc->kc_size, kc->kc_nfree, kc->kc_allocs,
+			kc->kc_hits, kc->kc_ctors, kc->kc_dtors);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+}
+
+void
+kmem_resetstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_allocs = 0;
+		kc->kc_hits = 0;
+		kc->kc_ctors = 0;
+		kc->kc_dtors = 0;
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+}
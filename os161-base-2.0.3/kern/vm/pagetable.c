@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <vmstats.h>
+
+#define PT_DIRINDEX(va)		((va) >> PT_DIR_SHIFT)
+#define PT_TABLEINDEX(va)	(((va) >> PT_TABLE_SHIFT) & PT_TABLE_MASK)
+#define PT_VADDR(d, t)		(((vaddr_t)(d) << PT_DIR_SHIFT) | \
+				 ((vaddr_t)(t) << PT_TABLE_SHIFT))
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	spinlock_init(&pt->pt_lock);
+	for (i=0; i<PT_DIR_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+/*
+ * Pin the frame of valid entry PTE, waiting if it is being paged out.
+ * Returns the frame, or 0 if by the time we got it the entry wasn't
+ * valid any more.
+ */
+paddr_t
+pt_pin(struct pagetable *pt, pte_t *pte)
+{
+	paddr_t pa;
+
+	while (1) {
+		spinlock_acquire(&pt->pt_lock);
+		if (!(*pte & PTE_VALID)) {
+			spinlock_release(&pt->pt_lock);
+			return 0;
+		}
+		pa = *pte & PTE_FRAME;
+		if (coremap_pin(pa)) {
+			spinlock_release(&pt->pt_lock);
+			return pa;
+		}
+		spinlock_release(&pt->pt_lock);
+		coremap_waitpin(pa);
+	}
+}
+
+/*
+ * Free the frame or swap slot of entry PTE and clear it.
+ */
+static
+void
+pt_release(struct pagetable *pt, pte_t *pte)
+{
+	paddr_t pa;
+
+	pa = pt_pin(pt, pte);
+	if (pa != 0) {
+		spinlock_acquire(&pt->pt_lock);
+		*pte = 0;
+		spinlock_release(&pt->pt_lock);
+		coremap_free_upage(pa);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(*pte));
+		*pte = 0;
+	}
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned d, t;
+	pte_t *table;
+
+	for (d=0; d<PT_DIR_ENTRIES; d++) {
+		table = pt->pt_dir[d];
+		if (table == NULL) {
+			continue;
+		}
+		for (t=0; t<PT_TABLE_ENTRIES; t++) {
+			pt_release(pt, &table[t]);
+		}
+		kfree(table);
+	}
+	spinlock_cleanup(&pt->pt_lock);
+	kfree(pt);
+}
+
+void
+pt_unmap(struct pagetable *pt, vaddr_t vaddr, unsigned npages)
+{
+	unsigned n;
+	pte_t *table;
+
+	KASSERT(npages <= (USERSPACETOP - vaddr) / PAGE_SIZE);
+
+	for (n=0; n<npages; n++, vaddr += PAGE_SIZE) {
+		table = pt->pt_dir[PT_DIRINDEX(vaddr)];
+		if (table != NULL) {
+			pt_release(pt, &table[PT_TABLEINDEX(vaddr)]);
+		}
+	}
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	unsigned d, t;
+	pte_t *table;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	d = PT_DIRINDEX(vaddr);
+	table = pt->pt_dir[d];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_TABLE_ENTRIES * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		for (t=0; t<PT_TABLE_ENTRIES; t++) {
+			table[t] = 0;
+		}
+		pt->pt_dir[d] = table;
+	}
+	return &table[PT_TABLEINDEX(vaddr)];
+}
+
+/*
+ * Copy a page table. Nothing is copied: every page present
+ * in SRC is shared, and marked copy-on-write on both sides, so that
+ * vm_fault makes a private copy for whichever side writes to it first.
+ * Pages on swap share their slot instead; whichever side faults one in
+ * first gets its own copy. Pages not yet faulted in stay absent in
+ * both.
+ */
+int
+pt_copy(struct pagetable *src, struct pagetable **ret)
+{
+	struct pagetable *new;
+	unsigned d, t;
+	pte_t *table, *newpte;
+	paddr_t pa;
+
+	new = pt_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+
+	for (d=0; d<PT_DIR_ENTRIES; d++) {
+		table = src->pt_dir[d];
+		if (table == NULL) {
+			continue;
+		}
+		for (t=0; t<PT_TABLE_ENTRIES; t++) {
+			if (!(table[t] & (PTE_VALID | PTE_SWAPPED))) {
+				continue;
+			}
+			newpte = pt_lookup(new, PT_VADDR(d, t), true);
+			if (newpte == NULL) {
+				pt_destroy(new);
+				return ENOMEM;
+			}
+
+			/* pin it so it can't go out to swap meanwhile */
+			pa = pt_pin(src, &table[t]);
+			if (pa != 0) {
+				coremap_share_upage(pa);
+				spinlock_acquire(&src->pt_lock);
+				table[t] |= PTE_COW;
+				*newpte = table[t];
+				spinlock_release(&src->pt_lock);
+				coremap_unpin(pa, false);
+				vmstats_inc(VMSTAT_COW_SHARED);
+			}
+			else if (table[t] & PTE_SWAPPED) {
+				swap_share(PTE_SLOT(table[t]));
+				*newpte = table[t];
+			}
+		}
+	}
+
+	*ret = new;
+	return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Paging to swap. See swap.h.
+ *
+ * Locking: swap_lock protects the slot bitmap and reference counts.
+ * Page table entries are changed under their pt_lock, and only while
+ * the frame involved is pinned; see pagetable.h and coremap.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <stat.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <vmstats.h>
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* raw swap device, or NULL */
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refs;		/* references to each slot */
+static unsigned swap_nslots;
+static unsigned swap_nused;
+static unsigned swap_rotor;		/* where to look for free slots */
+
+void
+swap_bootstrap(void)
+{
+	struct vnode *vn;
+	struct stat st;
+	unsigned nslots;
+	int result;
+
+	result = vfs_swapon(SWAP_DEVICE, &vn);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		return;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	nslots = st.st_size / PAGE_SIZE;
+
+	swap_map = bitmap_create(nslots);
+	swap_refs = kmalloc(nslots * sizeof(swap_refs[0]));
+	if (swap_map == NULL || swap_refs == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+	bzero(swap_refs, nslots * sizeof(swap_refs[0]));
+
+	spinlock_acquire(&swap_lock);
+	swap_nslots = nslots;
+	swap_nused = 0;
+	swap_rotor = 0;
+	swap_vnode = vn;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u pages on %s\n", nslots, SWAP_DEVICE);
+}
+
+/*
+ * Allocate N contiguous slots; put the first in RET. Searches from
+ * where the last allocation left off.
+ */
+static
+int
+swap_alloc(unsigned n, unsigned *ret)
+{
+	unsigned i, k, run;
+
+	spinlock_acquire(&swap_lock);
+	run = 0;
+	for (k=0; k<swap_nslots; k++) {
+		i = (swap_rotor + k) % swap_nslots;
+		if (i == 0) {
+			/* runs can't wrap around */
+			run = 0;
+		}
+		if (bitmap_isset(swap_map, i)) {
+			run = 0;
+			continue;
+		}
+		if (++run < n) {
+			continue;
+		}
+
+		*ret = i + 1 - n;
+		for (i = *ret; i < *ret + n; i++) {
+			bitmap_mark(swap_map, i);
+			swap_refs[i] = 1;
+		}
+		swap_nused += n;
+		swap_rotor = (*ret + n) % swap_nslots;
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+	spinlock_release(&swap_lock);
+	return ENOSPC;
+}
+
+void
+swap_share(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0);
+	if (swap_refs[slot] == (uint16_t)-1) {
+		panic("swap: slot %u shared too many times\n", slot);
+	}
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+static
+unsigned
+swap_refcount(unsigned slot)
+{
+	unsigned ret;
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	ret = swap_refs[slot];
+	spinlock_release(&swap_lock);
+	return ret;
+}
+
+/*
+ * Whether there is swap with room for more pages.
+ */
+static
+bool
+swap_canwrite(void)
+{
+	bool ret;
+
+	spinlock_acquire(&swap_lock);
+	ret = swap_vnode != NULL && swap_nused < swap_nslots;
+	spinlock_release(&swap_lock);
+	return ret;
+}
+
+/*
+ * Read or write the N frames in PAGES from or to the N slots starting
+ * at SLOT, as one I/O.
+ */
+static
+int
+swap_io(unsigned slot, const paddr_t *pages, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pages[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+unsigned
+swap_evict(void)
+{
+	struct addrspace *as;
+	struct pagetable *pt;
+	paddr_t pages[SWAP_CLUSTER];
+	vaddr_t vaddr, va;
+	pte_t *pte;
+	unsigned n, i, slot;
+	int oldslot, result;
+	bool dirty;
+
+	/* Paging out sleeps; don't even try where we can't. */
+	if (!CURCPU_EXISTS() || curthread->t_in_interrupt ||
+	    curcpu->c_spinlocks > 0) {
+		return 0;
+	}
+
+	pages[0] = coremap_victim(swap_canwrite(), &as, &vaddr);
+	if (pages[0] == 0) {
+		return 0;
+	}
+	/* AS stays around as long as we have one of its pages pinned */
+	pt = as->as_pt;
+	n = 1;
+
+	dirty = coremap_isdirty(pages[0]);
+	if (dirty) {
+		/*
+		 * Take the following pages along if they could go too,
+		 * so they are written together and can be read back
+		 * together.
+		 */
+		for (; n < SWAP_CLUSTER; n++) {
+			va = vaddr + n * PAGE_SIZE;
+			if (va >= USERSPACETOP) {
+				break;
+			}
+			spinlock_acquire(&pt->pt_lock);
+			pte = pt_lookup(pt, va, false);
+			if (pte == NULL || !(*pte & PTE_VALID) ||
+			    !coremap_pin_victim(*pte & PTE_FRAME, as, va)) {
+				spinlock_release(&pt->pt_lock);
+				break;
+			}
+			pages[n] = *pte & PTE_FRAME;
+			spinlock_release(&pt->pt_lock);
+		}
+	}
+
+	/*
+	 * Nobody can map the pages again while they are pinned; get rid
+	 * of any mappings there are. After this the contents can't
+	 * change under us.
+	 */
+	vm_shootdown(vaddr, n);
+
+	if (dirty) {
+		/* Any copies already on swap are stale. */
+		for (i=0; i<n; i++) {
+			oldslot = coremap_getslot(pages[i]);
+			if (oldslot >= 0) {
+				coremap_setslot(pages[i], -1);
+				swap_free(oldslot);
+			}
+		}
+
+		/* Shrink the cluster until there is room for it. */
+		while (swap_alloc(n, &slot)) {
+			n--;
+			coremap_unpin(pages[n], false);
+			if (n == 0) {
+				return 0;
+			}
+		}
+
+		result = swap_io(slot, pages, n, UIO_WRITE);
+		if (result) {
+			kprintf("swap: write error: %s\n", strerror(result));
+			for (i=0; i<n; i++) {
+				swap_free(slot + i);
+				coremap_unpin(pages[i], false);
+			}
+			return 0;
+		}
+		vmstats_add(VMSTAT_SWAPFILE_WRITES, n);
+		vmstats_inc(VMSTAT_SWAPFILE_WRITE_IOS);
+
+		for (i=0; i<n; i++) {
+			coremap_setslot(pages[i], slot + i);
+		}
+	}
+	else {
+		vmstats_inc(VMSTAT_EVICTIONS_CLEAN);
+	}
+
+	/*
+	 * Point the page table at the copies on swap, or, for clean
+	 * pages never written to swap, forget the pages; they will be
+	 * filled in from their region again.
+	 */
+	for (i=0; i<n; i++) {
+		oldslot = coremap_getslot(pages[i]);
+		coremap_setslot(pages[i], -1);
+
+		spinlock_acquire(&pt->pt_lock);
+		pte = pt_lookup(pt, vaddr + i * PAGE_SIZE, false);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & PTE_FRAME) == pages[i]);
+		*pte = oldslot >= 0 ? PTE_MKSWAPPED(oldslot) : 0;
+		spinlock_release(&pt->pt_lock);
+
+		coremap_free_upage(pages[i]);
+	}
+
+	vmstats_add(VMSTAT_EVICTIONS, n);
+	return n;
+}
+
+int
+swap_pagein(struct addrspace *as, vaddr_t vaddr, pte_t *pte, paddr_t paddr)
+{
+	struct pagetable *pt;
+	paddr_t pages[SWAP_CLUSTER];
+	pte_t *ptes[SWAP_CLUSTER];
+	vaddr_t va;
+	unsigned slot, n, i;
+	int result;
+
+	KASSERT(*pte & PTE_SWAPPED);
+	KASSERT(swap_vnode != NULL);
+
+	pt = as->as_pt;
+	slot = PTE_SLOT(*pte);
+	pages[0] = paddr;
+	ptes[0] = pte;
+
+	/*
+	 * Read the pages that went out with this one along with it, as
+	 * long as memory for them can be had without paging anything
+	 * else out. We're the owner and these entries aren't valid, so
+	 * they can't change under us.
+	 */
+	for (n = 1; n < SWAP_CLUSTER; n++) {
+		va = vaddr + n * PAGE_SIZE;
+		if (va >= USERSPACETOP || slot + n >= swap_nslots) {
+			break;
+		}
+		ptes[n] = pt_lookup(pt, va, false);
+		if (ptes[n] == NULL ||
+		    *ptes[n] != PTE_MKSWAPPED(slot + n) ||
+		    swap_refcount(slot + n) != 1) {
+			break;
+		}
+		pages[n] = coremap_tryalloc_upage(as, va);
+		if (pages[n] == 0) {
+			break;
+		}
+	}
+
+	result = swap_io(slot, pages, n, UIO_READ);
+	if (result) {
+		for (i=1; i<n; i++) {
+			coremap_free_upage(pages[i]);
+		}
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		if (swap_refcount(slot + i) == 1) {
+			/* the page takes over the entry's reference */
+			coremap_setslot(pages[i], slot + i);
+		}
+		else {
+			/* still shared; we get our own copy */
+			swap_free(slot + i);
+			coremap_setdirty(pages[i]);
+		}
+
+		spinlock_acquire(&pt->pt_lock);
+		*ptes[i] = pages[i] | PTE_VALID;
+		spinlock_release(&pt->pt_lock);
+
+		if (i > 0) {
+			coremap_unpin(pages[i], false);
+		}
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULTS_DISK);
+	vmstats_inc(VMSTAT_PAGE_FAULTS_SWAP);
+	vmstats_add(VMSTAT_SWAP_PREFETCHES, n - 1);
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nused, nslots;
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	nslots = swap_nslots;
+	spinlock_release(&swap_lock);
+
+	if (nslots == 0) {
+		kprintf("Swap: none\n");
+		return;
+	}
+	kprintf("Swap: %u of %u pages in use on %s\n", nused, nslots,
+		SWAP_DEVICE);
+}
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Demand-paged virtual memory: kernel page allocation, page faults,
+ * and the TLB refill path.
+ *
+ * On a TLB miss we look the page up in the current address space's
+ * page table. If it is there, we just reload the TLB (a "reload");
+ * otherwise this is the first touch, and the page is allocated and
+ * filled with zeros or from the executable according to its region.
+ * If the TLB has no free slot, a random entry is replaced.
+ *
+ * After fork, pages are shared copy-on-write (see pt_copy) and are
+ * loaded into the TLB read-only. The first write to one traps as
+ * VM_FAULT_READONLY, and only then is the page copied.
+ *
+ * Pages are also loaded read-only until they are dirty, i.e. until
+ * they differ from what backs them, so we find out which pages have to
+ * be written to swap when they are evicted (see swap.c). A page on
+ * swap is read back in on the next fault.
+ *
+ * Files mapped with mmap are regions too, filled from the file the
+ * same way.
+ *
+ * The faulting page is pinned from the time we find it in the page
+ * table until it is in the TLB, so that it can't be paged out in
+ * between.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <proc.h>
+#include <current.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vnode.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <vmstats.h>
+
+/*
+ * Lets the sender of a TLB shootdown know when each CPU is done.
+ */
+struct tlbshootdown_sync {
+	struct spinlock tss_lock;
+	unsigned tss_done;
+};
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	swap_bootstrap();
+}
+
+/*
+ * Check if we're in a context that can sleep. Page allocation and
+ * page faults may do I/O, so assert this where they start.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+
+	vm_can_sleep();
+	pa = coremap_alloc_kpages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0);
+	coremap_free_kpages(addr - MIPS_KSEG0);
+}
+
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+
+	vmstats_inc(VMSTAT_TLB_INVALIDATIONS);
+}
+
+/*
+ * Invalidate any entries for NPAGES pages at VADDR in this CPU's TLB.
+ */
+static
+void
+vm_tlb_invalidate(vaddr_t vaddr, unsigned npages)
+{
+	unsigned n;
+	int i, spl;
+
+	spl = splhigh();
+	for (n=0; n<npages; n++) {
+		i = tlb_probe(vaddr + n * PAGE_SIZE, 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	splx(spl);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlb_invalidate(ts->ts_vaddr, ts->ts_npages);
+
+	spinlock_acquire(&ts->ts_sync->tss_lock);
+	ts->ts_sync->tss_done++;
+	spinlock_release(&ts->ts_sync->tss_lock);
+}
+
+/*
+ * We don't know which CPUs might have the pages mapped (the address
+ * space can only be active on one, but it could have been on others
+ * before), so ask all of them. Interrupts are off while sending, so
+ * that we don't move to another CPU and miss this one.
+ */
+void
+vm_shootdown(vaddr_t vaddr, unsigned npages)
+{
+	struct tlbshootdown_sync sync;
+	struct tlbshootdown ts;
+	unsigned sent, done;
+	int spl;
+
+	spinlock_init(&sync.tss_lock);
+	sync.tss_done = 0;
+	ts.ts_vaddr = vaddr;
+	ts.ts_npages = npages;
+	ts.ts_sync = &sync;
+
+	spl = splhigh();
+	sent = ipi_tlbshootdown_broadcast(&ts);
+	vm_tlb_invalidate(vaddr, npages);
+	splx(spl);
+
+	do {
+		spinlock_acquire(&sync.tss_lock);
+		done = sync.tss_done;
+		spinlock_release(&sync.tss_lock);
+	} while (done < sent);
+
+	spinlock_cleanup(&sync.tss_lock);
+}
+
+/*
+ * Fill a newly allocated frame PADDR for page VADDR of region RG:
+ * zeros, plus whatever part of the executable or mapped file falls in
+ * the page. A mapped file may have been truncated, or never have been
+ * as long as the mapping; what isn't there any more reads as zeros.
+ */
+static
+int
+vm_fill_page(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	     paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *v;
+	vaddr_t kva, fstart, fend, lo, hi;
+	int result;
+
+	kva = PADDR_TO_KVADDR(paddr);
+	bzero((void *)kva, PAGE_SIZE);
+
+	fstart = rg->rg_fvaddr;
+	fend = fstart + rg->rg_filesize;
+	lo = vaddr > fstart ? vaddr : fstart;
+	hi = vaddr + PAGE_SIZE < fend ? vaddr + PAGE_SIZE : fend;
+	if (lo >= hi) {
+		vmstats_inc(VMSTAT_PAGE_FAULTS_ZERO);
+		return 0;
+	}
+
+	v = rg->rg_vnode != NULL ? rg->rg_vnode : as->as_vnode;
+	KASSERT(v != NULL);
+	uio_kinit(&iov, &ku, (void *)(kva + (lo - vaddr)), hi - lo,
+		  rg->rg_foffset + (lo - fstart), UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULTS_DISK);
+	if (rg->rg_vnode != NULL) {
+		vmstats_inc(VMSTAT_PAGE_FAULTS_FILE);
+		return 0;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("vm: short read on executable - file truncated?\n");
+		return ENOEXEC;
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULTS_ELF);
+	return 0;
+}
+
+/*
+ * Make a private copy of the copy-on-write page mapped by PTE, at
+ * VADDR in AS, so it can be written. If every other sharer has let go
+ * of the page in the meantime, just take it over instead. The page,
+ * in *PADDR, is pinned; on success *PADDR is the (pinned) page now
+ * mapped.
+ */
+static
+int
+vm_cow_break(struct addrspace *as, vaddr_t vaddr, pte_t *pte,
+	     paddr_t *paddr)
+{
+	struct pagetable *pt = as->as_pt;
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_VALID);
+	KASSERT(*pte & PTE_COW);
+
+	vmstats_inc(VMSTAT_COW_FAULTS);
+
+	oldpa = *paddr;
+	if (coremap_unshare_upage(oldpa, as, vaddr)) {
+		spinlock_acquire(&pt->pt_lock);
+		*pte &= ~PTE_COW;
+		spinlock_release(&pt->pt_lock);
+		return 0;
+	}
+
+	newpa = coremap_alloc_upage(as, vaddr);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	coremap_setdirty(newpa);
+
+	spinlock_acquire(&pt->pt_lock);
+	*pte = newpa | (*pte & ~(PTE_FRAME | PTE_COW));
+	spinlock_release(&pt->pt_lock);
+	coremap_free_upage(oldpa);
+
+	*paddr = newpa;
+	vmstats_inc(VMSTAT_COW_COPIES);
+	return 0;
+}
+
+/*
+ * Load a translation into the TLB: over the existing entry for VADDR
+ * if there is one, otherwise into a free slot if there is one, or
+ * over a random entry.
+ */
+static
+void
+vm_tlb_load(vaddr_t vaddr, paddr_t paddr, bool writeable)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	i = tlb_probe(vaddr, 0);
+	if (i >= 0) {
+		tlb_write(vaddr, paddr | TLBLO_VALID |
+			  (writeable ? TLBLO_DIRTY : 0), i);
+		splx(spl);
+		return;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (!(elo & TLBLO_VALID)) {
+			break;
+		}
+	}
+
+	ehi = vaddr;
+	elo = paddr | TLBLO_VALID | (writeable ? TLBLO_DIRTY : 0);
+	if (i < NUM_TLB) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+
+	splx(spl);
+
+	vmstats_inc(i < NUM_TLB ? VMSTAT_TLB_FAULTS_FREE :
+		    VMSTAT_TLB_FAULTS_REPLACE);
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct pagetable *pt;
+	struct region *rg;
+	pte_t *pte;
+	paddr_t paddr;
+	bool writeable, swapped;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/*
+		 * A write to a page we loaded without the dirty bit:
+		 * a read-only region, a copy-on-write page, or a page
+		 * that is still clean.
+		 */
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	if (!(rg->rg_flags & RG_READ)) {
+		/* PROT_NONE; nothing at all is allowed */
+		return EFAULT;
+	}
+	if (faulttype != VM_FAULT_READ && !(rg->rg_flags & RG_WRITE)) {
+		return EFAULT;
+	}
+
+	vm_can_sleep();
+
+	pt = as->as_pt;
+	pte = pt_lookup(pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+ retry:
+	spinlock_acquire(&pt->pt_lock);
+	if (*pte & PTE_VALID) {
+		paddr = *pte & PTE_FRAME;
+		if (!coremap_pin(paddr)) {
+			/* being paged out */
+			spinlock_release(&pt->pt_lock);
+			coremap_waitpin(paddr);
+			goto retry;
+		}
+		spinlock_release(&pt->pt_lock);
+
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_RELOADS);
+		}
+		if (faulttype != VM_FAULT_READ && (*pte & PTE_COW)) {
+			result = vm_cow_break(as, faultaddress, pte, &paddr);
+			if (result) {
+				coremap_unpin(paddr, false);
+				return result;
+			}
+		}
+	}
+	else {
+		swapped = (*pte & PTE_SWAPPED) != 0;
+		spinlock_release(&pt->pt_lock);
+
+		if (faulttype == VM_FAULT_READONLY) {
+			/* it was paged out since the fault happened */
+			faulttype = VM_FAULT_WRITE;
+		}
+
+		paddr = coremap_alloc_upage(as, faultaddress);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		if (swapped) {
+			result = swap_pagein(as, faultaddress, pte, paddr);
+		}
+		else {
+			result = vm_fill_page(as, rg, faultaddress, paddr);
+			if (!result) {
+				spinlock_acquire(&pt->pt_lock);
+				*pte = paddr | PTE_VALID;
+				spinlock_release(&pt->pt_lock);
+			}
+		}
+		if (result) {
+			coremap_free_upage(paddr);
+			return result;
+		}
+	}
+
+	if (faulttype != VM_FAULT_READ) {
+		coremap_setdirty(paddr);
+	}
+	writeable = (rg->rg_flags & RG_WRITE) && !(*pte & PTE_COW) &&
+		coremap_isdirty(paddr);
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULTS);
+	}
+	vm_tlb_load(faultaddress, paddr, writeable);
+	coremap_unpin(paddr, true);
+
+	return 0;
+}
+
+/*
+ * A lent page is one more reference to the frame, as if it were
+ * shared copy-on-write with someone; the page-out code leaves shared
+ * pages alone, and the frame can't be freed under the borrower.
+ */
+int
+vm_loan_page(vaddr_t vaddr, paddr_t *ret)
+{
+	struct addrspace *as;
+	struct pagetable *pt;
+	pte_t *pte;
+	paddr_t paddr;
+	int result;
+
+	vaddr &= PAGE_FRAME;
+	as = proc_getas();
+	if (as == NULL || vaddr >= USERSPACETOP) {
+		return EFAULT;
+	}
+	pt = as->as_pt;
+
+	while (1) {
+		pte = pt_lookup(pt, vaddr, false);
+		if (pte != NULL) {
+			paddr = pt_pin(pt, pte);
+			if (paddr != 0) {
+				coremap_share_upage(paddr);
+				coremap_unpin(paddr, true);
+				*ret = paddr;
+				return 0;
+			}
+		}
+		/* not in memory; bring it in, and look again */
+		result = vm_fault(VM_FAULT_READ, vaddr);
+		if (result) {
+			return result;
+		}
+	}
+}
+
+void
+vm_unloan_page(paddr_t paddr)
+{
+	while (!coremap_pin(paddr)) {
+		coremap_waitpin(paddr);
+	}
+	coremap_free_upage(paddr);
+}
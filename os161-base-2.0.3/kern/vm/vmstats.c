@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Virtual memory statistics. See vmstats.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vmstats.h>
+
+static struct spinlock vmstats_lock = SPINLOCK_INITIALIZER;
+static unsigned vmstats_counts[VMSTAT_NUM];
+
+static const char *const vmstats_names[VMSTAT_NUM] = {
+	"TLB faults",
+	"TLB faults with free",
+	"TLB faults with replace",
+	"TLB invalidations",
+	"TLB reloads",
+	"Page faults (zeroed)",
+	"Page faults (disk)",
+	"Page faults from ELF",
+	"Address space copies",
+	"Pages shared copy-on-write",
+	"Copy-on-write faults",
+	"Copy-on-write page copies",
+	"Page faults from swapfile",
+	"Pages prefetched from swap",
+	"Swapfile writes",
+	"Swapfile write operations",
+	"Pages evicted",
+	"Pages evicted clean",
+	"Pages scanned for eviction",
+	"Page faults from mapped files",
+};
+
+void
+vmstats_inc(enum vmstat which)
+{
+	vmstats_add(which, 1);
+}
+
+void
+vmstats_add(enum vmstat which, unsigned n)
+{
+	KASSERT(which < VMSTAT_NUM);
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats_counts[which] += n;
+	spinlock_release(&vmstats_lock);
+}
+
+void
+vmstats_print(void)
+{
+	unsigned counts[VMSTAT_NUM];
+	unsigned i;
+
+	spinlock_acquire(&vmstats_lock);
+	for (i=0; i<VMSTAT_NUM; i++) {
+		counts[i] = vmstats_counts[i];
+	}
+	spinlock_release(&vmstats_lock);
+
+	kprintf("VM statistics:\n");
+	for (i=0; i<VMSTAT_NUM; i++) {
+		kprintf("    %-28s %u\n", vmstats_names[i], counts[i]);
+	}
+
+	if (counts[VMSTAT_TLB_FAULTS] !=
+	    counts[VMSTAT_TLB_FAULTS_FREE] +
+	    counts[VMSTAT_TLB_FAULTS_REPLACE]) {
+		kprintf("vmstats: warning: TLB faults != "
+			"faults with free + faults with replace\n");
+	}
+	if (counts[VMSTAT_TLB_FAULTS] !=
+	    counts[VMSTAT_TLB_RELOADS] +
+	    counts[VMSTAT_PAGE_FAULTS_ZERO] +
+	    counts[VMSTAT_PAGE_FAULTS_DISK]) {
+		kprintf("vmstats: warning: TLB faults != "
+			"reloads + zeroed faults + disk faults\n");
+	}
+	if (counts[VMSTAT_PAGE_FAULTS_DISK] !=
+	    counts[VMSTAT_PAGE_FAULTS_ELF] +
+	    counts[VMSTAT_PAGE_FAULTS_SWAP] +
+	    counts[VMSTAT_PAGE_FAULTS_FILE]) {
+		kprintf("vmstats: warning: disk faults != "
+			"ELF faults + swapfile faults + mapped file faults\n");
+	}
+
+	if (counts[VMSTAT_AS_COPIES] > 0) {
+		kprintf("    Pages copied per fork: %u.%02u "
+			"(of %u.%02u shared)\n",
+			counts[VMSTAT_COW_COPIES] / counts[VMSTAT_AS_COPIES],
+			(counts[VMSTAT_COW_COPIES] * 100 /
+			 counts[VMSTAT_AS_COPIES]) % 100,
+			counts[VMSTAT_COW_SHARED] / counts[VMSTAT_AS_COPIES],
+			(counts[VMSTAT_COW_SHARED] * 100 /
+			 counts[VMSTAT_AS_COPIES]) % 100);
+	}
+	if (counts[VMSTAT_EVICTIONS] > 0) {
+		kprintf("    Pages scanned per eviction: %u\n",
+			counts[VMSTAT_EVICT_SCANNED] /
+			counts[VMSTAT_EVICTIONS]);
+	}
+	if (counts[VMSTAT_SWAPFILE_WRITE_IOS] > 0) {
+		kprintf("    Pages per swapfile write: %u.%02u\n",
+			counts[VMSTAT_SWAPFILE_WRITES] /
+			counts[VMSTAT_SWAPFILE_WRITE_IOS],
+			(counts[VMSTAT_SWAPFILE_WRITES] * 100 /
+			 counts[VMSTAT_SWAPFILE_WRITE_IOS]) % 100);
+	}
+}
+
+void
+vmstats_reset(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&vmstats_lock);
+	for (i=0; i<VMSTAT_NUM; i++) {
+		vmstats_counts[i] = 0;
+	}
+	spinlock_release(&vmstats_lock);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * timer.c
+ *
+ * 	Measures elapsed time for the benchmarks.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <test/timer.h>
+
+void
+timer_start(struct timer *t)
+{
+	__time(&t->t_secs, &t->t_nsecs);
+}
+
+unsigned long long
+timer_usecs(const struct timer *t)
+{
+	time_t secs;
+	unsigned long nsecs;
+	unsigned long long usecs;
+
+	__time(&secs, &nsecs);
+
+	/* secs.nsecs -= t_secs.t_nsecs */
+	if (nsecs < t->t_nsecs) {
+		nsecs += 1000000000;
+		secs--;
+	}
+	nsecs -= t->t_nsecs;
+	secs -= t->t_secs;
+
+	usecs = (unsigned long long)secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	return usecs;
+}
+
+void
+timer_report(const struct timer *t, const char *prog, const char *what,
+	     unsigned long long bytes)
+{
+	unsigned long long usecs = timer_usecs(t);
+
+	printf("%s: %-8s %llu KB in %llu.%06llu s, %llu KB/s\n",
+	       prog, what, bytes / 1024, usecs / 1000000, usecs % 1000000,
+	       bytes * 1000000 / 1024 / usecs);
+}
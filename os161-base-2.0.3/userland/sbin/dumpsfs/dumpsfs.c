@@ -230,7 +230,7 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
@@ -239,7 +239,11 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	switch (level) {
+	    case 1: printf("Indirect block %u\n", block); break;
+	    case 2: printf("Double indirect block %u\n", block); break;
+	    default: printf("Triple indirect block %u\n", block); break;
+	}
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +257,23 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+
+	/* Then the blocks this one points to */
+	if (level > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), level-1);
+		}
+	}
 }
 
+/*
+ * Traverse the indirect block BLOCK, which is LEVEL levels above the
+ * data blocks, starting from FILEBLOCK. Returns the next file block.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,7 +285,14 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level-1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -291,7 +313,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -338,6 +368,104 @@ dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 	traverse(sfi, dumpdirblock);
 }
 
+/* Directory index being loaded by loaddiridxblock() */
+static uint32_t *diridxwords;
+
+static
+void
+loaddiridxblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint32_t *w = diridxwords + fileblock * (SFS_BLOCKSIZE/sizeof(uint32_t));
+	unsigned i;
+
+	if (diskblock == 0) {
+		memset(w, 0, SFS_BLOCKSIZE);
+		return;
+	}
+	diskread(w, diskblock);
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		w[i] = SWAP32(w[i]);
+	}
+}
+
+/*
+ * Count the slots on one chain of a directory index, stopping if it
+ * goes out of range or loops.
+ */
+static
+unsigned
+diridxchain(uint32_t head, unsigned nlinks)
+{
+	const uint32_t *links = diridxwords + SFS_DIRIDX_LINKS/sizeof(uint32_t);
+	unsigned len;
+	uint32_t cur;
+
+	for (cur = head, len = 0; cur != 0 && cur <= nlinks && len <= nlinks;
+	     cur = links[cur-1]) {
+		len++;
+	}
+	return len;
+}
+
+static
+void
+dumpdiridx(uint32_t ino)
+{
+	struct sfs_dinode sfi;
+	const struct sfs_dirindex *sdi;
+	const uint32_t *buckets;
+	unsigned nwords, nlinks, nbuckets, i, len;
+	unsigned used = 0, entries = 0, longest = 0;
+
+	diskread(&sfi, ino);
+	if (SWAP16(sfi.sfi_type) != SFS_TYPE_DIRIDX) {
+		warnx("Warning: directory index %u has wrong type %u",
+		      ino, SWAP16(sfi.sfi_type));
+		return;
+	}
+	nwords = DIVROUNDUP(SWAP32(sfi.sfi_size), SFS_BLOCKSIZE) *
+		(SFS_BLOCKSIZE/sizeof(uint32_t));
+	if (nwords < SFS_DIRIDX_LINKS/sizeof(uint32_t)) {
+		warnx("Warning: directory index %u is too small", ino);
+		return;
+	}
+
+	diridxwords = malloc(nwords * sizeof(uint32_t));
+	if (diridxwords == NULL) {
+		errx(1, "Out of memory");
+	}
+	traverse(&sfi, loaddiridxblock);
+
+	sdi = (const struct sfs_dirindex *)diridxwords;
+	buckets = diridxwords + SFS_DIRIDX_BUCKETS/sizeof(uint32_t);
+	nlinks = nwords - SFS_DIRIDX_LINKS/sizeof(uint32_t);
+	nbuckets = SFS_DIRIDX_NBUCKETS;
+
+	for (i=0; i<nbuckets; i++) {
+		len = diridxchain(buckets[i], nlinks);
+		if (len > 0) {
+			used++;
+			entries += len;
+		}
+		if (len > longest) {
+			longest = len;
+		}
+	}
+
+	printf("Directory index %u:\n", ino);
+	dumpvalf("Magic", "0x%08x%s", sdi->sdi_magic,
+		 sdi->sdi_magic == SFS_DIRIDX_MAGIC ? "" : " (wrong)");
+	dumpvalf("Buckets", "%u", sdi->sdi_nbuckets);
+	dumpvalf("Entries", "%u", entries);
+	dumpvalf("Buckets used", "%u", used);
+	dumpvalf("Longest chain", "%u", longest);
+	dumpvalf("Free slots", "%u", diridxchain(sdi->sdi_freehead, nlinks));
+	printf("\n");
+
+	free(diridxwords);
+	diridxwords = NULL;
+}
+
 static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
@@ -444,11 +572,15 @@ dumpinode(uint32_t ino, const char *name)
 	switch (SWAP16(sfi.sfi_type)) {
 	    case SFS_TYPE_FILE: typename = "regular file"; break;
 	    case SFS_TYPE_DIR: typename = "directory"; break;
+	    case SFS_TYPE_DIRIDX: typename = "directory index"; break;
 	    default: typename = "invalid"; break;
 	}
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR) {
+		dumpvalf("Directory index", "%u", SWAP32(sfi.sfi_dirindex));
+	}
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -476,6 +608,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,11 +620,16 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
 		dumpdir(ino, &sfi);
+		if (sfi.sfi_dirindex != 0) {
+			dumpdiridx(SWAP32(sfi.sfi_dirindex));
+		}
 	}
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_FILE && dofiles) {
 		dumpfile(ino, &sfi);
@@ -498,6 +639,182 @@ dumpinode(uint32_t ino, const char *name)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// fragmentation report
+
+/* State for counting the extents of the file being looked at */
+static uint32_t fraglast;
+static unsigned fragblocks, fragextents;
+
+/* Totals over all files */
+static unsigned fragfiles, fragfragmented;
+static unsigned long fragtotblocks, fragtotextents;
+
+/* Inodes already counted, so hard links don't count twice */
+static uint8_t *fragseen;
+
+static void fraginode(uint32_t ino);
+
+/*
+ * Count one block of a file. A block that doesn't follow the one
+ * before it on disk starts a new extent; holes don't count either way.
+ */
+static
+void
+fragblock(uint32_t fileblock, uint32_t diskblock)
+{
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	if (fragblocks == 0 || diskblock != fraglast + 1) {
+		fragextents++;
+	}
+	fragblocks++;
+	fraglast = diskblock;
+}
+
+static
+void
+fragdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	int i;
+
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	diskread(&sds, diskblock);
+	for (i=0; i<nsds; i++) {
+		if (SWAP32(sds[i].sfd_ino) != SFS_NOINO) {
+			fraginode(SWAP32(sds[i].sfd_ino));
+		}
+	}
+}
+
+/*
+ * Count the extents of inode INO, and if it's a directory, of
+ * everything under it. (The inode itself isn't counted as part of
+ * the file; neither are indirect blocks.)
+ */
+static
+void
+fraginode(uint32_t ino)
+{
+	struct sfs_dinode sfi;
+
+	if (fragseen[ino / 8] & (1U << (ino % 8))) {
+		return;
+	}
+	fragseen[ino / 8] |= 1U << (ino % 8);
+
+	diskread(&sfi, ino);
+	fraglast = 0;
+	fragblocks = fragextents = 0;
+	traverse(&sfi, fragblock);
+
+	fragfiles++;
+	fragtotblocks += fragblocks;
+	fragtotextents += fragextents;
+	if (fragextents > 1) {
+		fragfragmented++;
+	}
+
+	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR) {
+		if (sfi.sfi_dirindex != 0) {
+			fraginode(SWAP32(sfi.sfi_dirindex));
+		}
+		traverse(&sfi, fragdirblock);
+	}
+}
+
+/*
+ * Report how fragmented free space and files are: for each
+ * allocation group, how much is free and the longest free run; for
+ * the whole volume, the free runs; and for all files reachable from
+ * the root, how many pieces (extents) they are in.
+ */
+static
+void
+dumpfrag(uint32_t fsblocks)
+{
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint8_t *freemap;
+	uint32_t i, bn, group, ngroups;
+	uint32_t run, longest, grprun, grpfree, grplongest;
+	unsigned long nfree, nruns;
+	bool isfree;
+
+	freemap = malloc(freemapblocks * SFS_BLOCKSIZE);
+	fragseen = malloc(freemapblocks * SFS_BLOCKSIZE);
+	if (freemap == NULL || fragseen == NULL) {
+		errx(1, "Out of memory");
+	}
+	for (i=0; i<freemapblocks; i++) {
+		diskread(freemap + i*SFS_BLOCKSIZE, SFS_FREEMAP_START+i);
+	}
+	memset(fragseen, 0, freemapblocks * SFS_BLOCKSIZE);
+
+	ngroups = DIVROUNDUP(fsblocks, SFS_AGBLOCKS);
+
+	printf("Fragmentation\n");
+	printf("-------------\n");
+	printf("    %u allocation groups of %u blocks\n",
+	       ngroups, SFS_AGBLOCKS);
+
+	nfree = nruns = 0;
+	longest = 0;
+	run = 0;
+	for (group=0; group<ngroups; group++) {
+		grpfree = grplongest = grprun = 0;
+		for (bn = group * SFS_AGBLOCKS;
+		     bn < (group+1) * SFS_AGBLOCKS && bn < fsblocks; bn++) {
+			isfree = (freemap[bn / 8] & (1U << (bn % 8))) == 0;
+			if (!isfree) {
+				run = grprun = 0;
+				continue;
+			}
+			if (run == 0) {
+				nruns++;
+			}
+			run++;
+			grprun++;
+			nfree++;
+			grpfree++;
+			if (run > longest) {
+				longest = run;
+			}
+			if (grprun > grplongest) {
+				grplongest = grprun;
+			}
+		}
+		printf("    Group %-4u blocks %u - %u: %u free, "
+		       "longest free run %u\n",
+		       group, group * SFS_AGBLOCKS, bn - 1, grpfree, grplongest);
+	}
+	printf("    Free: %lu blocks in %lu runs, longest %u, "
+	       "average %lu\n", nfree, nruns, longest,
+	       nruns > 0 ? nfree / nruns : 0);
+
+	fragfiles = fragfragmented = 0;
+	fragtotblocks = fragtotextents = 0;
+	fraginode(SFS_ROOTDIR_INO);
+	printf("    Files: %u, %u of them in more than one extent\n",
+	       fragfiles, fragfragmented);
+	printf("    Data blocks: %lu in %lu extents, average extent %lu.%lu"
+	       " blocks\n", fragtotblocks, fragtotextents,
+	       fragtotextents > 0 ? fragtotblocks / fragtotextents : 0,
+	       fragtotextents > 0 ?
+	       (fragtotblocks * 10 / fragtotextents) % 10 : 0);
+	printf("\n");
+
+	free(fragseen);
+	fragseen = NULL;
+	free(freemap);
+}
+
 ////////////////////////////////////////////////////////////
 // main
 
@@ -513,6 +830,7 @@ usage(void)
 	warnx("   -f: dump file contents");
 	warnx("   -d: dump directory contents");
 	warnx("   -r: recurse into directory contents");
+	warnx("   -F: report fragmentation");
 	warnx("   -a: equivalent to -sbdfr -i 1");
 	errx(1, "   Default is -i 1");
 }
@@ -522,6 +840,7 @@ main(int argc, char **argv)
 {
 	bool dosb = false;
 	bool dofreemap = false;
+	bool dofrag = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
 
@@ -554,6 +873,7 @@ main(int argc, char **argv)
 				    case 'f': dofiles = true; break;
 				    case 'd': dodirs = true; break;
 				    case 'r': recurse = true; break;
+				    case 'F': dofrag = true; break;
 				    case 'a':
 					dosb = true;
 					dofreemap = true;
@@ -584,7 +904,7 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	if (!dosb && !dofreemap && dumpino == 0) {
+	if (!dosb && !dofreemap && !dofrag && dumpino == 0) {
 		dumpino = SFS_ROOTDIR_INO;
 	}
 
@@ -597,6 +917,9 @@ main(int argc, char **argv)
 	if (dofreemap) {
 		dumpfreemap(nblocks);
 	}
+	if (dofrag) {
+		dumpfrag(nblocks);
+	}
 	if (dumpino != 0) {
 		dumpinode(dumpino, NULL);
 	}
@@ -57,8 +57,8 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
-#define MAXFREEMAPBLOCKS 32
+/* Maximum size of freemap we support (1G volume) */
+#define MAXFREEMAPBLOCKS 512
 
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
@@ -73,6 +73,8 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(SFS_DIRIDX_LINKS % SFS_BLOCKSIZE == 0);
 }
 
 /*
@@ -89,6 +91,25 @@ allocblock(uint32_t block)
 	freemapbuf[mapbyte] |= mask;
 }
 
+/*
+ * Allocate the first free block.
+ */
+static
+uint32_t
+getblock(uint32_t fsblocks)
+{
+	uint32_t block;
+
+	for (block=0; block<fsblocks; block++) {
+		if ((freemapbuf[block/CHAR_BIT] &
+		     (1<<(block % CHAR_BIT))) == 0) {
+			allocblock(block);
+			return block;
+		}
+	}
+	errx(1, "Filesystem too small");
+}
+
 /*
  * Initialize the free block bitmap.
  */
@@ -165,11 +186,52 @@ writefreemap(uint32_t fsblocks)
 }
 
 /*
- * Write out the root directory inode.
+ * Write out an empty directory index and return its inode number.
+ * With no directory slots yet, it's just the header and the (empty)
+ * hash buckets.
+ */
+static
+uint32_t
+writedirindex(uint32_t fsblocks)
+{
+	struct sfs_dinode sfi;
+	struct sfs_dirindex sdi;
+	char zeros[SFS_BLOCKSIZE];
+	uint32_t ino, block, nblocks, i;
+
+	nblocks = SFS_DIRIDX_LINKS / SFS_BLOCKSIZE;
+	assert(nblocks <= SFS_NDIRECT);
+
+	bzero((void *)&sfi, sizeof(sfi));
+	bzero((void *)&sdi, sizeof(sdi));
+	bzero(zeros, sizeof(zeros));
+
+	ino = getblock(fsblocks);
+	sfi.sfi_size = SWAP32(SFS_DIRIDX_LINKS);
+	sfi.sfi_type = SWAP16(SFS_TYPE_DIRIDX);
+	sfi.sfi_linkcount = SWAP16(1);
+
+	sdi.sdi_magic = SWAP32(SFS_DIRIDX_MAGIC);
+	sdi.sdi_nbuckets = SWAP32(SFS_DIRIDX_NBUCKETS);
+	sdi.sdi_freehead = SWAP32(0);
+
+	for (i=0; i<nblocks; i++) {
+		block = getblock(fsblocks);
+		sfi.sfi_direct[i] = SWAP32(block);
+		diskwrite(i == 0 ? (void *)&sdi : (void *)zeros, block);
+	}
+
+	diskwrite(&sfi, ino);
+	return ino;
+}
+
+/*
+ * Write out the root directory inode. The root directory is where
+ * things pile up, so it gets an index from the start.
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t fsblocks)
 {
 	struct sfs_dinode sfi;
 
@@ -178,6 +240,7 @@ writerootdir(void)
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	sfi.sfi_dirindex = SWAP32(writedirindex(fsblocks));
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -231,8 +294,8 @@ main(int argc, char **argv)
 	/* Write out the on-disk structures */
 	initfreemap(size);
 	writesuper(volname, size);
+	writerootdir(size);
 	writefreemap(size);
-	writerootdir();
 
 	closedisk();
 
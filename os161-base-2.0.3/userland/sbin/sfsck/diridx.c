@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "utils.h"
+#include "sfs.h"
+#include "diridx.h"
+#include "main.h"
+
+/* Word offsets of things in an index; see kern/sfs.h */
+#define W_MAGIC		0
+#define W_NBUCKETS	1
+#define W_FREEHEAD	2
+#define W_BUCKETS	(SFS_DIRIDX_BUCKETS / sizeof(uint32_t))
+#define W_LINKS		(SFS_DIRIDX_LINKS / sizeof(uint32_t))
+
+struct diridxinfo {
+	uint32_t dirino;
+	uint32_t idxino;
+};
+
+/* Table of indexed directories found. */
+static struct diridxinfo *diridxs = NULL;
+static unsigned ndiridxs = 0, maxdiridxs = 0;
+
+void
+diridx_add(uint32_t dirino, uint32_t idxino)
+{
+	unsigned newmax;
+
+	assert(ndiridxs <= maxdiridxs);
+	if (ndiridxs == maxdiridxs) {
+		newmax = maxdiridxs ? maxdiridxs * 2 : 4;
+		diridxs = dorealloc(diridxs, maxdiridxs * sizeof(diridxs[0]),
+				    newmax * sizeof(diridxs[0]));
+		maxdiridxs = newmax;
+	}
+	diridxs[ndiridxs].dirino = dirino;
+	diridxs[ndiridxs].idxino = idxino;
+	ndiridxs++;
+}
+
+/*
+ * Walk one chain of index W starting at word HEADW, marking the slots
+ * seen in SEEN. Slots on a bucket chain (BUCKET >= 0) must be in use
+ * and hash to that bucket; slots on the free list (BUCKET < 0) must
+ * be unused. Returns nonzero if the chain is bad.
+ */
+static
+int
+diridx_checkchain(const uint32_t *w, unsigned headw, int bucket,
+		  const struct sfs_direntry *d, unsigned nd, char *seen)
+{
+	uint32_t cur, slot;
+
+	for (cur = w[headw]; cur != 0; cur = w[W_LINKS + slot]) {
+		slot = cur - 1;
+		if (slot >= nd || seen[slot]) {
+			return 1;
+		}
+		seen[slot] = 1;
+		if (bucket < 0) {
+			if (d[slot].sfd_ino != SFS_NOINO) {
+				return 1;
+			}
+		}
+		else {
+			if (d[slot].sfd_ino == SFS_NOINO ||
+			    sfsdir_hash(d[slot].sfd_name) != (unsigned)bucket) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check index W against directory D (ND slots). Returns nonzero if
+ * it is wrong anywhere.
+ */
+static
+int
+diridx_isbad(const uint32_t *w, const struct sfs_direntry *d, unsigned nd)
+{
+	char *seen;
+	unsigned i;
+	int bad = 0;
+
+	if (w[W_MAGIC] != SFS_DIRIDX_MAGIC ||
+	    w[W_NBUCKETS] != SFS_DIRIDX_NBUCKETS) {
+		return 1;
+	}
+
+	seen = domalloc(nd ? nd : 1);
+	bzero(seen, nd ? nd : 1);
+
+	for (i=0; i<SFS_DIRIDX_NBUCKETS && !bad; i++) {
+		bad = diridx_checkchain(w, W_BUCKETS + i, i, d, nd, seen);
+	}
+	if (!bad) {
+		bad = diridx_checkchain(w, W_FREEHEAD, -1, d, nd, seen);
+	}
+	/* every slot must be on some chain */
+	for (i=0; i<nd && !bad; i++) {
+		if (!seen[i]) {
+			bad = 1;
+		}
+	}
+
+	free(seen);
+	return bad;
+}
+
+/*
+ * Rebuild index W (NW words) from directory D (ND slots), the same
+ * way the kernel does.
+ */
+static
+void
+diridx_rebuild(uint32_t *w, unsigned nw, const struct sfs_direntry *d,
+	       unsigned nd)
+{
+	unsigned i, b;
+
+	bzero(w, nw * sizeof(uint32_t));
+	w[W_MAGIC] = SFS_DIRIDX_MAGIC;
+	w[W_NBUCKETS] = SFS_DIRIDX_NBUCKETS;
+
+	for (i=nd; i-- > 0; ) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			w[W_LINKS + i] = w[W_FREEHEAD];
+			w[W_FREEHEAD] = i + 1;
+		}
+		else {
+			b = sfsdir_hash(d[i].sfd_name);
+			w[W_LINKS + i] = w[W_BUCKETS + b];
+			w[W_BUCKETS + b] = i + 1;
+		}
+	}
+}
+
+/*
+ * Check the index of one directory.
+ */
+static
+void
+diridx_checkone(const struct diridxinfo *di)
+{
+	struct sfs_dinode dirsfi, idxsfi;
+	struct sfs_direntry *direntries;
+	uint32_t *w;
+	unsigned nd, nw;
+
+	sfs_readinode(di->dirino, &dirsfi);
+	sfs_readinode(di->idxino, &idxsfi);
+
+	nd = dirsfi.sfi_size / sizeof(struct sfs_direntry);
+	nw = idxsfi.sfi_size / sizeof(uint32_t);
+
+	/* pass 1 made sure of this, and pass 2 only adds to the last block */
+	assert(nw >= W_LINKS + nd);
+
+	direntries = domalloc(nd * sizeof(struct sfs_direntry) + 1);
+	w = domalloc(nw * sizeof(uint32_t));
+
+	sfs_readdir(&dirsfi, direntries, nd);
+	sfs_readdiridx(&idxsfi, w, nw);
+
+	if (diridx_isbad(w, direntries, nd)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %lu: index %lu does not match "
+		      "the directory (rebuilt)",
+		      (unsigned long) di->dirino,
+		      (unsigned long) di->idxino);
+		diridx_rebuild(w, nw, direntries, nd);
+		sfs_writediridx(&idxsfi, w, nw);
+	}
+
+	free(w);
+	free(direntries);
+}
+
+void
+diridx_check(void)
+{
+	unsigned i;
+
+	for (i=0; i<ndiridxs; i++) {
+		diridx_checkone(&diridxs[i]);
+	}
+}
@@ -244,6 +244,10 @@ inode_adjust_filelinks(void)
 			/* directory */
 			continue;
 		}
+		if (inodes[i].type == SFS_TYPE_DIRIDX) {
+			/* directory index; pass 1 checks its link count */
+			continue;
+		}
 		assert(inodes[i].type == SFS_TYPE_FILE);
 
 		/* because we've seen it, there must be at least one link */
@@ -39,6 +39,7 @@
 #include "sb.h"
 #include "freemap.h"
 #include "inode.h"
+#include "diridx.h"
 #include "passes.h"
 #include "main.h"
 
@@ -91,6 +92,9 @@ main(int argc, char **argv)
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	printf("Phase 4 -- check directory indexes\n");
+	diridx_check();
+
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
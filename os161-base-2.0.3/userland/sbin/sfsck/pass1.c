@@ -44,6 +44,7 @@
 #include "sb.h"
 #include "freemap.h"
 #include "inode.h"
+#include "diridx.h"
 #include "passes.h"
 #include "main.h"
 
@@ -89,7 +90,6 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 
 	if (*ientry > 0 && *ientry < ibs->volblocks) {
 		sfs_readindirect(*ientry, entries);
-		freemap_blockinuse(*ientry, B_IBLOCK, ibs->ino);
 	}
 	else {
 		if (*ientry >= ibs->volblocks) {
@@ -165,7 +165,12 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 	}
 	else {
+		/*
+		 * Only now count the block as in use; if it turned
+		 * out empty above, it goes back to the freemap.
+		 */
 		assert(*ientry != 0);
+		freemap_blockinuse(*ientry, B_IBLOCK, ibs->ino);
 		if (localchanged) {
 			sfs_writeindirect(*ientry, entries);
 		}
@@ -277,6 +282,14 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (!isdir && sfi->sfi_dirindex != 0) {
+		warnx("Inode %lu: directory index set in non-directory "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_dirindex = 0;
+		changed = 1;
+	}
+
 	if (check_inode_blocks(ino, sfi, isdir)) {
 		changed = 1;
 	}
@@ -287,6 +300,70 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 	return 0;
 }
 
+/*
+ * Check the index of directory INO, whose inode is SFI, if it has
+ * one. Indexes that can't be used as they stand are dropped (the
+ * kernel makes a new one when it needs it); the contents are checked
+ * after pass 2, by diridx_check().
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+pass1_dirindex(uint32_t ino, struct sfs_dinode *sfi, const char *path)
+{
+	struct sfs_dinode idxsfi;
+	uint32_t idxino, nslots;
+	const char *why;
+
+	idxino = sfi->sfi_dirindex;
+	if (idxino == 0) {
+		return 0;
+	}
+
+	/* the link array covers whole directory blocks */
+	nslots = SFS_ROUNDUP(sfi->sfi_size / sizeof(struct sfs_direntry),
+			     SFS_DIRENTRIESPERBLOCK);
+
+	if (idxino >= sb_totalblocks()) {
+		why = "out of range";
+		goto drop;
+	}
+	sfs_readinode(idxino, &idxsfi);
+	if (idxsfi.sfi_type != SFS_TYPE_DIRIDX) {
+		why = "not an index";
+		goto drop;
+	}
+	if (idxsfi.sfi_size < SFS_DIRIDX_LINKS + nslots * sizeof(uint32_t) ||
+	    sfs_checkholes(&idxsfi)) {
+		why = "incomplete";
+		goto drop;
+	}
+	if (pass1_inode(idxino, &idxsfi, 0)) {
+		why = "shared with another directory";
+		goto drop;
+	}
+	if (idxsfi.sfi_linkcount != 1) {
+		warnx("Directory %s: index %lu link count %lu should be 1 "
+		      "(fixed)", path, (unsigned long) idxino,
+		      (unsigned long) idxsfi.sfi_linkcount);
+		setbadness(EXIT_RECOV);
+		idxsfi.sfi_linkcount = 1;
+		sfs_writeinode(idxino, &idxsfi);
+	}
+
+	diridx_add(ino, idxino);
+	return 0;
+
+ drop:
+	setbadness(EXIT_RECOV);
+	warnx("Directory %s: index %lu %s (dropped)",
+	      path, (unsigned long) idxino, why);
+	sfi->sfi_dirindex = 0;
+	return 1;
+}
+
 /*
  * Check the directory entry in SFD. INDEX is its offset, and PATH is
  * its name; these are used for printing messages.
@@ -381,6 +458,10 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 		return;
 	}
 
+	if (pass1_dirindex(ino, &sfi, pathsofar)) {
+		sfs_writeinode(ino, &sfi);
+	}
+
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
 	direntries = domalloc(sfi.sfi_size);
 
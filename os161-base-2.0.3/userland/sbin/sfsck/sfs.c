@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -51,6 +52,8 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirindex)==SFS_BLOCKSIZE);
+	assert(SFS_DIRIDX_LINKS % SFS_BLOCKSIZE == 0);
 }
 
 ////////////////////////////////////////////////////////////
@@ -97,6 +100,8 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_dirindex = SWAP32(sfi->sfi_dirindex);
 }
 
 static
@@ -134,7 +139,7 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
 	uint32_t entries[SFS_DBPERIDB];
 
-	if (iblock == 0) {
+	if (iblock == 0 || iblock >= sb_totalblocks()) {
 		return 0;
 	}
 
@@ -184,6 +189,25 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 	return 0;
 }
 
+/*
+ * Check that every block of the file SFI, up to its size, is mapped
+ * to a block inside the volume. Returns nonzero if not.
+ */
+int
+sfs_checkholes(const struct sfs_dinode *sfi)
+{
+	uint32_t nblocks, i, diskblock;
+
+	nblocks = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE) / SFS_BLOCKSIZE;
+	for (i=0; i<nblocks; i++) {
+		diskblock = bmap(sfi, i);
+		if (diskblock == 0 || diskblock >= sb_totalblocks()) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 // superblock, free block bitmap, and inode I/O
 
@@ -391,9 +415,76 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 	assert(left == 0);
 }
 
+////////////////////////////////////////////////////////////
+// directory index I/O
+
+/*
+ * Read the first NW words of the directory index whose inode is SFI
+ * into W. The caller must have checked that the index has no holes
+ * (sfs_checkholes) and is at least that big.
+ */
+void
+sfs_readdiridx(const struct sfs_dinode *sfi, uint32_t *w, unsigned nw)
+{
+	const unsigned atonce = SFS_BLOCKSIZE/sizeof(uint32_t);
+	uint32_t buffer[atonce];
+	unsigned i, j, thismany;
+
+	for (i=0; i*atonce < nw; i++) {
+		diskread(buffer, bmap(sfi, i));
+		thismany = nw - i*atonce < atonce ? nw - i*atonce : atonce;
+		for (j=0; j<thismany; j++) {
+			w[i*atonce + j] = SWAP32(buffer[j]);
+		}
+	}
+}
+
+/*
+ * Write back the first NW words of a directory index; the rest of the
+ * last block is read back first so it doesn't get clobbered.
+ */
+void
+sfs_writediridx(const struct sfs_dinode *sfi, const uint32_t *w, unsigned nw)
+{
+	const unsigned atonce = SFS_BLOCKSIZE/sizeof(uint32_t);
+	uint32_t buffer[atonce];
+	uint32_t diskblock;
+	unsigned i, j, thismany;
+
+	for (i=0; i*atonce < nw; i++) {
+		diskblock = bmap(sfi, i);
+		thismany = nw - i*atonce < atonce ? nw - i*atonce : atonce;
+		if (thismany < atonce) {
+			diskread(buffer, diskblock);
+		}
+		for (j=0; j<thismany; j++) {
+			buffer[j] = SWAP32(w[i*atonce + j]);
+		}
+		diskwrite(buffer, diskblock);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // directory utilities
 
+/*
+ * Hash a name to its directory index bucket. This must match
+ * sfs_dirindex_hash() in the kernel: 32-bit FNV-1a.
+ */
+unsigned
+sfsdir_hash(const char *name)
+{
+	const unsigned char *s;
+	uint32_t h;
+
+	h = 2166136261U;
+	for (s = (const unsigned char *)name; *s; s++) {
+		h ^= *s;
+		h *= 16777619U;
+	}
+	return h % SFS_DIRIDX_NBUCKETS;
+}
+
 /* this exists because qsort() doesn't pass a context pointer through */
 static struct sfs_direntry *global_sortdirs;
 
@@ -65,6 +65,14 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
+/* directory index - NW is the number of 32-bit words W points to */
+void sfs_readdiridx(const struct sfs_dinode *sfi, uint32_t *w, unsigned nw);
+void sfs_writediridx(const struct sfs_dinode *sfi,
+		     const uint32_t *w, unsigned nw);
+
+/* Check that a file has no holes; returns nonzero if it does. */
+int sfs_checkholes(const struct sfs_dinode *sfi);
+
 /* directory - ND should be the number of directory entries D points to */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
@@ -74,6 +82,9 @@ void sfs_writedir(const struct sfs_dinode *sfi,
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
 
+/* Hash a name to its directory index bucket. */
+unsigned sfsdir_hash(const char *name);
+
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 
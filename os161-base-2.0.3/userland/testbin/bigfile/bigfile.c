@@ -41,6 +41,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <err.h>
+#include <test/timer.h>
 
 static char buffer[8192 + 1];
 
@@ -52,6 +53,7 @@ main(int argc, char *argv[])
 	size_t i, size, chunksize, offset;
 	ssize_t len;
 	int fd;
+	struct timer timer;
 
 	if (argc != 3) {
 		warnx("Usage: bigfile <filename> <size>");
@@ -86,6 +88,8 @@ main(int argc, char *argv[])
 		err(1, "%s: create", filename);
 	}
 
+	timer_start(&timer);
+
 	i=0;
 	while (i<size) {
 		snprintf(buffer, sizeof(buffer), "%d\n", i);
@@ -103,5 +107,7 @@ main(int argc, char *argv[])
 
 	close(fd);
 
+	timer_report(&timer, "bigfile", "write", size);
+
 	return 0;
 }
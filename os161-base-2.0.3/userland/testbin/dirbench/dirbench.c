@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * dirbench - measure operations on one very big directory.
+ *
+ * Usage: dirbench [nfiles]
+ *
+ * In the current directory, creates NFILES files (default 10000),
+ * looks each of them up, looks up as many names that don't exist,
+ * and then removes them all, printing the average time per operation
+ * for each phase. Every file costs an inode, so the volume needs
+ * NFILES free blocks and then some.
+ *
+ * With directories searched linearly every phase is O(NFILES) per
+ * operation; with an indexed directory they should stay flat as
+ * NFILES grows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_NFILES	10000
+#define MAX_NFILES	100000
+
+static struct timer timer;
+
+static
+void
+filename(char *name, size_t len, const char *prefix, unsigned num)
+{
+	snprintf(name, len, "%s.%u", prefix, num);
+}
+
+/*
+ * Print the time since timer_start() per each of N operations.
+ */
+static
+void
+report(const char *what, unsigned n)
+{
+	unsigned long long usecs = timer_usecs(&timer);
+
+	printf("dirbench: %-6s %u ops in %llu.%06llu s, %llu us per op\n",
+	       what, n, usecs / 1000000, usecs % 1000000, usecs / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned nfiles = DEFAULT_NFILES;
+	unsigned i;
+	char name[32];
+	int fd;
+
+	if (argc > 2) {
+		errx(1, "Usage: dirbench [nfiles]");
+	}
+	if (argc == 2) {
+		nfiles = atoi(argv[1]);
+		if (nfiles == 0 || nfiles > MAX_NFILES) {
+			errx(1, "nfiles must be between 1 and %d", MAX_NFILES);
+		}
+	}
+
+	timer_start(&timer);
+	for (i=0; i<nfiles; i++) {
+		filename(name, sizeof(name), "dirbench", i);
+		fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0664);
+		if (fd < 0) {
+			err(1, "%s: create", name);
+		}
+		close(fd);
+	}
+	report("create", nfiles);
+
+	timer_start(&timer);
+	for (i=0; i<nfiles; i++) {
+		filename(name, sizeof(name), "dirbench", i);
+		fd = open(name, O_RDONLY);
+		if (fd < 0) {
+			err(1, "%s", name);
+		}
+		close(fd);
+	}
+	report("lookup", nfiles);
+
+	timer_start(&timer);
+	for (i=0; i<nfiles; i++) {
+		filename(name, sizeof(name), "nosuchfile", i);
+		fd = open(name, O_RDONLY);
+		if (fd >= 0) {
+			errx(1, "%s: exists", name);
+		}
+		if (errno != ENOENT) {
+			err(1, "%s", name);
+		}
+	}
+	report("miss", nfiles);
+
+	timer_start(&timer);
+	for (i=0; i<nfiles; i++) {
+		filename(name, sizeof(name), "dirbench", i);
+		if (remove(name) < 0) {
+			err(1, "%s: remove", name);
+		}
+	}
+	report("unlink", nfiles);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * fillbench - measure file creation and write throughput as a volume
+ * fills up.
+ *
+ * Usage: fillbench [-k] [totalkb [filekb]]
+ *
+ * Creates files fill.0, fill.1, ... of FILEKB kilobytes each
+ * (default 64) in the current directory until TOTALKB kilobytes have
+ * been written, or until the disk is full if TOTALKB is 0 or not
+ * given. The rate is printed for each tenth of TOTALKB (or for each
+ * megabyte if there is no TOTALKB), so one can see whether creating
+ * and writing files slows down as free space runs out; give TOTALKB
+ * as 95% of the free space to stop short of completely full. The
+ * files are removed afterwards unless -k is given, in which case
+ * the layout can be looked at with dumpsfs -F.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_FILEKB		64
+#define CHUNKSIZE		4096
+
+static char buf[CHUNKSIZE];
+
+static struct timer timer;
+
+/*
+ * Print the rate for FILES files and KB kilobytes since timer_start().
+ * DONEKB is the total so far.
+ */
+static
+void
+report(unsigned files, unsigned kb, unsigned donekb)
+{
+	unsigned long long usecs = timer_usecs(&timer);
+
+	printf("fillbench: at %6u KB: %u files, %u KB in %llu.%06llu s, "
+	       "%llu KB/s\n", donekb, files, kb,
+	       usecs / 1000000, usecs % 1000000,
+	       (unsigned long long)kb * 1000000 / usecs);
+}
+
+/*
+ * Create file number N and write FILEKB kilobytes to it. Returns the
+ * number of kilobytes written, which is less than FILEKB only if the
+ * disk filled up, or -1 if the file couldn't be created because the
+ * disk is full.
+ */
+static
+int
+fill(unsigned n, unsigned filekb)
+{
+	char name[32];
+	size_t done, len;
+	ssize_t r;
+	int fd;
+
+	snprintf(name, sizeof(name), "fill.%u", n);
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		if (errno == ENOSPC) {
+			return -1;
+		}
+		err(1, "%s: create", name);
+	}
+
+	memset(buf, n, sizeof(buf));
+	for (done = 0; done < filekb * 1024; done += r) {
+		len = filekb * 1024 - done;
+		if (len > CHUNKSIZE) {
+			len = CHUNKSIZE;
+		}
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == ENOSPC) {
+				break;
+			}
+			err(1, "%s: write", name);
+		}
+		if ((size_t)r < len) {
+			done += r;
+			break;
+		}
+	}
+	close(fd);
+	return done / 1024;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned totalkb = 0, filekb = DEFAULT_FILEKB;
+	unsigned step, files, kb, stepfiles, stepkb, i;
+	int n;
+	int argn = 1;
+	int keep = 0;
+
+	if (argn < argc && !strcmp(argv[argn], "-k")) {
+		keep = 1;
+		argn++;
+	}
+	if (argc - argn > 2) {
+		errx(1, "Usage: fillbench [-k] [totalkb [filekb]]");
+	}
+	if (argc - argn > 0) {
+		totalkb = atoi(argv[argn]);
+	}
+	if (argc - argn > 1) {
+		filekb = atoi(argv[argn+1]);
+		if (filekb == 0) {
+			errx(1, "Really?");
+		}
+	}
+	step = totalkb > 0 ? (totalkb + 9) / 10 : 1024;
+
+	files = kb = 0;
+	stepfiles = stepkb = 0;
+	timer_start(&timer);
+	while (totalkb == 0 || kb < totalkb) {
+		n = fill(files, filekb);
+		if (n < 0) {
+			/* disk full */
+			break;
+		}
+		files++;
+		kb += n;
+		stepfiles++;
+		stepkb += n;
+		if ((unsigned)n < filekb) {
+			/* disk full */
+			break;
+		}
+		if (stepkb >= step) {
+			report(stepfiles, stepkb, kb);
+			stepfiles = stepkb = 0;
+			timer_start(&timer);
+		}
+	}
+	if (stepfiles > 0) {
+		report(stepfiles, stepkb, kb);
+	}
+	printf("fillbench: %u files, %u KB total%s\n", files, kb,
+	       (totalkb == 0 || kb < totalkb) ? " (disk full)" : "");
+
+	if (!keep) {
+		for (i=0; i<files; i++) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "fill.%u", i);
+			remove(name);
+		}
+	}
+	return 0;
+}
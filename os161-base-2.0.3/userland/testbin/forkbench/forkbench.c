@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkbench - measure the cost of fork.
+ *
+ * Usage: forkbench [iterations]
+ *
+ * Times three workloads, each repeated ITERATIONS times (default 50):
+ *
+ *    exit  - fork; the child exits at once.
+ *    touch - the parent first fills a 64-page array; the child writes
+ *            one word in each of TOUCHPAGES of those pages and exits.
+ *    exec  - fork; the child execs /bin/true (the shell's pattern).
+ *
+ * With copy-on-write fork, "exit" and "exec" should copy almost
+ * nothing and "touch" should copy about TOUCHPAGES pages per fork,
+ * regardless of how big the parent is. To see the page counts, run
+ * "vm reset" from the kernel menu before and "vm" after; the kernel
+ * prints the pages actually copied per fork.
+ *
+ * Likewise "kmem reset" before and "kmem" after show how many of the
+ * proc, thread and trapframe structures each fork got ready-made from
+ * the kernel's object caches ("hits") rather than building them.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define PAGESIZE	4096
+#define BIGPAGES	64
+#define TOUCHPAGES	8
+#define DEFAULT_ITERS	50
+
+enum workload { W_EXIT, W_TOUCH, W_EXEC };
+
+static const char *const names[] = { "exit", "touch", "exec" };
+
+static char big[BIGPAGES * PAGESIZE];
+
+/*
+ * Run the child's part of one workload.
+ */
+static
+void
+child(enum workload what)
+{
+	char *args[2];
+	unsigned i;
+
+	switch (what) {
+	    case W_EXIT:
+		_exit(0);
+	    case W_TOUCH:
+		for (i=0; i<TOUCHPAGES; i++) {
+			big[i * PAGESIZE] = (char)i;
+		}
+		_exit(0);
+	    case W_EXEC:
+		args[0] = (char *)"true";
+		args[1] = NULL;
+		execv("/bin/true", args);
+		_exit(1);
+	}
+	_exit(1);
+}
+
+/*
+ * Fork ITERS children running WHAT, one at a time, and print the
+ * average time per fork+wait.
+ */
+static
+void
+bench(enum workload what, unsigned iters)
+{
+	struct timer timer;
+	unsigned long long usecs;
+	unsigned i;
+	int pid, status;
+
+	timer_start(&timer);
+	for (i=0; i<iters; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			child(what);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("%s: child %d failed", names[what], pid);
+		}
+	}
+	usecs = timer_usecs(&timer);
+
+	printf("forkbench: %-5s %u forks in %lld.%06llu s, "
+	       "%llu us per fork\n", names[what], iters,
+	       (long long)(usecs / 1000000), usecs % 1000000,
+	       usecs / iters);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned iters = DEFAULT_ITERS;
+	unsigned i;
+
+	if (argc > 2) {
+		errx(1, "Usage: forkbench [iterations]");
+	}
+	if (argc == 2) {
+		iters = atoi(argv[1]);
+		if (iters == 0) {
+			errx(1, "Usage: forkbench [iterations]");
+		}
+	}
+
+	/* Make the parent big: touch every page of the array. */
+	for (i=0; i<BIGPAGES; i++) {
+		big[i * PAGESIZE] = 1;
+	}
+
+	bench(W_EXIT, iters);
+	bench(W_TOUCH, iters);
+	bench(W_EXEC, iters);
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkwait - measure fork and waitpid with many processes around.
+ *
+ * Usage: forkwait [nprocs]
+ *
+ * Forks NPROCS children (default 1024) that all exit at once, without
+ * waiting for any of them, so that by the end there are NPROCS
+ * processes in the process table. Then waits for them all, in a
+ * scrambled order. Prints the rate of forks and of waitpids.
+ *
+ * Like forkbomb, but it stops, and it cleans up after itself. With a
+ * process table that scales, neither rate should drop much as NPROCS
+ * grows.
+ *
+ * Last, forks NPROCS more children one at a time and waits for each
+ * right away, so that the parent's waitpid races with the child's
+ * exit, and prints the rate of those fork/exit/waitpid round trips.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_NPROCS	1024
+#define MAX_NPROCS	4000
+
+static pid_t pids[MAX_NPROCS];
+
+/*
+ * Print the rate of N operations done in USECS microseconds.
+ */
+static
+void
+report(const char *what, unsigned n, unsigned long long usecs)
+{
+	printf("forkwait: %u %s in %llu.%06llu s, %llu per second\n", n, what,
+	       usecs / 1000000, usecs % 1000000, n * 1000000ULL / usecs);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned nprocs = DEFAULT_NPROCS;
+	unsigned i, j, step, failed;
+	struct timer timer;
+	int status;
+
+	if (argc > 2) {
+		errx(1, "Usage: forkwait [nprocs]");
+	}
+	if (argc == 2) {
+		nprocs = atoi(argv[1]);
+		if (nprocs == 0 || nprocs > MAX_NPROCS) {
+			errx(1, "nprocs must be between 1 and %d", MAX_NPROCS);
+		}
+	}
+
+	timer_start(&timer);
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			warn("fork %u", i);
+			nprocs = i;
+			break;
+		}
+		if (pids[i] == 0) {
+			_exit(0);
+		}
+	}
+	report("forks", nprocs, timer_usecs(&timer));
+
+	/*
+	 * Wait in a scrambled order: stepping through the array by a
+	 * stride prime to NPROCS visits every child once.
+	 */
+	step = 1;
+	for (j=2; j<nprocs; j++) {
+		if (nprocs % j != 0 && j * j > nprocs) {
+			step = j;
+			break;
+		}
+	}
+
+	failed = 0;
+	timer_start(&timer);
+	for (i=0, j=0; i<nprocs; i++, j = (j + step) % nprocs) {
+		if (waitpid(pids[j], &status, 0) < 0) {
+			warn("waitpid %d", pids[j]);
+			failed++;
+		}
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("child %d failed", pids[j]);
+			failed++;
+		}
+	}
+	report("waitpids", nprocs, timer_usecs(&timer));
+
+	/* Reaping each child as soon as it is forked. */
+	timer_start(&timer);
+	for (i=0; i<nprocs; i++) {
+		pids[0] = fork();
+		if (pids[0] < 0) {
+			warn("fork %u", i);
+			failed++;
+			break;
+		}
+		if (pids[0] == 0) {
+			_exit(i % 128);
+		}
+		if (waitpid(pids[0], &status, 0) < 0) {
+			warn("waitpid %d", pids[0]);
+			failed++;
+		}
+		else if (!WIFEXITED(status) ||
+			 WEXITSTATUS(status) != (int)(i % 128)) {
+			warnx("child %d: wrong exit status", pids[0]);
+			failed++;
+		}
+	}
+	report("reaps", i, timer_usecs(&timer));
+
+	if (failed > 0) {
+		errx(1, "%u children went wrong", failed);
+	}
+	return 0;
+}
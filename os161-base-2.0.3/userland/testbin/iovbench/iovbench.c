@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * iovbench - positional and vectored I/O against the plain calls.
+ *
+ * Usage: iovbench [filename [records]]
+ *
+ * Writes RECORDS (default 2048) records to a file, each a small header
+ * followed by a body, and reads them back, printing the rate of each
+ * way in records per second:
+ *
+ *     write    write the header, then write the body
+ *     writev   write both with one writev
+ *     seek     read records in a scattered order with lseek and read
+ *     pread    the same with pread
+ *     readv    read them all in order, header and body with one readv
+ *
+ * Everything read is checked, and so is that pread and pwrite leave
+ * the seek position alone. Then a forked child and its parent read the
+ * file with pread at the same time through the same open file, which
+ * with lseek and read would both need the shared seek position. The
+ * file is removed afterwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_FILENAME	"iovbench.tmp"
+#define DEFAULT_RECORDS		2048
+#define HEADERSIZE		16
+#define BODYSIZE		496
+#define RECORDSIZE		(HEADERSIZE + BODYSIZE)
+
+/* Records are visited in the order i * STRIDE mod the record count. */
+#define STRIDE			97
+
+static char header[HEADERSIZE];
+static char body[BODYSIZE];
+
+static struct timer timer;
+
+/*
+ * Print the rate for COUNT records since timer_start().
+ */
+static
+void
+report(const char *what, unsigned count)
+{
+	unsigned long long usecs = timer_usecs(&timer);
+
+	printf("iovbench: %-8s %u records in %llu.%06llu s, %llu/s\n",
+	       what, count, usecs / 1000000, usecs % 1000000,
+	       (unsigned long long)count * 1000000 / usecs);
+}
+
+/*
+ * Fill in record N.
+ */
+static
+void
+fill(unsigned n)
+{
+	unsigned i;
+
+	snprintf(header, sizeof(header), "rec %10u", n);
+	for (i=0; i<BODYSIZE; i++) {
+		body[i] = n + i;
+	}
+}
+
+/*
+ * Check that header and body hold record N.
+ */
+static
+void
+check(const char *what, unsigned n)
+{
+	char expect[HEADERSIZE];
+	unsigned i;
+
+	memset(expect, 0, sizeof(expect));
+	snprintf(expect, sizeof(expect), "rec %10u", n);
+	if (memcmp(header, expect, HEADERSIZE) != 0) {
+		errx(1, "%s: record %u: wrong header", what, n);
+	}
+	for (i=0; i<BODYSIZE; i++) {
+		if (body[i] != (char)(n + i)) {
+			errx(1, "%s: record %u: wrong body", what, n);
+		}
+	}
+}
+
+static
+int
+openfile(const char *filename, int flags)
+{
+	int fd;
+
+	fd = open(filename, flags, 0664);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	return fd;
+}
+
+/*
+ * Write the records with two writes each, or with one writev each.
+ */
+static
+void
+writerecords(const char *filename, unsigned nrecs, int usewritev)
+{
+	struct iovec iov[2];
+	unsigned n;
+	ssize_t r;
+	int fd;
+
+	fd = openfile(filename, O_WRONLY|O_CREAT|O_TRUNC);
+	iov[0].iov_base = header;
+	iov[0].iov_len = HEADERSIZE;
+	iov[1].iov_base = body;
+	iov[1].iov_len = BODYSIZE;
+
+	timer_start(&timer);
+	for (n=0; n<nrecs; n++) {
+		fill(n);
+		if (usewritev) {
+			r = writev(fd, iov, 2);
+		}
+		else {
+			r = write(fd, header, HEADERSIZE);
+			if (r == HEADERSIZE) {
+				r = write(fd, body, BODYSIZE);
+				if (r == BODYSIZE) {
+					r = RECORDSIZE;
+				}
+			}
+		}
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if (r != RECORDSIZE) {
+			errx(1, "%s: short write", filename);
+		}
+	}
+	report(usewritev ? "writev" : "write", nrecs);
+	close(fd);
+}
+
+/*
+ * Read record N at its place in the file, with pread or with lseek
+ * and read.
+ */
+static
+void
+readrecord(int fd, unsigned n, int usepread)
+{
+	char buf[RECORDSIZE];
+	off_t pos = (off_t)n * RECORDSIZE;
+	ssize_t r;
+
+	if (usepread) {
+		r = pread(fd, buf, RECORDSIZE, pos);
+	}
+	else {
+		if (lseek(fd, pos, SEEK_SET) < 0) {
+			err(1, "lseek");
+		}
+		r = read(fd, buf, RECORDSIZE);
+	}
+	if (r < 0) {
+		err(1, usepread ? "pread" : "read");
+	}
+	if (r != RECORDSIZE) {
+		errx(1, "short read");
+	}
+	memcpy(header, buf, HEADERSIZE);
+	memcpy(body, buf + HEADERSIZE, BODYSIZE);
+}
+
+/*
+ * Read all the records in a scattered order.
+ */
+static
+void
+scatteredread(const char *filename, unsigned nrecs, int usepread)
+{
+	const char *what = usepread ? "pread" : "seek";
+	unsigned i, n;
+	int fd;
+
+	fd = openfile(filename, O_RDONLY);
+	timer_start(&timer);
+	for (i=0; i<nrecs; i++) {
+		n = (unsigned long long)i * STRIDE % nrecs;
+		readrecord(fd, n, usepread);
+		check(what, n);
+	}
+	report(what, nrecs);
+
+	if (usepread && lseek(fd, 0, SEEK_CUR) != 0) {
+		errx(1, "pread moved the seek position");
+	}
+	close(fd);
+}
+
+/*
+ * Read all the records in order with readv.
+ */
+static
+void
+vectorread(const char *filename, unsigned nrecs)
+{
+	struct iovec iov[2];
+	unsigned n;
+	ssize_t r;
+	int fd;
+
+	fd = openfile(filename, O_RDONLY);
+	iov[0].iov_base = header;
+	iov[0].iov_len = HEADERSIZE;
+	iov[1].iov_base = body;
+	iov[1].iov_len = BODYSIZE;
+
+	timer_start(&timer);
+	for (n=0; n<nrecs; n++) {
+		r = readv(fd, iov, 2);
+		if (r < 0) {
+			err(1, "readv");
+		}
+		if (r != RECORDSIZE) {
+			errx(1, "readv: short read");
+		}
+		check("readv", n);
+	}
+	report("readv", nrecs);
+	close(fd);
+}
+
+/*
+ * Change record 0 with pwrite, and check that the seek position stays
+ * put and the change shows.
+ */
+static
+void
+positionalwrite(const char *filename)
+{
+	char buf[RECORDSIZE];
+	int fd;
+
+	fd = openfile(filename, O_RDWR);
+	if (lseek(fd, RECORDSIZE, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	memset(buf, 'x', sizeof(buf));
+	if (pwrite(fd, buf, RECORDSIZE, 0) != RECORDSIZE) {
+		err(1, "pwrite");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != RECORDSIZE) {
+		errx(1, "pwrite moved the seek position");
+	}
+	memset(buf, 0, sizeof(buf));
+	if (pread(fd, buf, RECORDSIZE, 0) != RECORDSIZE) {
+		err(1, "pread");
+	}
+	if (buf[0] != 'x' || buf[RECORDSIZE - 1] != 'x') {
+		errx(1, "pwrite: change not seen");
+	}
+
+	/* put it back */
+	fill(0);
+	memcpy(buf, header, HEADERSIZE);
+	memcpy(buf + HEADERSIZE, body, BODYSIZE);
+	if (pwrite(fd, buf, RECORDSIZE, 0) != RECORDSIZE) {
+		err(1, "pwrite");
+	}
+	close(fd);
+}
+
+/*
+ * Parent and child both read every record with pread through the
+ * same open file.
+ */
+static
+void
+sharedread(const char *filename, unsigned nrecs)
+{
+	unsigned i, n;
+	int status;
+	pid_t pid;
+	int fd;
+
+	fd = openfile(filename, O_RDONLY);
+	timer_start(&timer);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	for (i=0; i<nrecs; i++) {
+		/* the child goes the other way round */
+		n = (unsigned long long)i * STRIDE % nrecs;
+		if (pid == 0) {
+			n = nrecs - 1 - n;
+		}
+		readrecord(fd, n, 1);
+		check("shared", n);
+	}
+	if (pid == 0) {
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	report("shared", 2 * nrecs);
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename = DEFAULT_FILENAME;
+	unsigned nrecs = DEFAULT_RECORDS;
+
+	if (argc > 3) {
+		errx(1, "Usage: iovbench [filename [records]]");
+	}
+	if (argc > 1) {
+		filename = argv[1];
+	}
+	if (argc > 2) {
+		nrecs = atoi(argv[2]);
+		if (nrecs == 0) {
+			errx(1, "Really?");
+		}
+	}
+
+	writerecords(filename, nrecs, 0);
+	writerecords(filename, nrecs, 1);
+	scatteredread(filename, nrecs, 0);
+	scatteredread(filename, nrecs, 1);
+	vectorread(filename, nrecs);
+	positionalwrite(filename);
+	sharedread(filename, nrecs);
+
+	if (remove(filename) < 0) {
+		err(1, "%s: remove", filename);
+	}
+	return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmapbench - compare scanning a file with mmap against read.
+ *
+ * Usage: mmapbench [filename [kbytes]]
+ *
+ * Writes a file of KBYTES kilobytes (default 4096, rounded down to
+ * whole pages), then goes through it two ways, printing the rate of
+ * each in kilobytes per second:
+ *
+ *     read     read() into a buffer a page at a time
+ *     mmap     map the whole file read-only and walk through it
+ *
+ * and checks that both scans see the same data, that the file can be
+ * written from and read into a mapping of itself, and that MAP_SHARED,
+ * which isn't supported, is refused. The file is removed afterwards.
+ * Last, it checks that touching a PROT_NONE mapping kills the process
+ * that does it.
+ *
+ * read makes a system call per page and copies it out to the user
+ * buffer; mmap takes a page fault per page instead, which reads the
+ * page from the file straight into the memory the program sees.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_FILENAME	"mmapbench.tmp"
+#define DEFAULT_KBYTES		4096
+#define PAGESIZE		4096
+
+static char buf[PAGESIZE];
+
+static struct timer timer;
+
+static
+unsigned long
+sum(const char *p, size_t len)
+{
+	unsigned long total = 0;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		total += (unsigned char)p[i];
+	}
+	return total;
+}
+
+/*
+ * Scan the file with read; return the sum of its bytes.
+ */
+static
+unsigned long
+readscan(const char *filename, size_t size)
+{
+	unsigned long total = 0;
+	size_t done;
+	ssize_t r;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	for (done = 0; done < size; done += r) {
+		r = read(fd, buf, PAGESIZE);
+		if (r < 0) {
+			err(1, "%s: read", filename);
+		}
+		if (r == 0) {
+			errx(1, "%s: short read", filename);
+		}
+		total += sum(buf, r);
+	}
+	close(fd);
+	return total;
+}
+
+/*
+ * Scan the file through a read-only mapping; return the sum of its
+ * bytes.
+ */
+static
+unsigned long
+mmapscan(const char *filename, size_t size)
+{
+	unsigned long total;
+	char *p;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", filename);
+	}
+	/* the mapping keeps the file */
+	close(fd);
+
+	total = sum(p, size);
+	if (munmap(p, size) < 0) {
+		err(1, "%s: munmap", filename);
+	}
+	return total;
+}
+
+/*
+ * Write the file from, and then read it into, fresh private mappings
+ * of the file itself, so that every page faults (and reads the file)
+ * in the middle of the write or read. Return the sum of the bytes read.
+ */
+static
+unsigned long
+selfio(const char *filename, size_t size)
+{
+	unsigned long total;
+	ssize_t r;
+	char *p;
+	int fd;
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", filename);
+	}
+	r = write(fd, p, size);
+	if (r < 0) {
+		err(1, "%s: write from mapping", filename);
+	}
+	if ((size_t)r != size) {
+		errx(1, "%s: short write from mapping", filename);
+	}
+	if (munmap(p, size) < 0) {
+		err(1, "%s: munmap", filename);
+	}
+
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", filename);
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	r = read(fd, p, size);
+	if (r < 0) {
+		err(1, "%s: read into mapping", filename);
+	}
+	if ((size_t)r != size) {
+		errx(1, "%s: short read into mapping", filename);
+	}
+	close(fd);
+
+	total = sum(p, size);
+	if (munmap(p, size) < 0) {
+		err(1, "%s: munmap", filename);
+	}
+	return total;
+}
+
+/*
+ * Check that a MAP_SHARED mapping of the file is refused.
+ */
+static
+void
+sharedrefused(const char *filename)
+{
+	void *p;
+	int fd;
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	p = mmap(NULL, PAGESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "%s: MAP_SHARED mapping was allowed", filename);
+	}
+	if (errno != EINVAL) {
+		err(1, "%s: MAP_SHARED: expected EINVAL", filename);
+	}
+	close(fd);
+}
+
+/*
+ * Map a page PROT_NONE and have a child read it. The child should die
+ * of the fault instead of getting to exit normally.
+ */
+static
+void
+protnone(void)
+{
+	volatile char *p;
+	int status;
+	pid_t pid;
+
+	p = mmap(NULL, PAGESIZE, PROT_NONE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap PROT_NONE");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		(void)p[0];
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		errx(1, "PROT_NONE: page could be read");
+	}
+	if (munmap((void *)p, PAGESIZE) < 0) {
+		err(1, "munmap PROT_NONE");
+	}
+	printf("mmapbench: PROT_NONE access faulted, as it should\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename = DEFAULT_FILENAME;
+	unsigned kbytes = DEFAULT_KBYTES;
+	unsigned long expected, total;
+	size_t size, i, j;
+	ssize_t r;
+	int fd;
+
+	if (argc > 3) {
+		errx(1, "Usage: mmapbench [filename [kbytes]]");
+	}
+	if (argc > 1) {
+		filename = argv[1];
+	}
+	if (argc > 2) {
+		kbytes = atoi(argv[2]);
+		if (kbytes == 0) {
+			errx(1, "Really?");
+		}
+	}
+	size = (size_t)kbytes * 1024 / PAGESIZE * PAGESIZE;
+	if (size == 0) {
+		errx(1, "Need at least one page");
+	}
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+	expected = 0;
+	for (i=0; i<size; i+=PAGESIZE) {
+		for (j=0; j<PAGESIZE; j++) {
+			buf[j] = i / PAGESIZE + j;
+		}
+		expected += sum(buf, PAGESIZE);
+		r = write(fd, buf, PAGESIZE);
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if (r != PAGESIZE) {
+			errx(1, "%s: short write", filename);
+		}
+	}
+	close(fd);
+
+	timer_start(&timer);
+	total = readscan(filename, size);
+	timer_report(&timer, "mmapbench", "read", size);
+	if (total != expected) {
+		errx(1, "read: wrong data (sum %lu, expected %lu)",
+		     total, expected);
+	}
+
+	timer_start(&timer);
+	total = mmapscan(filename, size);
+	timer_report(&timer, "mmapbench", "mmap", size);
+	if (total != expected) {
+		errx(1, "mmap: wrong data (sum %lu, expected %lu)",
+		     total, expected);
+	}
+
+	total = selfio(filename, size);
+	if (total != expected) {
+		errx(1, "self: wrong data (sum %lu, expected %lu)",
+		     total, expected);
+	}
+	sharedrefused(filename);
+
+	if (remove(filename) < 0) {
+		err(1, "%s: remove", filename);
+	}
+
+	protnone();
+	return 0;
+}
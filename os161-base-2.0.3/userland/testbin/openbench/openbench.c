@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * openbench - measure the cost of open and close.
+ *
+ * Usage: openbench [iterations]
+ *        openbench -l [nfiles]
+ *
+ * Opens and closes a file ITERATIONS times (default 500), then does
+ * the same while also keeping NHELD other opens of the file, and
+ * prints the average time per open+close.
+ *
+ * Each open needs an open file object with a lock in the kernel; run
+ * "kmem reset" from the kernel menu before and "kmem" after to see how
+ * many of them came ready-made from the openfile cache ("hits").
+ *
+ * With -l it measures name lookups with many files in memory instead.
+ * It creates NFILES files (default 200), then opens and closes each of
+ * them in three ways:
+ *
+ *    cold   - first open of each file after creating them all.
+ *    warm   - ROUNDS times over; the files were just closed, and the
+ *             kernel may still have their inodes in memory.
+ *    held   - the same, with LOOKUP_NHELD of the files kept open
+ *             meanwhile, so the kernel has at least that many vnodes
+ *             loaded.
+ *
+ * With the vnode table searched linearly, "held" gets slower as
+ * LOOKUP_NHELD and NFILES grow; with a hashed table it shouldn't.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define NHELD		8
+#define DEFAULT_ITERS	500
+
+#define LOOKUP_NHELD	100
+#define DEFAULT_NFILES	200
+#define MAX_NFILES	2000
+#define ROUNDS		5
+
+static
+void
+filename(char *name, size_t len, unsigned num)
+{
+	snprintf(name, len, "openbench.%u", num);
+}
+
+/*
+ * Open and close each of the first NFILES files ROUNDS times, and
+ * print the average time per open+close.
+ */
+static
+void
+bench(const char *what, unsigned nfiles, unsigned rounds)
+{
+	struct timer timer;
+	unsigned long long usecs;
+	unsigned i, r, n;
+	char name[32];
+	int fd;
+
+	timer_start(&timer);
+	for (r=0; r<rounds; r++) {
+		for (i=0; i<nfiles; i++) {
+			filename(name, sizeof(name), i);
+			fd = open(name, O_RDONLY);
+			if (fd < 0) {
+				err(1, "%s", name);
+			}
+			if (close(fd) < 0) {
+				err(1, "%s: close", name);
+			}
+		}
+	}
+	usecs = timer_usecs(&timer);
+
+	n = nfiles * rounds;
+	printf("openbench: %-5s %u opens in %llu.%06llu s, "
+	       "%llu us per open+close\n", what, n,
+	       usecs / 1000000, usecs % 1000000, usecs / n);
+}
+
+/*
+ * Open NHELD files from among the first NFILES, starting from the
+ * last one; with fewer files than that, some are opened more than
+ * once.
+ */
+static
+void
+hold(int *held, unsigned nheld, unsigned nfiles)
+{
+	unsigned i;
+	char name[32];
+
+	for (i=0; i<nheld; i++) {
+		filename(name, sizeof(name), nfiles - 1 - i % nfiles);
+		held[i] = open(name, O_RDONLY);
+		if (held[i] < 0) {
+			err(1, "%s", name);
+		}
+	}
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: openbench [iterations] | openbench -l [nfiles]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned count, nfiles, nheld, i;
+	int held[LOOKUP_NHELD];
+	char name[32];
+	bool lookup;
+	int fd;
+
+	lookup = argc > 1 && !strcmp(argv[1], "-l");
+	if (lookup) {
+		argc--;
+		argv++;
+	}
+	if (argc > 2) {
+		usage();
+	}
+	count = lookup ? DEFAULT_NFILES : DEFAULT_ITERS;
+	if (argc == 2) {
+		count = atoi(argv[1]);
+		if (count == 0) {
+			usage();
+		}
+		if (lookup && count > MAX_NFILES) {
+			errx(1, "nfiles must be between 1 and %d", MAX_NFILES);
+		}
+	}
+
+	nfiles = lookup ? count : 1;
+	for (i=0; i<nfiles; i++) {
+		filename(name, sizeof(name), i);
+		fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+		if (fd < 0) {
+			err(1, "%s: create", name);
+		}
+		close(fd);
+	}
+
+	if (lookup) {
+		bench("cold", nfiles, 1);
+		bench("warm", nfiles, ROUNDS);
+		nheld = nfiles < LOOKUP_NHELD ? nfiles : LOOKUP_NHELD;
+		hold(held, nheld, nfiles);
+		bench("held", nfiles, ROUNDS);
+	}
+	else {
+		bench("alone", nfiles, count);
+		nheld = NHELD;
+		hold(held, nheld, nfiles);
+		bench("held", nfiles, count);
+	}
+	for (i=0; i<nheld; i++) {
+		close(held[i]);
+	}
+
+	for (i=0; i<nfiles; i++) {
+		filename(name, sizeof(name), i);
+		remove(name);
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pathbench - measure path name resolution.
+ *
+ * Usage: pathbench [rounds]
+ *
+ * Opens and closes a few existing paths of different depths ROUNDS
+ * times each (default 1000), then does the same with paths that
+ * don't exist, printing the average time per open+close (or failed
+ * open) for each. Every exec resolves paths like these, so they
+ * should be served from the kernel's name cache after the first
+ * round rather than going back to the file system; compare the "dc"
+ * counters in the kernel menu before and after.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_ROUNDS	1000
+#define MAX_ROUNDS	1000000
+
+static const char *const hits[] = {
+	"/bin/sh",
+	"/bin/cat",
+	"/testbin/pathbench",
+	"/bin/../testbin/pathbench",
+};
+static const char *const misses[] = {
+	"/bin/nosuchfile",
+	"/testbin/nosuchfile",
+	"/nosuchdir/nosuchfile",
+};
+#define NHITS	(sizeof(hits) / sizeof(hits[0]))
+#define NMISSES	(sizeof(misses) / sizeof(misses[0]))
+
+static struct timer timer;
+
+/*
+ * Print the time since timer_start() per each of N operations.
+ */
+static
+void
+report(const char *what, unsigned n)
+{
+	unsigned long long usecs = timer_usecs(&timer);
+
+	printf("pathbench: %-6s %u ops in %llu.%06llu s, %llu us per op\n",
+	       what, n, usecs / 1000000, usecs % 1000000, usecs / n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned rounds = DEFAULT_ROUNDS;
+	unsigned i, j;
+	int fd;
+
+	if (argc > 2) {
+		errx(1, "Usage: pathbench [rounds]");
+	}
+	if (argc == 2) {
+		rounds = atoi(argv[1]);
+		if (rounds == 0 || rounds > MAX_ROUNDS) {
+			errx(1, "rounds must be between 1 and %d", MAX_ROUNDS);
+		}
+	}
+
+	timer_start(&timer);
+	for (i=0; i<rounds; i++) {
+		for (j=0; j<NHITS; j++) {
+			fd = open(hits[j], O_RDONLY);
+			if (fd < 0) {
+				err(1, "%s", hits[j]);
+			}
+			close(fd);
+		}
+	}
+	report("hit", rounds * NHITS);
+
+	timer_start(&timer);
+	for (i=0; i<rounds; i++) {
+		for (j=0; j<NMISSES; j++) {
+			fd = open(misses[j], O_RDONLY);
+			if (fd >= 0) {
+				errx(1, "%s: exists", misses[j]);
+			}
+			if (errno != ENOENT) {
+				err(1, "%s", misses[j]);
+			}
+		}
+	}
+	report("miss", rounds * NMISSES);
+
+	return 0;
+}
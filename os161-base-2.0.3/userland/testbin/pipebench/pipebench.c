@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * pipebench - measure pipes.
+ *
+ * Usage: pipebench [kbytes [roundtrips]]
+ *
+ * Forks a child and sends it KBYTES kilobytes (default 4096) through
+ * a pipe two ways, printing the rate of each in kilobytes per second:
+ *
+ *     small    writes of PIPE_BUF (512) bytes, which go through the
+ *              pipe's buffer in the kernel
+ *     large    writes of 64K, which the reader copies straight out of
+ *              the writer's pages
+ *
+ * The child checks what it gets. Then the two bounce a byte back and
+ * forth over a pair of pipes ROUNDTRIPS times (default 1000) and the
+ * time per round trip is printed, which is mostly the cost of a
+ * sleeping reader being woken up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_KBYTES		4096
+#define DEFAULT_ROUNDTRIPS	1000
+#define BIGWRITE		65536
+
+static char buf[BIGWRITE];
+
+static struct timer timer;
+
+/*
+ * Wait for the child and complain if it failed.
+ */
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+/*
+ * Child side of a throughput run: read SIZE bytes from FD and check
+ * that byte i is i % 251 (a prime, so it doesn't line up with the
+ * write size).
+ */
+static
+void
+drain(int fd, size_t size)
+{
+	size_t done, i;
+	ssize_t r;
+
+	for (done = 0; done < size; done += r) {
+		r = read(fd, buf, sizeof(buf));
+		if (r < 0) {
+			err(1, "child: read");
+		}
+		if (r == 0) {
+			errx(1, "child: early end of file at %zu", done);
+		}
+		for (i=0; i<(size_t)r; i++) {
+			if ((unsigned char)buf[i] != (done + i) % 251) {
+				errx(1, "child: wrong data at %zu", done + i);
+			}
+		}
+	}
+	r = read(fd, buf, sizeof(buf));
+	if (r != 0) {
+		errx(1, "child: no end of file");
+	}
+}
+
+/*
+ * Send SIZE bytes to a child in writes of CHUNK bytes.
+ */
+static
+void
+throughput(const char *what, size_t size, size_t chunk)
+{
+	size_t done, i, n;
+	ssize_t r;
+	pid_t pid;
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[1]);
+		drain(fds[0], size);
+		_exit(0);
+	}
+	close(fds[0]);
+
+	timer_start(&timer);
+	for (done = 0; done < size; done += n) {
+		n = size - done < chunk ? size - done : chunk;
+		for (i=0; i<n; i++) {
+			buf[i] = (done + i) % 251;
+		}
+		r = write(fds[1], buf, n);
+		if (r < 0) {
+			err(1, "write");
+		}
+		if ((size_t)r != n) {
+			errx(1, "short write");
+		}
+	}
+	close(fds[1]);
+	reap(pid);
+	timer_report(&timer, "pipebench", what, size);
+}
+
+/*
+ * Bounce a byte back and forth ROUNDTRIPS times.
+ */
+static
+void
+pingpong(unsigned roundtrips)
+{
+	int there[2], back[2];
+	unsigned long long usecs;
+	unsigned i;
+	pid_t pid;
+	char c;
+
+	if (pipe(there) < 0 || pipe(back) < 0) {
+		err(1, "pipe");
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(there[1]);
+		close(back[0]);
+		while (read(there[0], &c, 1) == 1) {
+			if (write(back[1], &c, 1) != 1) {
+				err(1, "child: write");
+			}
+		}
+		_exit(0);
+	}
+	close(there[0]);
+	close(back[1]);
+
+	timer_start(&timer);
+	for (i=0; i<roundtrips; i++) {
+		c = i;
+		if (write(there[1], &c, 1) != 1) {
+			err(1, "write");
+		}
+		if (read(back[0], &c, 1) != 1) {
+			errx(1, "read: child went away");
+		}
+		if (c != (char)i) {
+			errx(1, "wrong byte back");
+		}
+	}
+	usecs = timer_usecs(&timer);
+	close(there[1]);
+	close(back[0]);
+	reap(pid);
+
+	printf("pipebench: %-8s %u round trips in %llu.%06llu s, "
+	       "%llu us each\n", "pingpong", roundtrips,
+	       usecs / 1000000, usecs % 1000000, usecs / roundtrips);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned kbytes = DEFAULT_KBYTES;
+	unsigned roundtrips = DEFAULT_ROUNDTRIPS;
+	size_t size;
+
+	if (argc > 3) {
+		errx(1, "Usage: pipebench [kbytes [roundtrips]]");
+	}
+	if (argc > 1) {
+		kbytes = atoi(argv[1]);
+		if (kbytes == 0) {
+			errx(1, "Really?");
+		}
+	}
+	if (argc > 2) {
+		roundtrips = atoi(argv[2]);
+		if (roundtrips == 0) {
+			errx(1, "Really?");
+		}
+	}
+	size = (size_t)kbytes * 1024;
+
+	throughput("small", size, PIPE_BUF);
+	throughput("large", size, BIGWRITE);
+	pingpong(roundtrips);
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * readbench - measure file reads from several processes at once.
+ *
+ * Usage: readbench [-s] [nprocs]
+ *
+ * Creates one file of FILESIZE bytes per process (or, with -s, a
+ * single file they all share), then forks NPROCS children (default 4)
+ * that each read their file from start to end PASSES times. Prints
+ * the total rate in kilobytes per second.
+ *
+ * The files are small enough to stay in the buffer cache, so this
+ * mostly measures file system locking: run it with 1, 2, 4, ...
+ * processes and, on a multiprocessor, the rate should grow with the
+ * number of processes, up to the number of cpus.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define FILESIZE	(32*1024)
+#define PASSES		20
+#define DEFAULT_NPROCS	4
+#define MAX_NPROCS	32
+
+static char buf[4096];
+
+/*
+ * Name of the file process NUM reads.
+ */
+static
+void
+filename(char *name, size_t len, unsigned num, int shared)
+{
+	snprintf(name, len, "readbench.%u", shared ? 0 : num);
+}
+
+/*
+ * Create a file of FILESIZE bytes.
+ */
+static
+void
+makefile(const char *name)
+{
+	unsigned i;
+	int fd;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	memset(buf, 'r', sizeof(buf));
+	for (i=0; i<FILESIZE; i += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			err(1, "%s: write", name);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Body of each child: read the file PASSES times.
+ */
+static
+void
+reader(const char *name)
+{
+	unsigned pass, total;
+	ssize_t len;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	for (pass=0; pass<PASSES; pass++) {
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			err(1, "%s: lseek", name);
+		}
+		total = 0;
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
+			total += len;
+		}
+		if (len < 0) {
+			err(1, "%s: read", name);
+		}
+		if (total != FILESIZE) {
+			errx(1, "%s: read %u bytes, expected %u", name,
+			     total, FILESIZE);
+		}
+	}
+	close(fd);
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: readbench [-s] [nprocs]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pids[MAX_NPROCS];
+	unsigned nprocs = DEFAULT_NPROCS;
+	unsigned i, failed;
+	unsigned long long usecs, kbytes;
+	struct timer timer;
+	char name[32];
+	int shared = 0;
+	int status;
+	int arg = 1;
+
+	if (arg < argc && !strcmp(argv[arg], "-s")) {
+		shared = 1;
+		arg++;
+	}
+	if (arg < argc) {
+		nprocs = atoi(argv[arg]);
+		if (nprocs == 0 || nprocs > MAX_NPROCS) {
+			errx(1, "nprocs must be between 1 and %d", MAX_NPROCS);
+		}
+		arg++;
+	}
+	if (arg < argc) {
+		usage();
+	}
+
+	for (i=0; i<(shared ? 1 : nprocs); i++) {
+		filename(name, sizeof(name), i, shared);
+		makefile(name);
+	}
+
+	/* Read everything once, so the timed part runs from the cache. */
+	for (i=0; i<(shared ? 1 : nprocs); i++) {
+		filename(name, sizeof(name), i, shared);
+		reader(name);
+	}
+
+	timer_start(&timer);
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			warn("fork %u", i);
+			nprocs = i;
+			break;
+		}
+		if (pids[i] == 0) {
+			filename(name, sizeof(name), i, shared);
+			reader(name);
+			_exit(0);
+		}
+	}
+
+	failed = 0;
+	for (i=0; i<nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			warn("waitpid %d", pids[i]);
+			failed++;
+		}
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("child %d failed", pids[i]);
+			failed++;
+		}
+	}
+	usecs = timer_usecs(&timer);
+
+	kbytes = (unsigned long long)nprocs * PASSES * (FILESIZE / 1024);
+	printf("readbench: %u procs, %s file%s, %llu KB in %llu.%06llu s, "
+	       "%llu KB/s\n", nprocs, shared ? "one" : "own", shared ? "" : "s",
+	       kbytes, usecs / 1000000, usecs % 1000000,
+	       kbytes * 1000000 / usecs);
+
+	for (i=0; i<(shared ? 1 : nprocs); i++) {
+		filename(name, sizeof(name), i, shared);
+		remove(name);
+	}
+
+	if (failed > 0) {
+		errx(1, "%u children went wrong", failed);
+	}
+	return 0;
+}
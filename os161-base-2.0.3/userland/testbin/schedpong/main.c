@@ -182,10 +182,11 @@ waitall(pid_t *pids, unsigned numpids)
 }
 
 /*
- * Fetch, compute, and print the timing for one task group.
+ * Fetch, compute, and print the timing for one task group. Also
+ * returns it in microseconds.
  */
 static
-void
+unsigned long long
 calcresult(unsigned groupid, time_t startsecs, unsigned long startnsecs,
 	   char *buf, size_t bufmax)
 {
@@ -202,6 +203,7 @@ calcresult(unsigned groupid, time_t startsecs, unsigned long startnsecs,
 	nsecs -= startnsecs;
 	secs -= startsecs;
 	snprintf(buf, bufmax, "%lld.%09lu", (long long)secs, nsecs);
+	return (unsigned long long)secs * 1000000 + nsecs / 1000;
 }
 
 /*
@@ -227,6 +229,7 @@ runit(unsigned numthinkers, unsigned numgrinders,
 	time_t startsecs;
 	unsigned long startnsecs;
 	char buf[32];
+	unsigned long long usecs;
 	unsigned i;
 
 	printf("Running with %u thinkers, %u grinders, and %u pong groups "
@@ -254,8 +257,14 @@ runit(unsigned numthinkers, unsigned numgrinders,
 
 	printf("--- Timings ---\n");
 	if (numthinkers > 0) {
-		calcresult(0, startsecs, startnsecs, buf, sizeof(buf));
-		printf("Thinkers: %s\n", buf);
+		usecs = calcresult(0, startsecs, startnsecs, buf, sizeof(buf));
+		printf("Thinkers: %s", buf);
+		if (usecs > 0) {
+			/* throughput: loop iterations per second, all thinkers */
+			printf(" (%llu loops/s)", (unsigned long long)numthinkers
+			       * THINKLOOPS * 1000000ULL / usecs);
+		}
+		printf("\n");
 	}
 
 	if (numgrinders > 0) {
@@ -264,8 +273,11 @@ runit(unsigned numthinkers, unsigned numgrinders,
 	}
 
 	for (i=0; i<numponggroups; i++) {
-		calcresult(i+2, startsecs, startnsecs, buf, sizeof(buf));
-		printf("Pong group %u: %s\n", i, buf);
+		usecs = calcresult(i+2, startsecs, startnsecs,
+				   buf, sizeof(buf));
+		/* latency: average time for one ponger to wake the next */
+		printf("Pong group %u: %s (%llu us per wakeup)\n", i, buf,
+		       usecs / pong_handoffs(ponggroupsize));
 	}
 
 	closeresultsfile();
@@ -283,6 +295,8 @@ usage(const char *av0)
 	warnx("  [-s ponggroupsize]    set pong group size (default 6)");
 	warnx("Thinkers are CPU bound; grinders are memory-bound;");
 	warnx("pong groups are I/O bound.");
+	warnx("Compare runs under the kernel menu's \"sched mlfq\" and");
+	warnx("\"sched rr\" to see what the scheduler policy does.");
 	exit(1);
 }
 
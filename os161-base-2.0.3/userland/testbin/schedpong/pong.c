@@ -178,6 +178,19 @@ pong_reciprocating(unsigned id)
 #endif
 }
 
+/*
+ * Number of times a group of COUNT pongers passes the token along in
+ * one run: PONGLOOPS each in the two cyclic rounds, and in the
+ * reciprocating round PONGLOOPS for the two ends and twice that for
+ * the others. Each pass is one process waking another, so the time
+ * per pass is the wakeup latency.
+ */
+unsigned
+pong_handoffs(unsigned count)
+{
+	return 2 * count * PONGLOOPS + 2 * (count - 1) * PONGLOOPS;
+}
+
 /*
  * Do the pong thing.
  */
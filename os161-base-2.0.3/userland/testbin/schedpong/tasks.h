@@ -30,9 +30,13 @@
 
 void waitstart(void);
 
+/* Iterations of the thinkers' loop, for the throughput figure. */
+#define THINKLOOPS 35000000
+
 void think(unsigned groupid, unsigned id);
 void grind(unsigned groupid, unsigned id);
 
 void pong_prep(unsigned groupid, unsigned count);
 void pong_cleanup(unsigned groupid, unsigned count);
 void pong(unsigned groupid, unsigned id);
+unsigned pong_handoffs(unsigned count);
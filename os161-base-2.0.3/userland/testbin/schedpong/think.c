@@ -48,8 +48,7 @@ think(unsigned groupid, unsigned id)
 
 	k = 15;
 	m = 7;
-#define LOOPCOUNT 35000000
-	for (i=0; i<LOOPCOUNT; i++) {
+	for (i=0; i<THINKLOOPS; i++) {
 		k += k*m;
 	}
 }
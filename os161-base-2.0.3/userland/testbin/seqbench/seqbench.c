@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * seqbench - measure sequential file throughput.
+ *
+ * Usage: seqbench [filename [kbytes [chunksize]]]
+ *
+ * Writes a file of KBYTES kilobytes (default 4096) in CHUNKSIZE-byte
+ * writes (default 4096), then reads it back from start to end, then
+ * reads it again chunk by chunk from the end backwards, printing the
+ * rate for each phase in kilobytes per second. The file is removed
+ * afterwards.
+ *
+ * Make the file several times the size of the buffer cache so the
+ * writes and reads actually go to disk (up to a cacheful of the
+ * writes may still be dirty in memory when the write phase ends).
+ * Sequential writes should benefit from write clustering and the
+ * forward read from read-ahead; the backward read gets no read-ahead
+ * past each chunk, for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_FILENAME	"seqbench.tmp"
+#define DEFAULT_KBYTES		4096
+#define DEFAULT_CHUNKSIZE	4096
+#define MAX_CHUNKSIZE		65536
+
+static char buf[MAX_CHUNKSIZE];
+
+static struct timer timer;
+
+static
+void
+readchunk(int fd, const char *filename, unsigned chunk, size_t len)
+{
+	ssize_t r;
+	unsigned i;
+
+	r = read(fd, buf, len);
+	if (r < 0) {
+		err(1, "%s: read", filename);
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: short read", filename);
+	}
+	for (i=0; i<len; i++) {
+		if (buf[i] != (char)(chunk + i)) {
+			errx(1, "%s: wrong data in chunk %u", filename, chunk);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename = DEFAULT_FILENAME;
+	unsigned kbytes = DEFAULT_KBYTES;
+	size_t chunksize = DEFAULT_CHUNKSIZE;
+	unsigned long long size;
+	unsigned nchunks, i, j;
+	ssize_t r;
+	int fd;
+
+	if (argc > 4) {
+		errx(1, "Usage: seqbench [filename [kbytes [chunksize]]]");
+	}
+	if (argc > 1) {
+		filename = argv[1];
+	}
+	if (argc > 2) {
+		kbytes = atoi(argv[2]);
+		if (kbytes == 0) {
+			errx(1, "Really?");
+		}
+	}
+	if (argc > 3) {
+		chunksize = atoi(argv[3]);
+		if (chunksize == 0 || chunksize > MAX_CHUNKSIZE) {
+			errx(1, "chunksize must be between 1 and %d",
+			     MAX_CHUNKSIZE);
+		}
+	}
+	size = (unsigned long long)kbytes * 1024;
+	nchunks = size / chunksize;
+	size = (unsigned long long)nchunks * chunksize;
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+	timer_start(&timer);
+	for (i=0; i<nchunks; i++) {
+		for (j=0; j<chunksize; j++) {
+			buf[j] = i + j;
+		}
+		r = write(fd, buf, chunksize);
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if ((size_t)r != chunksize) {
+			errx(1, "%s: short write", filename);
+		}
+	}
+	timer_report(&timer, "seqbench", "write", size);
+	close(fd);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", filename);
+	}
+	timer_start(&timer);
+	for (i=0; i<nchunks; i++) {
+		readchunk(fd, filename, i, chunksize);
+	}
+	timer_report(&timer, "seqbench", "read", size);
+
+	timer_start(&timer);
+	for (i=nchunks; i-- > 0; ) {
+		if (lseek(fd, (off_t)i * chunksize, SEEK_SET) < 0) {
+			err(1, "%s: lseek", filename);
+		}
+		readchunk(fd, filename, i, chunksize);
+	}
+	timer_report(&timer, "seqbench", "backward", size);
+	close(fd);
+
+	if (remove(filename) < 0) {
+		err(1, "%s: remove", filename);
+	}
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * syncbench - measure how long sync takes after a small change.
+ *
+ * Usage: syncbench [filename [iterations]]
+ *
+ * Syncs once to start from a clean state, then ITERATIONS times
+ * (default 20) appends one 512-byte block to FILENAME and times the
+ * sync that follows, and then times as many syncs with nothing to
+ * write. Each append allocates a block, so each sync has an inode,
+ * a freemap block, and a data block to write. Run it on a large
+ * volume: if sync cost depends on the size of the volume or the
+ * number of loaded files rather than on what changed, it shows.
+ * The file is removed afterwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define DEFAULT_FILENAME	"syncbench.tmp"
+#define DEFAULT_ITERATIONS	20
+#define BLOCKSIZE		512
+
+static char buf[BLOCKSIZE];
+
+/*
+ * Time one sync, in microseconds.
+ */
+static
+unsigned long long
+timesync(void)
+{
+	struct timer timer;
+
+	timer_start(&timer);
+	if (sync() < 0) {
+		err(1, "sync");
+	}
+	return timer_usecs(&timer);
+}
+
+static
+void
+report(const char *what, unsigned n, unsigned long long total,
+       unsigned long long max)
+{
+	printf("syncbench: %-12s %u syncs, average %llu us, max %llu us\n",
+	       what, n, total / n, max);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename = DEFAULT_FILENAME;
+	unsigned iterations = DEFAULT_ITERATIONS;
+	unsigned long long t, total, max;
+	unsigned i;
+	ssize_t r;
+	int fd;
+
+	if (argc > 3) {
+		errx(1, "Usage: syncbench [filename [iterations]]");
+	}
+	if (argc > 1) {
+		filename = argv[1];
+	}
+	if (argc > 2) {
+		iterations = atoi(argv[2]);
+		if (iterations == 0) {
+			errx(1, "Really?");
+		}
+	}
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+	timesync();
+
+	total = max = 0;
+	for (i=0; i<iterations; i++) {
+		memset(buf, i, sizeof(buf));
+		r = write(fd, buf, sizeof(buf));
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if ((size_t)r != sizeof(buf)) {
+			errx(1, "%s: short write", filename);
+		}
+		t = timesync();
+		total += t;
+		if (t > max) {
+			max = t;
+		}
+	}
+	report("1-block", iterations, total, max);
+
+	total = max = 0;
+	for (i=0; i<iterations; i++) {
+		t = timesync();
+		total += t;
+		if (t > max) {
+			max = t;
+		}
+	}
+	report("clean", iterations, total, max);
+
+	close(fd);
+	if (remove(filename) < 0) {
+		err(1, "%s: remove", filename);
+	}
+	return 0;
+}